@@ -7,11 +7,19 @@
 #include "assert.h"
 #include "see.h"
 
+#include <stddef.h>
+
 // Define a weak kprintf() so that panic() and assert() still work even
 // if the kernel is built without console.o.
 extern void kprintf(const char * fmt, ...) __attribute__ ((weak));
 
+// Without klog.o, output is synchronous already.
+extern void klog_sync(void) __attribute__ ((weak));
+
 void panic_actual(const char * srcfile, int srcline, const char * msg) {    
+    if (klog_sync != NULL)
+        klog_sync();
+
     if (msg != NULL && *msg != '\0')
         klprintf("PANIC", srcfile, srcline, "%s\n", msg);
     else
@@ -21,6 +29,9 @@ void panic_actual(const char * srcfile, int srcline, const char * msg) {
 }
 
 void assert_failed(const char * srcfile, int srcline, const char * stmt) {
+    if (klog_sync != NULL)
+        klog_sync();
+
     klprintf("ASSERT", srcfile, srcline, "failed (%s)\n", stmt);
     halt_failure();
 }
@@ -1,76 +1,241 @@
+// cache.c - Block cache for a storage device
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef CACHE_TRACE
+#define TRACE
+#endif
+
+#ifdef CACHE_DEBUG
+#define DEBUG
+#endif
+
 #include "cache.h"
+#include "ktrace.h"
+#include "conf.h"
 #include "io.h"
 #include "heap.h"
 #include "error.h"
 #include "string.h"
 #include "console.h"
-#include "heap.h"
-#include "string.h"
-#include "cache.h"
 #include "ioimpl.h"
 #include "thread.h"
+#include "timer.h"
+#include "riscv.h"
+#include "assert.h"
+#include "memory.h"
+
+#include <stddef.h>
+#include <stdint.h>
 
+// INTERNAL TYPE DEFINITIONS
+//
 
+// Each entry is linked into two lists: the hash chain of the bucket its pos
+// falls in (hnext/hprev, only while valid) and the LRU list (lru_next and
+// lru_prev), which holds every entry with the most recently used at the head.
+// Invalid entries are kept at the tail so they are recycled first.
+//
+// A cache block is blksz bytes, a multiple of CACHE_BLKSZ, and pos of an
+// entry is always a multiple of blksz. cache_get_block() hands out the
+// CACHE_BLKSZ piece of a cache block that was asked for. Each block has its
+// own run of physical pages, and the owner table maps every page of RAM to
+// the entry whose block holds it, so cache_release_block() finds the entry
+// from the pointer it is given.
+//
+// The cache always has /capacity/ blocks. On a miss it takes a new block
+// instead of evicting one as long as plenty of memory is free (see
+// RECLAIM_LOWAT), up to a block for every page of RAM. When memory runs low,
+// the page allocator calls cache_reclaim(), which gives back clean blocks
+// past the capacity, least recently used first. Entries that lose their
+// block go on the spare list for the next time the cache grows.
+//
+// The cache is write-back: releasing a block dirty only marks it. Dirty blocks
+// are written when they are evicted, on cache_flush(), by the flusher thread
+// once they are older than dirty_age, and by the releasing thread itself when
+// the number of dirty blocks reaches dirty_highwat. Except for an evicted
+// victim, dirty blocks are written in batches sorted by position, adjacent
+// blocks together in one gathered write (see writeback_batch()).
+//
+// cache_get_block() pins the entry it returns and cache_release_block()
+// unpins it; pinned entries are never evicted. cache_lock is never held
+// across device I/O. An entry whose block is being read in is marked loading
+// and stays pinned by the loading thread, and other threads that want the
+// same block wait on its loaded condition. A block being written back is
+// pinned for the duration of the write, but it stays valid, so it can still
+// be used.
+//
+// cache_lock is a reader-writer lock. A hit on a block that is not loading
+// only takes it for reading: the pin count and hit counter are bumped with
+// atomic adds and the entry is marked referenced instead of being moved to
+// the head of the LRU list. find_victim() gives referenced entries a second
+// chance, moving them to the head as it passes them. A clean release also
+// only reads; everything else takes the lock for writing.
 
 struct cache_entry {
     unsigned long long pos; // position of block in device
-    void *block;
+    unsigned long len; // bytes of the block inside the device
     int valid;
     int dirty;
-    struct cache_entry * next;
+    int loading; // block is being read from the device
+    int referenced; // hit since find_victim() last passed it
+    unsigned int pincnt;
+    unsigned int holdcnt; // holds by cache_hold_block(), each also a pin
+    unsigned long long dirty_time; // rdtime() when the entry became dirty
+    struct condition loaded;
+    struct cache_entry * hnext;
+    struct cache_entry * hprev;
+    struct cache_entry * lru_next; // also links the spare list
+    struct cache_entry * lru_prev;
+    char * block;
 };
 
-
 struct cache {
     struct io* bkgio;
-    struct cache_entry * head;
-    struct cache_entry * tail;
-    struct lock cache_lock;
+    struct cache_entry * head; // most recently used
+    struct cache_entry * tail; // least recently used
+    struct cache_entry ** buckets;
+    unsigned long nbuckets; // power of two
+    unsigned long capacity; // blocks always kept
+    unsigned long max_blocks; // most blocks the cache grows to
+    unsigned long nblocks; // entries with a block
+    unsigned long blksz;
+    unsigned int blkpages; // pages per block
+    unsigned long long dev_end; // size of backing device
+    struct cache_entry ** owner; // entry of each page of RAM, or NULL
+    struct cache_entry * spare; // entries without a block
+    unsigned long ndirty;
+    unsigned long long dirty_age; // in timer ticks
+    unsigned long dirty_highwat;
+    struct rwlock cache_lock;
+    struct condition unpinned; // an entry's pin count dropped to zero
+    struct cache_stats stats;
 };
 
-int create_cache(struct io *bkgio, struct cache **cptr) {
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static unsigned long cache_hash(const struct cache * cache, unsigned long long pos);
+
+static struct cache_entry * cache_lookup (
+    const struct cache * cache, unsigned long long pos);
+
+static void hash_insert(struct cache * cache, struct cache_entry * ent);
+static void hash_remove(struct cache * cache, struct cache_entry * ent);
+
+static void lru_remove(struct cache * cache, struct cache_entry * ent);
+static void lru_push_front(struct cache * cache, struct cache_entry * ent);
+static void lru_push_back(struct cache * cache, struct cache_entry * ent);
+
+static inline struct cache_entry * block_to_entry (
+    struct cache * cache, void * pblk);
+
+static void * alloc_zeroed_pages(size_t size);
+
+static struct cache_entry * cache_grow(struct cache * cache);
+static unsigned long cache_reclaim(void * aux, unsigned long want);
+
+static struct cache_entry * find_victim(struct cache * cache);
+static void unpin_entry(struct cache * cache, struct cache_entry * ent);
+
+static int writeback_entry(struct cache * cache, struct cache_entry * ent);
+static int writeback_aged(struct cache * cache, unsigned long long age);
+static int writeback_oldest(struct cache * cache, unsigned long target);
+static int writeback_batch (
+    struct cache * cache, unsigned long long before, unsigned long max);
+
+static void cache_flusher(struct cache * cache);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+// Creates a cache of /capacity/ blocks of /blksz/ bytes in front of /bkgio/.
+// A capacity of zero selects the compile-time default CACHE_CAPACITY and a
+// blksz of zero selects CACHE_DEFAULT_BLKSZ. The block size must be a
+// multiple of CACHE_BLKSZ.
+
+int create_cache (
+    struct io *bkgio, unsigned long capacity, unsigned long blksz,
+    struct cache **cptr)
+{
+    struct cache * cache;
+    unsigned long i;
+
     if (!bkgio || !cptr) {
         return -EINVAL;
     }
 
-    struct cache *cache = kmalloc(sizeof(struct cache));
+    if (capacity == 0)
+        capacity = CACHE_CAPACITY;
+    
+    if (blksz == 0)
+        blksz = CACHE_DEFAULT_BLKSZ;
+    
+    if (blksz % CACHE_BLKSZ != 0)
+        return -EINVAL;
+
+    cache = kcalloc(1, sizeof(struct cache));
     if (!cache) {
         return -ENOMEM;
     }
 
     cache->bkgio = bkgio;
-        
-    lock_init(&cache->cache_lock);
-    cache->head = NULL;
-    cache->tail = NULL;
-
-    // Build a linked list of CACHE_CAPACITY entries
-    for (int i = 0; i < CAPACITY; i++) {
-        struct cache_entry *node = kmalloc(sizeof(struct cache_entry));
-        if (!node) {
-            // partial failure => free if you want
-            return -ENOMEM;
-        }
+    cache->capacity = capacity;
+    cache->blksz = blksz;
+    cache->blkpages = (blksz + PAGE_SIZE - 1) / PAGE_SIZE;
+    cache->max_blocks = RAM_SIZE / PAGE_SIZE / cache->blkpages;
+
+    if (cache->max_blocks < capacity)
+        cache->max_blocks = capacity;
+
+    // The last cache block may extend past the end of the device; only the
+    // part inside it is transferred.
+
+    if (ioctl(bkgio, IOCTL_GETEND, &cache->dev_end) != 0)
+        cache->dev_end = ~0ULL;
+    cache->dirty_age = CACHE_DIRTY_AGE_MS * (TIMER_FREQ / 1000);
+    cache->dirty_highwat = CACHE_DIRTY_HIGHWAT;
+
+    if (cache->dirty_highwat == 0 || capacity < cache->dirty_highwat)
+        cache->dirty_highwat = (capacity + 1) / 2;
+
+    // Bucket count is the next power of two at or above the most blocks the
+    // cache can grow to, so the average chain length stays at or below one.
+
+    cache->nbuckets = 1;
+    while (cache->nbuckets < cache->max_blocks)
+        cache->nbuckets <<= 1;
+
+    // These arrays would soon exceed what heap0 can allocate, so they come
+    // from physical pages. Nothing is unwound on failure; this only happens
+    // at mount time.
 
-        node->block = kmalloc(CACHE_BLKSZ);
-        if (!node->block) {
-            // partial failure => free
+    cache->buckets = alloc_zeroed_pages(
+        cache->nbuckets * sizeof(struct cache_entry *));
+    cache->owner = alloc_zeroed_pages(
+        RAM_SIZE / PAGE_SIZE * sizeof(struct cache_entry *));
+
+    if (!cache->buckets || !cache->owner)
+        return -ENOMEM;
+
+    rwlock_init(&cache->cache_lock);
+    condition_init(&cache->unpinned, "cache_unpinned");
+
+    for (i = 0; i < capacity; i++) {
+        if (cache_grow(cache) == NULL)
             return -ENOMEM;
-        }
+    }
 
-        node->pos   = 0ULL;
-        node->valid = 0;
-        node->dirty = 0;
-        node->next  = NULL;
+    if (register_reclaimer(&cache_reclaim, cache) < 0)
+        kprintf("cache: cannot give memory back\n");
 
-        if (cache->head == NULL) {
-            // first node
-            cache->head = node;
-            cache->tail = node;
-        } else {
-            cache->tail->next = node;
-            cache->tail = node;
-        }
+    if (thread_spawn("cache_flusher",
+        (void(*)(void))&cache_flusher, cache) < 0)
+    {
+        // Still correct without the flusher, just less eager about writing
+        kprintf("cache: no flusher thread\n");
     }
 
     *cptr = cache;
@@ -79,160 +244,856 @@ int create_cache(struct io *bkgio, struct cache **cptr) {
 
 
 int cache_get_block(struct cache* cache, unsigned long long pos, void** pptr) {
+    unsigned long long base;
+    struct cache_entry * ent;
+    unsigned long long t0;
+    long rcnt;
 
-    // check first if block is in cache. if it is, get the block from cache
-    // if not, read in from the device
-    // ● Pointer to block data (512 bytes) returned via pptr argument
-    // non zero error on failure
-    // caller has exclusive use of block -> need to think about how to handle this -> walk through seems easier
-    // block remain in memory until released using cahce_release_block
-    // must call cache_release_block to release the block
-    // for eviction, use LRU
+    // Caller has use of the block until it is released with
+    // cache_release_block(). On a miss the least recently used unpinned entry
+    // is recycled, writing it back first if it is dirty.
 
     if (cache == NULL || pptr == NULL) {
         return -EINVAL;
     }
-    
-    lock_acquire(&cache->cache_lock);
-
-
-    struct cache_entry * curr = cache->head;
-    struct cache_entry * prev = NULL;
-
-    // check if the block is already in the cache
-    while(curr != NULL) {
-        if (curr->valid && curr->pos == pos) {
-            *pptr = curr->block;
-            if(prev != NULL){ // since we got a hit move this node to the front of the linked list
-                prev->next = curr->next;
-                if(curr == cache->tail){
-                    cache->tail = prev;
-                }
-                curr->next = cache->head;
-                cache->head = curr;
-            }
-            lock_release(&cache->cache_lock);
-            return 0;
-        }
-        prev = curr;
-        curr = curr->next;
+
+    if (pos % CACHE_BLKSZ != 0 || cache->dev_end <= pos)
+        return -EINVAL;
+
+    base = pos - pos % cache->blksz;
+
+    rwlock_read_acquire(&cache->cache_lock);
+    ent = cache_lookup(cache, base);
+
+    if (ent != NULL && !ent->loading) {
+        __atomic_add_fetch(&ent->pincnt, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&cache->stats.hits, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&ent->referenced, 1, __ATOMIC_RELAXED);
+        *pptr = ent->block + (pos - base);
+        rwlock_read_release(&cache->cache_lock);
+        return 0;
     }
 
-    curr = cache->head;
-    prev = NULL;
+    // Missed or still loading: take the lock for writing and look again,
+    // since the block may have come in while no lock was held.
+
+    rwlock_read_release(&cache->cache_lock);
+    rwlock_write_acquire(&cache->cache_lock);
 
-    // if not, find an empty entry in the cache
-    while(curr != NULL) {
-        if (!curr->valid) {
-            curr->valid = 1;
-            curr->pos = pos;
-            *pptr = curr->block;
+    for (;;) {
+        ent = cache_lookup(cache, base);
 
-            // read the block from the device
-            long rcnt = ioreadat(cache->bkgio, pos, curr->block, CACHE_BLKSZ);
-            if (rcnt < 0) {
-                curr->valid = 0;
-                lock_release(&cache->cache_lock);
-                return rcnt;
+        if (ent != NULL) {
+            if (ent->loading) {
+                // The loading thread broadcasts loaded, so the broadcast
+                // cannot come before the wait (see thread.h).
+                rwlock_write_release(&cache->cache_lock);
+                condition_wait(&ent->loaded);
+                rwlock_write_acquire(&cache->cache_lock);
+                continue; // the load may have failed
             }
-            lock_release(&cache->cache_lock);
+
+            ent->pincnt++;
+            cache->stats.hits++;
+            lru_remove(cache, ent);
+            lru_push_front(cache, ent);
+            *pptr = ent->block + (pos - base);
+            rwlock_write_release(&cache->cache_lock);
             return 0;
         }
-        curr = curr->next;
+
+        // Take a new block while memory is plentiful, else recycle one
+
+        ent = NULL;
+
+        if (cache->nblocks < cache->max_blocks &&
+            2 * RECLAIM_LOWAT < free_phys_page_count())
+        {
+            ent = cache_grow(cache);
+        }
+
+        if (ent == NULL)
+            ent = find_victim(cache);
+
+        if (ent == NULL) {
+            rwlock_write_release(&cache->cache_lock);
+            condition_wait(&cache->unpinned);
+            rwlock_write_acquire(&cache->cache_lock);
+            continue;
+        }
+
+        if (!ent->valid || !ent->dirty)
+            break;
+        
+        // Dirty victim: write it back, then start over since the cache may
+        // have changed while the lock was dropped. If the write failed the
+        // block has to go anyway.
+
+        if (writeback_entry(cache, ent) < 0 && ent->pincnt == 0 && ent->dirty) {
+            ent->dirty = 0;
+            cache->ndirty--;
+        }
     }
 
+    // Claim the clean victim for pos and read it in without the lock
 
-    if (cache->tail->dirty == 1) {
-        iowriteat(cache->bkgio, cache->tail->pos,
-                cache->tail->block, CACHE_BLKSZ);
-        cache->tail->dirty = 0;
+    cache->stats.misses++;
+    ktrace(KTRACE_CACHE_MISS, base, 0);
+
+    if (ent->valid) {
+        hash_remove(cache, ent);
+        cache->stats.evictions++;
     }
+    
+    ent->pos = base;
+    ent->len = cache->blksz;
+    if (cache->dev_end - base < ent->len)
+        ent->len = cache->dev_end - base;
+    ent->valid = 1;
+    ent->loading = 1;
+    ent->referenced = 0;
+    ent->pincnt = 1;
+    hash_insert(cache, ent);
+    lru_remove(cache, ent);
+    lru_push_front(cache, ent);
 
-    //evict the oldest one
+    rwlock_write_release(&cache->cache_lock);
+    t0 = rdtime();
+    rcnt = ioreadat(cache->bkgio, base, ent->block, ent->len);
+    rwlock_write_acquire(&cache->cache_lock);
+    cache->stats.wait_ticks += rdtime() - t0;
 
-    cache->tail->pos = pos;
-    cache->tail->valid = 1;
-    *pptr = cache->tail->block;
+    ent->loading = 0;
+    condition_broadcast(&ent->loaded);
 
-    long rcnt = ioreadat(cache->bkgio, pos, cache->tail->block, CACHE_BLKSZ);
     if (rcnt < 0) {
-        cache->tail->valid = 0;
-        lock_release(&cache->cache_lock);
+        // Return the entry to the tail as invalid
+        hash_remove(cache, ent);
+        ent->valid = 0;
+        lru_remove(cache, ent);
+        lru_push_back(cache, ent);
+        unpin_entry(cache, ent);
+        rwlock_write_release(&cache->cache_lock);
         return rcnt;
     }
 
-    if(cache->head == cache->tail){
-        lock_release(&cache->cache_lock);
-        return 0;
-    }
-
-    curr = cache->head;
-    while(curr->next != cache->tail){
-        curr = curr->next;
-    }
-    curr->next = NULL;
-    if(cache->head != cache->tail){
-        cache->tail->next = cache->head;
-    }
-    cache->head = cache->tail;
-    cache->tail = curr;
-    lock_release(&cache->cache_lock);
+    *pptr = ent->block + (pos - base);
+    rwlock_write_release(&cache->cache_lock);
     return 0;
 }
 
-//pblk is a pointer to a block that was made available in cache_get_block() (which means that pblk == *pptr 
+//pblk is a pointer to a block that was made available in cache_get_block() (which means that pblk == *pptr
 //for some pptr). If dirty==1, the block has been written to. If dirty==0, the block has not been written to.
 
 extern void cache_release_block(struct cache * cache, void * pblk, int dirty){
+    struct cache_entry * ent;
 
     if(cache == NULL || pblk == NULL){
         return;
     }
 
-    lock_acquire(&cache->cache_lock);
+    ent = block_to_entry(cache, pblk);
 
-    struct cache_entry * curr = cache->head;
+    if (!dirty) {
+        rwlock_read_acquire(&cache->cache_lock);
+        assert (0 < ent->pincnt);
+        if (__atomic_sub_fetch(&ent->pincnt, 1, __ATOMIC_RELAXED) == 0)
+            condition_broadcast(&cache->unpinned);
+        rwlock_read_release(&cache->cache_lock);
+        return;
+    }
 
-    while(curr != NULL){
-        if(curr->valid && curr->block == pblk){
-            if(dirty){
-                iowriteat(cache->bkgio, curr->pos, curr->block, CACHE_BLKSZ);
-                curr->dirty = 0;
-            }
-            lock_release(&cache->cache_lock);
-            return;
-        }
-        curr = curr->next;
+    rwlock_write_acquire(&cache->cache_lock);
+
+    assert (0 < ent->pincnt);
+
+    if(ent->valid && dirty && !ent->dirty){
+        ent->dirty = 1;
+        ent->dirty_time = rdtime();
+        cache->ndirty++;
     }
 
+    unpin_entry(cache, ent);
+
+    // Throttle the writer instead of letting dirty blocks pile up
+    if (dirty && cache->dirty_highwat <= cache->ndirty)
+        writeback_oldest(cache, cache->dirty_highwat / 2);
+
+    rwlock_write_release(&cache->cache_lock);
+}
+
+// Keeps the cache block holding /pblk/, which the caller has pinned, in the
+// cache and stops it from being written back until cache_unhold_block().
+// Lets a caller order a block's write after some other write of its own.
+
+void cache_hold_block(struct cache * cache, void * pblk) {
+    struct cache_entry * const ent = block_to_entry(cache, pblk);
 
-    lock_release(&cache->cache_lock);
-    return;
+    rwlock_write_acquire(&cache->cache_lock);
+    assert (0 < ent->pincnt);
+    ent->pincnt++;
+    ent->holdcnt++;
+    rwlock_write_release(&cache->cache_lock);
 }
 
-//This function flushes the cache. Any dirty blocks that have not yet been written to the backing interface 
-//must be written to the backing interface. Returns 0 if successful.
+void cache_unhold_block(struct cache * cache, void * pblk) {
+    struct cache_entry * const ent = block_to_entry(cache, pblk);
+
+    rwlock_write_acquire(&cache->cache_lock);
+    assert (0 < ent->holdcnt);
+    ent->holdcnt--;
+    unpin_entry(cache, ent);
+    rwlock_write_release(&cache->cache_lock);
+}
+
+//This function flushes the cache. Any dirty blocks that have not yet been written to the backing interface
+//must be written to the backing interface. Held blocks are skipped. Returns 0 if successful.
+// The device is then asked to make the writes durable (IOCTL_FLUSH), if it
+// has a way to.
 
 extern int cache_flush(struct cache * cache){
+    int result;
+
     if(cache == NULL){
         return -EINVAL;
     }
 
-    lock_acquire(&cache->cache_lock);
+    rwlock_write_acquire(&cache->cache_lock);
+    cache->stats.flushes++;
+    result = writeback_oldest(cache, 0);
+    rwlock_write_release(&cache->cache_lock);
+
+    if (result == 0) {
+        result = ioctl(cache->bkgio, IOCTL_FLUSH, NULL);
+        if (result == -ENOTSUP)
+            result = 0;
+    }
+
+    return result;
+}
+
+// Loads the block at /pos/ into the cache without handing it to the caller,
+// so that a later cache_get_block() hits. Does nothing if the block is
+// already cached. Returns 0 or a negative error code.
+
+int cache_prefetch(struct cache * cache, unsigned long long pos) {
+    void * blk;
+    int result;
+
+    if (cache == NULL)
+        return -EINVAL;
+
+    rwlock_read_acquire(&cache->cache_lock);
+    result = (cache_lookup(cache, pos - pos % cache->blksz) != NULL);
+    rwlock_read_release(&cache->cache_lock);
+
+    if (result)
+        return 0;
+
+    result = cache_get_block(cache, pos, &blk);
+    if (result == 0)
+        cache_release_block(cache, blk, CACHE_CLEAN);
+    return result;
+}
+
+// Reads /len/ bytes at /pos/ from the backing device straight into /buf/,
+// bypassing the cache blocks. Both must be multiples of CACHE_BLKSZ. Cached
+// copies of blocks in the range may be newer than the device copy, so they
+// are pinned during the read and copied over the data read, one CACHE_BLKSZ
+// piece at a time. Returns the number of bytes read or a negative error code.
+
+long cache_read_direct (
+    struct cache * cache, unsigned long long pos, void * buf, unsigned long len)
+{
+    struct cache_entry * ent;
+    unsigned long long blkpos;
+    unsigned long seglen, off;
+    unsigned long long t0;
+    uint64_t pinned;
+    long total, rcnt;
+    int i;
+
+    if (cache == NULL || buf == NULL)
+        return -EINVAL;
+
+    if (pos % CACHE_BLKSZ != 0 || len % CACHE_BLKSZ != 0)
+        return -EINVAL;
+
+    total = 0;
+
+    // Work in segments of up to 64 blocks so the pinned set fits in a word
+
+    while (total < len) {
+        seglen = len - total;
+        if (64 * CACHE_BLKSZ < seglen)
+            seglen = 64 * CACHE_BLKSZ;
+
+        pinned = 0;
+        rwlock_write_acquire(&cache->cache_lock);
+
+        for (i = 0, off = 0; off < seglen; i++, off += CACHE_BLKSZ) {
+            blkpos = pos + total + off;
+            ent = cache_lookup(cache, blkpos - blkpos % cache->blksz);
+            if (ent != NULL && !ent->loading) {
+                ent->pincnt++;
+                pinned |= (uint64_t)1 << i;
+            }
+        }
+
+        rwlock_write_release(&cache->cache_lock);
+        t0 = rdtime();
+        rcnt = ioreadat(cache->bkgio, pos + total, buf + total, seglen);
+        rwlock_write_acquire(&cache->cache_lock);
+        cache->stats.wait_ticks += rdtime() - t0;
+
+        // a short read leaves the buffer past rcnt alone
+
+        for (i = 0, off = 0; off < seglen; i++, off += CACHE_BLKSZ) {
+            if (pinned & ((uint64_t)1 << i)) {
+                blkpos = pos + total + off;
+                ent = cache_lookup(cache, blkpos - blkpos % cache->blksz);
+                if (0 < rcnt && off < rcnt)
+                    memcpy(buf + total + off,
+                        ent->block + (blkpos - ent->pos),
+                        (rcnt - off < CACHE_BLKSZ) ? rcnt - off : CACHE_BLKSZ);
+                unpin_entry(cache, ent);
+            }
+        }
+
+        rwlock_write_release(&cache->cache_lock);
+
+        if (rcnt < 0)
+            return (total > 0) ? total : rcnt;
+        
+        total += rcnt;
+
+        if (rcnt < seglen)
+            break;
+    }
+
+    return total;
+}
+
+// Zeroes /len/ bytes at /pos/, both multiples of CACHE_BLKSZ, without
+// sending zeroes to the device where it can be avoided. Cached pieces are
+// cleared in the cache and marked dirty; the rest are zeroed on the device
+// with IOCTL_WRZEROES. A block read in while that request was in flight may
+// hold the old contents, so a piece cached by then is cleared as well, and
+// one written back and evicted in the meantime is zeroed again. Returns 0,
+// -ENOTSUP if the device cannot zero a range, or a negative error code.
+
+int cache_write_zeroes (
+    struct cache * cache, unsigned long long pos, unsigned long len)
+{
+    struct cache_entry * ent;
+    struct ioextent ext;
+    unsigned long long base, nwb;
+    unsigned long n;
+    int result;
+
+    if (cache == NULL)
+        return -EINVAL;
+
+    if (pos % CACHE_BLKSZ != 0 || len % CACHE_BLKSZ != 0 ||
+        cache->dev_end < pos || cache->dev_end - pos < len)
+    {
+        return -EINVAL;
+    }
+
+    rwlock_write_acquire(&cache->cache_lock);
+
+    while (len != 0) {
+        base = pos - pos % cache->blksz;
+        n = cache->blksz - (pos - base);
+        if (len < n)
+            n = len;
 
-    struct cache_entry * curr = cache->head;
+        ent = cache_lookup(cache, base);
 
-    while(curr != NULL){
-            if(curr->dirty && curr->valid){
-                iowriteat(cache->bkgio, curr->pos, curr->block, CACHE_BLKSZ);
-                curr->dirty = 0;
+        if (ent == NULL) {
+            ext.pos = pos;
+            ext.len = n;
+            nwb = cache->stats.writebacks;
+
+            rwlock_write_release(&cache->cache_lock);
+            result = ioctl(cache->bkgio, IOCTL_WRZEROES, &ext);
+            rwlock_write_acquire(&cache->cache_lock);
+
+            if (result < 0) {
+                rwlock_write_release(&cache->cache_lock);
+                return result;
             }
-            curr = curr->next;
+
+            ent = cache_lookup(cache, base);
+            if (ent == NULL && nwb != cache->stats.writebacks)
+                continue;
+        }
+
+        if (ent != NULL && ent->loading) {
+            // wait for the load as cache_get_block() does
+            rwlock_write_release(&cache->cache_lock);
+            condition_wait(&ent->loaded);
+            rwlock_write_acquire(&cache->cache_lock);
+            continue; // the load may have failed
         }
 
-    lock_release(&cache->cache_lock);
+        if (ent != NULL) {
+            memset(ent->block + (pos - base), 0, n);
+            if (!ent->dirty) {
+                ent->dirty = 1;
+                ent->dirty_time = rdtime();
+                cache->ndirty++;
+            }
+        }
+
+        pos += n;
+        len -= n;
+    }
+
+    rwlock_write_release(&cache->cache_lock);
     return 0;
+}
+
+// Copies the cache counters into /stats/. Readers holding the lock for
+// reading still count hits, so the copy may be a few hits behind.
+
+void cache_get_stats(struct cache * cache, struct cache_stats * stats) {
+    if (cache == NULL || stats == NULL)
+        return;
+
+    rwlock_read_acquire(&cache->cache_lock);
+    *stats = cache->stats;
+    rwlock_read_release(&cache->cache_lock);
+}
+
+// Zeroes the cache counters, starting a new measurement window.
+
+void cache_reset_stats(struct cache * cache) {
+    if (cache == NULL)
+        return;
+
+    rwlock_write_acquire(&cache->cache_lock);
+    memset(&cache->stats, 0, sizeof(cache->stats));
+    rwlock_write_release(&cache->cache_lock);
+}
+
+// Sets the write-back policy: dirty blocks older than /age_ms/ milliseconds
+// are written by the flusher, and a release that brings the dirty block count
+// to /highwat/ writes back the oldest half. Zero leaves a setting unchanged.
+
+void cache_set_writeback (
+    struct cache * cache, unsigned long age_ms, unsigned long highwat)
+{
+    if (cache == NULL)
+        return;
+
+    rwlock_write_acquire(&cache->cache_lock);
+
+    if (age_ms != 0)
+        cache->dirty_age = age_ms * (TIMER_FREQ / 1000);
+
+    if (highwat != 0)
+        cache->dirty_highwat = (highwat < cache->capacity) ?
+            highwat : cache->capacity;
+
+    rwlock_write_release(&cache->cache_lock);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+unsigned long cache_hash(const struct cache * cache, unsigned long long pos) {
+    unsigned long long blkno = pos / cache->blksz;
+
+    // Fibonacci hashing spreads the runs of consecutive block numbers that
+    // the file system produces across the table.
+    return (unsigned long)((blkno * 0x9E3779B97F4A7C15ULL) >> 32)
+        & (cache->nbuckets - 1);
+}
+
+struct cache_entry * cache_lookup (
+    const struct cache * cache, unsigned long long pos)
+{
+    struct cache_entry * ent;
+
+    ent = cache->buckets[cache_hash(cache, pos)];
+
+    while (ent != NULL && ent->pos != pos)
+        ent = ent->hnext;
+
+    return ent;
+}
+
+void hash_insert(struct cache * cache, struct cache_entry * ent) {
+    struct cache_entry ** const bucket = &cache->buckets[cache_hash(cache, ent->pos)];
+
+    ent->hprev = NULL;
+    ent->hnext = *bucket;
+    if (*bucket != NULL)
+        (*bucket)->hprev = ent;
+    *bucket = ent;
+}
+
+void hash_remove(struct cache * cache, struct cache_entry * ent) {
+    if (ent->hprev != NULL)
+        ent->hprev->hnext = ent->hnext;
+    else
+        cache->buckets[cache_hash(cache, ent->pos)] = ent->hnext;
+
+    if (ent->hnext != NULL)
+        ent->hnext->hprev = ent->hprev;
+
+    ent->hnext = NULL;
+    ent->hprev = NULL;
+}
 
+void lru_remove(struct cache * cache, struct cache_entry * ent) {
+    if (ent->lru_prev != NULL)
+        ent->lru_prev->lru_next = ent->lru_next;
+    else
+        cache->head = ent->lru_next;
+
+    if (ent->lru_next != NULL)
+        ent->lru_next->lru_prev = ent->lru_prev;
+    else
+        cache->tail = ent->lru_prev;
+
+    ent->lru_next = NULL;
+    ent->lru_prev = NULL;
+}
+
+void lru_push_front(struct cache * cache, struct cache_entry * ent) {
+    ent->lru_prev = NULL;
+    ent->lru_next = cache->head;
+
+    if (cache->head != NULL)
+        cache->head->lru_prev = ent;
+    else
+        cache->tail = ent;
+
+    cache->head = ent;
+}
+
+void lru_push_back(struct cache * cache, struct cache_entry * ent) {
+    ent->lru_next = NULL;
+    ent->lru_prev = cache->tail;
+
+    if (cache->tail != NULL)
+        cache->tail->lru_next = ent;
+    else
+        cache->head = ent;
+
+    cache->tail = ent;
+}
+
+static inline struct cache_entry * block_to_entry (
+    struct cache * cache, void * pblk)
+{
+    return cache->owner[((uintptr_t)pblk - RAM_START_PMA) / PAGE_SIZE];
+}
+
+// Allocates zeroed physical pages covering at least /size/ bytes.
+
+void * alloc_zeroed_pages(size_t size) {
+    const unsigned int cnt = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    void * pp;
+
+    pp = alloc_phys_pages(cnt);
+    if (pp != NULL)
+        memset(pp, 0, cnt * PAGE_SIZE);
+    return pp;
+}
+
+// Gives a block to an entry, taken from the spare list or carved from a new
+// page of entries, and puts it at the tail of the LRU list as invalid.
+// Returns the entry, or NULL if memory runs out. Caller holds cache_lock
+// for writing, or is create_cache().
+
+struct cache_entry * cache_grow(struct cache * cache) {
+    struct cache_entry * ent;
+    unsigned int i;
+    char * block;
+
+    block = alloc_phys_pages(cache->blkpages);
+    if (block == NULL)
+        return NULL;
+
+    // Entries are carved out of whole pages and never freed
+
+    if (cache->spare == NULL) {
+        ent = alloc_zeroed_pages(PAGE_SIZE);
+        if (ent == NULL) {
+            free_phys_pages(block, cache->blkpages);
+            return NULL;
+        }
+        for (i = 0; i < PAGE_SIZE / sizeof(struct cache_entry); i++) {
+            condition_init(&ent[i].loaded, "cache_loaded");
+            ent[i].lru_next = cache->spare;
+            cache->spare = &ent[i];
+        }
+    }
+
+    ent = cache->spare;
+    cache->spare = ent->lru_next;
+
+    ent->block = block;
+    ent->valid = 0;
+    ent->dirty = 0;
+    ent->referenced = 0;
+    for (i = 0; i < cache->blkpages; i++)
+        cache->owner[((uintptr_t)block - RAM_START_PMA) / PAGE_SIZE + i] = ent;
+
+    lru_push_back(cache, ent);
+    cache->nblocks++;
+    return ent;
 }
 
-    
\ No newline at end of file
+// Reclaimer (see register_reclaimer()): frees the blocks of clean entries
+// that are neither pinned nor loading, least recently used first, until
+// /want/ pages are freed or only /capacity/ blocks are left. Gives up at
+// once if cache_lock is not free, since we may be inside a cache operation.
+
+unsigned long cache_reclaim(void * aux, unsigned long want) {
+    struct cache * const cache = aux;
+    struct cache_entry * ent, * prev;
+    unsigned long freed = 0;
+    unsigned int i;
+
+    if (!rwlock_write_tryacquire(&cache->cache_lock))
+        return 0;
+
+    for (ent = cache->tail; ent != NULL && freed < want &&
+        cache->capacity < cache->nblocks; ent = prev)
+    {
+        prev = ent->lru_prev;
+
+        if (ent->pincnt != 0 || ent->loading || (ent->valid && ent->dirty))
+            continue;
+
+        if (ent->valid) {
+            hash_remove(cache, ent);
+            ent->valid = 0;
+            cache->stats.evictions++;
+        }
+
+        lru_remove(cache, ent);
+
+        for (i = 0; i < cache->blkpages; i++) {
+            cache->owner[((uintptr_t)ent->block - RAM_START_PMA) / PAGE_SIZE
+                + i] = NULL;
+        }
+
+        free_phys_pages(ent->block, cache->blkpages);
+        ent->block = NULL;
+        ent->lru_next = cache->spare;
+        cache->spare = ent;
+        cache->nblocks--;
+        freed += cache->blkpages;
+    }
+
+    rwlock_write_release(&cache->cache_lock);
+    return freed;
+}
+
+// Returns the least recently used entry that can be recycled: one that is
+// neither pinned nor being loaded. Referenced entries passed on the way are
+// moved to the head with the bit cleared, so they are only taken once the
+// scan comes around to them again. Returns NULL if every entry is in use.
+
+struct cache_entry * find_victim(struct cache * cache) {
+    struct cache_entry * ent;
+    struct cache_entry * prev;
+
+    for (ent = cache->tail; ent != NULL; ent = prev) {
+        prev = ent->lru_prev;
+
+        if (ent->referenced) {
+            ent->referenced = 0;
+            lru_remove(cache, ent);
+            lru_push_front(cache, ent);
+            continue;
+        }
+
+        if (ent->pincnt == 0 && !ent->loading)
+            return ent;
+    }
+
+    return NULL;
+}
+
+void unpin_entry(struct cache * cache, struct cache_entry * ent) {
+    if (--ent->pincnt == 0)
+        condition_broadcast(&cache->unpinned);
+}
+
+// Writes a dirty entry to the backing device. Called and returns with
+// cache_lock held, but drops it during the write. The entry is marked clean
+// before the write so that a release while the write is in progress makes it
+// dirty again; on a write error it is marked dirty again. Returns 0 or a
+// negative error code.
+
+int writeback_entry(struct cache * cache, struct cache_entry * ent) {
+    unsigned long long t0;
+    long wcnt;
+
+    ent->dirty = 0;
+    cache->ndirty--;
+    ent->pincnt++;
+
+    rwlock_write_release(&cache->cache_lock);
+    t0 = rdtime();
+    wcnt = iowriteat(cache->bkgio, ent->pos, ent->block, ent->len);
+    rwlock_write_acquire(&cache->cache_lock);
+    cache->stats.wait_ticks += rdtime() - t0;
+
+    if (wcnt >= 0)
+        cache->stats.writebacks++;
+    else {
+        debug("cache: writeback of %llu failed (%d)", ent->pos, (int)wcnt);
+        if (!ent->dirty) {
+            ent->dirty = 1;
+            cache->ndirty++;
+        }
+    }
+
+    unpin_entry(cache, ent);
+    return (wcnt < 0) ? wcnt : 0;
+}
+
+// Writes every dirty entry that has been dirty for at least /age/ ticks.
+// Returns 0 or the error of the first write that failed, at which point it
+// stops. Caller holds cache_lock.
+
+int writeback_aged(struct cache * cache, unsigned long long age) {
+    const unsigned long long now = rdtime();
+    int n;
+
+    if (now < age)
+        return 0;
+
+    // Entries dirtied again while being written get a new dirty_time, so
+    // they are not picked up again.
+
+    do
+        n = writeback_batch(cache, now - age, CACHE_WB_BATCH);
+    while (0 < n);
+
+    return (n < 0) ? n : 0;
+}
+
+// Writes back dirty entries, least recently used first, until at most
+// /target/ remain dirty. Returns 0 or the error of the first write that
+// failed. Caller holds cache_lock.
+
+int writeback_oldest(struct cache * cache, unsigned long target) {
+    int n;
+
+    while (target < cache->ndirty) {
+        n = writeback_batch(cache, ~0ULL, cache->ndirty - target);
+        if (n <= 0)
+            return n;
+    }
+
+    return 0;
+}
+
+// Writes back up to /max/ (at most CACHE_WB_BATCH) dirty entries that became
+// dirty no later than /before/, least recently used first. The entries are
+// sorted by position and each run of adjacent blocks, up to CACHE_WB_MAXSEG
+// of them, goes to the device as one gathered write. As in
+// writeback_entry(), they are marked clean and pinned during the writes.
+// After a write fails, the entries not yet written are marked dirty again.
+// Returns the number of entries taken or the error of the failed write.
+// Caller holds cache_lock, which is dropped during the writes.
+
+int writeback_batch (
+    struct cache * cache, unsigned long long before, unsigned long max)
+{
+    struct cache_entry * batch[CACHE_WB_BATCH];
+    struct iovec iov[CACHE_WB_MAXSEG];
+    struct cache_entry * ent;
+    unsigned long long t0;
+    long len, wcnt;
+    int n, i, j, k;
+    int result = 0;
+
+    if (CACHE_WB_BATCH < max)
+        max = CACHE_WB_BATCH;
+
+    n = 0;
+
+    for (ent = cache->tail; ent != NULL && n < max; ent = ent->lru_prev) {
+        if (ent->valid && ent->dirty && !ent->loading && !ent->holdcnt &&
+            ent->dirty_time <= before)
+        {
+            for (j = n; 0 < j && ent->pos < batch[j-1]->pos; j--)
+                batch[j] = batch[j-1];
+            batch[j] = ent;
+            n++;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        batch[i]->dirty = 0;
+        cache->ndirty--;
+        batch[i]->pincnt++;
+    }
+
+    for (i = 0; i < n; i = k) {
+        len = 0;
+
+        for (k = i; k < n && k - i < CACHE_WB_MAXSEG; k++) {
+            if (k != i && batch[k-1]->pos + batch[k-1]->len != batch[k]->pos)
+                break;
+            iov[k-i].base = batch[k]->block;
+            iov[k-i].len = batch[k]->len;
+            len += batch[k]->len;
+        }
+
+        if (result == 0) {
+            rwlock_write_release(&cache->cache_lock);
+            t0 = rdtime();
+            wcnt = iowritevat(cache->bkgio, batch[i]->pos, iov, k - i);
+            rwlock_write_acquire(&cache->cache_lock);
+            cache->stats.wait_ticks += rdtime() - t0;
+
+            if (wcnt == len)
+                cache->stats.writebacks += k - i;
+            else {
+                debug("cache: writeback of %llu failed (%d)",
+                    batch[i]->pos, (int)wcnt);
+                result = (wcnt < 0) ? wcnt : -EIO;
+            }
+        }
+
+        for (j = i; j < k; j++) {
+            if (result != 0 && !batch[j]->dirty) {
+                batch[j]->dirty = 1;
+                cache->ndirty++;
+            }
+            unpin_entry(cache, batch[j]);
+        }
+    }
+
+    return (result < 0) ? result : n;
+}
+
+// Flusher thread: periodically writes dirty blocks whose age exceeds the
+// configured dirty age.
+
+void cache_flusher(struct cache * cache) {
+    struct alarm al;
+
+    alarm_init(&al, "cache_flusher");
+
+    for (;;) {
+        alarm_sleep_ms(&al, CACHE_FLUSH_INTERVAL_MS);
+
+        if (cache->ndirty == 0)
+            continue;
+
+        rwlock_write_acquire(&cache->cache_lock);
+        writeback_aged(cache, cache->dirty_age);
+        rwlock_write_release(&cache->cache_lock);
+    }
+}
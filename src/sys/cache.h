@@ -7,8 +7,43 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 
-#define CACHE_BLKSZ 512UL 
-#define CAPACITY 64UL
+// Callers see the cache in CACHE_BLKSZ pieces; the cache itself moves whole
+// cache blocks, which are a multiple of CACHE_BLKSZ (default one page).
+
+#define CACHE_BLKSZ 512UL
+
+#ifndef CACHE_DEFAULT_BLKSZ
+#define CACHE_DEFAULT_BLKSZ 4096UL
+#endif
+
+// Write-back tuning. A dirty block is written by the flusher thread once it
+// has been dirty for CACHE_DIRTY_AGE_MS; the flusher wakes every
+// CACHE_FLUSH_INTERVAL_MS. Reaching CACHE_DIRTY_HIGHWAT dirty blocks makes the
+// releasing thread write back the oldest half (0 means half the capacity).
+
+#ifndef CACHE_DIRTY_AGE_MS
+#define CACHE_DIRTY_AGE_MS 1000UL
+#endif
+
+#ifndef CACHE_FLUSH_INTERVAL_MS
+#define CACHE_FLUSH_INTERVAL_MS 250UL
+#endif
+
+#ifndef CACHE_DIRTY_HIGHWAT
+#define CACHE_DIRTY_HIGHWAT 0UL
+#endif
+
+// Write-back takes up to CACHE_WB_BATCH dirty blocks at a time, sorts them
+// by position and merges runs of up to CACHE_WB_MAXSEG adjacent blocks into
+// one device write.
+
+#ifndef CACHE_WB_BATCH
+#define CACHE_WB_BATCH 32
+#endif
+
+#ifndef CACHE_WB_MAXSEG
+#define CACHE_WB_MAXSEG 16
+#endif
 
 #define CACHE_CLEAN 0
 #define CACHE_DIRTY 1
@@ -16,9 +51,34 @@
 struct io; // extern decl.
 struct cache; // opaque decl.
 
-extern int create_cache(struct io * bkgio, struct cache ** cptr);
+// Counters returned by cache_get_stats(). wait_ticks is the time, in timer
+// ticks, spent waiting on device reads and writes issued by the cache.
+
+struct cache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long writebacks;
+    unsigned long long flushes;
+    unsigned long long wait_ticks;
+};
+
+extern int create_cache (
+    struct io * bkgio, unsigned long capacity, unsigned long blksz,
+    struct cache ** cptr);
 extern int cache_get_block(struct cache * cache, unsigned long long pos, void ** pptr);
 extern void cache_release_block(struct cache * cache, void * pblk, int dirty);
 extern int cache_flush(struct cache * cache);
+extern int cache_prefetch(struct cache * cache, unsigned long long pos);
+extern long cache_read_direct (
+    struct cache * cache, unsigned long long pos, void * buf, unsigned long len);
+extern int cache_write_zeroes (
+    struct cache * cache, unsigned long long pos, unsigned long len);
+extern void cache_get_stats(struct cache * cache, struct cache_stats * stats);
+extern void cache_reset_stats(struct cache * cache);
+extern void cache_set_writeback (
+    struct cache * cache, unsigned long age_ms, unsigned long highwat);
+extern void cache_hold_block(struct cache * cache, void * pblk);
+extern void cache_unhold_block(struct cache * cache, void * pblk);
 
 #endif // _CACHE_H_
\ No newline at end of file
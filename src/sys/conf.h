@@ -40,8 +40,15 @@
 
 #define TIMER_FREQ 10000000UL // qemu/include/hw/intc/riscv_aclint.h
 
+// Number of harts the kernel runs on. Must match the -smp option given to
+// QEMU. Harts with a higher hartid stay parked in start.s.
+
+#ifndef NHART
+#define NHART 1
+#endif
+
 #define PLIC_SRC_CNT 96 // QEMU VIRT_IRQCHIP_NUM_SOURCES
-#define PLIC_CTX_CNT 2
+#define PLIC_CTX_CNT (2*NHART) // M and S mode context of each hart
 
 #define RTC_MMIO_BASE 0x00101000L
 
@@ -60,6 +67,31 @@
 #error "UMEM_END_VMA <= UMEM_START_VMA"
 #endif
 
+// User heap, which grows up from UMEM_HEAP_START_VMA (see process_sbrk())
+// toward the file mappings
+
+#ifndef UMEM_HEAP_START_VMA
+#define UMEM_HEAP_START_VMA 0x0E0000000UL
+#endif
+
+// User virtual memory given to file mappings, between the user heap and the
+// stack
+
+#ifndef UMEM_MMAP_START_VMA
+#define UMEM_MMAP_START_VMA 0x0F0000000UL
+#endif
+
+#ifndef UMEM_MMAP_END_VMA
+#define UMEM_MMAP_END_VMA 0x0FF000000UL
+#endif
+
+// Read-only time page mapped into every process (see rtc.h), just past the
+// ioring page
+
+#ifndef UMEM_TIME_PAGE_VMA
+#define UMEM_TIME_PAGE_VMA (UMEM_MMAP_END_VMA + 0x1000UL)
+#endif
+
 #define UMEM_START ((void*)UMEM_START_VMA)
 #define UMEM_END ((void*)UMEM_END_VMA)
 #define UMEM_SIZE (UMEM_END - UMEM_START)
@@ -76,7 +108,7 @@
 #define NIRQ PLIC_SRC_CNT
 #endif
 
-// Maximum number of threads
+// Initial size of the thread table, which grows past it as needed
 
 #ifndef NTHR
 #define NTHR 32
@@ -102,13 +134,17 @@
 #define VIORNG_INTR_PRIO 1
 #define VIOGPU_INTR_PRIO 2
 
-// Maximum number of open io objects
+// Maximum number of open io objects of a process. The fd table starts with
+// 64 slots and doubles as needed, so this is 64 times a power of two.
 
-#define PROCESS_IOMAX 16
+#define PROCESS_IOMAX 1024
 
-// Capacity of block cache
+// Default capacity of block cache in blocks (see fsmount_sized). The cache
+// keeps at least this many and grows past it while memory is free.
 
-#define CACHE_CAPACITY 64 // must be power of two
+#ifndef CACHE_CAPACITY
+#define CACHE_CAPACITY 64
+#endif
 
 // KERNEL FEATURES
 //
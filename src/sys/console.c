@@ -7,6 +7,7 @@
 #include "assert.h"
 #include "console.h"
 #include "intr.h"
+#include "klog.h"
 
 #include <stdarg.h>
 #include <stdint.h>
@@ -32,6 +33,16 @@ void console_init(void) {
 }
 
 void kputc(char c) {
+    if (klog_async)
+        klog_putc(c);
+    else
+        kputc_sync(c);
+}
+
+// Writes /c/ to the console device, waiting for it to take the character.
+// A newline goes out as \r\n.
+
+void kputc_sync(char c) {
     static char cprev = '\0';
 
     switch (c) {
@@ -16,6 +16,7 @@ extern char console_initialized;
 
 extern void console_init(void);
 extern void kputc(char c);
+extern void kputc_sync(char c); // bypasses the kernel log (see klog.h)
 extern char kgetc(void);
 extern void kputs(const char * str);
 extern char * kgetsn(char * buf, size_t n);
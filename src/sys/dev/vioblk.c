@@ -13,6 +13,7 @@
 #endif
 
 #include "virtio.h"
+#include "vioblk.h"
 #include "intr.h"
 #include "assert.h"
 #include "heap.h"
@@ -24,6 +25,8 @@
 #include "ioimpl.h"
 #include "io.h"
 #include "conf.h"
+#include "memory.h"
+#include "ktrace.h"
 
 #include <limits.h>
 #include <errno.h>
@@ -39,14 +42,33 @@
 #define VIOBLK_NAME "vioblk"
 #endif
 
+// Upper bound on the virtqueue length. The length actually used is the
+// largest power of two no greater than this and the device's queue_num_max.
+// The rings for VIOBLK_VQ_LEN_MAX entries must fit in one page.
+
+#ifndef VIOBLK_VQ_LEN_MAX
+#define VIOBLK_VQ_LEN_MAX 128
+#endif
+
+// Most data buffers gathered into one request by vioblk_writevat(). The
+// device may accept fewer (VIRTIO_BLK_F_SEG_MAX).
+
+#ifndef VIOBLK_MAXSEG
+#define VIOBLK_MAXSEG 16
+#endif
+
 // INTERNAL CONSTANT DEFINITIONS
 //
 
-#define VIOBLK_VQ_LEN 8
+#define VIOBLK_REQ_NDESC (VIOBLK_MAXSEG + 2) // header, data, status
 #define VIRTIO_MMIO_INT_VRING   0x01  // Used ring notification
 #define VIRTIO_MMIO_INT_CONFIG  0x02  // Config change notification
 #define VIRTIO_BLK_T_IN 0 // type of request: read
 #define VIRTIO_BLK_T_OUT 1 // type of request: write
+#define VIRTIO_BLK_T_FLUSH 4 // type of request: make writes durable
+#define VIRTIO_BLK_T_DISCARD 11 // type of request: drop a range
+#define VIRTIO_BLK_T_WRITE_ZEROES 13 // type of request: zero a range
+#define VIRTIO_BLK_SECTOR_SIZE 512 // unit of sectors, capacity and limits
 
 
 // INTERNAL TYPE DEFINITIONS
@@ -58,27 +80,42 @@ struct vioblk_device {
 
     struct io io;
 
+    // The rings live in one physical page allocated at attach time. Unused
+    // descriptors are chained through their next field starting at
+    // free_head.
+
     struct {
+        uint16_t len;
         uint16_t last_used_idx;
+        uint16_t free_head;
+        uint16_t nfree;
 
-        union {
-            struct virtq_avail avail;
-            char _avail_filler[VIRTQ_AVAIL_SIZE(VIOBLK_VQ_LEN)];
-        };
-
-        union {
-            volatile struct virtq_used used;
-            char _used_filler[VIRTQ_USED_SIZE(VIOBLK_VQ_LEN)];
-        };
-
-        struct virtq_desc desc[VIOBLK_VQ_LEN];
+        struct virtq_desc * desc;
+        struct virtq_avail * avail;
+        volatile struct virtq_used * used;
     } vq;
 
+    // Request slots, indexed by the head descriptor of a request's chain.
+    // Each holds the request header and status byte the device reads and
+    // writes, so the I/O path allocates nothing. The ISR marks the slot
+    // complete and wakes its submitter.
+
+    struct vioblk_slot * slots;
 
     uint32_t blksz;
+    int event_idx; // VIRTIO_F_EVENT_IDX negotiated
+    uint32_t max_discard; // 512-byte sectors per discard, 0 if unsupported
+    uint32_t max_zeroes; // 512-byte sectors per write zeroes, 0 if unsupported
+    uint32_t maxseg; // data buffers per request
+    int flush; // VIRTIO_BLK_F_FLUSH negotiated (device has a write cache)
 
     struct lock qlock;
-    struct condition qwait;
+    struct condition desc_avail; // descriptors were returned to the free chain
+
+    // The ISR only acknowledges the device. Completed requests are matched
+    // to their slots by deferred work (see vioblk_complete()).
+
+    struct intr_work complete_work;
 };
 
 // request structure tells the device what to do
@@ -91,6 +128,28 @@ struct virtio_blk_req {
     //   - 1-byte status field
 };
 
+// Data of a discard or write zeroes request: the range it applies to
+
+struct virtio_blk_discard_write_zeroes {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags; // unmap (write zeroes only)
+};
+
+// Every request takes a single ring descriptor pointing at the indirect table
+// in its slot, so the ring holds as many requests as it has entries. The
+// table has room for the most data buffers a request may gather.
+
+struct vioblk_slot {
+    struct virtq_desc itab[VIOBLK_REQ_NDESC];
+    struct virtio_blk_req req;
+    struct virtio_blk_discard_write_zeroes seg;
+    struct condition done;
+    volatile int complete;
+    uint32_t len; // bytes written by the device
+    volatile uint8_t status;
+};
+
 
 
 // VirtIO block device feature bits (number, *not* mask)
@@ -125,26 +184,60 @@ static long vioblk_writeat (
     const void * buf,
     long len);
 
+static long vioblk_writevat (
+    struct io * io,
+    unsigned long long pos,
+    const struct iovec * iov,
+    int iovcnt);
+
 static int vioblk_cntl (
     struct io * io, int cmd, void * arg);
 
 static void vioblk_isr(int srcno, void * aux);
+static void vioblk_complete(void * aux);
+
+static int vioblk_check (
+    struct vioblk_device * blkio, unsigned long long pos, long len);
 
-static int get_free_desc(struct vioblk_device *blkio);
+static int vioblk_range_cntl (
+    struct vioblk_device * blkio, int cmd, const struct ioextent * ext);
 
-// EXPORTED FUNCTION DEFINITIONS
+static int vioblk_alloc_vq(struct vioblk_device * blkio, uint_fast16_t len);
+
+static int vioblk_submit (
+    struct vioblk_device * blkio, uint32_t type, unsigned long long pos,
+    void * buf, long len);
+
+static int vioblk_submitv (
+    struct vioblk_device * blkio, uint32_t type, unsigned long long pos,
+    const struct iovec * iov, int iovcnt);
+
+static int vioblk_wait(struct vioblk_device * blkio, int head);
+
+static long vioblk_request (
+    struct vioblk_device * blkio, uint32_t type, unsigned long long pos,
+    void * buf, long len);
+
+static int alloc_desc_chain(struct vioblk_device * blkio, int cnt);
+static void free_desc_chain(struct vioblk_device * blkio, int head);
+
+// INTERNAL GLOBAL VARIABLES
 //
-// Attaches a VirtIO block device. Declared and called directly from virtio.c.
 
-void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
+//set up io interface like how we did with uart
+static const struct iointf vioblk_iointf = {
+    .close = &vioblk_close,
+    .readat = &vioblk_readat,
+    .writeat = &vioblk_writeat,
+    .writevat = &vioblk_writevat,
+    .cntl = &vioblk_cntl
+}; 
 
-    //set up io interface like how we did with uart
-    static const struct iointf vioblk_iointf = {
-        .close = &vioblk_close,
-        .readat = &vioblk_readat,
-        .writeat = &vioblk_writeat,
-        .cntl = &vioblk_cntl
-    }; 
+// EXPORTED FUNCTION DEFINITIONS
+//
+// Attaches a VirtIO block device. Declared and called directly from virtio.c.
+
+void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     if (regs->device_id != VIRTIO_ID_BLOCK) {
         return;
@@ -167,8 +260,13 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     //  - VIRTIO_F_RING_RESET and
     //  - VIRTIO_F_INDIRECT_DESC
     // We want:
-    //  - VIRTIO_BLK_F_BLK_SIZE and
-    //  - VIRTIO_BLK_F_TOPOLOGY.
+    //  - VIRTIO_BLK_F_BLK_SIZE,
+    //  - VIRTIO_BLK_F_TOPOLOGY,
+    //  - VIRTIO_BLK_F_SEG_MAX,
+    //  - VIRTIO_BLK_F_FLUSH,
+    //  - VIRTIO_BLK_F_DISCARD,
+    //  - VIRTIO_BLK_F_WRITE_ZEROES and
+    //  - VIRTIO_F_EVENT_IDX.
 
     virtio_featset_init(needed_features);
     // Mandatory features
@@ -178,6 +276,14 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     // Optional features
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE); // give me block size  should be 512 bytes for our case
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SEG_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_FLUSH);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_DISCARD);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_WRITE_ZEROES);
+    virtio_featset_add(wanted_features, VIRTIO_F_RING_EVENT_IDX);
+    // Needed features must also be requested
+    virtio_featset_add(wanted_features, VIRTIO_F_RING_RESET);
+    virtio_featset_add(wanted_features, VIRTIO_F_INDIRECT_DESC);
     result = virtio_negotiate_features(regs, enabled_features, wanted_features, needed_features);
 
     // if failed -> set fail bit and reset
@@ -228,14 +334,22 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
         return;
     }
 
-    // zero the vq memory:
-    memset(&blkio->vq, 0, sizeof(blkio->vq));
-
-    regs->queue_num = VIOBLK_VQ_LEN;
-    regs->queue_ready = 1;
+    // Use the longest queue both sides support (power of two)
+    uint_fast16_t qlen = VIOBLK_VQ_LEN_MAX;
+    while (regs->queue_num_max < qlen)
+        qlen >>= 1;
 
+    if (qlen == 0 || vioblk_alloc_vq(blkio, qlen) != 0) {
+        regs->status |= VIRTIO_STAT_FAILED;
+        regs->status = 0;
+        return;
+    }
 
-    virtio_attach_virtq(regs, 0, VIOBLK_VQ_LEN, (uint64_t)(uintptr_t)&blkio->vq.desc, (uint64_t)(uintptr_t)&blkio->vq.used, (uint64_t)(uintptr_t)&blkio->vq.avail);
+    virtio_attach_virtq(regs, 0, blkio->vq.len,
+        (uint64_t)(uintptr_t)blkio->vq.desc,
+        (uint64_t)(uintptr_t)blkio->vq.used,
+        (uint64_t)(uintptr_t)blkio->vq.avail);
+    regs->queue_ready = 1;
 
 
     // If the device provides a block size, use it. Otherwise, use 512.
@@ -251,8 +365,26 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     }
     
     blkio->blksz = blksz;
+    blkio->event_idx =
+        virtio_featset_test(enabled_features, VIRTIO_F_RING_EVENT_IDX);
+
+    blkio->maxseg = VIOBLK_MAXSEG;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SEG_MAX) &&
+        0 < regs->config.blk.seg_max && regs->config.blk.seg_max < VIOBLK_MAXSEG)
+    {
+        blkio->maxseg = regs->config.blk.seg_max;
+    }
+
+    blkio->flush = virtio_featset_test(enabled_features, VIRTIO_BLK_F_FLUSH);
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_DISCARD))
+        blkio->max_discard = regs->config.blk.max_discard_sectors;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_WRITE_ZEROES))
+        blkio->max_zeroes = regs->config.blk.max_write_zeroes_sectors;
 
-    condition_init(&blkio->qwait, "queuewait");
+    condition_init(&blkio->desc_avail, "vioblk_desc");
+    init_intr_work(&blkio->complete_work, blkio->irqno,
+        vioblk_complete, blkio);
     lock_init(&blkio->qlock);
 
 
@@ -267,6 +399,39 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
 }
 
+// Starts a transfer of /len/ bytes at /pos/ on the vioblk device /io/ and
+// returns without waiting for it. Blocks only while every descriptor is in
+// use. Returns a handle for vioblk_finish_io(), -ENOTSUP if /io/ is not a
+// vioblk device or -EINVAL if the range is not whole blocks on the device.
+
+int vioblk_start_io (
+    struct io * io, int write, unsigned long long pos, void * buf, long len)
+{
+    struct vioblk_device * blkio;
+    int result;
+
+    if (io->intf != &vioblk_iointf)
+        return -ENOTSUP;
+
+    blkio = (void*)io - offsetof(struct vioblk_device, io);
+
+    result = vioblk_check(blkio, pos, len);
+    if (result != 0)
+        return result;
+
+    return vioblk_submit(blkio,
+        write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, pos, buf, len);
+}
+
+// Waits for the transfer started as /handle/ to complete. Returns 0 or -EIO.
+
+int vioblk_finish_io(struct io * io, int handle) {
+    struct vioblk_device * const blkio =
+        (void*)io - offsetof(struct vioblk_device, io);
+
+    return (vioblk_wait(blkio, handle) == 0) ? 0 : -EIO;
+}
+
 static void vioblk_close(struct io*	io) {
     struct vioblk_device* const blkio = (void*)io - offsetof(struct vioblk_device, io);
 
@@ -283,8 +448,8 @@ static void vioblk_close(struct io*	io) {
     // disable interrupts
     disable_intr_source(blkio->irqno);
 
-    blkio->vq.avail.idx = 0;
-    blkio->vq.used.idx  = 0;
+    blkio->vq.avail->idx = 0;
+    blkio->vq.used->idx  = 0;
     blkio->vq.last_used_idx = 0;
 
 }	
@@ -299,7 +464,7 @@ static int vioblk_cntl (struct io * io, int cmd, void * arg) {
                 return -EINVAL;
             }
             unsigned long long capacity = blkio->regs->config.blk.capacity;
-            *(unsigned long long*)arg = capacity * (unsigned long long)blkio->blksz;
+            *(unsigned long long*)arg = capacity * VIRTIO_BLK_SECTOR_SIZE;
             return 0;
         }
         case IOCTL_GETBLKSZ:
@@ -309,6 +474,17 @@ static int vioblk_cntl (struct io * io, int cmd, void * arg) {
             *(uint32_t*)arg = blkio->blksz;
             return 0;
 
+        case IOCTL_DISCARD:
+        case IOCTL_WRZEROES:
+            return vioblk_range_cntl(blkio, cmd, arg);
+
+        case IOCTL_FLUSH:
+            // Without a write cache every completed write is durable
+            if (!blkio->flush)
+                return 0;
+            return (vioblk_request(blkio, VIRTIO_BLK_T_FLUSH, 0, NULL, 0) < 0) ?
+                -EIO : 0;
+
         default:
             return -ENOTSUP;
     }
@@ -339,6 +515,10 @@ static void vioblk_isr(int srcno, void * aux) {
 
     uint32_t int_status = blkio->regs->interrupt_status; // find out the interrupt enabled bits
 
+    // notifies the device that events causing the interrupt have been handled.
+    blkio->regs->interrupt_ack = int_status; 
+    __sync_synchronize();
+
     // 3 types of notification
     
     // config and used buffer notification are sent by the device to the driver
@@ -350,202 +530,413 @@ static void vioblk_isr(int srcno, void * aux) {
 
 
         // used buffer notification
-    if (int_status & VIRTIO_MMIO_INT_VRING) {
-        // do something
-        condition_broadcast(&blkio->qwait);
+    if (int_status & VIRTIO_MMIO_INT_VRING)
+        queue_intr_work(&blkio->complete_work);
 
-    }
     // configuration change notification
     if (int_status & VIRTIO_MMIO_INT_CONFIG) {
         // anything that's related to config
         panic("viorng: config change notification and shouldn't happen");
     }
+}
 
-    // notifies the device that events causing the interrupt have been handled.
-    blkio->regs->interrupt_ack = int_status; 
-    __sync_synchronize();
+// Deferred part of vioblk_isr(). Matches each new used-ring entry to the
+// request whose chain it returns and wakes that request's submitter.
+
+static void vioblk_complete(void * aux) {
+    struct vioblk_device* const blkio = aux;
+
+    do {
+        while (blkio->vq.last_used_idx != blkio->vq.used->idx) {
+            __sync_synchronize(); // read used.idx before the ring entry
+            uint16_t uidx = blkio->vq.last_used_idx % blkio->vq.len;
+            uint32_t head = blkio->vq.used->ring[uidx].id;
+
+            if (head < blkio->vq.len) {
+                ktrace(KTRACE_BIO_DONE, head, blkio->slots[head].status);
+                blkio->slots[head].len = blkio->vq.used->ring[uidx].len;
+                blkio->slots[head].complete = 1;
+                condition_broadcast(&blkio->slots[head].done);
+            }
+
+            blkio->vq.last_used_idx++;
+        }
+
+        if (!blkio->event_idx)
+            break;
+
+        // Ask for an interrupt only at the next completion, then look
+        // again in case one slipped in before the device saw that.
+        *virtq_used_event(blkio->vq.avail, blkio->vq.len) =
+            blkio->vq.last_used_idx;
+        __sync_synchronize();
+    } while (blkio->vq.last_used_idx != blkio->vq.used->idx);
 }
 
 static long vioblk_readat(struct io *io, unsigned long long pos, void *buf, long bufsz) {
     struct vioblk_device* blkio = (void*)io - offsetof(struct vioblk_device, io);
-    if (bufsz < 0 || bufsz % blkio->blksz != 0 || pos % blkio->blksz != 0)
-        return -EINVAL;
-    if (bufsz == 0)
+    int result;
+
+    if (bufsz == 0 && pos % blkio->blksz == 0)
         return 0;
-    unsigned long long end = pos + bufsz;  // or `len` for writeat
-    unsigned long long total = blkio->regs->config.blk.capacity * blkio->blksz;
-    if (end > total) {
-        return -EINVAL;
-    }
 
+    result = vioblk_check(blkio, pos, bufsz);
+    if (result != 0)
+        return result;
 
-    lock_acquire(&blkio->qlock);
+    return vioblk_request(blkio, VIRTIO_BLK_T_IN, pos, buf, bufsz);
+}
+
+static long vioblk_writeat(struct io *io, unsigned long long pos, const void *buf, long len) {
+    struct vioblk_device* blkio = (void*)io - offsetof(struct vioblk_device, io);
+    int result;
 
-    // maybe i need to check if pos + bufsz <= endpoint to prevent reading beyond the end of the device 
+    result = vioblk_check(blkio, pos, len);
+    if (result != 0)
+        return result;
 
-    // Allocate and set up the request and status buffer
-    struct virtio_blk_req *req = kcalloc(1, sizeof(*req));
-    uint8_t *status = kcalloc(1, sizeof(uint8_t));
+    return vioblk_request(blkio, VIRTIO_BLK_T_OUT, pos, (void*)buf, len);
+}
 
-    if (!req || !status) {
-        lock_release(&blkio->qlock);
-        return -ENOMEM;
-    }
+// Writes the buffers of /iov/ at /pos/, gathering up to maxseg of them into
+// each request. Each request must cover whole blocks.
 
-    req->type = VIRTIO_BLK_T_IN;
-    req->reserved = 0;
-    req->sector = pos / blkio->blksz;
+static long vioblk_writevat (
+    struct io * io, unsigned long long pos,
+    const struct iovec * iov, int iovcnt)
+{
+    struct vioblk_device* blkio = (void*)io - offsetof(struct vioblk_device, io);
+    long total, len;
+    int head, cnt, i;
+    int result;
 
-    // Find 3 free descriptors dynamically
-    int head = get_free_desc(blkio);
-    if (head == -1) {
-        lock_release(&blkio->qlock);
-        kfree(req);
-        kfree(status);
-        return -ENOMEM;  // No free descriptors available
-    }
+    total = 0;
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].len;
 
-    int data = (head + 1) % VIOBLK_VQ_LEN;
-    int stat = (head + 2) % VIOBLK_VQ_LEN;
+    result = vioblk_check(blkio, pos, total);
+    if (result != 0)
+        return result;
 
-    // Setup descriptors
-    blkio->vq.desc[head].addr = (uint64_t)(uintptr_t)req;
-    blkio->vq.desc[head].len = sizeof(*req);
-    blkio->vq.desc[head].flags = VIRTQ_DESC_F_NEXT;
-    blkio->vq.desc[head].next = data;
+    for (total = 0; 0 < iovcnt; iov += cnt, iovcnt -= cnt) {
+        cnt = (iovcnt < blkio->maxseg) ? iovcnt : blkio->maxseg;
 
-    blkio->vq.desc[data].addr = (uint64_t)(uintptr_t)buf;
-    blkio->vq.desc[data].len = bufsz;
-    blkio->vq.desc[data].flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
-    blkio->vq.desc[data].next = stat;
+        for (len = 0, i = 0; i < cnt; i++)
+            len += iov[i].len;
 
-    blkio->vq.desc[stat].addr = (uint64_t)(uintptr_t)status;
-    blkio->vq.desc[stat].len = 1;
-    blkio->vq.desc[stat].flags = VIRTQ_DESC_F_WRITE;
+        if (len % blkio->blksz != 0)
+            return (total > 0) ? total : -EINVAL;
 
-    // Submit the descriptors
-    uint16_t idx = blkio->vq.avail.idx % VIOBLK_VQ_LEN;
-    blkio->vq.avail.ring[idx] = head;
-    __sync_synchronize();
-    blkio->vq.avail.idx++;
-    __sync_synchronize();
+        if (len == 0)
+            continue;
 
-    virtio_notify_avail(blkio->regs, 0);
+        head = vioblk_submitv(blkio, VIRTIO_BLK_T_OUT, pos + total, iov, cnt);
+        if (vioblk_wait(blkio, head) != 0)
+            return (total > 0) ? total : -EIO;
 
-    // Wait for the completion of the request
-    while (blkio->vq.used.idx == blkio->vq.last_used_idx)
-        condition_wait(&blkio->qwait);
+        total += len;
+    }
 
-    blkio->vq.last_used_idx++;
+    return total;
+}
 
-    int ret = (status[0] == 0) ? bufsz : -EIO;
+// Returns 0 if /len/ bytes at /pos/ are a non-empty run of whole blocks
+// within the device, and -EINVAL otherwise.
 
-    blkio->vq.desc[head].flags = 0;
-    blkio->vq.desc[data].flags = 0; 
-    blkio->vq.desc[stat].flags = 0;
+static int vioblk_check (
+    struct vioblk_device * blkio, unsigned long long pos, long len)
+{
+    unsigned long long total;
 
-    lock_release(&blkio->qlock);
-    kfree(req);
-    kfree(status);
-    return ret;
+    if (len <= 0 || len % blkio->blksz != 0 || pos % blkio->blksz != 0)
+        return -EINVAL;
+
+    // Check if the transfer goes beyond the end of the device
+    total = blkio->regs->config.blk.capacity * VIRTIO_BLK_SECTOR_SIZE;
+    if (total < pos || total - pos < len)
+        return -EINVAL;
+
+    return 0;
 }
 
-static long vioblk_writeat(struct io *io, unsigned long long pos, const void *buf, long len) {
-    struct vioblk_device* blkio = (void*)io - offsetof(struct vioblk_device, io);
+// Discards or zeroes (IOCTL_DISCARD or IOCTL_WRZEROES in /cmd/) the range
+// /ext/, in as many requests as the device's limit on their size calls for.
+// A zero-length range only asks whether the device supports the command.
+// Returns 0, -ENOTSUP if it does not, -EINVAL or -EIO.
+
+static int vioblk_range_cntl (
+    struct vioblk_device * blkio, int cmd, const struct ioextent * ext)
+{
+    unsigned long long pos, end, max;
+    uint32_t type;
+    long n;
+    int result;
 
-    if (len <= 0 || len % blkio->blksz != 0 || pos % blkio->blksz != 0)
+    if (ext == NULL)
         return -EINVAL;
 
-    unsigned long long end = pos + len;
-    unsigned long long total = blkio->regs->config.blk.capacity * blkio->blksz;
+    if (cmd == IOCTL_DISCARD) {
+        type = VIRTIO_BLK_T_DISCARD;
+        max = blkio->max_discard;
+    } else {
+        type = VIRTIO_BLK_T_WRITE_ZEROES;
+        max = blkio->max_zeroes;
+    }
+
+    if (max == 0)
+        return -ENOTSUP;
 
-    // Check if the write goes beyond the end of the device
-    if (end > total) {
+    if (ext->len == 0)
+        return 0;
+
+    if (LONG_MAX < ext->len)
         return -EINVAL;
+
+    result = vioblk_check(blkio, ext->pos, ext->len);
+    if (result != 0)
+        return result;
+
+    max *= VIRTIO_BLK_SECTOR_SIZE;
+    end = ext->pos + ext->len;
+
+    for (pos = ext->pos; pos < end; pos += n) {
+        n = (end - pos < max) ? end - pos : max;
+        if (vioblk_request(blkio, type, pos, NULL, n) < 0)
+            return -EIO;
     }
 
-    lock_acquire(&blkio->qlock);
+    return 0;
+}
 
-    // Allocate and set up the request and status buffer
-    struct virtio_blk_req *req = kcalloc(1, sizeof(*req));
-    uint8_t *status = kcalloc(1, sizeof(uint8_t));
+// Allocates and lays out the rings for a virtqueue of /len/ entries in one
+// physical page, allocates the request slots and builds the free descriptor
+// chain.
 
-    // A driver MUST NOT create a descriptor chain longer than the Queue Size of the device.
+static int vioblk_alloc_vq(struct vioblk_device * blkio, uint_fast16_t len) {
+    size_t avail_off, used_off;
+    unsigned int slot_pages;
+    void * page;
+    int i;
 
+    avail_off = len * sizeof(struct virtq_desc);
+    used_off = avail_off + VIRTQ_AVAIL_SIZE(len) + sizeof(uint16_t);
+    used_off = (used_off + 3) & ~(size_t)3;
 
-    if (!req || !status) {
-        lock_release(&blkio->qlock);
+    if (PAGE_SIZE < used_off + VIRTQ_USED_SIZE(len) + sizeof(uint16_t))
+        return -EINVAL;
+
+    page = alloc_phys_page();
+    if (page == NULL)
+        return -ENOMEM;
+    
+    zero_page(page);
+
+    // The slot array can exceed the heap0 allocation limit, so it also
+    // comes from physical pages.
+
+    slot_pages = (len * sizeof(struct vioblk_slot) + PAGE_SIZE - 1) / PAGE_SIZE;
+    blkio->slots = alloc_phys_pages(slot_pages);
+    if (blkio->slots == NULL) {
+        free_phys_page(page);
         return -ENOMEM;
     }
 
-    req->type = VIRTIO_BLK_T_OUT;
-    req->reserved = 0;
-    req->sector = pos / blkio->blksz;
+    memset(blkio->slots, 0, slot_pages * PAGE_SIZE);
 
-    // Find 3 free descriptors dynamically
-    int head = get_free_desc(blkio);
-    if (head == -1) {
+    blkio->vq.len = len;
+    blkio->vq.desc = page;
+    blkio->vq.avail = page + avail_off;
+    blkio->vq.used = page + used_off;
+    blkio->vq.last_used_idx = 0;
+
+    for (i = 0; i < len; i++) {
+        blkio->vq.desc[i].next = (i + 1 < len) ? i + 1 : -1;
+        condition_init(&blkio->slots[i].done, "vioblk_req");
+    }
+
+    blkio->vq.free_head = 0;
+    blkio->vq.nfree = len;
+    return 0;
+}
+
+// Performs a single request and waits for it to complete. Returns /len/ on
+// success or a negative error code.
+
+static long vioblk_request (
+    struct vioblk_device * blkio, uint32_t type, unsigned long long pos,
+    void * buf, long len)
+{
+    int head;
+
+    head = vioblk_submit(blkio, type, pos, buf, len);
+    return (vioblk_wait(blkio, head) == 0) ? len : -EIO;
+}
+
+// Places a request on the available ring and notifies the device without
+// waiting for it. Blocks until enough descriptors are free. Returns the head
+// descriptor, which is passed to vioblk_wait().
+
+static int vioblk_submit (
+    struct vioblk_device * blkio, uint32_t type, unsigned long long pos,
+    void * buf, long len)
+{
+    struct iovec iov;
+
+    iov.base = buf;
+    iov.len = len;
+
+    // A flush has no data
+    return vioblk_submitv(blkio, type, pos, &iov,
+        (type == VIRTIO_BLK_T_FLUSH) ? 0 : 1);
+}
+
+// As vioblk_submit(), but the data is the /iovcnt/ buffers of /iov/, at most
+// VIOBLK_MAXSEG of them.
+
+static int vioblk_submitv (
+    struct vioblk_device * blkio, uint32_t type, unsigned long long pos,
+    const struct iovec * iov, int iovcnt)
+{
+    struct iovec segiov;
+    struct vioblk_slot * slot;
+    uint16_t old_idx;
+    long len;
+    int head, i;
+
+    assert (iovcnt <= VIOBLK_MAXSEG);
+
+    for (len = 0, i = 0; i < iovcnt; i++)
+        len += iov[i].len;
+
+    lock_acquire(&blkio->qlock);
+
+    while ((head = alloc_desc_chain(blkio, 1)) < 0) {
+        // desc_avail is signaled by vioblk_wait() in thread context, never
+        // by the ISR, so it cannot come before the wait (see thread.h).
         lock_release(&blkio->qlock);
-        kfree(req);
-        kfree(status);
-        return -ENOMEM;  // No free descriptors available
+        condition_wait(&blkio->desc_avail);
+        lock_acquire(&blkio->qlock);
     }
 
-    int data = (head + 1) % VIOBLK_VQ_LEN;
-    int stat = (head + 2) % VIOBLK_VQ_LEN;
+    slot = &blkio->slots[head];
+    slot->req.type = type;
+    slot->req.reserved = 0;
+    slot->req.sector = pos / VIRTIO_BLK_SECTOR_SIZE;
+    slot->status = 0xff;
+    slot->complete = 0;
+
+    // Setup the indirect table: header, data, status
+    slot->itab[0].addr = (uint64_t)(uintptr_t)&slot->req;
+    slot->itab[0].len = sizeof(slot->req);
+    slot->itab[0].flags = VIRTQ_DESC_F_NEXT;
+    slot->itab[0].next = 1;
+
+    // A discard or write zeroes request carries a segment naming its range
+    // in place of data
+
+    if (type == VIRTIO_BLK_T_DISCARD || type == VIRTIO_BLK_T_WRITE_ZEROES) {
+        slot->seg.sector = slot->req.sector;
+        slot->seg.num_sectors = len / VIRTIO_BLK_SECTOR_SIZE;
+        slot->seg.flags = 0;
+        segiov.base = &slot->seg;
+        segiov.len = sizeof(slot->seg);
+        iov = &segiov;
+        iovcnt = 1;
+    }
 
-    // Setup descriptors
-    blkio->vq.desc[head].addr = (uint64_t)(uintptr_t)req;
-    blkio->vq.desc[head].len = sizeof(*req);
-    blkio->vq.desc[head].flags = VIRTQ_DESC_F_NEXT;
-    blkio->vq.desc[head].next = data;
+    for (i = 0; i < iovcnt; i++) {
+        slot->itab[1+i].addr = (uint64_t)(uintptr_t)iov[i].base;
+        slot->itab[1+i].len = iov[i].len;
+        slot->itab[1+i].flags = VIRTQ_DESC_F_NEXT;
+        if (type == VIRTIO_BLK_T_IN)
+            slot->itab[1+i].flags |= VIRTQ_DESC_F_WRITE;
+        slot->itab[1+i].next = 2+i;
+    }
 
-    blkio->vq.desc[data].addr = (uint64_t)(uintptr_t)buf;
-    blkio->vq.desc[data].len = len;
-    blkio->vq.desc[data].flags = VIRTQ_DESC_F_NEXT;
-    blkio->vq.desc[data].next = stat;
+    slot->itab[1+i].addr = (uint64_t)(uintptr_t)&slot->status;
+    slot->itab[1+i].len = 1;
+    slot->itab[1+i].flags = VIRTQ_DESC_F_WRITE;
 
-    blkio->vq.desc[stat].addr = (uint64_t)(uintptr_t)status;
-    blkio->vq.desc[stat].len = 1;
-    blkio->vq.desc[stat].flags = VIRTQ_DESC_F_WRITE;
+    virtq_set_indirect(&blkio->vq.desc[head], slot->itab, 2 + iovcnt);
 
-    // Submit the descriptors
-    uint16_t idx = blkio->vq.avail.idx % VIOBLK_VQ_LEN;
-    blkio->vq.avail.ring[idx] = head;
-    __sync_synchronize();
-    blkio->vq.avail.idx++;
+    // Submit the descriptor
+    old_idx = blkio->vq.avail->idx;
+    blkio->vq.avail->ring[old_idx % blkio->vq.len] = head;
     __sync_synchronize();
+    blkio->vq.avail->idx = old_idx + 1;
+
+    ktrace(KTRACE_BIO_SUBMIT, slot->req.sector, type | (uint64_t)len << 8);
 
-    virtio_notify_avail(blkio->regs, 0);
+    // Skip the MMIO notify if the device is still working through earlier
+    // requests and has not asked for one.
+    virtio_kick(blkio->regs, 0, blkio->event_idx, blkio->vq.used,
+        blkio->vq.len, old_idx, old_idx + 1);
 
-    // Wait for the completion of the request
-    while (blkio->vq.used.idx == blkio->vq.last_used_idx)
-        condition_wait(&blkio->qwait);
+    lock_release(&blkio->qlock);
+    return head;
+}
+
+// Waits for the request with chain /head/ to complete and returns its
+// descriptors to the free chain. Returns the status byte written by the
+// device (0 on success).
 
-    blkio->vq.last_used_idx++;
+static int vioblk_wait(struct vioblk_device * blkio, int head) {
+    struct vioblk_slot * const slot = &blkio->slots[head];
+    int status;
+    int pie;
 
-    int ret = (status[0] == 0) ? len : -EIO;
+    pie = disable_interrupts();
+    while (!slot->complete)
+        condition_wait(&slot->done);
+    restore_interrupts(pie);
 
-    blkio->vq.desc[head].flags = 0;
-    blkio->vq.desc[data].flags = 0;
-    blkio->vq.desc[stat].flags = 0;
+    status = slot->status;
 
+    lock_acquire(&blkio->qlock);
+    free_desc_chain(blkio, head);
     lock_release(&blkio->qlock);
-    kfree(req);
-    kfree(status);
-    return ret;
+
+    condition_signal(&blkio->desc_avail); // one chain freed, one waiter served
+    return status;
 }
 
+// Takes /cnt/ descriptors from the free chain, linked through their next
+// fields. Returns the first one, or -1 if not enough are free. Caller holds
+// qlock.
 
-// Looks for 3 free descriptors
-static int get_free_desc(struct vioblk_device *blkio) {
-    for (int i = 0; i < VIOBLK_VQ_LEN; i++) {
-        int i1 = (i + 1) % VIOBLK_VQ_LEN;
-        int i2 = (i + 2) % VIOBLK_VQ_LEN;
-        if (blkio->vq.desc[i].flags == 0 &&
-            blkio->vq.desc[i1].flags == 0 &&
-            blkio->vq.desc[i2].flags == 0)
-            return i;
+static int alloc_desc_chain(struct vioblk_device * blkio, int cnt) {
+    int head, last, i;
+
+    if (blkio->vq.nfree < cnt)
+        return -1;
+    
+    head = last = blkio->vq.free_head;
+    for (i = 1; i < cnt; i++)
+        last = blkio->vq.desc[last].next;
+    
+    blkio->vq.free_head = blkio->vq.desc[last].next;
+    blkio->vq.nfree -= cnt;
+    blkio->vq.desc[last].next = -1;
+    return head;
+}
+
+// Returns the chain starting at /head/ to the free chain. Caller holds qlock.
+
+static void free_desc_chain(struct vioblk_device * blkio, int head) {
+    struct virtq_desc * const desc = blkio->vq.desc;
+    int last, cnt;
+
+    last = head;
+    cnt = 1;
+
+    while (desc[last].flags & VIRTQ_DESC_F_NEXT) {
+        desc[last].flags = 0;
+        last = desc[last].next;
+        cnt++;
     }
-    return -1;
-}
\ No newline at end of file
+
+    desc[last].flags = 0;
+    desc[last].next = blkio->vq.free_head;
+    blkio->vq.free_head = head;
+    blkio->vq.nfree += cnt;
+}
@@ -0,0 +1,21 @@
+// vioblk.h - VirtIO block device
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _VIOBLK_H_
+#define _VIOBLK_H_
+
+struct io; // io.h
+
+// Split-phase transfers on a vioblk device, for callers that keep several
+// requests in flight at once (see stripe.c). readat and writeat through the
+// io interface are a start followed straight away by a finish.
+
+extern int vioblk_start_io (
+    struct io * io, int write, unsigned long long pos, void * buf, long len);
+
+extern int vioblk_finish_io(struct io * io, int handle);
+
+#endif // _VIOBLK_H_
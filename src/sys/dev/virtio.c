@@ -7,30 +7,45 @@
 #include "virtio.h"
 #include "assert.h"
 #include "console.h"
+#include "device.h"
 #include "error.h"
+#include "heap.h"
 
 #include <stddef.h>
 #include <errno.h>
 
 #define VIRTIO_MAGIC 0x74726976
 
-// EXPORTED FUNCTION DEFINITIONS
+// With VIRTIO_LAZY, only block devices, which may hold the root file system,
+// are attached at boot. Other devices whose name is known here (see
+// lazy_name()) are attached on first open_device().
+
+#ifndef VIRTIO_LAZY
+#define VIRTIO_LAZY 1
+#endif
+
+// INTERNAL TYPE DEFINITIONS
 //
 
-void virtio_attach(void * mmio_base, int irqno) {
-    volatile struct virtio_mmio_regs * const regs = mmio_base;
+struct virtio_slot {
+    volatile struct virtio_mmio_regs * regs;
+    int irqno;
+};
 
-    extern void viocons_attach (
-        volatile struct virtio_mmio_regs * regs, int irqno); // viocons.c
-    
-    extern void vioblk_attach (
-        volatile struct virtio_mmio_regs * regs, int irqno); // vioblk.c
+// INTERNAL FUNCTION DECLARATIONS
+//
 
-    extern void viorng_attach (
-        volatile struct virtio_mmio_regs * regs, int irqno); // viorng.c
+static void attach_driver(volatile struct virtio_mmio_regs * regs, int irqno);
+static void attach_deferred(void * aux);
+static const char * lazy_name(uint32_t device_id);
 
-    extern void viogpu_attach (
-        volatile struct virtio_mmio_regs * regs, int irqno); // viogpu.c
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void virtio_attach(void * mmio_base, int irqno) {
+    volatile struct virtio_mmio_regs * const regs = mmio_base;
+    struct virtio_slot * slot;
+    const char * name;
 
     if (regs->magic_value != VIRTIO_MAGIC) {
         kprintf("%p: No virtio magic number found\n", mmio_base);
@@ -46,31 +61,19 @@ void virtio_attach(void * mmio_base, int irqno) {
     if (regs->device_id == VIRTIO_ID_NONE)
         return;
 
-    regs->status = 0; // reset
-    regs->status = VIRTIO_STAT_ACKNOWLEDGE;
+    name = VIRTIO_LAZY ? lazy_name(regs->device_id) : NULL;
 
-    switch (regs->device_id) {
-    case VIRTIO_ID_CONSOLE:
-        debug("%p: Found virtio console device", regs);
-        viocons_attach(regs, irqno);
-        break;
-    case VIRTIO_ID_BLOCK:
-        debug("%p: Found virtio block device", regs);
-        vioblk_attach(regs, irqno);
-        break;
-    case VIRTIO_ID_RNG:
-        debug("%p: Found virtio rng device", regs);
-        viorng_attach(regs, irqno);
-        break;
-    case VIRTIO_ID_GPU:
-        debug("%p: Found virtio gpu device", regs);
-        viogpu_attach(regs, irqno);
-        break;
-    default:
-        kprintf("%p: Unknown virtio device type %u ignored\n",
-            mmio_base, (unsigned int) regs->device_id);
-        return;
+    if (name != NULL) {
+        slot = kmalloc(sizeof(struct virtio_slot));
+        if (slot != NULL) {
+            slot->regs = regs;
+            slot->irqno = irqno;
+            register_lazy_device(name, &attach_deferred, slot);
+            return;
+        }
     }
+
+    attach_driver(regs, irqno);
 }
 
 int virtio_negotiate_features (
@@ -127,6 +130,89 @@ void virtio_attach_virtq (
     __sync_synchronize(); // fence o,o
 }
 
+void virtio_kick (
+    volatile struct virtio_mmio_regs * regs, int qid, int event_idx,
+    volatile struct virtq_used * used, uint_fast16_t len,
+    uint16_t old_idx, uint16_t new_idx)
+{
+    int notify;
+
+    __sync_synchronize(); // avail idx visible before reading the hint
+
+    if (event_idx)
+        notify = virtq_need_event(*virtq_avail_event(used, len),
+            new_idx, old_idx);
+    else
+        notify = !(used->flags & VIRTQ_USED_F_NO_NOTIFY);
+
+    if (notify)
+        virtio_notify_avail(regs, qid);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Resets the device at /regs/ and hands it to its driver
+
+void attach_driver(volatile struct virtio_mmio_regs * regs, int irqno) {
+    extern void viocons_attach (
+        volatile struct virtio_mmio_regs * regs, int irqno); // viocons.c
+    
+    extern void vioblk_attach (
+        volatile struct virtio_mmio_regs * regs, int irqno); // vioblk.c
+
+    extern void viorng_attach (
+        volatile struct virtio_mmio_regs * regs, int irqno); // viorng.c
+
+    extern void viogpu_attach (
+        volatile struct virtio_mmio_regs * regs, int irqno); // viogpu.c
+
+    regs->status = 0; // reset
+    regs->status = VIRTIO_STAT_ACKNOWLEDGE;
+
+    switch (regs->device_id) {
+    case VIRTIO_ID_CONSOLE:
+        debug("%p: Found virtio console device", regs);
+        viocons_attach(regs, irqno);
+        break;
+    case VIRTIO_ID_BLOCK:
+        debug("%p: Found virtio block device", regs);
+        vioblk_attach(regs, irqno);
+        break;
+    case VIRTIO_ID_RNG:
+        debug("%p: Found virtio rng device", regs);
+        viorng_attach(regs, irqno);
+        break;
+    case VIRTIO_ID_GPU:
+        debug("%p: Found virtio gpu device", regs);
+        viogpu_attach(regs, irqno);
+        break;
+    default:
+        kprintf("%p: Unknown virtio device type %u ignored\n",
+            regs, (unsigned int) regs->device_id);
+        return;
+    }
+}
+
+void attach_deferred(void * aux) {
+    struct virtio_slot * const slot = aux;
+
+    attach_driver(slot->regs, slot->irqno);
+    kfree(slot);
+}
+
+// Returns the name the driver of /device_id/ registers its devices under if
+// they can be attached on first open, or NULL if they must be attached now.
+
+const char * lazy_name(uint32_t device_id) {
+    switch (device_id) {
+    case VIRTIO_ID_RNG:
+        return "rng"; // VIORNG_NAME in viorng.c
+    default:
+        return NULL;
+    }
+}
+
 // The following provide weak no-op attach functions that are overridden if the
 // appropriate device driver is linked in.
 
@@ -26,6 +26,8 @@
 #define VIRTIO_F_ANY_LAYOUT			27
 #define VIRTIO_F_RING_RESET         40
 
+#define VIRTIO_F_RING_EVENT_IDX     VIRTIO_F_EVENT_IDX
+
 #define VIRTQ_LEN_MAX 32768
 
 #define VIRTQ_USED_F_NO_NOTIFY		1
@@ -181,6 +183,25 @@ extern void virtio_attach_virtq (
     volatile struct virtio_mmio_regs * regs, int qid, uint_fast16_t len,
     uint64_t desc_addr, uint64_t used_addr, uint64_t avail_addr);
 
+// Notifies the device of new avail ring entries [old_idx, new_idx), unless
+// the device asked not to be: with VIRTIO_F_EVENT_IDX (event_idx nonzero) by
+// the avail_event field of the used ring, otherwise by VIRTQ_USED_F_NO_NOTIFY.
+
+extern void virtio_kick (
+    volatile struct virtio_mmio_regs * regs, int qid, int event_idx,
+    volatile struct virtq_used * used, uint_fast16_t len,
+    uint16_t old_idx, uint16_t new_idx);
+
+static inline volatile uint16_t * virtq_used_event (
+    struct virtq_avail * avail, uint_fast16_t len);
+static inline volatile uint16_t * virtq_avail_event (
+    volatile struct virtq_used * used, uint_fast16_t len);
+static inline int virtq_need_event (
+    uint16_t event_idx, uint16_t new_idx, uint16_t old_idx);
+static inline void virtq_set_indirect (
+    struct virtq_desc * desc, const struct virtq_desc * table,
+    uint_fast16_t cnt);
+
 static inline void virtio_enable_virtq (
     volatile struct virtio_mmio_regs * regs, int qid);
 
@@ -276,6 +297,47 @@ static inline void virtio_reset_virtq (
     regs->queue_reset = 1;
 }
 
+// With VIRTIO_F_EVENT_IDX, the avail ring of a queue of /len/ entries is
+// followed by used_event, the used index at which the driver wants its next
+// interrupt, and the used ring is followed by avail_event, the avail index at
+// which the device wants its next notification. Rings laid out for this must
+// reserve the extra uint16_t after each.
+
+static inline volatile uint16_t * virtq_used_event (
+    struct virtq_avail * avail, uint_fast16_t len)
+{
+    return (volatile uint16_t *)&avail->ring[len];
+}
+
+static inline volatile uint16_t * virtq_avail_event (
+    volatile struct virtq_used * used, uint_fast16_t len)
+{
+    return (volatile uint16_t *)&used->ring[len];
+}
+
+// Returns true if moving an index from /old_idx/ to /new_idx/ passed
+// /event_idx/, i.e. the other side asked to be told about this update.
+
+static inline int virtq_need_event (
+    uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+// Makes /desc/ refer to an indirect table of /cnt/ descriptors, which are
+// chained with VIRTQ_DESC_F_NEXT and next as in the ring itself
+// (VIRTIO_F_INDIRECT_DESC).
+
+static inline void virtq_set_indirect (
+    struct virtq_desc * desc, const struct virtq_desc * table,
+    uint_fast16_t cnt)
+{
+    desc->addr = (uint64_t)(uintptr_t)table;
+    desc->len = cnt * sizeof(struct virtq_desc);
+    desc->flags = VIRTQ_DESC_F_INDIRECT;
+    desc->next = -1;
+}
+
 static inline void virtio_featset_init(virtio_featset_t fts) {
     uint_fast8_t i;
 
@@ -11,7 +11,7 @@
 #include "heap.h"
 #include "string.h"
 #include "assert.h"
-#include "assert.h"
+#include "thread.h"
 
 #include <stddef.h>
 #include <limits.h> // INT_MAX
@@ -25,15 +25,31 @@
 
 #define ISPOW2(n) (((n)&((n)-1)) == 0)
 
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void open_lazy_device(int i);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
+// An entry registered with register_lazy_device() has an attach function
+// until its first open, and is marked attaching while that runs.
+
 static struct {
     const char * name;
     int (*openfn)(struct io ** ioptr, void * aux);
     void * aux;
+    void (*attachfn)(void * aux);
+    char attaching;
 } devtab[NDEV];
 
+// Devices are registered only while attaching but looked up on every open,
+// so devtab is guarded by a reader-writer lock.
+
+static struct rwlock devtab_lock;
+static struct condition devtab_attached; // an attach function returned
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -44,6 +60,8 @@ char devmgr_initialized = 0;
 
 void devmgr_init(void) {
     trace("%s()", __func__);
+    rwlock_init(&devtab_lock);
+    condition_init(&devtab_attached, "devtab_attached");
     devmgr_initialized = 1;
 }
 
@@ -57,11 +75,29 @@ int register_device (
 
     assert (name != NULL);
 
+    rwlock_write_acquire(&devtab_lock);
+
+    // An instance being attached lazily fills the entry held for it
+
+    for (i = 0; i < NDEV && devtab[i].name != NULL; i++) {
+        if (devtab[i].attaching && strcmp(name, devtab[i].name) == 0) {
+            devtab[i].openfn = openfn;
+            devtab[i].aux = aux;
+            devtab[i].attaching = 0;
+            rwlock_write_release(&devtab_lock);
+            return instno;
+        } else if (strcmp(name, devtab[i].name) == 0)
+            instno += 1;
+    }
+
+    instno = 0;
+
     for (i = 0; i < NDEV; i++) {
         if (devtab[i].name == NULL) {
             devtab[i].name = name;
             devtab[i].openfn = openfn;
             devtab[i].aux = aux;
+            rwlock_write_release(&devtab_lock);
             return instno;
         } else if (strcmp(name, devtab[i].name) == 0)
             instno += 1;
@@ -70,12 +106,44 @@ int register_device (
     panic(NULL);
 }
 
+void register_lazy_device (
+    const char * name,
+    void (*attachfn)(void * aux),
+    void * aux)
+{
+    int i;
+
+    assert (name != NULL && attachfn != NULL);
+
+    rwlock_write_acquire(&devtab_lock);
+
+    for (i = 0; i < NDEV; i++) {
+        if (devtab[i].name == NULL) {
+            devtab[i].name = name;
+            devtab[i].attachfn = attachfn;
+            devtab[i].aux = aux;
+            rwlock_write_release(&devtab_lock);
+            return;
+        }
+    }
+
+    panic(NULL);
+}
+
 int open_device(const char * name, int instno, struct io ** ioptr) {
+    int (*openfn)(struct io ** ioptr, void * aux);
+    void * aux;
     int i, k = 0;
 
     trace("%s(%s,%d)", __func__, name, instno);
 
-    // Find numbered instance of device in devtab
+    // Find numbered instance of device in devtab. The open function is called
+    // after dropping the lock, since it may sleep or open other devices. So
+    // is the attach function of a device not attached yet; a concurrent open
+    // of the same device waits for it and looks again.
+
+retry:
+    rwlock_read_acquire(&devtab_lock);
 
     for (i = 0; i < NDEV; i++) {
         if (devtab[i].name == NULL)
@@ -83,14 +151,27 @@ int open_device(const char * name, int instno, struct io ** ioptr) {
 
         if (strcmp(name, devtab[i].name) == 0) {
             if (k++ == instno) {
-                if (devtab[i].openfn != NULL)
-                    return devtab[i].openfn(ioptr, devtab[i].aux);
+                if (devtab[i].attachfn != NULL || devtab[i].attaching) {
+                    rwlock_read_release(&devtab_lock);
+                    open_lazy_device(i);
+                    k = 0;
+                    goto retry;
+                }
+
+                openfn = devtab[i].openfn;
+                aux = devtab[i].aux;
+                rwlock_read_release(&devtab_lock);
+
+                if (openfn != NULL)
+                    return openfn(ioptr, aux);
                 else
                     return -ENOTSUP;
             }
         }
     }
 
+    rwlock_read_release(&devtab_lock);
+
     debug("Device %s%d not found", name, instno);
     return -ENODEV;
 }
@@ -122,4 +203,46 @@ int parse_device_spec(char * spec) {
     }
 
     return -EINVAL;
-}
\ No newline at end of file
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Attaches the lazily registered device of devtab entry /i/, or waits for
+// the thread already attaching it. If the attach function registers nothing,
+// the entry is left without an open function.
+
+void open_lazy_device(int i) {
+    void (*attachfn)(void * aux);
+    void * aux;
+
+    rwlock_write_acquire(&devtab_lock);
+
+    attachfn = devtab[i].attachfn;
+
+    if (attachfn == NULL) {
+        // The attaching thread broadcasts devtab_attached, so the broadcast
+        // cannot come before the wait (see thread.h).
+        while (devtab[i].attaching) {
+            rwlock_write_release(&devtab_lock);
+            condition_wait(&devtab_attached);
+            rwlock_write_acquire(&devtab_lock);
+        }
+        rwlock_write_release(&devtab_lock);
+        return;
+    }
+
+    aux = devtab[i].aux;
+    devtab[i].attachfn = NULL;
+    devtab[i].aux = NULL;
+    devtab[i].attaching = 1;
+    rwlock_write_release(&devtab_lock);
+
+    trace("%s: attaching %s", __func__, devtab[i].name);
+    attachfn(aux);
+
+    rwlock_write_acquire(&devtab_lock);
+    devtab[i].attaching = 0;
+    condition_broadcast(&devtab_attached);
+    rwlock_write_release(&devtab_lock);
+}
@@ -32,6 +32,16 @@ extern int open_device (
     int instno,
     struct io ** ioptr);
 
+// Registers an instance of device /name/ that is only attached when it is
+// first opened, by calling /attachfn/ with /aux/. The attach function
+// registers the device as usual, and the registration takes the place held
+// for it, so instance numbers do not depend on when devices are attached.
+
+extern void register_lazy_device (
+    const char * name,
+    void (*attachfn)(void * aux),
+    void * aux);
+
 // The device_parse_spec function parses a device specification, which is an
 // ASCII string identifying a device instance. The specification string must
 // consist of one or more non-digit ASCII printable characters representing the
@@ -12,6 +12,7 @@
 #include "assert.h"
 #include "ktfs.h"
 #include "error.h"
+#include "process.h"
 
 #include <stdint.h>
 
@@ -104,10 +105,39 @@ struct elf64_phdr {
 // ELF header e_machine values (short list)
 #define  EM_RISCV   243
 
+// With ELF_LAZY, segments are mapped from the file and their pages are read
+// in on first touch instead of being loaded up front.
+
+#ifndef ELF_LAZY
+#define ELF_LAZY 1
+#endif
+
+static int elf_load_hdrs (
+    struct io * elfio, struct io * hdrio, void (**eptr)(void));
+
+// The ELF header and program headers are small reads close together near the
+// start of the file, so they are read through a buffer; segment contents go
+// to the file directly.
+
 int elf_load(struct io * elfio, void (**eptr)(void)) {
+    struct io * hdrio;
+    int result;
+
+    hdrio = create_buffered_io(elfio, PAGE_SIZE);
+    if (hdrio == NULL)
+        hdrio = ioaddref(elfio);
+
+    result = elf_load_hdrs(elfio, hdrio, eptr);
+    ioclose(hdrio);
+    return result;
+}
+
+int elf_load_hdrs (
+    struct io * elfio, struct io * hdrio, void (**eptr)(void))
+{
     struct elf64_ehdr ehdr;
 
-    long r = ioreadat(elfio, 0, &ehdr, sizeof(ehdr));
+    long r = ioreadat(hdrio, 0, &ehdr, sizeof(ehdr));
     if (r < 0) return r;
     if (r != sizeof(ehdr)) {
         return -EIO;
@@ -139,7 +169,7 @@ int elf_load(struct io * elfio, void (**eptr)(void)) {
 
     for (uint16_t i = 0; i < ehdr.e_phnum; i++) {
         struct elf64_phdr phdr;
-        r = ioreadat(elfio, ehdr.e_phoff + i * ehdr.e_phentsize, &phdr, sizeof(phdr));
+        r = ioreadat(hdrio, ehdr.e_phoff + i * ehdr.e_phentsize, &phdr, sizeof(phdr));
         if (r < 0) {
             return r;
         }
@@ -155,6 +185,32 @@ int elf_load(struct io * elfio, void (**eptr)(void)) {
             return -EBADFMT;
         }
 
+#if ELF_LAZY
+        // Map the pages spanned by the segment from the page holding its
+        // first byte in the file. Text and read-only data are shared with
+        // other processes running the same file; writable data is private.
+
+        if ((phdr.p_vaddr - phdr.p_offset) % PAGE_SIZE != 0 ||
+            phdr.p_memsz < phdr.p_filesz)
+        {
+            return -EBADFMT;
+        }
+
+        const uintptr_t seg_start = ROUND_DOWN(phdr.p_vaddr, PAGE_SIZE);
+        const size_t seg_pad = phdr.p_vaddr - seg_start;
+
+        if (phdr.p_offset < seg_pad) {
+            return -EBADFMT;
+        }
+
+        r = process_map_segment(elfio, seg_start, seg_pad + phdr.p_memsz,
+            phdr.p_offset - seg_pad, seg_pad + phdr.p_filesz,
+            ((phdr.p_flags & PF_W) ? MMAP_WRITE | MMAP_PRIVATE : 0) |
+            ((phdr.p_flags & PF_X) ? MMAP_EXEC : 0));
+        if (r < 0) {
+            return r;
+        }
+#else
         int flags = PTE_R | PTE_W | PTE_U;
 
         if (!alloc_and_map_range((uintptr_t)phdr.p_vaddr, phdr.p_memsz, flags)) {
@@ -179,11 +235,9 @@ int elf_load(struct io * elfio, void (**eptr)(void)) {
             flags |= PTE_R;
         }
 
+        // pages past p_filesz (BSS) are already zero
         set_range_flags((const void*)phdr.p_vaddr, phdr.p_memsz, flags);
-
-        if (phdr.p_memsz > phdr.p_filesz) {
-            memset((void *)(phdr.p_vaddr + phdr.p_filesz), 0, phdr.p_memsz - phdr.p_filesz);
-        }
+#endif
     }
     *eptr = (void (*)(void))ehdr.e_entry;
     return 0;
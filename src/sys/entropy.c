@@ -0,0 +1,259 @@
+// entropy.c - Kernel entropy pool and random number generator
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef ENTROPY_TRACE
+#define TRACE
+#endif
+
+#ifdef ENTROPY_DEBUG
+#define DEBUG
+#endif
+
+#include "entropy.h"
+#include "thread.h"
+#include "intr.h"
+#include "error.h"
+#include "string.h"
+
+#include <stdint.h>
+
+// The generator is ChaCha20 used with fast key erasure: each refill of the
+// output buffer runs ENTROPY_NBLK blocks under the current key, keeps the
+// first 32 bytes as the next key and serves the rest. Served bytes are
+// cleared, so a later look at the kernel's memory does not give away output
+// already handed out. Before each refill, 32 raw bytes from the pool, if it
+// has them, are folded into the key.
+//
+// The pool is only touched with interrupts disabled, since the source adds
+// to it from its ISR. The key and output buffer are only touched by readers,
+// which never block while using them.
+
+#ifndef ENTROPY_NBLK
+#define ENTROPY_NBLK 8 // ChaCha20 blocks per output refill
+#endif
+
+#define KEY_WORDS 8
+#define KEY_SIZE (KEY_WORDS * sizeof(uint32_t))
+#define BLK_WORDS 16
+#define OUT_SIZE (ENTROPY_NBLK * BLK_WORDS * sizeof(uint32_t))
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void request_refill(void);
+static void mix_pool(void);
+static void refill_output(void);
+
+static void chacha20_block (
+    const uint32_t key[KEY_WORDS], uint32_t counter, uint32_t out[BLK_WORDS]);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static unsigned char entropy_pool[ENTROPY_POOLSZ];
+static unsigned int entropy_poolcnt; // raw bytes in pool
+static char entropy_seeded; // key has been set from the pool
+static char entropy_refill_pending;
+
+static void (*entropy_refill)(void * aux);
+static void * entropy_refill_aux;
+static struct condition entropy_seeded_cond;
+
+static uint32_t entropy_key[KEY_WORDS];
+static uint32_t entropy_out[OUT_SIZE / sizeof(uint32_t)];
+static unsigned int entropy_outpos = OUT_SIZE; // next unserved byte
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void entropy_register_source(void (*refill)(void * aux), void * aux) {
+    int pie;
+
+    condition_init(&entropy_seeded_cond, "entropy_seeded");
+
+    pie = disable_interrupts();
+    entropy_refill = refill;
+    entropy_refill_aux = aux;
+    entropy_refill_pending = 0;
+    request_refill();
+    restore_interrupts(pie);
+}
+
+// Once the pool has been asked for more, the source keeps being asked until
+// the pool is full, so refills come in runs from the low watermark up.
+
+void entropy_add(const void * buf, size_t len) {
+    size_t n;
+    int pie;
+
+    pie = disable_interrupts();
+
+    entropy_refill_pending = 0;
+
+    n = ENTROPY_POOLSZ - entropy_poolcnt;
+    if (len < n)
+        n = len;
+
+    memcpy(entropy_pool + entropy_poolcnt, buf, n);
+    entropy_poolcnt += n;
+
+    if (!entropy_seeded && KEY_SIZE <= entropy_poolcnt) {
+        mix_pool();
+        entropy_seeded = 1;
+        condition_broadcast(&entropy_seeded_cond);
+    }
+
+    if (entropy_poolcnt < ENTROPY_POOLSZ)
+        request_refill();
+
+    restore_interrupts(pie);
+}
+
+long entropy_read(void * buf, size_t len, int nonblock) {
+    unsigned char * const out = (unsigned char *)entropy_out;
+    size_t done, n;
+    int pie;
+
+    pie = disable_interrupts();
+
+    if (!entropy_seeded && nonblock) {
+        restore_interrupts(pie);
+        return -EAGAIN;
+    }
+
+    while (!entropy_seeded)
+        condition_wait(&entropy_seeded_cond);
+
+    restore_interrupts(pie);
+
+    for (done = 0; done < len; done += n) {
+        if (entropy_outpos == OUT_SIZE)
+            refill_output();
+
+        n = OUT_SIZE - entropy_outpos;
+        if (len - done < n)
+            n = len - done;
+
+        memcpy((char *)buf + done, out + entropy_outpos, n);
+        memset(out + entropy_outpos, 0, n);
+        entropy_outpos += n;
+    }
+
+    return len;
+}
+
+int entropy_ready(void) {
+    return entropy_seeded;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Asks the source for a chunk unless a request is outstanding. Called with
+// interrupts disabled.
+
+void request_refill(void) {
+    if (entropy_refill != NULL && !entropy_refill_pending) {
+        entropy_refill_pending = 1;
+        entropy_refill(entropy_refill_aux);
+    }
+}
+
+// Folds the last KEY_SIZE bytes of the pool into the key and clears them.
+// Called with interrupts disabled and at least KEY_SIZE bytes in the pool.
+
+void mix_pool(void) {
+    unsigned char * const key = (unsigned char *)entropy_key;
+    unsigned char * p;
+    int i;
+
+    entropy_poolcnt -= KEY_SIZE;
+    p = entropy_pool + entropy_poolcnt;
+
+    for (i = 0; i < KEY_SIZE; i++)
+        key[i] ^= p[i];
+
+    memset(p, 0, KEY_SIZE);
+}
+
+void refill_output(void) {
+    int pie;
+    int i;
+
+    pie = disable_interrupts();
+
+    if (KEY_SIZE <= entropy_poolcnt)
+        mix_pool();
+
+    if (entropy_poolcnt < ENTROPY_LOWAT)
+        request_refill();
+
+    restore_interrupts(pie);
+
+    // The key changes with every refill, so the block counter can start
+    // over from zero each time.
+
+    for (i = 0; i < ENTROPY_NBLK; i++)
+        chacha20_block(entropy_key, i, entropy_out + i * BLK_WORDS);
+
+    memcpy(entropy_key, entropy_out, KEY_SIZE);
+    memset(entropy_out, 0, KEY_SIZE);
+    entropy_outpos = KEY_SIZE;
+}
+
+static inline uint32_t rotl32(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static inline void quarter_round (
+    uint32_t * x, int a, int b, int c, int d)
+{
+    x[a] += x[b]; x[d] = rotl32(x[d] ^ x[a], 16);
+    x[c] += x[d]; x[b] = rotl32(x[b] ^ x[c], 12);
+    x[a] += x[b]; x[d] = rotl32(x[d] ^ x[a], 8);
+    x[c] += x[d]; x[b] = rotl32(x[b] ^ x[c], 7);
+}
+
+// Computes the ChaCha20 block for /key/ and block /counter/ with an all-zero
+// nonce (RFC 8439). The output words are in host byte order, which on RISC-V
+// is the little-endian order the RFC specifies for the key stream.
+
+void chacha20_block (
+    const uint32_t key[KEY_WORDS], uint32_t counter, uint32_t out[BLK_WORDS])
+{
+    uint32_t x[BLK_WORDS];
+    int i;
+
+    out[0] = 0x61707865; // "expand 32-byte k"
+    out[1] = 0x3320646e;
+    out[2] = 0x79622d32;
+    out[3] = 0x6b206574;
+
+    for (i = 0; i < KEY_WORDS; i++)
+        out[4+i] = key[i];
+
+    out[12] = counter;
+    out[13] = 0;
+    out[14] = 0;
+    out[15] = 0;
+
+    for (i = 0; i < BLK_WORDS; i++)
+        x[i] = out[i];
+
+    for (i = 0; i < 10; i++) {
+        quarter_round(x, 0, 4, 8, 12);
+        quarter_round(x, 1, 5, 9, 13);
+        quarter_round(x, 2, 6, 10, 14);
+        quarter_round(x, 3, 7, 11, 15);
+        quarter_round(x, 0, 5, 10, 15);
+        quarter_round(x, 1, 6, 11, 12);
+        quarter_round(x, 2, 7, 8, 13);
+        quarter_round(x, 3, 4, 9, 14);
+    }
+
+    for (i = 0; i < BLK_WORDS; i++)
+        out[i] += x[i];
+}
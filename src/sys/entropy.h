@@ -0,0 +1,48 @@
+// entropy.h - Kernel entropy pool and random number generator
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _ENTROPY_H_
+#define _ENTROPY_H_
+
+#include <stddef.h>
+
+// A hardware source (the VirtIO rng device) feeds raw bytes into the pool in
+// large chunks. Readers never wait on the source: their bytes come from a
+// ChaCha20 generator that is rekeyed from the pool as it drains. Only until
+// the first chunk arrives, when the generator has no key, do readers wait.
+
+#ifndef ENTROPY_POOLSZ
+#define ENTROPY_POOLSZ 2048 // raw bytes held
+#endif
+
+#ifndef ENTROPY_LOWAT
+#define ENTROPY_LOWAT 512 // ask the source for more below this
+#endif
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Registers the source of raw bytes. The pool calls /refill/(/aux/), with
+// interrupts disabled, when it wants another chunk; the source answers with
+// entropy_add(), usually from deferred interrupt work. Only one refill is
+// outstanding at a time.
+
+extern void entropy_register_source(void (*refill)(void * aux), void * aux);
+
+// Adds /len/ raw bytes to the pool. May be called from an ISR.
+
+extern void entropy_add(const void * buf, size_t len);
+
+// Fills /buf/ with /len/ random bytes. Returns /len/, or -EAGAIN if the
+// generator is not seeded yet and /nonblock/ is set.
+
+extern long entropy_read(void * buf, size_t len, int nonblock);
+
+// Returns non-zero once entropy_read() no longer waits.
+
+extern int entropy_ready(void);
+
+#endif // _ENTROPY_H_
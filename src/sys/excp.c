@@ -56,6 +56,17 @@ void handle_smode_exception(unsigned int cause, struct trap_frame * tfr) {
     const char * name = NULL;
     char msgbuf[80];
 
+    // The kernel touching user memory for a process, e.g. reading into a
+    // buffer in a page still shared copy-on-write after fork, faults the
+    // same way the process would.
+
+    if ((cause == RISCV_SCAUSE_LOAD_PAGE_FAULT ||
+        cause == RISCV_SCAUSE_STORE_PAGE_FAULT) &&
+        handle_umode_page_fault(tfr, csrr_stval()))
+    {
+        return;
+    }
+
     if (0 <= cause && cause < sizeof(excp_names)/sizeof(excp_names[0]))
 		name = excp_names[cause];
 	
@@ -117,6 +128,12 @@ void handle_umode_exception(unsigned int cause, struct trap_frame * tfr) {
                 process_exit();
             }
             return;  
+            // Text pages of a lazily loaded executable are read on first fetch
+            case RISCV_SCAUSE_INSTR_PAGE_FAULT:
+            if (handle_umode_page_fault(tfr, csrr_stval()) == 0) {
+                process_exit();
+            }
+            return;
             default:
                 // If we don't know how to handle this exception, log it
                 snprintf(msgbuf, sizeof(msgbuf),
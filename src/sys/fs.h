@@ -15,6 +15,8 @@
 extern char fs_initialized;
 
 extern int fsmount(struct io * io);
+extern int fsmount_sized(struct io * io, unsigned long cache_capacity);
+extern int fsmount_ramdisk(struct io * io, int writeback);
 extern int fsopen(const char * name, struct io ** ioptr);
 extern int fsflush(void);
 extern int fscreate(const char * name);
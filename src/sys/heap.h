@@ -20,4 +20,34 @@ extern void * kmalloc(size_t size);
 extern void * kcalloc(size_t nelts, size_t eltsz);
 extern void kfree(void * ptr);
 
+// Typed object cache. Objects of one type are carved from whole pages and
+// kept on a free list of their own, so allocating one is a pointer pop. A
+// new object is passed through /ctor/ if there is one and zeroed otherwise.
+// A cache is usually a static variable set up with KCACHE_INITIALIZER.
+
+struct kcache {
+    const char * name;
+    size_t objsz;
+    void (*ctor)(void * obj);
+    void * free_list;
+    unsigned long live; // objects allocated and not yet freed
+    unsigned long peak; // highest value of live
+    unsigned long pages; // pages taken from the page allocator
+};
+
+#define KCACHE_INITIALIZER(nm,type,ctorfn) { \
+    .name = (nm), .objsz = sizeof(type), .ctor = (ctorfn) }
+
+extern void kcache_init (
+    struct kcache * cache, const char * name, size_t objsz,
+    void (*ctor)(void * obj));
+
+extern void * kcache_alloc(struct kcache * cache);
+extern void kcache_free(struct kcache * cache, void * obj);
+
+// Returns the bytes allocated from the heap and object caches and the pages
+// they hold.
+
+extern void heap_usage(unsigned long * bytesptr, unsigned long * pagesptr);
+
 #endif // _HEAP_H_
\ No newline at end of file
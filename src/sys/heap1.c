@@ -0,0 +1,360 @@
+// heap1.c - Size-class heap memory manager
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef HEAP_TRACE
+#define TRACE
+#endif
+
+#ifdef HEAP_DEBUG
+#define DEBUG
+#endif
+
+#include "conf.h"
+#include "heap.h"
+#include "string.h"
+#include "riscv.h"
+#include "assert.h"
+#include "memory.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef HEAP_ALIGN
+#define HEAP_ALIGN 16
+#endif
+
+#define HEAP_ALLOC_MAGIC 0xEAEAEAEA
+#define HEAP_FREE_MAGIC 0x25252525
+
+// Blocks are carved from pages in power-of-two size classes from
+// 2^HEAP_MIN_ORDER to 2^HEAP_MAX_ORDER bytes, header included. Larger
+// requests get whole pages of their own.
+
+#define HEAP_MIN_ORDER 5
+#define HEAP_MAX_ORDER 11
+#define HEAP_NCLASS (HEAP_MAX_ORDER - HEAP_MIN_ORDER + 1)
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+//        +----------------+----------------+
+//        |     magic      |      size      |
+//        +----------------+----------------+
+//        |   size_inv     |    alloc_ra    |
+// ptr -> +----------------+----------------+
+//        |  next (free) / caller data      |
+//        +---------------------------------+
+//
+// The size is that of the whole block, header included. For a block from
+// the large-allocation path it is a multiple of PAGE_SIZE. The return
+// address is only recorded in HEAP_DEBUG builds.
+
+// Header that preceeds each block. Must be a multiple of HEAP_ALIGN.
+
+struct heap_alloc_header {
+    uint32_t magic; ///< HEAP_ALLOC_MAGIC or HEAP_FREE_MAGIC
+    uint32_t size; ///< Size of block, including header
+    uint32_t size_inv; ///< Bitwise not of the size
+    uint32_t ra32;    ///< Caller return address (HEAP_DEBUG only)
+};
+
+// A free block is on the free list of its size class, linked through the
+// first word after its header.
+
+struct heap_free_block {
+    struct heap_alloc_header hdr;
+    struct heap_free_block * next;
+};
+
+// The ISPOW2 macro evaluates to 1 if its argument is either zero or a power of
+// two. The argument must be an integer type. Cast pointers to uintptr_t to test
+// pointer alignment.
+
+#define ISPOW2(n) (((n)&((n)-1)) == 0)
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct heap_free_block * free_lists[HEAP_NCLASS];
+
+static unsigned long heap_bytes; // bytes in allocated blocks and objects
+static unsigned long heap_pages; // pages taken from the page allocator
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static void * heap_malloc_actual(size_t size, void * ra);
+static void * heap_calloc_actual(size_t nelts, size_t eltsz, void * ra);
+static void heap_free_actual(void * ptr, void * ra);
+
+static void heap_carve(void * start, size_t len, unsigned int cls);
+static struct heap_free_block * heap_refill(unsigned int cls);
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+char heap_initialized = 0;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void heap_init(void * start, void * end) {
+    trace("%s(%p,%p)", __func__, start, end);
+
+    assert (4 <= HEAP_ALIGN);
+    assert (ISPOW2(HEAP_ALIGN));
+    assert (sizeof(struct heap_alloc_header) % HEAP_ALIGN == 0);
+
+    // Round start up and end down to a HEAP_ALIGN boundary
+
+    start = (void*)ROUND_UP((uintptr_t)start, HEAP_ALIGN);
+    end = (void*)ROUND_DOWN((uintptr_t)end, HEAP_ALIGN);
+    assert (start < end);
+
+    // The initial block is too small to be worth a page-aligned slab, so it
+    // becomes a handful of blocks of the smallest class.
+
+    heap_carve(start, end - start, 0);
+    heap_initialized = 1;
+}
+
+void * kmalloc(size_t size) {
+    return heap_malloc_actual(size, __builtin_return_address(0));
+}
+
+void * kcalloc(size_t nelts, size_t eltsz) {
+    return heap_calloc_actual(nelts, eltsz, __builtin_return_address(0));
+}
+
+void kfree(void * ptr) {
+    return heap_free_actual(ptr, __builtin_return_address(0));
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void * heap_malloc_actual(size_t size, void * ra) {
+    struct heap_alloc_header * hdr;
+    struct heap_free_block * blk;
+    unsigned int cls;
+    size_t blksz;
+
+    trace("%s(%zu,ra=%p)", __func__, size, ra);
+
+    if (size == 0)
+        return NULL;
+
+    size = ROUND_UP(size, HEAP_ALIGN) + sizeof(struct heap_alloc_header);
+
+    if ((1UL << HEAP_MAX_ORDER) < size) {
+        // large-allocation path: whole pages
+        blksz = ROUND_UP(size, PAGE_SIZE);
+        hdr = alloc_phys_pages(blksz / PAGE_SIZE);
+        if (hdr == NULL)
+            return NULL;
+        heap_pages += blksz / PAGE_SIZE;
+    } else {
+        cls = 0;
+        while ((1UL << (HEAP_MIN_ORDER + cls)) < size)
+            cls++;
+
+        blk = free_lists[cls];
+        if (blk == NULL) {
+            blk = heap_refill(cls);
+            if (blk == NULL)
+                return NULL;
+        }
+
+        assert (blk->hdr.magic == HEAP_FREE_MAGIC);
+        free_lists[cls] = blk->next;
+        hdr = &blk->hdr;
+        blksz = 1UL << (HEAP_MIN_ORDER + cls);
+    }
+
+    hdr->magic = HEAP_ALLOC_MAGIC;
+    hdr->size = blksz;
+    hdr->size_inv = ~blksz;
+    heap_bytes += blksz;
+
+#ifdef HEAP_DEBUG
+    hdr->ra32 = (uint32_t)(uintptr_t)ra;
+    memset(hdr+1, 0x33, blksz - sizeof(struct heap_alloc_header));
+#endif
+
+    return hdr+1;
+}
+
+
+void * heap_calloc_actual(size_t nelts, size_t eltsz, void * ra) {
+    size_t size;
+    void * ptr;
+
+    trace("%s(%zu,%zu,ra=%p)", __func__, nelts, eltsz, ra);
+
+    if (eltsz != 0 && SIZE_MAX / eltsz < nelts)
+        return NULL;
+
+    size = nelts * eltsz;
+
+    ptr = heap_malloc_actual(size, ra);
+    if (ptr != NULL)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+
+void heap_free_actual(void * ptr, void * ra) {
+    struct heap_free_block * blk;
+    unsigned int cls;
+
+    trace("%s(%p,ra=%p)", __func__, ptr, ra);
+
+    if (ptr == NULL)
+        return;
+
+    blk = (struct heap_free_block*)((struct heap_alloc_header*)ptr - 1);
+
+    // Check integrity
+
+    if (blk->hdr.magic != HEAP_ALLOC_MAGIC) {
+        if (blk->hdr.magic == HEAP_FREE_MAGIC)
+            panic("kfree: double free");
+        else
+            panic("kfree: bad pointer");
+    }
+
+    if (blk->hdr.size != ~blk->hdr.size_inv)
+        panic("kfree: corrupted header");
+
+    heap_bytes -= blk->hdr.size;
+
+    if ((1UL << HEAP_MAX_ORDER) < blk->hdr.size) {
+        heap_pages -= blk->hdr.size / PAGE_SIZE;
+        blk->hdr.magic = HEAP_FREE_MAGIC;
+        free_phys_pages(blk, blk->hdr.size / PAGE_SIZE);
+        return;
+    }
+
+    cls = 0;
+    while ((1UL << (HEAP_MIN_ORDER + cls)) < blk->hdr.size)
+        cls++;
+
+#ifdef HEAP_DEBUG
+    memset(blk+1, 0x11, blk->hdr.size - sizeof(struct heap_free_block));
+    blk->hdr.ra32 = (uint32_t)(uintptr_t)ra;
+#endif
+
+    blk->hdr.magic = HEAP_FREE_MAGIC;
+    blk->next = free_lists[cls];
+    free_lists[cls] = blk;
+}
+
+void kcache_init (
+    struct kcache * cache, const char * name, size_t objsz,
+    void (*ctor)(void * obj))
+{
+    memset(cache, 0, sizeof(struct kcache));
+    cache->name = name;
+    cache->objsz = objsz;
+    cache->ctor = ctor;
+}
+
+// Returns an object from /cache/, taking another page from the page
+// allocator if its free list is empty. Returns NULL if there are no pages.
+
+void * kcache_alloc(struct kcache * cache) {
+    const size_t objsz = ROUND_UP(cache->objsz, HEAP_ALIGN);
+    void * obj;
+    void * p;
+
+    trace("%s(%s)", __func__, cache->name);
+    assert (sizeof(void*) <= objsz && objsz <= PAGE_SIZE);
+
+    if (cache->free_list == NULL) {
+        p = alloc_phys_page();
+        if (p == NULL)
+            return NULL;
+        
+        cache->pages++;
+        heap_pages++;
+
+        for (obj = p; obj + objsz <= p + PAGE_SIZE; obj += objsz) {
+            *(void**)obj = cache->free_list;
+            cache->free_list = obj;
+        }
+    }
+
+    obj = cache->free_list;
+    cache->free_list = *(void**)obj;
+
+    if (++cache->live > cache->peak)
+        cache->peak = cache->live;
+    heap_bytes += objsz;
+
+    if (cache->ctor != NULL)
+        cache->ctor(obj);
+    else
+        memset(obj, 0, cache->objsz);
+    
+    return obj;
+}
+
+void kcache_free(struct kcache * cache, void * obj) {
+    trace("%s(%s,%p)", __func__, cache->name, obj);
+
+    if (obj == NULL)
+        return;
+    
+    assert (0 < cache->live);
+
+#ifdef HEAP_DEBUG
+    memset(obj, 0x11, cache->objsz);
+#endif
+
+    *(void**)obj = cache->free_list;
+    cache->free_list = obj;
+    cache->live--;
+    heap_bytes -= ROUND_UP(cache->objsz, HEAP_ALIGN);
+}
+
+void heap_usage(unsigned long * bytesptr, unsigned long * pagesptr) {
+    *bytesptr = heap_bytes;
+    *pagesptr = heap_pages;
+}
+
+// Splits [start,start+len) into blocks of size class /cls/ and puts them on
+// its free list.
+
+void heap_carve(void * start, size_t len, unsigned int cls) {
+    const size_t blksz = 1UL << (HEAP_MIN_ORDER + cls);
+    struct heap_free_block * blk;
+
+    while (blksz <= len) {
+        blk = start;
+        blk->hdr.magic = HEAP_FREE_MAGIC;
+        blk->hdr.size = blksz;
+        blk->hdr.size_inv = ~blksz;
+        blk->next = free_lists[cls];
+        free_lists[cls] = blk;
+        start += blksz;
+        len -= blksz;
+    }
+}
+
+// Takes a page from the page allocator for the empty size class /cls/.
+// Returns the head of the refilled free list, or NULL if there are no pages.
+
+struct heap_free_block * heap_refill(unsigned int cls) {
+    void * const page = alloc_phys_page();
+
+    if (page == NULL)
+        return NULL;
+    
+    heap_pages++;
+
+    heap_carve(page, PAGE_SIZE, cls);
+    return free_lists[cls];
+}
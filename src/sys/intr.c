@@ -19,6 +19,9 @@
 #include "plic.h"
 #include "timer.h"
 #include "thread.h"
+#include "see.h"
+#include "ktrace.h"
+#include "error.h"
 
 #include <stddef.h>
 
@@ -35,12 +38,22 @@ static struct {
     void * isr_aux; // isr auxilary var
 } isrtab[NIRQ];
 
+// Deferred work runs on the interrupt worker thread in the order queued.
+
+static struct intr_work * intr_work_head;
+static struct intr_work * intr_work_tail;
+static struct condition intr_work_ready;
+
+static struct intr_stats intr_stats[NIRQ];
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 static void handle_interrupt(unsigned int cause);
 
 static void handle_extern_interrupt(void);
 
+static void intr_worker(void);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -50,12 +63,25 @@ void intrmgr_init(void) {
     disable_interrupts(); // should not be enabled yet
     plic_init();
 
-    // Enable timer and external interrupts
-    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_STIE);
+    // Enable timer, external and software (IPI) interrupts
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_STIE | RISCV_SIE_SSIE);
 
     intrmgr_initialized = 1;
 }
 
+void intrmgr_init_hart(void) {
+    assert (intrmgr_initialized);
+
+    disable_interrupts();
+
+    // smp_start woke us with an IPI that was never acknowledged
+
+    csrc_sip(RV32_SIP_SSIP);
+    clear_ipi();
+
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_STIE | RISCV_SIE_SSIE);
+}
+
 void enable_intr_source (
     int srcno,
     int prio,
@@ -76,6 +102,61 @@ void disable_intr_source(int srcno) {
     isrtab[srcno].isr_aux = NULL;
 }
 
+void start_intr_worker(void) {
+    int tid;
+
+    condition_init(&intr_work_ready, "intr_work");
+    tid = thread_spawn_prio(0, "intrwork", &intr_worker);
+    assert (0 <= tid);
+}
+
+void init_intr_work (
+    struct intr_work * work, int srcno,
+    void (*fn)(void * aux), void * aux)
+{
+    assert (0 <= srcno && srcno < NIRQ);
+
+    work->next = NULL;
+    work->fn = fn;
+    work->aux = aux;
+    work->srcno = srcno;
+    work->queued = 0;
+}
+
+void queue_intr_work(struct intr_work * work) {
+    int pie;
+
+    pie = disable_interrupts();
+
+    if (!work->queued) {
+        work->queued = 1;
+        work->next = NULL;
+        if (intr_work_tail != NULL)
+            intr_work_tail->next = work;
+        else
+            intr_work_head = work;
+        intr_work_tail = work;
+        condition_signal(&intr_work_ready);
+    }
+
+    restore_interrupts(pie);
+}
+
+int intr_get_stats(int srcno, struct intr_stats * st) {
+    int pie;
+
+    if (srcno < 0 || NIRQ <= srcno)
+        return -EINVAL;
+
+    if (intr_stats[srcno].count == 0 && isrtab[srcno].isr == NULL)
+        return -ENOENT;
+
+    pie = disable_interrupts();
+    *st = intr_stats[srcno];
+    restore_interrupts(pie);
+    return 0;
+}
+
 void handle_smode_interrupt(unsigned int cause) {
     handle_interrupt(cause);
 }
@@ -83,7 +164,8 @@ void handle_smode_interrupt(unsigned int cause) {
 void handle_umode_interrupt(unsigned int cause) {
     handle_interrupt(cause);
     
-    thread_yield();
+    if (thread_preempt_pending())
+        thread_yield();
 }
 
 
@@ -91,6 +173,9 @@ void handle_umode_interrupt(unsigned int cause) {
 //
 
 void handle_interrupt(unsigned int cause) {
+    if (cause != RISCV_SCAUSE_SEI)
+        ktrace(KTRACE_INTR, cause, 0);
+
     switch (cause) {
     case RISCV_SCAUSE_STI:
         handle_timer_interrupt();
@@ -98,6 +183,12 @@ void handle_interrupt(unsigned int cause) {
     case RISCV_SCAUSE_SEI:
         handle_extern_interrupt();
         break;
+    case RISCV_SCAUSE_SSI:
+        // An IPI only wakes us up. Whatever the sender made ready is picked
+        // up on the way out of the interrupt or by the idle loop.
+        csrc_sip(RV32_SIP_SSIP);
+        clear_ipi();
+        break;
     default:
         panic(NULL);
         break;
@@ -105,6 +196,8 @@ void handle_interrupt(unsigned int cause) {
 }
 
 void handle_extern_interrupt(void) {
+    struct intr_stats * st;
+    unsigned long long t;
     int srcno;
 
     srcno = plic_claim_interrupt();
@@ -113,10 +206,56 @@ void handle_extern_interrupt(void) {
     if (srcno == 0)
         return;
     
+    ktrace(KTRACE_INTR, RISCV_SCAUSE_SEI, srcno);
+
     if (isrtab[srcno].isr == NULL)
         panic(NULL);
     
+    t = rdtime();
     isrtab[srcno].isr(srcno, isrtab[srcno].isr_aux);
+    t = rdtime() - t;
 
     plic_finish_interrupt(srcno);
+
+    st = &intr_stats[srcno];
+    st->count += 1;
+    st->isr_ticks += t;
+    if (st->isr_max < t)
+        st->isr_max = t;
+}
+
+// Runs queued work items one at a time with interrupts enabled. An item is
+// off the queue before its function runs, so an interrupt that comes in
+// meanwhile queues it again.
+
+void intr_worker(void) {
+    struct intr_work * work;
+    struct intr_stats * st;
+    unsigned long long t;
+    int pie;
+
+    for (;;) {
+        pie = disable_interrupts();
+
+        while (intr_work_head == NULL)
+            condition_wait(&intr_work_ready);
+
+        work = intr_work_head;
+        intr_work_head = work->next;
+        if (intr_work_head == NULL)
+            intr_work_tail = NULL;
+        work->queued = 0;
+
+        restore_interrupts(pie);
+
+        t = rdtime();
+        work->fn(work->aux);
+        t = rdtime() - t;
+
+        st = &intr_stats[work->srcno];
+        st->nwork += 1;
+        st->work_ticks += t;
+        if (st->work_max < t)
+            st->work_max = t;
+    }
 }
\ No newline at end of file
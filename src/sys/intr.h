@@ -17,12 +17,45 @@
 #define INTR_PRIO_MAX PLIC_PRIO_MAX
 #define INTR_SRC_CNT PLIC_SRC_CNT
 
+// EXPORTED TYPE DEFINITIONS
+//
+
+// A deferred work item. An ISR does only what the hardware needs right away,
+// then queues a work item whose function does the rest (waking threads, for
+// example) on the interrupt worker thread, with interrupts enabled. Items
+// are set up once by their driver; queuing one that is already queued does
+// nothing, and an item queued again while its function runs runs again.
+
+struct intr_work {
+    struct intr_work * next; // in worker queue
+    void (*fn)(void * aux);
+    void * aux;
+    int srcno; // interrupt source charged for the work
+    char queued;
+};
+
+// Statistics of an interrupt source, in timer ticks where they are times.
+
+struct intr_stats {
+    unsigned long count;            // interrupts handled
+    unsigned long long isr_ticks;   // time spent in the ISR
+    unsigned long long isr_max;     // longest ISR run
+    unsigned long nwork;            // deferred work items run
+    unsigned long long work_ticks;  // time spent in deferred work
+    unsigned long long work_max;    // longest work item run
+};
+
 // EXPORTED FUNCTION DECLARATIONS
 // 
 
 extern void intrmgr_init(void);
 extern char intrmgr_initialized;
 
+// Enables interrupts on a secondary hart. The PLIC was set up by intrmgr_init
+// on hart 0.
+
+extern void intrmgr_init_hart(void);
+
 extern void enable_intr_source (
     int srcno, int prio,
     void (*isr)(int srcno, void * aux),
@@ -30,6 +63,25 @@ extern void enable_intr_source (
 
 extern void disable_intr_source(int srcno);
 
+// Starts the interrupt worker thread, at the highest priority. Work queued
+// before it starts waits.
+
+extern void start_intr_worker(void);
+
+extern void init_intr_work (
+    struct intr_work * work, int srcno,
+    void (*fn)(void * aux), void * aux);
+
+// Queues /work/ for the interrupt worker. May be called from an ISR.
+
+extern void queue_intr_work(struct intr_work * work);
+
+// Fills in /st/ with the statistics of interrupt source /srcno/. Returns 0,
+// -ENOENT if the source has never had an ISR, or -EINVAL if /srcno/ is past
+// the last source, so a caller can walk all sources counting up from 0.
+
+extern int intr_get_stats(int srcno, struct intr_stats * st);
+
 extern void handle_smode_interrupt(unsigned int cause);
 
 static inline long enable_interrupts(void) {
@@ -12,6 +12,8 @@
 #include "error.h"
 #include "thread.h"
 #include "memory.h"
+#include "timer.h"
+#include "intr.h"
 
 #include <stddef.h>
 #include <limits.h>
@@ -26,6 +28,12 @@ struct memio {
 
 #define PIPE_BUFSZ PAGE_SIZE
 
+// Readers wake blocked writers once at least this much room is free
+
+#ifndef PIPE_WAKE_FREE
+#define PIPE_WAKE_FREE (PIPE_BUFSZ / 4)
+#endif
+
 struct seekio {
     struct io io; // I/O struct of seek I/O
     struct io * bkgio; // Backing I/O supporting _readat_ and _writeat_
@@ -34,17 +42,54 @@ struct seekio {
     int blksz; // Block size of backing endpoint
 };
 
+// A buffered I/O object keeps a window of its backing object in memory.
+// Reads are served from the window, which is refilled bufsz bytes at a time
+// from the block holding the requested position; writes are collected in it
+// and written back, rounded out to whole blocks, when the window moves or on
+// close or ioctl. Requests of at least bufsz bytes bypass the window.
+
+#ifndef BUFIO_DEFSZ
+#define BUFIO_DEFSZ PAGE_SIZE
+#endif
+
+#ifndef BUFIO_MAXSZ
+#define BUFIO_MAXSZ (16 * PAGE_SIZE)
+#endif
+
+struct bufio {
+    struct io io; // I/O struct of buffered I/O
+    struct io * bkgio; // Backing I/O supporting _readat_ and _writeat_
+    char * buf; // Window contents
+    size_t bufsz; // Window size (multiple of blksz)
+    unsigned long long bufpos; // Position of window in backing object
+    size_t buflen; // Bytes of window holding data
+    char filled; // Window was read in by bufio_fill() since last dropped
+    size_t dirty_lo, dirty_hi; // Dirty part of window (empty if equal)
+    int blksz; // Block size of backing object
+    struct lock lock;
+};
+
 struct pipe {
     struct io wio; // write I/O
     struct io rio; // read I/O
     void * buf; // Buffer
     size_t head, tail; // Head and tail positions
     int refcnt_w, refcnt_r; // Reference counts
+    char nonblock_w, nonblock_r; // IOCTL_SETNONBLOCK of each end
     struct lock lock;
     struct condition can_read;
     struct condition can_write;
 };
 
+// A thread in iopoll() waits on the condition of its own alarm, so that
+// either the timeout or an iopoll_notify() wakes it.
+
+struct iopoll_waiter {
+    struct iopoll_waiter * next;
+    struct condition * cond;
+    volatile int notified;
+};
+
 // INTERNAL FUNCTION DEFINITIONS
 //
 
@@ -66,23 +111,56 @@ static long seekio_read(struct io * io, void * buf, long bufsz);
 
 static long seekio_write(struct io * io, const void * buf, long len);
 
+static long seekio_readv (
+    struct io * io, const struct iovec * iov, int iovcnt);
+
+static long seekio_writev (
+    struct io * io, const struct iovec * iov, int iovcnt);
+
+static long seekio_sendto (
+    struct io * io, unsigned long long pos, struct io * sink, long len);
+
 static long seekio_readat (
     struct io * io, unsigned long long pos, void * buf, long bufsz);
 
 static long seekio_writeat (
     struct io * io, unsigned long long pos, const void * buf, long len);
 
+static void seekio_set_bkgio(struct seekio * sio, struct io * io);
+static int seekio_setbuf(struct seekio * sio, unsigned int bufsz);
+
+static void bufio_close(struct io * io);
+static int bufio_cntl(struct io * io, int cmd, void * arg);
+
+static long bufio_sendto (
+    struct io * io, unsigned long long pos, struct io * sink, long len);
+
+static long bufio_readat (
+    struct io * io, unsigned long long pos, void * buf, long bufsz);
+
+static long bufio_writeat (
+    struct io * io, unsigned long long pos, const void * buf, long len);
+
+static int bufio_flush(struct bufio * bio);
+static long bufio_fill(struct bufio * bio, unsigned long long pos);
+
 static void pipe_close(struct io *io);
+static int pipe_poll(struct io *io, int events);
+static int pipe_cntl(struct io *io, int cmd, void *arg);
 static long pipe_read(struct io *io, void *buf, long bufsz);
 static long pipe_write(struct io *io, const void *buf, long len);
     
 static const struct iointf pipe_w_intf = {
     .close = &pipe_close,
+    .cntl = &pipe_cntl,
+    .poll = &pipe_poll,
     .write = &pipe_write,
 };
 
 static const struct iointf pipe_r_intf = {
     .close = &pipe_close,
+    .cntl = &pipe_cntl,
+    .poll = &pipe_poll,
     .read = &pipe_read,
 };
 // INTERNAL GLOBAL CONSTANTS
@@ -91,16 +169,34 @@ static const struct iointf seekio_iointf = {
     .cntl = &seekio_cntl,
     .read = &seekio_read,
     .write = &seekio_write,
+    .readv = &seekio_readv,
+    .writev = &seekio_writev,
+    .sendto = &seekio_sendto,
     .readat = &seekio_readat,
     .writeat = &seekio_writeat
 };
 
+static const struct iointf bufio_iointf = {
+    .close = &bufio_close,
+    .cntl = &bufio_cntl,
+    .sendto = &bufio_sendto,
+    .readat = &bufio_readat,
+    .writeat = &bufio_writeat
+};
+
 static const struct iointf memio_iointf = {
     .cntl = &memio_cntl,
     .readat = &memio_readat,
     .writeat = &memio_writeat
 };
 
+// INTERNAL GLOBAL VARIABLES
+
+static struct kcache pipe_cache =
+    KCACHE_INITIALIZER("pipe", struct pipe, NULL);
+
+static struct iopoll_waiter * iopoll_waiters;
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -195,6 +291,10 @@ long iowrite(struct io * io, const void * buf, long len) {
     do {
         n = io->intf->write(io, buf+bufpos, len-bufpos);
 
+        // a non-blocking endpoint that filled up keeps what it took
+        if (n == -EAGAIN && 0 < bufpos)
+            return bufpos;
+
         if (n <= 0)
             return (n < 0) ? n : bufpos;
 
@@ -204,6 +304,170 @@ long iowrite(struct io * io, const void * buf, long len) {
     return bufpos;
 }
 
+// Reads into the /iovcnt/ buffers of /iov/ in order, as one read of their
+// total length would, and returns the number of bytes read. Endpoints that
+// can take the whole vector at once provide a readv function; for the rest
+// each buffer gets its own read, stopping at the first short one. An error
+// after some bytes were read returns the bytes read.
+
+long ioreadv(struct io * io, const struct iovec * iov, int iovcnt) {
+    long total = 0;
+    long n;
+    int i;
+
+    assert (io != NULL);
+    assert (io->intf != NULL);
+
+    if (iovcnt < 0)
+        return -EINVAL;
+    
+    for (i = 0; i < iovcnt; i++) {
+        if (LONG_MAX - total < iov[i].len)
+            return -EINVAL;
+        total += iov[i].len;
+    }
+
+    if (io->intf->readv != NULL)
+        return io->intf->readv(io, iov, iovcnt);
+
+    if (io->intf->read == NULL)
+        return -ENOTSUP;
+    
+    total = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0)
+            continue;
+        
+        n = io->intf->read(io, iov[i].base, iov[i].len);
+
+        if (n < 0)
+            return (total > 0) ? total : n;
+        
+        total += n;
+
+        if (n < iov[i].len)
+            break;
+    }
+
+    return total;
+}
+
+// Writes the /iovcnt/ buffers of /iov/ in order and returns the number of
+// bytes written. Like iowrite(), the fallback for endpoints without a writev
+// function keeps writing each buffer until all of it is written.
+
+long iowritev(struct io * io, const struct iovec * iov, int iovcnt) {
+    long total = 0;
+    long n;
+    int i;
+
+    assert (io != NULL);
+    assert (io->intf != NULL);
+
+    if (iovcnt < 0)
+        return -EINVAL;
+    
+    for (i = 0; i < iovcnt; i++) {
+        if (LONG_MAX - total < iov[i].len)
+            return -EINVAL;
+        total += iov[i].len;
+    }
+
+    if (io->intf->writev != NULL)
+        return io->intf->writev(io, iov, iovcnt);
+
+    if (io->intf->write == NULL)
+        return -ENOTSUP;
+    
+    total = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0)
+            continue;
+        
+        n = iowrite(io, iov[i].base, iov[i].len);
+
+        if (n < 0)
+            return (total > 0) ? total : n;
+        
+        total += n;
+
+        if (n < iov[i].len)
+            break;
+    }
+
+    return total;
+}
+
+// Moves up to /len/ bytes from /in/ to /out/ without going through user
+// memory and returns the number of bytes written to /out/. If /in/ supports
+// readat, reading starts at /pos/ and its own position is not moved;
+// otherwise /in/ is read like a stream. Endpoints with a sendto function
+// write straight from their own buffers (for ktfs, the block cache); for
+// the rest data goes through a page-sized bounce buffer.
+
+long iosendfile (
+    struct io * out, struct io * in, unsigned long long pos, long len)
+{
+    long total = 0;
+    long n, rcnt, wcnt;
+    void * buf;
+
+    assert (out != NULL && out->intf != NULL);
+    assert (in != NULL && in->intf != NULL);
+
+    if (len < 0)
+        return -EINVAL;
+    
+    if (out->intf->write == NULL)
+        return -ENOTSUP;
+    
+    if (len == 0)
+        return 0;
+
+    if (in->intf->sendto != NULL)
+        return in->intf->sendto(in, pos, out, len);
+    
+    if (in->intf->readat == NULL && in->intf->read == NULL)
+        return -ENOTSUP;
+    
+    buf = alloc_phys_page();
+    if (buf == NULL)
+        return -ENOMEM;
+    
+    while (total < len) {
+        n = (len - total < PAGE_SIZE) ? len - total : PAGE_SIZE;
+
+        if (in->intf->readat != NULL)
+            rcnt = in->intf->readat(in, pos + total, buf, n);
+        else
+            rcnt = in->intf->read(in, buf, n);
+        
+        if (rcnt <= 0) {
+            if (rcnt < 0 && total == 0)
+                total = rcnt;
+            break;
+        }
+
+        wcnt = iowrite(out, buf, rcnt);
+
+        if (wcnt < 0) {
+            if (total == 0)
+                total = wcnt;
+            break;
+        }
+
+        total += wcnt;
+
+        if (wcnt < rcnt || rcnt < n)
+            break;
+    }
+
+    free_phys_page(buf);
+    return total;
+}
+
 long ioreadat (
     struct io * io, unsigned long long pos, void * buf, long bufsz)
 {
@@ -234,6 +498,58 @@ long iowriteat (
     return io->intf->writeat(io, pos, buf, len);
 }
 
+// Writes the /iovcnt/ buffers of /iov/ in order at /pos/, as one iowriteat()
+// of their total length would, and returns the number of bytes written.
+// Endpoints that can gather the buffers into one request provide a writevat
+// function; for the rest each buffer gets its own iowriteat(), stopping at
+// the first short one.
+
+long iowritevat (
+    struct io * io, unsigned long long pos,
+    const struct iovec * iov, int iovcnt)
+{
+    long total = 0;
+    long n;
+    int i;
+
+    assert (io != NULL);
+    assert (io->intf != NULL);
+
+    if (iovcnt < 0)
+        return -EINVAL;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (LONG_MAX - total < iov[i].len)
+            return -EINVAL;
+        total += iov[i].len;
+    }
+
+    if (io->intf->writevat != NULL)
+        return io->intf->writevat(io, pos, iov, iovcnt);
+
+    if (io->intf->writeat == NULL)
+        return -ENOTSUP;
+
+    total = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0)
+            continue;
+
+        n = io->intf->writeat(io, pos + total, iov[i].base, iov[i].len);
+
+        if (n < 0)
+            return (total > 0) ? total : n;
+
+        total += n;
+
+        if (n < iov[i].len)
+            break;
+    }
+
+    return total;
+}
+
 int ioctl(struct io * io, int cmd, void * arg) {
     assert (io != NULL);
     assert (io->intf != NULL);
@@ -246,6 +562,113 @@ int ioctl(struct io * io, int cmd, void * arg) {
         return -ENOTSUP;
 }
 
+// Returns the subset of /events/ that are ready on /io/, plus POLLHUP if the
+// other end is gone. Endpoints without a poll function never block, so they
+// are ready for whichever of reading and writing they support.
+
+int ioready(struct io * io, int events) {
+    int ready = 0;
+
+    assert (io != NULL);
+    assert (io->intf != NULL);
+
+    if (io->intf->poll != NULL)
+        return io->intf->poll(io, events) & (events | POLLHUP);
+    
+    if (io->intf->read != NULL || io->intf->readat != NULL)
+        ready |= POLLIN;
+    if (io->intf->write != NULL || io->intf->writeat != NULL)
+        ready |= POLLOUT;
+    
+    return ready & events;
+}
+
+// Waits until at least one of the /n/ endpoints in /ios/ is ready for its
+// /events/ or /timeout_us/ microseconds pass, and returns the number of
+// ready endpoints, setting /revents/ for each. A NULL entry in /ios/ is
+// skipped (it keeps whatever its revents holds). A negative timeout waits
+// forever, and 0 just checks.
+//
+// Endpoints that may block call iopoll_notify() whenever they could have
+// become ready, which wakes every waiting poller to check again.
+
+int iopoll (
+    struct io * const * ios, const int * events, int * revents,
+    int n, long timeout_us)
+{
+    struct iopoll_waiter waiter, ** wp;
+    unsigned long long now, deadline;
+    struct alarm al;
+    int cnt, pie, i;
+
+    alarm_init(&al, "poll");
+    deadline = al.twake;
+    if (0 < timeout_us)
+        deadline += timeout_us * (TIMER_FREQ / 1000 / 1000);
+
+    waiter.cond = &al.cond;
+    pie = disable_interrupts();
+    waiter.next = iopoll_waiters;
+    iopoll_waiters = &waiter;
+    restore_interrupts(pie);
+
+    for (;;) {
+        waiter.notified = 0;
+        cnt = 0;
+
+        for (i = 0; i < n; i++) {
+            if (ios[i] == NULL)
+                continue;
+            revents[i] = ioready(ios[i], events[i]);
+            if (revents[i] != 0)
+                cnt++;
+        }
+
+        if (cnt != 0 || timeout_us == 0)
+            break;
+        
+        now = rdtime();
+        if (0 < timeout_us && deadline <= now)
+            break;
+
+        // An endpoint that became ready since we checked has set notified
+
+        pie = disable_interrupts();
+        if (!waiter.notified) {
+            if (timeout_us < 0)
+                condition_wait(&al.cond);
+            else {
+                al.twake = now;
+                alarm_sleep(&al, deadline - now);
+            }
+        }
+        restore_interrupts(pie);
+        alarm_cancel(&al);
+    }
+
+    pie = disable_interrupts();
+    for (wp = &iopoll_waiters; *wp != &waiter; wp = &(*wp)->next)
+        continue;
+    *wp = waiter.next;
+    restore_interrupts(pie);
+
+    return cnt;
+}
+
+// Wakes every thread waiting in iopoll(). May be called from an ISR.
+
+void iopoll_notify(void) {
+    struct iopoll_waiter * w;
+    int pie;
+
+    pie = disable_interrupts();
+    for (w = iopoll_waiters; w != NULL; w = w->next) {
+        w->notified = 1;
+        condition_broadcast(w->cond);
+    }
+    restore_interrupts(pie);
+}
+
 int ioblksz(struct io * io) {
     return ioctl(io, IOCTL_GETBLKSZ, NULL);
 }
@@ -254,6 +677,27 @@ int ioseek(struct io * io, unsigned long long pos) {
     return ioctl(io, IOCTL_SETPOS, &pos);
 }
 
+// Returns the object that /io/ reads and writes at: the backing endpoint of a
+// seekable I/O object, or /io/ itself. Seekable objects opened separately on
+// the same file share an endpoint. A buffer on the seekable object is looked
+// through, so data still in its window is not seen at the endpoint.
+
+struct io * ioendpoint(struct io * io) {
+    struct seekio * sio;
+    struct bufio * bio;
+
+    if (io->intf != &seekio_iointf)
+        return io;
+
+    sio = (void*)io - offsetof(struct seekio, io);
+
+    if (sio->bkgio->intf != &bufio_iointf)
+        return sio->bkgio;
+
+    bio = (void*)sio->bkgio - offsetof(struct bufio, io);
+    return bio->bkgio;
+}
+
 struct io * create_memory_io(void * buf, size_t size) {
     // FIX ME
     if (buf == NULL || size == 0) {
@@ -295,6 +739,43 @@ struct io * create_seekable_io(struct io * io) {
 
 };
 
+// Returns a buffered I/O object on /io/, which must support readat and
+// writeat, with a window of /bufsz/ bytes (BUFIO_DEFSZ if zero), rounded up
+// to the block size of /io/. The new object holds a reference to /io/.
+// Returns NULL if memory runs out.
+
+struct io * create_buffered_io(struct io * io, size_t bufsz) {
+    struct bufio * bio;
+    int blksz;
+
+    blksz = ioblksz(io);
+    assert (0 < blksz);
+    assert ((blksz & (blksz - 1)) == 0);
+
+    if (bufsz == 0)
+        bufsz = BUFIO_DEFSZ;
+    if (BUFIO_MAXSZ < bufsz)
+        bufsz = BUFIO_MAXSZ;
+    bufsz = ROUND_UP(bufsz, blksz);
+
+    bio = kcalloc(1, sizeof(struct bufio));
+    if (bio == NULL)
+        return NULL;
+
+    bio->buf = kmalloc(bufsz);
+    if (bio->buf == NULL) {
+        kfree(bio);
+        return NULL;
+    }
+
+    bio->bufsz = bufsz;
+    bio->blksz = blksz;
+    bio->bkgio = ioaddref(io);
+    lock_init(&bio->lock);
+
+    return ioinit1(&bio->io, &bufio_iointf);
+}
+
 // INTERNAL FUNCTION DEFINITIONS
 //
 
@@ -358,28 +839,23 @@ int memio_cntl(struct io * io, int cmd, void * arg) {
     struct memio * memio = (struct memio *) io;
     switch (cmd) {
         case IOCTL_GETBLKSZ:
-            if (arg == NULL) {
-                return -EINVAL;
-            }
             return 1;
         case IOCTL_GETEND:
+            // positions are offsets into the buffer, as for any endpoint
             if (arg == NULL) {
                 return -EINVAL;
             }
-            *(size_t *) arg = (size_t)(memio->buf) + memio->size;
+            *(unsigned long long *) arg = memio->size;
             return 0;
         case IOCTL_SETEND:
             if (arg == NULL) {
                 return -EINVAL;
             }
-            size_t new_end = *(size_t *) arg;
-            size_t buf_start = (size_t) memio->buf;
-
-            if (new_end < buf_start || new_end > buf_start + memio->size) {
+            // the buffer can only shrink
+            if (*(const unsigned long long *) arg > memio->size) {
                 return -EINVAL;
             }
-
-            memio->size = new_end - buf_start;
+            memio->size = *(const unsigned long long *) arg;
             return 0;
         default:
             return -ENOTSUP;
@@ -419,11 +895,13 @@ int seekio_cntl(struct io * io, int cmd, void * arg) {
         *ullarg = sio->end;
         return 0;
     case IOCTL_SETEND:
-        // Call backing endpoint ioctl and save result
+        // Call backing endpoint ioctl and save result
         result = ioctl(sio->bkgio, IOCTL_SETEND, ullarg);
         if (result == 0)
             sio->end = *ullarg;
         return result;
+    case IOCTL_SETBUF:
+        return seekio_setbuf(sio, *(const unsigned int *)arg);
     default:
         return ioctl(sio->bkgio, cmd, arg);
     }
@@ -432,9 +910,15 @@ int seekio_cntl(struct io * io, int cmd, void * arg) {
 long seekio_read(struct io * io, void * buf, long bufsz) {
     struct seekio * const sio = (void*)io - offsetof(struct seekio, io);
     unsigned long long const pos = sio->pos;
-    unsigned long long const end = sio->end;
+    unsigned long long end = sio->end;
     long rcnt;
 
+    // Another open instance of the same file may have moved the end
+    if (end - pos < bufsz && ioctl(sio->bkgio, IOCTL_GETEND, &end) == 0)
+        sio->end = end;
+    else
+        end = sio->end;
+
     // Cannot read past end
     if (end - pos < bufsz)
         bufsz = end - pos;
@@ -472,7 +956,13 @@ long seekio_write(struct io * io, const void * buf, long len) {
     // Truncate length to multiple of blksz
     len &= ~(sio->blksz - 1);
 
-    // Check if write is past end. If it is, we need to change end position.
+    // Check if write is past end. If it is, we need to change end position.
+    // Another open instance of the same file may have moved it already.
+
+    if (end - pos < len && ioctl(sio->bkgio, IOCTL_GETEND, &end) == 0)
+        sio->end = end;
+    else
+        end = sio->end;
 
     if (end - pos < len) {
         if (ULLONG_MAX - pos < len)
@@ -493,6 +983,128 @@ long seekio_write(struct io * io, const void * buf, long len) {
     return wcnt;
 }
 
+// Vectored read at the current position. The end is checked once for the
+// whole vector, and each buffer goes straight to the backing endpoint's
+// readat. Every buffer must be a multiple of the block size.
+
+long seekio_readv(struct io * io, const struct iovec * iov, int iovcnt) {
+    struct seekio * const sio = (void*)io - offsetof(struct seekio, io);
+    unsigned long long const pos = sio->pos;
+    unsigned long long end = sio->end;
+    long total = 0;
+    long avail, n, rcnt;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if ((iov[i].len & (sio->blksz - 1)) != 0)
+            return -EINVAL;
+        total += iov[i].len;
+    }
+
+    // Another open instance of the same file may have moved the end
+    if (end - pos < total && ioctl(sio->bkgio, IOCTL_GETEND, &end) == 0)
+        sio->end = end;
+    else
+        end = sio->end;
+
+    avail = (end - pos < total) ? end - pos : total;
+    avail &= ~(sio->blksz - 1);
+    total = 0;
+
+    for (i = 0; i < iovcnt && total < avail; i++) {
+        n = (avail - total < iov[i].len) ? avail - total : iov[i].len;
+        if (n == 0)
+            continue;
+        
+        rcnt = ioreadat(sio->bkgio, pos + total, iov[i].base, n);
+
+        if (rcnt < 0) {
+            if (total == 0)
+                return rcnt;
+            break;
+        }
+
+        total += rcnt;
+
+        if (rcnt < n)
+            break;
+    }
+
+    sio->pos = pos + total;
+    return total;
+}
+
+// Vectored write at the current position. If the vector ends past the end,
+// the end is moved once for all of it rather than once per buffer.
+
+long seekio_writev(struct io * io, const struct iovec * iov, int iovcnt) {
+    struct seekio * const sio = (void*)io - offsetof(struct seekio, io);
+    unsigned long long const pos = sio->pos;
+    unsigned long long end = sio->end;
+    long total = 0;
+    long wcnt;
+    int result;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if ((iov[i].len & (sio->blksz - 1)) != 0)
+            return -EINVAL;
+        total += iov[i].len;
+    }
+
+    if (total == 0)
+        return 0;
+    
+    if (end - pos < total && ioctl(sio->bkgio, IOCTL_GETEND, &end) == 0)
+        sio->end = end;
+    else
+        end = sio->end;
+
+    if (end - pos < total) {
+        if (ULLONG_MAX - pos < total)
+            return -EINVAL;
+        
+        end = pos + total;
+
+        result = ioctl(sio->bkgio, IOCTL_SETEND, &end);
+        
+        if (result != 0)
+            return result;
+        
+        sio->end = end;
+    }
+
+    total = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0)
+            continue;
+        
+        wcnt = iowriteat(sio->bkgio, pos + total, iov[i].base, iov[i].len);
+
+        if (wcnt < 0) {
+            if (total == 0)
+                return wcnt;
+            break;
+        }
+
+        total += wcnt;
+
+        if (wcnt < iov[i].len)
+            break;
+    }
+
+    sio->pos = pos + total;
+    return total;
+}
+
+long seekio_sendto (
+    struct io * io, unsigned long long pos, struct io * sink, long len)
+{
+    struct seekio * const sio = (void*)io - offsetof(struct seekio, io);
+    return iosendfile(sink, sio->bkgio, pos, len);
+}
+
 long seekio_readat (
     struct io * io, unsigned long long pos, void * buf, long bufsz)
 {
@@ -507,9 +1119,268 @@ long seekio_writeat (
     return iowriteat(sio->bkgio, pos, buf, len);
 }
 
+// Makes /io/ the backing object of /sio/. A seekable object holds two
+// references to its backing object (see seekio_close()), so two are taken on
+// /io/ and two dropped on the old one.
+
+void seekio_set_bkgio(struct seekio * sio, struct io * io) {
+    struct io * const old = sio->bkgio;
+
+    sio->bkgio = ioaddref(ioaddref(io));
+    old->refcnt--;
+    ioclose(old);
+}
+
+// Puts a buffer of /bufsz/ bytes between /sio/ and its backing endpoint,
+// replacing any buffer already there, or removes the buffer if /bufsz/ is
+// zero. Removing the buffer writes back what it holds.
+
+int seekio_setbuf(struct seekio * sio, unsigned int bufsz) {
+    struct bufio * bio;
+    struct io * io;
+
+    if (sio->bkgio->intf == &bufio_iointf) {
+        bio = (void*)sio->bkgio - offsetof(struct bufio, io);
+        seekio_set_bkgio(sio, bio->bkgio);
+    }
+
+    if (bufsz == 0)
+        return 0;
+
+    io = create_buffered_io(sio->bkgio, bufsz);
+    if (io == NULL)
+        return -ENOMEM;
+
+    seekio_set_bkgio(sio, io);
+    ioclose(io);
+    return 0;
+}
+
+void bufio_close(struct io * io) {
+    struct bufio * const bio = (void*)io - offsetof(struct bufio, io);
+
+    bufio_flush(bio);
+    ioclose(bio->bkgio);
+    kfree(bio->buf);
+    kfree(bio);
+}
+
+// Writes back the window before passing the request on, so the backing
+// object sees every write made so far. The window is dropped when the end
+// moves, since it may hold data past the new end.
+
+int bufio_cntl(struct io * io, int cmd, void * arg) {
+    struct bufio * const bio = (void*)io - offsetof(struct bufio, io);
+    int result;
+
+    if (cmd == IOCTL_GETBLKSZ)
+        return ioctl(bio->bkgio, cmd, arg);
+
+    lock_acquire(&bio->lock);
+    result = bufio_flush(bio);
+    if (cmd == IOCTL_SETEND) {
+        bio->buflen = 0;
+        bio->filled = 0;
+    }
+    lock_release(&bio->lock);
+
+    if (result < 0)
+        return result;
+
+    return ioctl(bio->bkgio, cmd, arg);
+}
+
+long bufio_sendto (
+    struct io * io, unsigned long long pos, struct io * sink, long len)
+{
+    struct bufio * const bio = (void*)io - offsetof(struct bufio, io);
+    int result;
+
+    lock_acquire(&bio->lock);
+    result = bufio_flush(bio);
+    lock_release(&bio->lock);
+
+    if (result < 0)
+        return result;
+
+    return iosendfile(sink, bio->bkgio, pos, len);
+}
+
+long bufio_readat (
+    struct io * io, unsigned long long pos, void * buf, long bufsz)
+{
+    struct bufio * const bio = (void*)io - offsetof(struct bufio, io);
+    long total = 0;
+    long result;
+    size_t off, n;
+
+    lock_acquire(&bio->lock);
+
+    // Large reads go straight to the backing object, after anything in the
+    // window they might cover has been written back.
+
+    if (bio->bufsz <= bufsz) {
+        result = bufio_flush(bio);
+        if (result == 0)
+            result = ioreadat(bio->bkgio, pos, buf, bufsz);
+        lock_release(&bio->lock);
+        return result;
+    }
+
+    while (total < bufsz) {
+        if (pos < bio->bufpos || bio->bufpos + bio->buflen <= pos) {
+            result = bufio_fill(bio, pos);
+            if (result < 0) {
+                if (total == 0)
+                    total = result;
+                break;
+            }
+
+            // pos is at or past the end
+            if (bio->bufpos + bio->buflen <= pos)
+                break;
+        }
+
+        off = pos - bio->bufpos;
+        n = bio->buflen - off;
+        if (bufsz - total < n)
+            n = bufsz - total;
+
+        memcpy(buf + total, bio->buf + off, n);
+        total += n;
+        pos += n;
+    }
+
+    lock_release(&bio->lock);
+    return total;
+}
+
+long bufio_writeat (
+    struct io * io, unsigned long long pos, const void * buf, long len)
+{
+    struct bufio * const bio = (void*)io - offsetof(struct bufio, io);
+    long total = 0;
+    long result;
+    size_t off, n;
+
+    lock_acquire(&bio->lock);
+
+    if (bio->bufsz <= len) {
+        result = bufio_flush(bio);
+        bio->buflen = 0;
+        bio->filled = 0;
+        if (result == 0)
+            result = iowriteat(bio->bkgio, pos, buf, len);
+        lock_release(&bio->lock);
+        return result;
+    }
+
+    while (total < len) {
+        // A write is added to the window if the window was read in and the
+        // write starts inside it or right after its data. Otherwise the
+        // window moves to the block holding pos, which is read in so partial
+        // blocks are written back whole.
+
+        if (!bio->filled ||
+            pos < bio->bufpos || bio->bufpos + bio->buflen < pos ||
+            bio->bufpos + bio->bufsz <= pos)
+        {
+            result = bufio_fill(bio, pos);
+            if (result < 0) {
+                if (total == 0)
+                    total = result;
+                break;
+            }
+
+            // writing past the end leaves a hole, which reads as zeroes
+            off = pos - bio->bufpos;
+            if (bio->buflen < off) {
+                memset(bio->buf + bio->buflen, 0, off - bio->buflen);
+                bio->buflen = off;
+            }
+        }
+
+        off = pos - bio->bufpos;
+        n = bio->bufsz - off;
+        if (len - total < n)
+            n = len - total;
+
+        memcpy(bio->buf + off, buf + total, n);
+
+        if (bio->dirty_lo == bio->dirty_hi) {
+            bio->dirty_lo = off;
+            bio->dirty_hi = off + n;
+        } else {
+            if (off < bio->dirty_lo)
+                bio->dirty_lo = off;
+            if (bio->dirty_hi < off + n)
+                bio->dirty_hi = off + n;
+        }
+
+        if (bio->buflen < off + n)
+            bio->buflen = off + n;
+
+        total += n;
+        pos += n;
+    }
+
+    lock_release(&bio->lock);
+    return total;
+}
+
+// Writes the dirty part of the window, rounded out to whole blocks, to the
+// backing object. The caller holds the lock of /bio/.
+
+int bufio_flush(struct bufio * bio) {
+    size_t lo, hi;
+    long result;
+
+    if (bio->dirty_lo == bio->dirty_hi)
+        return 0;
+
+    lo = ROUND_DOWN(bio->dirty_lo, bio->blksz);
+    hi = ROUND_UP(bio->dirty_hi, bio->blksz);
+    if (bio->buflen < hi)
+        hi = bio->buflen;
+
+    result = iowriteat(bio->bkgio, bio->bufpos + lo, bio->buf + lo, hi - lo);
+    if (result < 0)
+        return result;
+    if (result != hi - lo)
+        return -EIO;
+
+    bio->dirty_lo = 0;
+    bio->dirty_hi = 0;
+    return 0;
+}
+
+// Moves the window to the block holding /pos/ and reads it in. Returns the
+// number of bytes read, which is less than the window size at the end of the
+// backing object, or a negative error code. The caller holds the lock.
+
+long bufio_fill(struct bufio * bio, unsigned long long pos) {
+    long result;
+
+    result = bufio_flush(bio);
+    if (result < 0)
+        return result;
+
+    bio->bufpos = ROUND_DOWN(pos, bio->blksz);
+    bio->buflen = 0;
+    bio->filled = 0;
+
+    result = ioreadat(bio->bkgio, bio->bufpos, bio->buf, bio->bufsz);
+    if (result < 0)
+        return result;
+
+    bio->buflen = result;
+    bio->filled = 1;
+    return result;
+}
+
 void create_pipe(struct io ** wioptr, struct io ** rioptr) {
     kprintf("[create_pipe] creating pipe\n");
-    struct pipe *pipe = kcalloc(1, sizeof(struct pipe));
+    struct pipe *pipe = kcache_alloc(&pipe_cache);
     if (pipe == NULL) {
         *wioptr = NULL;
         *rioptr = NULL;
@@ -517,7 +1388,7 @@ void create_pipe(struct io ** wioptr, struct io ** rioptr) {
     }
     pipe->buf = alloc_phys_page();
     if (pipe->buf == NULL) {
-        kfree(pipe);
+        kcache_free(&pipe_cache, pipe);
         *wioptr = NULL;
         *rioptr = NULL;
         return;
@@ -561,6 +1432,7 @@ static void pipe_close(struct io *io) {
         pipe->refcnt_w--;
         condition_broadcast(&pipe->can_read);
     }
+    iopoll_notify();
     // destroy pipe if both read and write ends are closed
     if (pipe->refcnt_r == 0 && pipe->refcnt_w == 0) {
         destroyed = 1;
@@ -568,15 +1440,29 @@ static void pipe_close(struct io *io) {
     lock_release(&pipe->lock);
     if (destroyed) {
         free_phys_page(pipe->buf);
-        kfree(pipe);
+        kcache_free(&pipe_cache, pipe);
     }
 }
+// Returns the number of bytes in the ring buffer of /pipe/. One byte always
+// stays free, so that head == tail means empty.
+
+static inline size_t pipe_used(const struct pipe * pipe) {
+    return (pipe->tail - pipe->head + PIPE_BUFSZ) % PIPE_BUFSZ;
+}
+
+// Data moves through the ring buffer in at most two contiguous spans per
+// pass, split where the buffer wraps around. A reader waits only when the
+// pipe is empty, so writers wake readers only when they make it non-empty.
+// Writers wait only when it is full, and readers wake them once the free
+// space grows past PIPE_WAKE_FREE, not for every byte taken.
+
 static long pipe_read(struct io *io, void *buf, long bufsz)
 {
     if (!io || !buf || bufsz < 0) {
         return -EINVAL;
     }
     struct pipe *pipe = (void *)io - offsetof(struct pipe, rio);
+    size_t used, room, n, span;
     long nread = 0;
 
     lock_acquire(&pipe->lock);
@@ -587,14 +1473,33 @@ static long pipe_read(struct io *io, void *buf, long bufsz)
                 lock_release(&pipe->lock);
                 return (nread > 0) ? nread : 0;
             }
+            if (pipe->nonblock_r) {
+                lock_release(&pipe->lock);
+                return (nread > 0) ? nread : -EAGAIN;
+            }
+            // wake a writer for the room we made before going to sleep
+            condition_broadcast(&pipe->can_write);
             lock_release(&pipe->lock);
             condition_wait(&pipe->can_read);
             lock_acquire(&pipe->lock);
         }
-        ((char *)buf)[nread++] = ((char *)pipe->buf)[pipe->head];
-        pipe->head = (pipe->head + 1) % PIPE_BUFSZ;
-        condition_broadcast(&pipe->can_write);  
+
+        used = pipe_used(pipe);
+        room = PIPE_BUFSZ - 1 - used;
+        n = (bufsz - nread < used) ? bufsz - nread : used;
+        span = (PIPE_BUFSZ - pipe->head < n) ? PIPE_BUFSZ - pipe->head : n;
+
+        memcpy((char *)buf + nread, (char *)pipe->buf + pipe->head, span);
+        memcpy((char *)buf + nread + span, pipe->buf, n - span);
+        pipe->head = (pipe->head + n) % PIPE_BUFSZ;
+        nread += n;
+
+        if (room < PIPE_WAKE_FREE && PIPE_WAKE_FREE <= room + n) {
+            condition_broadcast(&pipe->can_write);
+            iopoll_notify();
+        }
     }
+
     lock_release(&pipe->lock);
     return nread;
 }
@@ -606,25 +1511,94 @@ static long pipe_write(struct io *io, const void *buf, long len)
         return -EINVAL;
     }
     struct pipe *pipe = (void *)io - offsetof(struct pipe, wio);
+    size_t used, n, span;
     long nwritten = 0;
 
     lock_acquire(&pipe->lock);
 
     while (nwritten < len) {
-        while (((pipe->tail + 1) % PIPE_BUFSZ) == pipe->head) {
+        while (pipe_used(pipe) == PIPE_BUFSZ - 1) {
             if (pipe->refcnt_r == 0) { 
                 lock_release(&pipe->lock);
                 return -EPIPE;
             }
+            if (pipe->nonblock_w) {
+                lock_release(&pipe->lock);
+                return (nwritten > 0) ? nwritten : -EAGAIN;
+            }
+            // wake a reader for what we wrote before going to sleep
+            condition_broadcast(&pipe->can_read);
             lock_release(&pipe->lock);
             condition_wait(&pipe->can_write);
             lock_acquire(&pipe->lock);
         }
-        ((char *)pipe->buf)[pipe->tail] = ((const char *)buf)[nwritten++];
-        pipe->tail = (pipe->tail + 1) % PIPE_BUFSZ;
 
-        condition_broadcast(&pipe->can_read); 
+        used = pipe_used(pipe);
+        n = PIPE_BUFSZ - 1 - used;
+        if (len - nwritten < n)
+            n = len - nwritten;
+        span = (PIPE_BUFSZ - pipe->tail < n) ? PIPE_BUFSZ - pipe->tail : n;
+
+        memcpy((char *)pipe->buf + pipe->tail, (const char *)buf + nwritten, span);
+        memcpy(pipe->buf, (const char *)buf + nwritten + span, n - span);
+        pipe->tail = (pipe->tail + n) % PIPE_BUFSZ;
+        nwritten += n;
+
+        if (used == 0) {
+            condition_broadcast(&pipe->can_read);
+            iopoll_notify();
+        }
     }
+
     lock_release(&pipe->lock);
     return nwritten;
-}
\ No newline at end of file
+}
+
+// A read end is ready when there is data or no writer left, a write end
+// when there is room. Pollers are notified at the same transitions that
+// wake blocked readers and writers.
+
+static int pipe_poll(struct io *io, int events)
+{
+    struct pipe *pipe;
+    int ready = 0;
+
+    if (io->intf->read == pipe_read) {
+        pipe = (void *)io - offsetof(struct pipe, rio);
+        if (pipe_used(pipe) != 0)
+            ready |= POLLIN;
+        if (pipe->refcnt_w == 0)
+            ready |= POLLIN | POLLHUP;
+    } else {
+        pipe = (void *)io - offsetof(struct pipe, wio);
+        if (pipe_used(pipe) < PIPE_BUFSZ - 1)
+            ready |= POLLOUT;
+        if (pipe->refcnt_r == 0)
+            ready |= POLLHUP;
+    }
+
+    return ready;
+}
+
+// Each end of a pipe has its own non-blocking mode.
+
+static int pipe_cntl(struct io *io, int cmd, void *arg)
+{
+    struct pipe *pipe;
+
+    switch (cmd) {
+    case IOCTL_GETBLKSZ:
+        return 1;
+    case IOCTL_SETNONBLOCK:
+        if (io->intf->read == pipe_read) {
+            pipe = (void *)io - offsetof(struct pipe, rio);
+            pipe->nonblock_r = (*(const int *)arg != 0);
+        } else {
+            pipe = (void *)io - offsetof(struct pipe, wio);
+            pipe->nonblock_w = (*(const int *)arg != 0);
+        }
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
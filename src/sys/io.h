@@ -14,11 +14,56 @@
 
 struct io; // opaque (defined in ioimpl.h)
 
+// One buffer of a vectored read or write (ioreadv() and iowritev())
+
+struct iovec {
+    void * base;
+    size_t len;
+};
+
+// Events for ioready() and iopoll()
+
+#define POLLIN  (1 << 0) // a read would not block
+#define POLLOUT (1 << 1) // a write would not block
+#define POLLHUP (1 << 2) // the other end is closed (always reported)
+#define POLLNVAL (1 << 3) // not an open descriptor (syscall only)
+
+// One entry of the poll syscall's array
+
+struct pollfd {
+    int fd;
+    int events; // POLLIN and/or POLLOUT
+    int revents; // set by the kernel
+};
+
+// Byte range of a block device for IOCTL_DISCARD and IOCTL_WRZEROES
+
+struct ioextent {
+    unsigned long long pos;
+    unsigned long long len;
+};
+
+#ifndef IOV_MAX
+#define IOV_MAX 16 // most buffers taken by the readv and writev syscalls
+#endif
+
 #define IOCTL_GETBLKSZ  0 // arg is ignored
 #define IOCTL_GETEND    2 // arg is unsigned long long *
 #define IOCTL_SETEND    3 // arg is const unsigned long long *
 #define IOCTL_GETPOS    4 // arg is unsigned long long *
 #define IOCTL_SETPOS    5 // arg is const unsigned long long *
+#define IOCTL_SETRA     6 // arg is const unsigned int * (0 disables)
+#define IOCTL_GETCSTATS 7 // arg is struct cache_stats *
+#define IOCTL_RSTCSTATS 8 // arg is ignored
+#define IOCTL_RESERVE   9 // arg is const unsigned long long * (bytes)
+#define IOCTL_SETTRACE  10 // arg is const unsigned int * (event mask)
+#define IOCTL_SETNONBLOCK 11 // arg is const int * (0 blocks, else -EAGAIN)
+#define IOCTL_SETBUF    12 // arg is const unsigned int * (bytes, 0 unbuffers)
+#define IOCTL_ISATTY    13 // arg is ignored; returns 1 for a terminal
+#define IOCTL_GETID     14 // arg is unsigned long long * (contents id, never 0)
+#define IOCTL_DISCARD   15 // arg is const struct ioextent * (len 0 probes)
+#define IOCTL_WRZEROES  16 // arg is const struct ioextent * (len 0 probes)
+#define IOCTL_FLUSH     17 // arg is ignored; makes completed writes durable
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -51,6 +96,25 @@ extern long iowrite (
     long len
 );
 
+extern long ioreadv (
+    struct io * io,
+    const struct iovec * iov,
+    int iovcnt
+);
+
+extern long iowritev (
+    struct io * io,
+    const struct iovec * iov,
+    int iovcnt
+);
+
+extern long iosendfile (
+    struct io * out,
+    struct io * in,
+    unsigned long long pos,
+    long len
+);
+
 extern long ioreadat (
     struct io * io,
     unsigned long long pos,
@@ -65,6 +129,25 @@ extern long iowriteat (
     long len
 );
 
+extern long iowritevat (
+    struct io * io,
+    unsigned long long pos,
+    const struct iovec * iov,
+    int iovcnt
+);
+
+extern int ioready(struct io * io, int events);
+
+extern int iopoll (
+    struct io * const * ios,
+    const int * events,
+    int * revents,
+    int n,
+    long timeout_us
+);
+
+extern void iopoll_notify(void);
+
 extern int ioseek (
     struct io * io,
     unsigned long long pos
@@ -73,6 +156,8 @@ extern int ioseek (
 extern int ioblksz(struct io * io);
 extern struct io * create_memory_io(void * buf, size_t size);
 extern struct io * create_seekable_io(struct io * io);
+extern struct io * create_buffered_io(struct io * io, size_t bufsz);
+extern struct io * ioendpoint(struct io * io);
 extern long memio_readat (struct io * io, unsigned long long pos, void * buf, long bufsz);
 extern long memio_writeat (struct io * io, unsigned long long pos, const void * buf, long len);
 extern int memio_cntl(struct io * io, int cmd, void * arg);
@@ -36,6 +36,26 @@ struct iointf {
         const void * buf,
         long len
     );
+    int (*poll) ( // optional, see ioready()
+        struct io * io,
+        int events
+    );
+    long (*readv) ( // optional, see ioreadv()
+        struct io * io,
+        const struct iovec * iov,
+        int iovcnt
+    );
+    long (*writev) ( // optional, see iowritev()
+        struct io * io,
+        const struct iovec * iov,
+        int iovcnt
+    );
+    long (*sendto) ( // optional, see iosendfile()
+        struct io * io,
+        unsigned long long pos,
+        struct io * sink,
+        long len
+    );
     long (*readat) (
         struct io * io,
         unsigned long long pos,
@@ -48,6 +68,12 @@ struct iointf {
         const void * buf,
         long len
     );
+    long (*writevat) ( // optional, see iowritevat()
+        struct io * io,
+        unsigned long long pos,
+        const struct iovec * iov,
+        int iovcnt
+    );
 };
 
 // EXPORTED FUNCTION DECLARATIONS
@@ -0,0 +1,215 @@
+// ioring.c - Shared-memory submission and completion rings
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef IORING_TRACE
+#define TRACE
+#endif
+
+#ifdef IORING_DEBUG
+#define DEBUG
+#endif
+
+#include "ioring.h"
+#include "process.h"
+#include "memory.h"
+#include "heap.h"
+#include "io.h"
+#include "error.h"
+#include "assert.h"
+#include "string.h"
+
+#include <limits.h>
+
+// Submissions are performed by ioring_enter() in the thread of the process
+// that entered the ring, so user buffers are reached the same way as from a
+// syscall, and an operation that blocks (a read of an empty pipe, say) holds
+// up only its own process, never the rings of others. A ring is owned by the process that set it up. Its
+// page is mapped shared, so a fork leaves the parent's mapping intact; the
+// child drops its copy of the mapping (see ioring_unmap()).
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct ioring {
+    struct process * proc; // owner
+    struct ioring_page * page; // kernel address of the shared page
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void ioring_consume(struct ioring * ring);
+static int64_t ioring_do(struct process * proc, const struct ioring_sqe * sqe);
+static unsigned int ioring_cq_count(const struct ioring_page * page);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void ioring_init(void) {
+    assert (sizeof(struct ioring_page) <= PAGE_SIZE);
+}
+
+// Creates a ring for /proc/, the current process, and maps its page into
+// the process. Returns the user address of the ring page.
+
+long ioring_setup(struct process * proc) {
+    struct ioring * ring;
+    void * pp;
+
+    if (proc->ioring != NULL)
+        return -EBUSY;
+
+    ring = kcalloc(1, sizeof(struct ioring));
+    pp = alloc_zeroed_phys_page();
+
+    if (ring == NULL || pp == NULL) {
+        kfree(ring);
+        free_phys_page(pp);
+        return -ENOMEM;
+    }
+
+    // PTE_SHARED keeps fork from making the page copy-on-write and
+    // reset_active_mspace() from freeing it
+
+    if (map_page(IORING_VMA, pp, PTE_R | PTE_W | PTE_U | PTE_SHARED) == NULL) {
+        kfree(ring);
+        free_phys_page(pp);
+        return -ENOMEM;
+    }
+
+    ring->proc = proc;
+    ring->page = pp;
+    ring->page->nsqe = IORING_NSQE;
+    ring->page->ncqe = IORING_NCQE;
+    proc->ioring = ring;
+
+    return IORING_VMA;
+}
+
+// Performs the submissions queued in the ring of /proc/, the current
+// process, until the submission queue is empty or the completion queue is
+// full. Operations complete before they are posted, so none are pending on
+// return; /min_complete/ is checked against the completion queue size only.
+// Returns the number of waiting completions.
+
+int ioring_enter(struct process * proc, unsigned int min_complete) {
+    struct ioring * const ring = proc->ioring;
+
+    if (ring == NULL)
+        return -EINVAL;
+
+    if (IORING_NCQE < min_complete)
+        return -EINVAL;
+
+    ioring_consume(ring);
+    return ioring_cq_count(ring->page);
+}
+
+// Frees the ring of /proc/, if it has one. Called before the process's
+// memory space and I/O table go.
+
+void ioring_release(struct process * proc) {
+    struct ioring * const ring = proc->ioring;
+
+    if (ring == NULL)
+        return;
+
+    // only the process's own space maps the page
+    if (active_mspace() == proc->mtag)
+        unmap_page(IORING_VMA, NULL);
+
+    free_phys_page(ring->page);
+    proc->ioring = NULL;
+    kfree(ring);
+}
+
+// Removes the mapping of a ring page from the active memory space without
+// freeing the page. Called in a forked child, which does not get the
+// parent's ring.
+
+void ioring_unmap(void) {
+    int flags;
+
+    if (lookup_page(IORING_VMA, &flags) != NULL && (flags & PTE_SHARED))
+        unmap_page(IORING_VMA, NULL);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Performs submissions until the submission queue is empty or the
+// completion queue is full.
+
+void ioring_consume(struct ioring * ring) {
+    struct ioring_page * const page = ring->page;
+    struct ioring_sqe sqe;
+    struct ioring_cqe * cqe;
+    uint32_t head, tail;
+
+    head = page->sq_head;
+
+    for (;;) {
+        tail = __atomic_load_n(&page->sq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail || IORING_NCQE <= ioring_cq_count(page))
+            break;
+
+        // copy the entry so the process cannot change it under us
+        sqe = page->sq[head % IORING_NSQE];
+        __atomic_store_n(&page->sq_head, ++head, __ATOMIC_RELEASE);
+
+        cqe = &page->cq[page->cq_tail % IORING_NCQE];
+        cqe->user_data = sqe.user_data;
+        cqe->result = ioring_do(ring->proc, &sqe);
+        __atomic_store_n(&page->cq_tail, page->cq_tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Performs one submission for /proc/, whose memory space is active, and
+// returns its result.
+
+int64_t ioring_do(struct process * proc, const struct ioring_sqe * sqe) {
+    const int wflag = (sqe->op == IORING_OP_READ ||
+        sqe->op == IORING_OP_PREAD) ? PTE_W : PTE_R;
+    struct io * io;
+    int result;
+
+    if (sqe->op == IORING_OP_NOP)
+        return 0;
+
+    io = process_getio(proc, sqe->fd);
+    if (io == NULL)
+        return -EBADFD;
+
+    if (sqe->op == IORING_OP_CLOSE)
+        return process_closeio(proc, sqe->fd);
+
+    if (LONG_MAX < sqe->len)
+        return -EINVAL;
+
+    if (sqe->len == 0)
+        return 0;
+
+    result = validate_vptr(sqe->buf, sqe->len, wflag | PTE_U);
+    if (result < 0)
+        return result;
+
+    switch (sqe->op) {
+    case IORING_OP_READ:
+        return ioread(io, sqe->buf, sqe->len);
+    case IORING_OP_WRITE:
+        return iowrite(io, sqe->buf, sqe->len);
+    case IORING_OP_PREAD:
+        return ioreadat(io, sqe->pos, sqe->buf, sqe->len);
+    case IORING_OP_PWRITE:
+        return iowriteat(io, sqe->pos, sqe->buf, sqe->len);
+    default:
+        return -ENOTSUP;
+    }
+}
+
+unsigned int ioring_cq_count(const struct ioring_page * page) {
+    return __atomic_load_n(&page->cq_tail, __ATOMIC_ACQUIRE) - page->cq_head;
+}
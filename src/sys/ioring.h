@@ -0,0 +1,83 @@
+// ioring.h - Shared-memory submission and completion rings
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _IORING_H_
+#define _IORING_H_
+
+#include "conf.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A process may set up one ring page, shared between it and the kernel. The
+// process queues operations in the submission queue (sq) and advances
+// sq_tail; the kernel consumes them, advancing sq_head, and posts one
+// completion per operation to the completion queue (cq), advancing cq_tail.
+// The process consumes completions by advancing cq_head. Indices run freely
+// and are reduced modulo the queue size. Each side publishes its index only
+// after the entries it covers are written.
+
+#ifndef IORING_NSQE
+#define IORING_NSQE 32 // power of two
+#endif
+
+#ifndef IORING_NCQE
+#define IORING_NCQE 64 // power of two
+#endif
+
+// The ring page is mapped at a fixed address, between the mmap area and the
+// user stack.
+
+#define IORING_VMA UMEM_MMAP_END_VMA
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+enum ioring_op {
+    IORING_OP_NOP = 0,
+    IORING_OP_READ,     // ioread() at the fd's position
+    IORING_OP_WRITE,    // iowrite() at the fd's position
+    IORING_OP_PREAD,    // ioreadat() at pos
+    IORING_OP_PWRITE,   // iowriteat() at pos
+    IORING_OP_CLOSE     // close fd
+};
+
+struct ioring_sqe {
+    uint32_t op;
+    int32_t fd;
+    void * buf;
+    uint64_t len;
+    uint64_t pos;
+    uint64_t user_data; // copied to the completion
+};
+
+struct ioring_cqe {
+    uint64_t user_data;
+    int64_t result; // as the matching syscall would return
+};
+
+struct ioring_page {
+    volatile uint32_t sq_head, sq_tail;
+    volatile uint32_t cq_head, cq_tail;
+    uint32_t nsqe, ncqe;
+    uint32_t reserved[10];
+    struct ioring_sqe sq[IORING_NSQE];
+    struct ioring_cqe cq[IORING_NCQE];
+};
+
+struct process; // process.h
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+extern void ioring_init(void);
+
+extern long ioring_setup(struct process * proc);
+extern int ioring_enter(struct process * proc, unsigned int min_complete);
+extern void ioring_release(struct process * proc);
+extern void ioring_unmap(void);
+
+#endif // _IORING_H_
@@ -0,0 +1,389 @@
+// kbench.c - Kernel microbenchmarks run at boot
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef KBENCH_TRACE
+#define TRACE
+#endif
+
+#ifdef KBENCH_DEBUG
+#define DEBUG
+#endif
+
+#include "kbench.h"
+#include "cache.h"
+#include "conf.h"
+#include "console.h"
+#include "error.h"
+#include "fs.h"
+#include "heap.h"
+#include "io.h"
+#include "memory.h"
+#include "riscv.h"
+#include "thread.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Each benchmark takes KBENCH_NSAMPLE samples. A sample times one operation,
+// or a batch of KBENCH_BATCH for operations close to the resolution of
+// rdtime, in which case the time per operation is reported.
+
+#ifndef KBENCH_NSAMPLE
+#define KBENCH_NSAMPLE 200
+#endif
+
+#define KBENCH_BATCH 16
+
+#define KBENCH_FILE "shell.elf" // read by the ktfs benchmarks
+#define KBENCH_BUFSZ (64 * 1024) // largest vioblk read
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void report(const char * name, unsigned long long * samples);
+
+static void bench_cache(struct io * blkio);
+static void bench_vioblk(struct io * blkio);
+static void bench_ktfs(void);
+static void bench_pages(void);
+static void bench_kmalloc(void);
+static void bench_lock(void);
+static void bench_yield(void);
+
+static void lock_holder(void);
+static void yielder(void);
+
+static unsigned long lcg_next(void);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static unsigned long long samples[KBENCH_NSAMPLE];
+static char * kbench_buf; // KBENCH_BUFSZ bytes of physical pages
+static unsigned long lcg_state = 1;
+
+// Shared with the helper threads of bench_lock() and bench_yield()
+
+static struct lock bench_lk;
+static struct condition holder_ready;
+static int holder_holds; // lock_holder() holds bench_lk
+static int helper_done;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void kbench_run(struct io * blkio) {
+    kbench_buf = alloc_phys_pages(KBENCH_BUFSZ / PAGE_SIZE);
+    if (kbench_buf == NULL) {
+        kprintf("kbench: out of memory\n");
+        return;
+    }
+
+    kprintf("kbench timer_hz %lu samples %d\n",
+        (unsigned long)TIMER_FREQ, KBENCH_NSAMPLE);
+
+    bench_cache(blkio);
+    bench_vioblk(blkio);
+    bench_ktfs();
+    bench_pages();
+    bench_kmalloc();
+    bench_lock();
+    bench_yield();
+
+    free_phys_pages(kbench_buf, KBENCH_BUFSZ / PAGE_SIZE);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Sorts /samples/ and prints their minimum, median and 99th percentile.
+
+void report(const char * name, unsigned long long * samples) {
+    unsigned long long t;
+    int i, j;
+
+    for (i = 1; i < KBENCH_NSAMPLE; i++) {
+        t = samples[i];
+        for (j = i; 0 < j && t < samples[j-1]; j--)
+            samples[j] = samples[j-1];
+        samples[j] = t;
+    }
+
+    kprintf("kbench %s min %llu med %llu p99 %llu\n", name, samples[0],
+        samples[KBENCH_NSAMPLE / 2], samples[KBENCH_NSAMPLE * 99 / 100]);
+}
+
+// A private cache on the disk, so the file system's cache is left alone.
+// Misses read consecutive blocks, each once, so none of them can hit.
+
+void bench_cache(struct io * blkio) {
+    unsigned long long end, t0;
+    struct cache * cache;
+    void * blk;
+    int i, j;
+
+    if (ioctl(blkio, IOCTL_GETEND, &end) != 0 ||
+        end < KBENCH_NSAMPLE * CACHE_DEFAULT_BLKSZ ||
+        create_cache(blkio, 0, 0, &cache) != 0)
+    {
+        kprintf("kbench: no cache\n");
+        return;
+    }
+
+    for (i = 0; i < KBENCH_NSAMPLE; i++) {
+        t0 = rdtime();
+        if (cache_get_block(cache, i * CACHE_DEFAULT_BLKSZ, &blk) != 0) {
+            kprintf("kbench: cache_get_block failed\n");
+            return;
+        }
+        samples[i] = rdtime() - t0;
+        cache_release_block(cache, blk, CACHE_CLEAN);
+    }
+
+    report("cache_get_block_miss", samples);
+
+    for (i = 0; i < KBENCH_NSAMPLE; i++) {
+        t0 = rdtime();
+        for (j = 0; j < KBENCH_BATCH; j++) {
+            cache_get_block(cache, 0, &blk);
+            cache_release_block(cache, blk, CACHE_CLEAN);
+        }
+        samples[i] = (rdtime() - t0) / KBENCH_BATCH;
+    }
+
+    report("cache_get_block_hit", samples);
+}
+
+void bench_vioblk(struct io * blkio) {
+    static const struct {
+        const char * name;
+        long len;
+    } sizes[] = {
+        { "vioblk_readat_512", 512 },
+        { "vioblk_readat_4k", 4096 },
+        { "vioblk_readat_16k", 16 * 1024 },
+        { "vioblk_readat_64k", KBENCH_BUFSZ }
+    };
+
+    unsigned long long end, t0;
+    long n;
+    int i, k;
+
+    if (ioctl(blkio, IOCTL_GETEND, &end) != 0 || end < KBENCH_BUFSZ)
+        return;
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        for (i = 0; i < KBENCH_NSAMPLE; i++) {
+            t0 = rdtime();
+            n = ioreadat(blkio, 0, kbench_buf, sizes[k].len);
+            samples[i] = rdtime() - t0;
+            if (n != sizes[k].len) {
+                kprintf("kbench: %s: error %ld\n", sizes[k].name, n);
+                return;
+            }
+        }
+
+        report(sizes[k].name, samples);
+    }
+}
+
+// Page-sized reads of KBENCH_FILE through ktfs, first in order, wrapping at
+// the end, then at random page offsets.
+
+void bench_ktfs(void) {
+    unsigned long long end, pos, t0;
+    struct io * io;
+    long n;
+    int i;
+
+    if (fsopen(KBENCH_FILE, &io) != 0)
+        return;
+
+    if (ioctl(io, IOCTL_GETEND, &end) != 0 || end < PAGE_SIZE) {
+        ioclose(io);
+        return;
+    }
+
+    end -= end % PAGE_SIZE;
+
+    for (i = 0, pos = 0; i < KBENCH_NSAMPLE; i++) {
+        t0 = rdtime();
+        n = ioreadat(io, pos, kbench_buf, PAGE_SIZE);
+        samples[i] = rdtime() - t0;
+        if (n != PAGE_SIZE)
+            break;
+        pos = (pos + PAGE_SIZE) % end;
+    }
+
+    if (i == KBENCH_NSAMPLE)
+        report("ktfs_readat_seq_4k", samples);
+
+    for (i = 0; i < KBENCH_NSAMPLE; i++) {
+        pos = lcg_next() % (end / PAGE_SIZE) * PAGE_SIZE;
+        t0 = rdtime();
+        n = ioreadat(io, pos, kbench_buf, PAGE_SIZE);
+        samples[i] = rdtime() - t0;
+        if (n != PAGE_SIZE)
+            break;
+    }
+
+    if (i == KBENCH_NSAMPLE)
+        report("ktfs_readat_rand_4k", samples);
+
+    ioclose(io);
+}
+
+// One allocation and free of a single page and of a 16-page block
+
+void bench_pages(void) {
+    unsigned long long t0;
+    void * pp;
+    int i;
+
+    for (i = 0; i < KBENCH_NSAMPLE; i++) {
+        t0 = rdtime();
+        pp = alloc_phys_pages(1);
+        free_phys_pages(pp, 1);
+        samples[i] = rdtime() - t0;
+    }
+
+    report("alloc_free_phys_pages_1", samples);
+
+    for (i = 0; i < KBENCH_NSAMPLE; i++) {
+        t0 = rdtime();
+        pp = alloc_phys_pages(16);
+        free_phys_pages(pp, 16);
+        samples[i] = rdtime() - t0;
+    }
+
+    report("alloc_free_phys_pages_16", samples);
+}
+
+void bench_kmalloc(void) {
+    static const struct {
+        const char * name;
+        size_t size;
+    } sizes[] = {
+        { "kmalloc_kfree_32", 32 },
+        { "kmalloc_kfree_256", 256 },
+        { "kmalloc_kfree_2k", 2048 }
+    };
+
+    unsigned long long t0;
+    void * p;
+    int i, j, k;
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        for (i = 0; i < KBENCH_NSAMPLE; i++) {
+            t0 = rdtime();
+            for (j = 0; j < KBENCH_BATCH; j++) {
+                p = kmalloc(sizes[k].size);
+                kfree(p);
+            }
+            samples[i] = (rdtime() - t0) / KBENCH_BATCH;
+        }
+
+        report(sizes[k].name, samples);
+    }
+}
+
+// Uncontended, an acquire and release of a free lock. Contended, an acquire
+// of a lock held by another thread, which gives it up as soon as it next
+// runs: the time includes blocking, the switch to the holder and back, and
+// the wakeup.
+
+void bench_lock(void) {
+    unsigned long long t0;
+    int i, j, tid;
+
+    lock_init(&bench_lk);
+    condition_init(&holder_ready, "kbench_holder");
+
+    for (i = 0; i < KBENCH_NSAMPLE; i++) {
+        t0 = rdtime();
+        for (j = 0; j < KBENCH_BATCH; j++) {
+            lock_acquire(&bench_lk);
+            lock_release(&bench_lk);
+        }
+        samples[i] = (rdtime() - t0) / KBENCH_BATCH;
+    }
+
+    report("lock_acquire_release", samples);
+
+    holder_holds = 0;
+    helper_done = 0;
+
+    tid = thread_spawn("kbench_lock", &lock_holder);
+    if (tid < 0)
+        return;
+
+    for (i = 0; i < KBENCH_NSAMPLE; i++) {
+        while (!holder_holds)
+            condition_wait(&holder_ready);
+
+        t0 = rdtime();
+        lock_acquire(&bench_lk);
+        samples[i] = rdtime() - t0;
+        holder_holds = 0;
+        lock_release(&bench_lk);
+    }
+
+    helper_done = 1;
+    thread_join(tid);
+    report("lock_acquire_contended", samples);
+}
+
+// Helper of bench_lock(): takes the lock, lets the benchmark block on it,
+// then releases it, until the benchmark is done.
+
+void lock_holder(void) {
+    while (!helper_done) {
+        lock_acquire(&bench_lk);
+        holder_holds = 1;
+        condition_broadcast(&holder_ready);
+        thread_yield();
+        lock_release(&bench_lk);
+
+        // let the benchmark take the sample before the lock is taken again
+        while (holder_holds && !helper_done)
+            thread_yield();
+    }
+}
+
+// A yield to a thread that yields straight back
+
+void bench_yield(void) {
+    unsigned long long t0;
+    int i, tid;
+
+    helper_done = 0;
+
+    tid = thread_spawn("kbench_yield", &yielder);
+    if (tid < 0)
+        return;
+
+    thread_yield(); // let it start
+
+    for (i = 0; i < KBENCH_NSAMPLE; i++) {
+        t0 = rdtime();
+        thread_yield();
+        samples[i] = rdtime() - t0;
+    }
+
+    helper_done = 1;
+    thread_join(tid);
+    report("thread_yield_round_trip", samples);
+}
+
+void yielder(void) {
+    while (!helper_done)
+        thread_yield();
+}
+
+unsigned long lcg_next(void) {
+    lcg_state = lcg_state * 1103515245 + 12345;
+    return lcg_state >> 16;
+}
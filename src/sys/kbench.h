@@ -0,0 +1,23 @@
+// kbench.h - Kernel microbenchmarks run at boot
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _KBENCH_H_
+#define _KBENCH_H_
+
+struct io; // io.h
+
+// Times kernel paths that cannot be isolated from user mode and prints one
+// line per benchmark on the console:
+//
+//     kbench <name> min <ticks> med <ticks> p99 <ticks>
+//
+// Times are in rdtime ticks per operation. /blkio/ is the disk the file
+// system is mounted from; it is only read. Only in kernels built with
+// BENCH defined (make bench), where main() calls it before starting init.
+
+extern void kbench_run(struct io * blkio);
+
+#endif // _KBENCH_H_
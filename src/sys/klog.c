@@ -0,0 +1,203 @@
+// klog.c - Kernel log buffer
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef KLOG_TRACE
+#define TRACE
+#endif
+
+#ifdef KLOG_DEBUG
+#define DEBUG
+#endif
+
+#include "klog.h"
+#include "console.h"
+#include "device.h"
+#include "ioimpl.h"
+#include "thread.h"
+#include "intr.h"
+#include "error.h"
+#include "string.h"
+
+#include <stdint.h>
+
+// The log is a ring of KLOG_SIZE bytes. klog_head counts the bytes ever
+// appended and klog_tail the bytes ever drained (or lost), so byte i lives at
+// klog_ring[i % KLOG_SIZE]. Both are changed with interrupts disabled, since
+// kprintf() may be called from an ISR.
+//
+// The drain thread runs at the lowest priority and writes at most
+// KLOG_BATCH bytes between chances for other threads to run, so a burst of
+// output does not hold up the kernel for its whole length.
+
+#ifndef KLOG_BATCH
+#define KLOG_BATCH 64
+#endif
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void klog_drain(void);
+static int klog_take(char * buf, int n);
+
+static int klog_open(struct io ** ioptr, void * aux);
+static int klog_cntl(struct io * io, int cmd, void * arg);
+static long klog_read(struct io * io, void * buf, long bufsz);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static char klog_ring[KLOG_SIZE];
+static uint64_t klog_head; // bytes appended
+static uint64_t klog_tail; // bytes drained or lost
+
+static struct condition klog_not_empty;
+static char klog_drain_waiting;
+
+static const struct iointf klog_intf = {
+    .cntl = &klog_cntl,
+    .read = &klog_read
+};
+
+static struct io klog_io;
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+char klog_async = 0;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void klog_attach(void) {
+    int tid;
+
+    ioinit0(&klog_io, &klog_intf);
+    register_device("klog", klog_open, NULL);
+
+    condition_init(&klog_not_empty, "klog");
+    tid = thread_spawn_prio(THREAD_NPRIO-1, "klog", &klog_drain);
+
+    if (0 <= tid)
+        klog_async = 1;
+}
+
+void klog_putc(char c) {
+    int pie;
+
+    pie = disable_interrupts();
+
+    if (klog_head - klog_tail == KLOG_SIZE)
+        klog_tail += 1; // drain is a whole log behind; lose the oldest
+
+    klog_ring[klog_head++ % KLOG_SIZE] = c;
+
+    if (klog_drain_waiting) {
+        klog_drain_waiting = 0;
+        condition_signal(&klog_not_empty);
+    }
+
+    restore_interrupts(pie);
+}
+
+void klog_sync(void) {
+    char buf[KLOG_BATCH];
+    int i, n;
+
+    disable_interrupts();
+    klog_async = 0;
+
+    while ((n = klog_take(buf, sizeof(buf))) != 0) {
+        for (i = 0; i < n; i++)
+            kputc_sync(buf[i]);
+    }
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void klog_drain(void) {
+    char buf[KLOG_BATCH];
+    int i, n;
+    int pie;
+
+    for (;;) {
+        pie = disable_interrupts();
+        while (klog_head == klog_tail) {
+            klog_drain_waiting = 1;
+            condition_wait(&klog_not_empty);
+        }
+        restore_interrupts(pie);
+
+        n = klog_take(buf, sizeof(buf));
+        for (i = 0; i < n; i++)
+            kputc_sync(buf[i]);
+
+        if (thread_preempt_pending())
+            thread_yield();
+    }
+}
+
+// Moves up to /n/ undrained bytes to /buf/ and returns how many it moved.
+
+int klog_take(char * buf, int n) {
+    int pie;
+    int i;
+
+    pie = disable_interrupts();
+
+    for (i = 0; i < n && klog_tail != klog_head; i++)
+        buf[i] = klog_ring[klog_tail++ % KLOG_SIZE];
+
+    restore_interrupts(pie);
+    return i;
+}
+
+int klog_open(struct io ** ioptr, void * aux) {
+    *ioptr = ioaddref(&klog_io);
+    return 0;
+}
+
+int klog_cntl(struct io * io, int cmd, void * arg) {
+    switch (cmd) {
+    case IOCTL_GETBLKSZ:
+        return 1;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+// Copies the most recent output that fits in _buf_, oldest first. The ring
+// keeps output after it has been drained, so this includes what the console
+// already shows.
+
+long klog_read(struct io * io, void * buf, long bufsz) {
+    uint64_t head, pos, n;
+    size_t off, len;
+    int pie;
+
+    if (bufsz < 0)
+        return -EINVAL;
+
+    pie = disable_interrupts();
+
+    head = klog_head;
+    n = bufsz;
+    if (KLOG_SIZE < n)
+        n = KLOG_SIZE;
+    if (head < n)
+        n = head;
+
+    // at most two spans, split where the ring wraps
+
+    pos = head - n;
+    off = pos % KLOG_SIZE;
+    len = (KLOG_SIZE - off < n) ? KLOG_SIZE - off : n;
+    memcpy(buf, klog_ring + off, len);
+    memcpy((char *)buf + len, klog_ring, n - len);
+
+    restore_interrupts(pie);
+    return n;
+}
@@ -0,0 +1,41 @@
+// klog.h - Kernel log buffer
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _KLOG_H_
+#define _KLOG_H_
+
+// Once klog_attach() has run, kputc() appends to an in-memory log instead of
+// writing to the console, and a low-priority thread drains the log to the
+// console. Appending never waits: when the drain falls a whole log behind,
+// the oldest unwritten output is lost. Until then, and again after
+// klog_sync(), output is written synchronously.
+
+#ifndef KLOG_SIZE
+#define KLOG_SIZE 16384 // bytes, power of two
+#endif
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+extern char klog_async; // kputc() appends to the log
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Starts the drain thread and registers the klog device ("klog", instance 0).
+// A read of the device returns as much of the most recent output as fits in
+// the buffer, oldest first, without consuming it.
+
+extern void klog_attach(void);
+
+extern void klog_putc(char c);
+
+// Writes out everything not yet drained and makes output synchronous again.
+// Called on panic, so the last words reach the console.
+
+extern void klog_sync(void);
+
+#endif // _KLOG_H_
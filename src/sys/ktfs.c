@@ -14,7 +14,88 @@
 
 #define MAX_OPEN_FILES 96UL
 
+// Longest run of physically contiguous data blocks ktfs_readat() will fetch
+// with a single device request (in blocks)
 
+#ifndef KTFS_EXTENT_MAX
+#define KTFS_EXTENT_MAX 128
+#endif
+
+// Sequential readahead. A file read sequentially starts with a window of
+// KTFS_RA_MIN blocks that doubles on each sequential read up to the file's
+// limit (KTFS_RA_MAX unless changed with IOCTL_SETRA). The window is kept
+// per open, so readers of the same file do not reset each other's. Prefetches
+// are queued to a kernel thread so the reader does not wait for them.
+
+#ifndef KTFS_RA_MIN
+#define KTFS_RA_MIN 4
+#endif
+
+#ifndef KTFS_RA_MAX
+#define KTFS_RA_MAX 64
+#endif
+
+#define KTFS_RA_QLEN 128 // prefetch queue length (power of two)
+
+// Number of in-core inodes. Each open file holds one, however many times it
+// is open, and the root directory holds one for as long as the file system
+// is mounted; the rest keep recently closed inodes around for the next open.
+
+#ifndef KTFS_NINODE
+#define KTFS_NINODE (MAX_OPEN_FILES + 32)
+#endif
+
+#define KTFS_IHASH 64 // in-core inode hash buckets (power of two)
+
+// Hash buckets of the directory index (power of two)
+
+#ifndef KTFS_DIR_NBUCKETS
+#define KTFS_DIR_NBUCKETS 128
+#endif
+
+#define KTFS_DENTS_PER_BLK (KTFS_BLKSZ / KTFS_DENSZ)
+#define KTFS_PTRS_PER_BLK (KTFS_BLKSZ / sizeof(uint32_t))
+
+#define KTFS_MAX_FILE_SIZE ((KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_PTRS_PER_BLK + \
+    KTFS_NUM_DINDIRECT_BLOCKS * KTFS_PTRS_PER_BLK * KTFS_PTRS_PER_BLK) * \
+    (unsigned long long)KTFS_BLKSZ)
+
+// Blocks reserved for a growing file at a time. A file that grows takes its
+// data blocks from a contiguous run reserved for it, so later reads of it can
+// use multi-block requests.
+
+#ifndef KTFS_RESV_BLKS
+#define KTFS_RESV_BLKS 16
+#endif
+
+// Metadata log. A file system without a log gets one of KTFS_LOG_NBLKS
+// blocks (header included) when it is first mounted. Records are committed
+// at least every KTFS_LOG_COMMIT_MS, or sooner if the log fills up.
+
+#ifndef KTFS_LOG_NBLKS
+#define KTFS_LOG_NBLKS 25
+#endif
+
+#ifndef KTFS_LOG_COMMIT_MS
+#define KTFS_LOG_COMMIT_MS 100
+#endif
+
+// Most blocks a create or delete changes, not counting bitmap blocks: two
+// directory blocks, two index blocks of the directory, the root inode block
+// and the file's inode block.
+
+#define KTFS_LOG_OPBLKS 6
+
+// Most runs of blocks freed by deletes that may wait for their record to
+// commit before they are discarded. A block freed when all are taken is
+// returned at once and not discarded.
+
+#ifndef KTFS_DISCARD_MAX
+#define KTFS_DISCARD_MAX 32
+#endif
+
+
+#include "conf.h"
 #include "heap.h"
 #include "fs.h"
 #include "ioimpl.h"
@@ -24,6 +105,9 @@
 #include "string.h"
 #include "console.h"
 #include "cache.h"
+#include "assert.h"
+#include "memory.h"
+#include "timer.h"
 
 // INTERNAL TYPE DEFINITIONS
 //
@@ -34,28 +118,177 @@ static struct cache * file_system_cache;
 
 struct master_ktfs {
     struct io io; // you can keep or remove
+    struct io * devio;           // backing device, for log writes
     struct ktfs_superblock superblock;
+    struct ktfs_log_super log_super;
     uint32_t bitmap_start_block; // block index in disk for the first bitmap block
     uint32_t inode_start_block;  // block index for the first inode block
     uint32_t data_start_block;   // block index for first data block
-    struct lock ktfs_lock;
+    uint64_t * blkmap;           // in-memory block bitmap (bit set if in use)
+    uint32_t blkmap_words;       // size of blkmap in 64-bit words
+    uint32_t blkmap_next;        // next-fit cursor (word index)
+    uint32_t free_blocks;        // clear bits in blkmap
+    uint64_t * inomap;           // inode bitmap (bit set if in use)
+    uint32_t inomap_words;
+    uint32_t inomap_next;
+    struct lock bitmap_lock;     // blkmap, inomap and their counters
+    char can_discard;            // devio supports IOCTL_DISCARD
+    char can_zero;               // devio supports IOCTL_WRZEROES
+    struct lock ktfs_lock;       // open_files and the in-core inode table
+    struct rwlock dir_lock;      // directory index, root directory and log
 };
 
 static struct master_ktfs * ktfs_master; 
 
+// Locks are taken in the order: inode lock, ktfs_lock, dir_lock, bitmap_lock.
+// Name lookups take dir_lock for reading; anything that changes the directory
+// or the log takes it for writing.
+// Data I/O only holds the lock of the file's inode, so reads and writes of
+// different files proceed concurrently.
+
+// In-core copy of an on-disk inode. Entries with a non-zero reference count
+// are in use; an entry whose count dropped to zero is clean and may be
+// reused for another inode. Inode changes are made to the in-core copy and
+// written back to the inode block with put_inode() when the last reference
+// is dropped or the file system is flushed.
+
+struct ktfs_incore_inode {
+    struct ktfs_incore_inode * hnext; // hash chain
+    struct ktfs_incore_inode * unext; // unused list
+    struct ktfs_incore_inode * uprev;
+    struct ktfs_file * file; // shared open file object, NULL if not open
+    unsigned long long version; // see IOCTL_GETID
+    uint16_t inum;
+    int refcnt;
+    int valid;
+    int dirty;
+    struct ktfs_inode inode;
+    struct lock lock; // file data, size and block map
+    uint32_t resv_next; // next reserved device block
+    uint32_t resv_end; // end of block reservation
+};
+
+static struct ktfs_incore_inode ktfs_itab[KTFS_NINODE];
+static struct ktfs_incore_inode * ktfs_ihash[KTFS_IHASH];
+static struct ktfs_incore_inode * ktfs_iunused_head;
+static struct ktfs_incore_inode * ktfs_iunused_tail;
+static struct ktfs_incore_inode * ktfs_root; // root directory, always held
+
+// Source of inode versions. An in-core inode takes a new one when it is read
+// in and whenever its file is written or grown, so a version names one state
+// of one file's contents and is never reused.
+
+static unsigned long long ktfs_last_version;
+
+
+
+// Copy of the last leaf index block (indirect block, or second level block
+// of a doubly-indirect block) used to map a file's blocks. Entry i maps file
+// block base+i.
+
+struct ktfs_bmap {
+    unsigned int base;
+    int valid;
+    uint32_t map[KTFS_PTRS_PER_BLK];
+};
 
+// File object shared by all open instances of a file. Its io only counts
+// the opens referring to it; I/O goes through the ktfs_fd of each open.
 
 struct ktfs_file {
     // Fill to fulfill spec
     struct io io;
+    struct ktfs_file * next_free; // free slot list
     struct ktfs_dir_entry ktfs_dir_entry;
     int in_use; // flag indicating if the file is currently open
+    struct ktfs_incore_inode * ip; // in-core inode, NULL if not open
     unsigned long long fsize;
     int flags; // file mode flags (write/read mode)
     unsigned long long offset; // current file offset for sequential reads/writes
+    struct ktfs_bmap bmap; // block map cache
+};
+
+// One open instance of a file, holding a reference to the shared file and
+// the readahead state of this open. Each open wraps it in its own seekable
+// io, which keeps that instance's position.
+
+struct ktfs_fd {
+    struct io io;
+    struct ktfs_file * file; // shared file object
+    unsigned long long ra_next; // position a sequential read would start at
+    unsigned int ra_window; // current readahead window (blocks)
+    unsigned int ra_max; // readahead limit (blocks), 0 if disabled
+    unsigned int ra_issued; // file blocks below this were already queued
 };
 
 static struct ktfs_file open_files[MAX_OPEN_FILES];
+static struct ktfs_file * ktfs_free_files;
+
+// Directory index. Every entry of the root directory has a node in a hash
+// table keyed by name, built at mount and kept up to date by create and
+// delete, so lookups never read the directory blocks.
+
+struct ktfs_dir_node {
+    struct ktfs_dir_node * next; // hash chain or free list
+    uint32_t idx; // position of the entry in the directory
+    uint16_t inode;
+    char name[KTFS_MAX_FILENAME_LEN+sizeof(uint8_t)];
+};
+
+static struct ktfs_dir_node * ktfs_dir_buckets[KTFS_DIR_NBUCKETS];
+static struct ktfs_dir_node * ktfs_dir_free;
+
+// Queue of device block positions for the readahead thread. Only threads
+// touch it and none blocks while updating it, so it needs no lock (see
+// thread.h).
+
+static struct {
+    unsigned long long pos[KTFS_RA_QLEN];
+    unsigned int head, tail;
+    struct condition not_empty;
+} ktfs_raq;
+
+// RAM disk the file system is mounted on, if any (see ktfs_mount_ramdisk())
+
+struct ktfs_ramdisk {
+    struct io io;               // endpoint the file system is mounted on
+    struct io * memio;          // memory I/O object over the image
+    struct io * devio;          // device the image was read from
+    void * image;               // copy of the whole device
+    unsigned long long size;    // bytes in the image
+    uint64_t * dirty;           // bit per block written since last sync
+    uint32_t nblks;             // blocks in the image
+    int writeback;              // write changed blocks to devio on flush
+};
+
+static struct ktfs_ramdisk * ktfs_ramdisk;
+
+// Metadata log state. Protected by dir_lock, which also serialises create
+// and delete. Blocks changed by the running operation are held in the cache
+// until the record holding them is committed.
+
+static struct {
+    uint32_t start;                     // header block, 0 if there is no log
+    uint32_t nblks;                     // blocks after the header
+    uint32_t opblks;                    // most blocks one operation changes
+    uint32_t seq;                       // sequence number of last record
+    uint32_t count;                     // blocks in the current record
+    int owner;                          // thread running an operation or -1
+    uint32_t blkno[KTFS_LOG_MAXBLKS];   // home block of each held block
+    void * blks[KTFS_LOG_MAXBLKS];      // held cache blocks
+    uint8_t * buf;                      // header and block copies
+} ktfs_log;
+
+// Runs of blocks freed by deletes, discarded once the record holding the
+// deletes is committed. Until then the blocks are free on disk but still
+// set in the in-memory bitmap, so they cannot be allocated and written
+// before the discard reaches the device. Protected by dir_lock.
+
+static struct {
+    uint32_t n;                         // runs queued
+    uint32_t start[KTFS_DISCARD_MAX];   // first device block of each run
+    uint32_t count[KTFS_DISCARD_MAX];   // blocks in each run
+} ktfs_discard;
 
 
 
@@ -63,6 +296,8 @@ static struct ktfs_file open_files[MAX_OPEN_FILES];
 //
 
 int ktfs_mount(struct io * io);
+int ktfs_mount_sized(struct io * io, unsigned long cache_capacity);
+int ktfs_mount_ramdisk(struct io * io, int writeback);
 
 int ktfs_open(const char * name, struct io ** ioptr);
 void ktfs_close(struct io* io);
@@ -80,16 +315,75 @@ int put_inode(uint16_t inode_num, const struct ktfs_inode *input_inode);
 
 int find_inode_by_name(const char * name, uint16_t * inode_num, int delete);
 
+static int ktfs_iget(uint16_t inum, struct ktfs_incore_inode ** ipptr);
+static int ktfs_iput(struct ktfs_incore_inode * ip);
+static int ktfs_isync(void);
+static void ktfs_iforget(uint16_t inum);
+static void ktfs_iunused_append(struct ktfs_incore_inode * ip);
+static void ktfs_detach(struct ktfs_file * file);
+static struct ktfs_incore_inode * ktfs_lock_file(struct ktfs_file * file);
+
+static unsigned int ktfs_dir_hash(const char * name);
+static struct ktfs_dir_node * ktfs_dir_lookup(const char * name);
+static int ktfs_dir_insert(const struct ktfs_dir_entry * dent, uint32_t idx);
+static void ktfs_dir_remove(struct ktfs_dir_node * node);
+static int ktfs_dir_get_block (
+    uint32_t idx, struct ktfs_dir_entry ** blkptr, uint32_t * gblkptr);
+static int ktfs_dir_build(void);
+
+int ktfs_get_data_block(struct ktfs_inode * inode, int file_block_index);
+int ktfs_map_block (
+    struct ktfs_inode * inode, unsigned int file_block_index,
+    struct ktfs_bmap * bmap);
+static int ktfs_file_block(struct ktfs_file * file, unsigned int file_block_index);
+static int ktfs_alloc_file_block(struct ktfs_incore_inode * ip, unsigned int b);
+static int ktfs_grow(struct ktfs_file * file, unsigned long long new_size);
+static void ktfs_reserve(struct ktfs_incore_inode * ip, uint32_t goal, uint32_t nblks);
+static void ktfs_unreserve(struct ktfs_incore_inode * ip);
+
+static int ktfs_load_bitmaps(void);
+
+static int ktfs_log_recover(void);
+static int ktfs_log_create(void);
+static int ktfs_log_begin(void);
+static int ktfs_log_end(void);
+static void ktfs_log_write(void * blk, uint32_t gblk);
+static int ktfs_log_commit(void);
+static void ktfs_log_func(void);
+
 int ktfs_create	(const char * name);
+static int ktfs_create_entry(const char * name);
 
 int ktfs_delete (const char * name);
+static int ktfs_free_file_blocks(const struct ktfs_inode * inode);
+static int ktfs_discard_block(uint32_t blkno);
+static void ktfs_discard_run(int discard);
 
 long ktfs_writeat(struct io* io, unsigned long long pos, const void * buf, long len);
+static long ktfs_sendto (
+    struct io * io, unsigned long long pos, struct io * sink, long len);
 
+static void ktfs_fd_close(struct io * io);
+static void ktfs_readahead (
+    struct ktfs_fd * fd, unsigned long long pos, long len);
+static void ktfs_readahead_func(void);
+
+static int ktfs_ramdisk_cntl(struct io * io, int cmd, void * arg);
+static long ktfs_ramdisk_readat (
+    struct io * io, unsigned long long pos, void * buf, long len);
+static long ktfs_ramdisk_writeat (
+    struct io * io, unsigned long long pos, const void * buf, long len);
+static int ktfs_ramdisk_sync(void);
+
+
+static const struct iointf ktfs_file_iointf = {
+    .close = &ktfs_close
+};
 
 static const struct iointf ktfs_iointf = {
-    .close = &ktfs_close,
+    .close = &ktfs_fd_close,
     .readat = &ktfs_readat,
+    .sendto = &ktfs_sendto,
     .cntl = &ktfs_cntl,
     .writeat = &ktfs_writeat
 };
@@ -100,6 +394,11 @@ static const struct iointf ktfs_iointf = {
 int fsmount(struct io * io)
     __attribute__ ((alias("ktfs_mount")));
 
+int fsmount_ramdisk(struct io * io, int writeback)
+    __attribute__ ((alias("ktfs_mount_ramdisk")));
+int fsmount_sized(struct io * io, unsigned long cache_capacity)
+    __attribute__ ((alias("ktfs_mount_sized")));
+
 int fsopen(const char * name, struct io ** ioptr)
     __attribute__ ((alias("ktfs_open")));
 
@@ -118,103 +417,197 @@ int fsdelete(const char * name)
 
 int find_inode_by_name(const char *name, uint16_t *inode_num, int delete)
 {
+    struct ktfs_dir_node * node;
+    struct ktfs_dir_node * last_node;
+    struct ktfs_dir_entry * blk;
+    struct ktfs_dir_entry * last_blk;
+    uint32_t last_idx;
+    uint32_t gblk, last_gblk;
+    int ret;
+
     if (!name || !inode_num)
         return -EINVAL;
 
-    /* ------------ 1. fetch root inode ---------------------------------- */
-    uint16_t root_ino = ktfs_master->superblock.root_directory_inode;
-    struct ktfs_inode root;
-    int ret = get_inode(root_ino, &root, 0);
-    if (ret < 0) return ret;
+    node = ktfs_dir_lookup(name);
 
-    const int dentries_per_blk = KTFS_BLKSZ / sizeof(struct ktfs_dir_entry);
-    int total = root.size / sizeof(struct ktfs_dir_entry);
-
-    int global_idx = 0;
-    // uint32_t found_phys = 0;
-    int      found_slot = -1;
-    struct ktfs_dir_entry *found_blk = NULL;
-
-    /* ------------ 2. scan direct blocks for NAME ----------------------- */
-    for (int bi = 0; bi < KTFS_NUM_DIRECT_DATA_BLOCKS && global_idx < total; ++bi) {
-        uint32_t blkno = root.block[bi];
-
-        uint32_t phys = (blkno + ktfs_master->data_start_block) * KTFS_BLKSZ;
-        struct ktfs_dir_entry *blk_ptr;
-        ret = cache_get_block(file_system_cache, phys, (void**)&blk_ptr);
-        if (ret < 0) return ret;
-
-        for (int ei = 0; ei < dentries_per_blk && global_idx < total; ++ei, ++global_idx) {
-            if (strcmp(name, blk_ptr[ei].name) == 0) {
-                *inode_num  = blk_ptr[ei].inode;
-                // found_phys  = phys;
-                found_slot  = ei;
-                found_blk   = blk_ptr;           /* keep pinned */
-                goto after_scan;
-            }
-        }
-        cache_release_block(file_system_cache, blk_ptr, 0);
-    }
-    return -ENOENT;                               /* not found */
+    if (node == NULL)
+        return -ENOENT;
 
-after_scan:
+    *inode_num = node->inode;
 
-    /* ------------ 3. lookup only? ------------------------------------- */
-    if (!delete) {
-        cache_release_block(file_system_cache, found_blk, 0);
+    if (!delete)
         return 0;
+
+    // Move the last entry into the slot of the deleted one so the directory
+    // stays dense, and update its index node to match.
+
+    last_idx = ktfs_root->inode.size / sizeof(struct ktfs_dir_entry) - 1;
+
+    ret = ktfs_dir_get_block(node->idx, &blk, &gblk);
+    if (ret < 0)
+        return ret;
+
+    ret = ktfs_dir_get_block(last_idx, &last_blk, &last_gblk);
+    if (ret < 0) {
+        cache_release_block(file_system_cache, blk, 0);
+        return ret;
+    }
+
+    if (node->idx != last_idx) {
+        blk[node->idx % KTFS_DENTS_PER_BLK] =
+            last_blk[last_idx % KTFS_DENTS_PER_BLK];
+
+        last_node = ktfs_dir_lookup(last_blk[last_idx % KTFS_DENTS_PER_BLK].name);
+        if (last_node != NULL)
+            last_node->idx = node->idx;
+    }
+
+    memset(&last_blk[last_idx % KTFS_DENTS_PER_BLK], 0,
+        sizeof(struct ktfs_dir_entry));
+
+    // Both pointers may be the same block, which was then pinned twice
+
+    ktfs_log_write(blk, gblk);
+    ktfs_log_write(last_blk, last_gblk);
+
+    cache_release_block(file_system_cache, last_blk, 1);
+    cache_release_block(file_system_cache, blk, 1);
+
+    ktfs_dir_remove(node);
+
+    // Root inode is written back at the end of the operation
+
+    ktfs_root->inode.size -= sizeof(struct ktfs_dir_entry);
+    ktfs_root->dirty = 1;
+
+    return 0;
+}
+
+// Hashes a file name for the directory index (FNV-1a).
+
+unsigned int ktfs_dir_hash(const char * name)
+{
+    unsigned int h = 2166136261U;
+
+    while (*name != '\0') {
+        h ^= (unsigned char)*name++;
+        h *= 16777619U;
+    }
+
+    return h & (KTFS_DIR_NBUCKETS - 1);
+}
+
+// Returns the index node for /name/, or NULL if there is no such entry.
+
+struct ktfs_dir_node * ktfs_dir_lookup(const char * name)
+{
+    struct ktfs_dir_node * node;
+
+    for (node = ktfs_dir_buckets[ktfs_dir_hash(name)]; node; node = node->next)
+        if (strcmp(node->name, name) == 0)
+            return node;
+
+    return NULL;
+}
+
+// Adds directory entry /dent/, found at position /idx/ of the directory, to
+// the index. Index nodes are carved out of whole pages, since they are small
+// and the directory may hold many of them.
+
+int ktfs_dir_insert(const struct ktfs_dir_entry * dent, uint32_t idx)
+{
+    struct ktfs_dir_node * node;
+    unsigned int h;
+    int i;
+
+    if (ktfs_dir_free == NULL) {
+        node = alloc_phys_page();
+        if (node == NULL)
+            return -ENOMEM;
+
+        for (i = 0; i < PAGE_SIZE / sizeof(struct ktfs_dir_node); i++) {
+            node[i].next = ktfs_dir_free;
+            ktfs_dir_free = &node[i];
+        }
     }
 
-    /* ------------ 4. identify last dentry ----------------------------- */
-    int last_idx   = total - 1;                   /* index BEFORE shrink      */
-    int last_blk_i = last_idx / dentries_per_blk;
-    int last_slot  = last_idx % dentries_per_blk;
-    uint32_t last_blkno = root.block[last_blk_i];
+    node = ktfs_dir_free;
+    ktfs_dir_free = node->next;
+
+    memset(node->name, 0, sizeof(node->name));
+    strncpy(node->name, dent->name, KTFS_MAX_FILENAME_LEN);
+    node->inode = dent->inode;
+    node->idx = idx;
+
+    h = ktfs_dir_hash(node->name);
+    node->next = ktfs_dir_buckets[h];
+    ktfs_dir_buckets[h] = node;
+    return 0;
+}
+
+void ktfs_dir_remove(struct ktfs_dir_node * node)
+{
+    struct ktfs_dir_node ** linkptr;
+
+    linkptr = &ktfs_dir_buckets[ktfs_dir_hash(node->name)];
+
+    while (*linkptr != node)
+        linkptr = &(*linkptr)->next;
+
+    *linkptr = node->next;
+    node->next = ktfs_dir_free;
+    ktfs_dir_free = node;
+}
+
+// Gets the (pinned) directory block holding entry /idx/ of the root
+// directory. Its device block number is returned in /*gblkptr/ if /gblkptr/
+// is not NULL.
+
+int ktfs_dir_get_block (
+    uint32_t idx, struct ktfs_dir_entry ** blkptr, uint32_t * gblkptr)
+{
+    int blkno;
+
+    blkno = ktfs_get_data_block(&ktfs_root->inode, idx / KTFS_DENTS_PER_BLK);
+    if (blkno < 0)
+        return -EIO;
 
-    struct ktfs_dir_entry *last_blk;
-    ret = cache_get_block(file_system_cache, (last_blkno + ktfs_master->data_start_block) * KTFS_BLKSZ, (void**)&last_blk);
-    if (ret < 0) { cache_release_block(file_system_cache, found_blk, 0); return ret; }
+    if (gblkptr != NULL)
+        *gblkptr = blkno + ktfs_master->data_start_block;
 
-    /* ------------ 5. swap‑with‑last (if needed) ----------------------- */
-    if (last_idx != global_idx)
-        found_blk[found_slot] = last_blk[last_slot];
+    return cache_get_block(file_system_cache,
+        (blkno + ktfs_master->data_start_block) * (unsigned long long)KTFS_BLKSZ,
+        (void**)blkptr);
+}
 
-    memset(&last_blk[last_slot], 0, sizeof(struct ktfs_dir_entry));
+// Reads the root directory into the index. Called once at mount.
 
-    /* mark dirty + release (avoid double free) */
-    cache_release_block(file_system_cache, found_blk, 1);
-    if (last_blk != found_blk)
-        cache_release_block(file_system_cache, last_blk, 1);
+int ktfs_dir_build(void)
+{
+    struct ktfs_dir_entry * blk;
+    uint32_t total, idx;
+    int ret = 0;
 
-    /* ------------ 6. shrink root.dir size ----------------------------- */
-    root.size -= sizeof(struct ktfs_dir_entry);
+    total = ktfs_root->inode.size / sizeof(struct ktfs_dir_entry);
 
-    /* ------------ 7. if last block became empty, free it -------------- */
-    // if (root.size % KTFS_BLKSZ == 0) {
-    //     int freed_idx = root.size / KTFS_BLKSZ;       /* new #data blocks   */
-    //     if (freed_idx < KTFS_NUM_DIRECT_DATA_BLOCKS && root.block[freed_idx]) {
-    //         uint32_t blkno = root.block[freed_idx];   /* data‑region index */
-    //         /* clear bitmap bit ------------------------------------------------ */
-    //         uint32_t bmap_block   = blkno / (KTFS_BLKSZ * 8);
-    //         int      bit_in_block = blkno % (KTFS_BLKSZ * 8);
-    //         int      byte_idx     = bit_in_block / 8;
-    //         int      bit_ofs      = bit_in_block % 8;
+    for (idx = 0; idx < total; idx += KTFS_DENTS_PER_BLK) {
+        ret = ktfs_dir_get_block(idx, &blk, NULL);
+        if (ret < 0)
+            return ret;
 
-    //         uint8_t *bmp_ptr;
-    //         ret = cache_get_block(file_system_cache,
-    //                 (ktfs_master->bitmap_start_block + bmap_block) * KTFS_BLKSZ,
-    //                 (void**)&bmp_ptr);
-    //         if (ret < 0) return ret;
+        for (int i = 0; i < KTFS_DENTS_PER_BLK && idx + i < total; i++) {
+            ret = ktfs_dir_insert(&blk[i], idx + i);
+            if (ret < 0)
+                break;
+        }
 
-    //         bmp_ptr[byte_idx] &= ~(1 << bit_ofs);     /* clear bit */
-    //         cache_release_block(file_system_cache, bmp_ptr, 1);
+        cache_release_block(file_system_cache, blk, 0);
 
-    //         root.block[freed_idx] = 0;                 /* clear ptr */
-    //     }
-    // }
+        if (ret < 0)
+            return ret;
+    }
 
-    /* ------------ 8. persist root inode ------------------------------- */
-    return put_inode(root_ino, &root);
+    return 0;
 }
 
 int get_inode(uint16_t inode_num, struct ktfs_inode * output_inode, int delete){
@@ -247,6 +640,7 @@ int get_inode(uint16_t inode_num, struct ktfs_inode * output_inode, int delete){
 
     if(delete){
         memset(on_disk_inode, 0, sizeof(struct ktfs_inode));
+        ktfs_log_write(inode_ref, block_num);
     }
 
     cache_release_block(file_system_cache, inode_ref, delete);
@@ -285,6 +679,7 @@ int put_inode(uint16_t inode_num, const struct ktfs_inode *input_inode)
 
     // Copy our in-memory inode data out to disk
     memcpy(on_disk_inode, input_inode, sizeof(struct ktfs_inode));
+    ktfs_log_write(inode_ref, block_num);
 
     // Release the block, marking it dirty so it is written back
     cache_release_block(file_system_cache, inode_ref, 1);
@@ -292,9 +687,197 @@ int put_inode(uint16_t inode_num, const struct ktfs_inode *input_inode)
     return 0;
 }
 
+// In-core inodes with no references are kept on the unused list, least
+// recently used first, and are recycled from its head.
+
+static void ktfs_iunused_append(struct ktfs_incore_inode * ip)
+{
+    ip->unext = NULL;
+    ip->uprev = ktfs_iunused_tail;
+
+    if (ktfs_iunused_tail != NULL)
+        ktfs_iunused_tail->unext = ip;
+    else
+        ktfs_iunused_head = ip;
+
+    ktfs_iunused_tail = ip;
+}
+
+static void ktfs_iunused_remove(struct ktfs_incore_inode * ip)
+{
+    if (ip->uprev != NULL)
+        ip->uprev->unext = ip->unext;
+    else
+        ktfs_iunused_head = ip->unext;
+
+    if (ip->unext != NULL)
+        ip->unext->uprev = ip->uprev;
+    else
+        ktfs_iunused_tail = ip->uprev;
+
+    ip->unext = ip->uprev = NULL;
+}
+
+static void ktfs_ihash_remove(struct ktfs_incore_inode * ip)
+{
+    struct ktfs_incore_inode ** linkptr;
+
+    linkptr = &ktfs_ihash[ip->inum % KTFS_IHASH];
+
+    while (*linkptr != ip)
+        linkptr = &(*linkptr)->hnext;
+
+    *linkptr = ip->hnext;
+    ip->hnext = NULL;
+}
+
+static struct ktfs_incore_inode * ktfs_ihash_lookup(uint16_t inum)
+{
+    struct ktfs_incore_inode * ip;
+
+    for (ip = ktfs_ihash[inum % KTFS_IHASH]; ip != NULL; ip = ip->hnext)
+        if (ip->inum == inum)
+            return ip;
+
+    return NULL;
+}
+
+// Returns a referenced in-core copy of inode /inum/ in /*ipptr/, reading it
+// from the inode block if it is not already in the table. Caller holds
+// ktfs_lock.
+
+int ktfs_iget(uint16_t inum, struct ktfs_incore_inode ** ipptr)
+{
+    struct ktfs_incore_inode * ip;
+    int ret;
+
+    ip = ktfs_ihash_lookup(inum);
+
+    if (ip != NULL) {
+        if (ip->refcnt++ == 0)
+            ktfs_iunused_remove(ip);
+        *ipptr = ip;
+        return 0;
+    }
+
+    ip = ktfs_iunused_head;
+
+    if (ip == NULL)
+        return -EMFILE;
+
+    ktfs_iunused_remove(ip);
+
+    if (ip->valid) {
+        ktfs_ihash_remove(ip);
+        ip->valid = 0;
+    }
+
+    ret = get_inode(inum, &ip->inode, 0);
+    if (ret < 0) {
+        ktfs_iunused_append(ip);
+        return ret;
+    }
+
+    ip->inum = inum;
+    lock_init(&ip->lock);
+    ip->resv_next = ip->resv_end = 0;
+    ip->file = NULL;
+    ip->version = __atomic_add_fetch(&ktfs_last_version, 1, __ATOMIC_RELAXED);
+    ip->refcnt = 1;
+    ip->valid = 1;
+    ip->dirty = 0;
+
+    ip->hnext = ktfs_ihash[inum % KTFS_IHASH];
+    ktfs_ihash[inum % KTFS_IHASH] = ip;
+
+    *ipptr = ip;
+    return 0;
+}
+
+// Drops a reference to /ip/, writing the inode back if this was the last
+// reference and it was modified. Caller holds ktfs_lock.
+
+int ktfs_iput(struct ktfs_incore_inode * ip)
+{
+    int ret;
+
+    assert (0 < ip->refcnt);
+
+    if (--ip->refcnt != 0)
+        return 0;
+
+    ktfs_unreserve(ip);
+
+    if (ip->dirty) {
+        ret = put_inode(ip->inum, &ip->inode);
+        if (ret < 0) {
+            // Keep the in-core copy so a later flush can retry
+            ip->refcnt = 1;
+            return ret;
+        }
+
+        ip->dirty = 0;
+    }
+
+    ktfs_iunused_append(ip);
+    return 0;
+}
+
+// Writes back every modified in-core inode. Caller holds ktfs_lock.
+
+int ktfs_isync(void)
+{
+    int i, ret, result = 0;
+
+    for (i = 0; i < KTFS_NINODE; i++) {
+        if (!ktfs_itab[i].valid || !ktfs_itab[i].dirty)
+            continue;
+
+        ret = put_inode(ktfs_itab[i].inum, &ktfs_itab[i].inode);
+        if (ret < 0)
+            result = ret;
+        else
+            ktfs_itab[i].dirty = 0;
+    }
+
+    return result;
+}
+
+// Drops the cached copy of a deleted inode. Its open files have already been
+// closed, so any reference left is from a failed write-back. Caller holds
+// ktfs_lock.
+
+void ktfs_iforget(uint16_t inum)
+{
+    struct ktfs_incore_inode * ip;
+
+    ip = ktfs_ihash_lookup(inum);
+
+    if (ip == NULL)
+        return;
+
+    ktfs_ihash_remove(ip);
+
+    if (ip->refcnt != 0) {
+        ip->refcnt = 0;
+        ktfs_iunused_append(ip);
+    }
+
+    ip->valid = 0;
+    ip->dirty = 0;
+}
+
 
 
 int ktfs_mount(struct io * io)
+{
+    return ktfs_mount_sized(io, CACHE_CAPACITY);
+}
+
+// Same as ktfs_mount, but the block cache holds /cache_capacity/ blocks
+// instead of the compile-time default.
+
+int ktfs_mount_sized(struct io * io, unsigned long cache_capacity)
 {
     if (io == NULL) {
         return -EINVAL;
@@ -302,7 +885,7 @@ int ktfs_mount(struct io * io)
 
     // ioinit1(io, &ktfs_iointf);
 
-    int result = create_cache(io, &file_system_cache);
+    int result = create_cache(io, cache_capacity, 0, &file_system_cache);
     // return the error code if applicable
     if (result < 0) {
         return result;
@@ -315,6 +898,13 @@ int ktfs_mount(struct io * io)
     }
 
     ktfs_master->io = *io;
+    ktfs_master->devio = io;
+
+    // A zero-length range only asks whether the device has the command
+
+    struct ioextent probe = { 0, 0 };
+    ktfs_master->can_discard = (ioctl(io, IOCTL_DISCARD, &probe) == 0);
+    ktfs_master->can_zero = (ioctl(io, IOCTL_WRZEROES, &probe) == 0);
 
     struct ktfs_superblock *sbptr = NULL;
     result = cache_get_block(file_system_cache, 0ULL, (void**)&sbptr);
@@ -324,6 +914,8 @@ int ktfs_mount(struct io * io)
     }
 
     memcpy(&ktfs_master->superblock, sbptr, sizeof(struct ktfs_superblock));
+    memcpy(&ktfs_master->log_super, (void*)sbptr + sizeof(struct ktfs_superblock),
+        sizeof(struct ktfs_log_super));
 
     cache_release_block(file_system_cache, sbptr, 0);
 
@@ -342,65 +934,276 @@ int ktfs_mount(struct io * io)
     ktfs_master->data_start_block = 1 + B + N;
 
     lock_init(&ktfs_master->ktfs_lock);
+    rwlock_init(&ktfs_master->dir_lock);
+    lock_init(&ktfs_master->bitmap_lock);
 
-    return 0;
-}
+    // Finish the operations of the last committed record before anything
+    // reads metadata
 
-int ktfs_open(const char * name, struct io ** ioptr)
-{
-    if (name == NULL || ioptr == NULL) {
-        return -EINVAL;
+    ktfs_log.owner = -1;
+
+    result = ktfs_log_recover();
+    if (result < 0) {
+        return result;
     }
 
-    lock_acquire(&ktfs_master->ktfs_lock);
+    for (int i = MAX_OPEN_FILES - 1; 0 <= i; i--) {
+        open_files[i].next_free = ktfs_free_files;
+        ktfs_free_files = &open_files[i];
+    }
 
+    for (int i = 0; i < KTFS_NINODE; i++)
+        ktfs_iunused_append(&ktfs_itab[i]);
 
-    for(int i = 0; i < MAX_OPEN_FILES; i++){
-        if(open_files[i].in_use == 1){
-            if(strcmp(open_files[i].ktfs_dir_entry.name, name) == 0){
-                lock_release(&ktfs_master->ktfs_lock);
-                return -EBUSY;
-            }
-        }
+    result = ktfs_iget(ktfs_master->superblock.root_directory_inode, &ktfs_root);
+    if (result < 0) {
+        return result;
     }
 
-    int empty_index = -1;
-
-    for(int i = 0; i < MAX_OPEN_FILES; i++){
-        if(open_files[i].in_use == 0){
-            empty_index = i;
-            break;
-        }
+    result = ktfs_dir_build();
+    if (result < 0) {
+        return result;
     }
 
-    if(empty_index < 0){
-        lock_release(&ktfs_master->ktfs_lock);
-        return -EMFILE;
+    result = ktfs_load_bitmaps();
+    if (result < 0) {
+        return result;
     }
 
-    int ret;
-    uint16_t inode_num;
+    // Held blocks stay pinned until their record commits, so the cache must
+    // have room for a full record besides them. The log must also fit more
+    // than one operation. A log is only created if it would be used, so its
+    // blocks are not taken for nothing. One of them holds the record header.
 
-    ret = find_inode_by_name(name, &inode_num, 0);
+    if (cache_capacity == 0)
+        cache_capacity = CACHE_CAPACITY;
 
-    if(ret < 0){
-        lock_release(&ktfs_master->ktfs_lock);
-        return ret;
+    ktfs_log.opblks = KTFS_LOG_OPBLKS + B;
+
+    if (ktfs_log.start == 0 &&
+        2 * ktfs_log.opblks <= KTFS_LOG_NBLKS - 1 &&
+        2 * (KTFS_LOG_NBLKS - 1) <= cache_capacity)
+    {
+        result = ktfs_log_create();
+        if (result < 0) {
+            return result;
+        }
     }
 
-    struct ktfs_inode inode;
+    if (ktfs_log.start != 0 && (ktfs_log.nblks < 2 * ktfs_log.opblks ||
+        cache_capacity < 2 * ktfs_log.nblks))
+    {
+        debug("ktfs: metadata log disabled");
+        ktfs_log.start = 0;
+    }
 
+    if (ktfs_log.start != 0)
+        thread_spawn("ktfs_log", &ktfs_log_func);
 
-    ret = get_inode(inode_num, &inode, 0);
+    condition_init(&ktfs_raq.not_empty, "ktfs_raq");
+    thread_spawn("ktfs_readahead", &ktfs_readahead_func);
 
-    
+    return 0;
+}
+
+// Mounts the file system from an in-memory copy of device /io/. The whole
+// device is read into contiguous pages with one request and the file system
+// then runs on a memory I/O object over them, so file access never waits
+// for the device. If /writeback/ is non-zero, ktfs_flush() writes the blocks
+// changed since the last flush back to the device, as runs of consecutive
+// blocks; otherwise changes are lost at shutdown.
+
+int ktfs_mount_ramdisk(struct io * io, int writeback)
+{
+    static const struct iointf ktfs_ramdisk_iointf = {
+        .cntl = &ktfs_ramdisk_cntl,
+        .readat = &ktfs_ramdisk_readat,
+        .writeat = &ktfs_ramdisk_writeat
+    };
+
+    struct ktfs_ramdisk * rd;
+    unsigned long long size;
+    long rcnt;
+    int result;
+
+    if (io == NULL)
+        return -EINVAL;
+
+    result = ioctl(io, IOCTL_GETEND, &size);
+    if (result < 0)
+        return result;
+
+    if (size == 0 || size % KTFS_BLKSZ != 0)
+        return -EINVAL;
+
+    rd = kcalloc(1, sizeof(struct ktfs_ramdisk));
+    if (rd == NULL)
+        return -ENOMEM;
+
+    rd->devio = io;
+    rd->size = size;
+    rd->nblks = size / KTFS_BLKSZ;
+    rd->writeback = writeback;
+
+    rd->image = alloc_phys_pages(ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE);
+    rd->dirty = alloc_phys_pages (
+        ROUND_UP((rd->nblks + 63) / 64 * 8, PAGE_SIZE) / PAGE_SIZE);
+
+    if (rd->image == NULL || rd->dirty == NULL)
+        return -ENOMEM;
+
+    memset(rd->dirty, 0, (rd->nblks + 63) / 64 * 8);
+
+    rcnt = ioreadat(io, 0, rd->image, size);
+    if (rcnt < 0)
+        return rcnt;
+    if (rcnt != size)
+        return -EIO;
+
+    rd->memio = create_memory_io(rd->image, size);
+    if (rd->memio == NULL)
+        return -ENOMEM;
+
+    ktfs_ramdisk = rd;
+
+    return ktfs_mount(ioinit1(&rd->io, &ktfs_ramdisk_iointf));
+}
+
+int ktfs_ramdisk_cntl(struct io * io, int cmd, void * arg)
+{
+    return ioctl(ktfs_ramdisk->memio, cmd, arg);
+}
+
+long ktfs_ramdisk_readat (
+    struct io * io, unsigned long long pos, void * buf, long len)
+{
+    return ioreadat(ktfs_ramdisk->memio, pos, buf, len);
+}
+
+long ktfs_ramdisk_writeat (
+    struct io * io, unsigned long long pos, const void * buf, long len)
+{
+    struct ktfs_ramdisk * const rd = ktfs_ramdisk;
+    unsigned long long blk;
+    long wcnt;
+
+    wcnt = iowriteat(rd->memio, pos, buf, len);
+
+    if (rd->writeback && 0 < wcnt) {
+        for (blk = pos / KTFS_BLKSZ; blk * KTFS_BLKSZ < pos + wcnt; blk++)
+            rd->dirty[blk / 64] |= 1ULL << (blk % 64);
+    }
+
+    return wcnt;
+}
+
+// Writes the blocks of the RAM disk changed since the last sync back to its
+// device, one request per run of consecutive changed blocks.
+
+int ktfs_ramdisk_sync(void)
+{
+    struct ktfs_ramdisk * const rd = ktfs_ramdisk;
+    uint32_t blk, end;
+    long wcnt;
+
+    for (blk = 0; blk < rd->nblks; blk = end) {
+        // Skip clean words quickly
+
+        if (blk % 64 == 0 && rd->dirty[blk / 64] == 0) {
+            end = blk + 64;
+            continue;
+        }
+
+        end = blk + 1;
+
+        if (!(rd->dirty[blk / 64] & (1ULL << (blk % 64))))
+            continue;
+
+        while (end < rd->nblks && (rd->dirty[end / 64] & (1ULL << (end % 64))))
+            end++;
+
+        wcnt = iowriteat(rd->devio, blk * (unsigned long long)KTFS_BLKSZ,
+            rd->image + blk * (unsigned long long)KTFS_BLKSZ,
+            (end - blk) * KTFS_BLKSZ);
+        if (wcnt < 0)
+            return wcnt;
+
+        for (; blk < end; blk++)
+            rd->dirty[blk / 64] &= ~(1ULL << (blk % 64));
+    }
+
+    return 0;
+}
+
+int ktfs_open(const char * name, struct io ** ioptr)
+{
+    if (name == NULL || ioptr == NULL) {
+        return -EINVAL;
+    }
+
+    lock_acquire(&ktfs_master->ktfs_lock);
+
+    int ret;
+    uint16_t inode_num;
+
+    rwlock_read_acquire(&ktfs_master->dir_lock);
+    ret = find_inode_by_name(name, &inode_num, 0);
+    rwlock_read_release(&ktfs_master->dir_lock);
+
+    if(ret < 0){
+        lock_release(&ktfs_master->ktfs_lock);
+        return ret;
+    }
+
+    struct ktfs_incore_inode * ip;
+
+
+    ret = ktfs_iget(inode_num, &ip);
+
+    
     if(ret < 0){
         lock_release(&ktfs_master->ktfs_lock);
         return ret;
     }
 
+    struct ktfs_fd * const fd = kcalloc(1, sizeof(struct ktfs_fd));
+
+    if (fd == NULL) {
+        ktfs_iput(ip);
+        lock_release(&ktfs_master->ktfs_lock);
+        return -ENOMEM;
+    }
+
+    fd->ra_max = KTFS_RA_MAX;
+    ioinit1(&fd->io, &ktfs_iointf);
+
+    // Every open of a file shares one file object, so they all see the
+    // same size. The object holds a single inode reference.
+
+    if(ip->file != NULL){
+        struct ktfs_file * const file = ip->file;
+
+        ktfs_iput(ip);
+
+        fd->file = file;
+        ioaddref(&file->io);
+        *ioptr = create_seekable_io(&fd->io);
+
+        lock_release(&ktfs_master->ktfs_lock);
+
+        return 0;
+    }
+
+    struct ktfs_file * file_to_open = ktfs_free_files;
+
+    if(file_to_open == NULL){
+        kfree(fd);
+        ktfs_iput(ip);
+        lock_release(&ktfs_master->ktfs_lock);
+        return -EMFILE;
+    }
 
-    struct ktfs_file * file_to_open = &open_files[empty_index];
+    ktfs_free_files = file_to_open->next_free;
 
     memset(file_to_open, 0, sizeof(struct ktfs_file));
 
@@ -412,13 +1215,18 @@ int ktfs_open(const char * name, struct io ** ioptr)
 
     file_to_open->offset = 0ULL;
 
-    file_to_open->fsize = inode.size;
+    file_to_open->ip = ip;
+
+    ip->file = file_to_open;
 
-    file_to_open->flags = inode.flags;
+    file_to_open->fsize = ip->inode.size;
 
-    ioinit1(&file_to_open->io, &ktfs_iointf);
+    file_to_open->flags = ip->inode.flags;
 
-    *ioptr = create_seekable_io(&file_to_open->io);
+    ioinit1(&file_to_open->io, &ktfs_file_iointf);
+
+    fd->file = file_to_open;
+    *ioptr = create_seekable_io(&fd->io);
 
     lock_release(&ktfs_master->ktfs_lock);
 
@@ -426,6 +1234,8 @@ int ktfs_open(const char * name, struct io ** ioptr)
     return 0;
 }
 
+// Called when the last open instance of the file is closed.
+
 void ktfs_close(struct io* io)
 {
     if(io == NULL){
@@ -434,141 +1244,207 @@ void ktfs_close(struct io* io)
     
     struct ktfs_file * const file = (void*)io - offsetof(struct ktfs_file, io);
 
-    file->in_use = 0;
+    // ktfs_delete() may have detached the file already
+
+    ktfs_detach(file);
+
+    lock_acquire(&ktfs_master->ktfs_lock);
+
+    file->next_free = ktfs_free_files;
+    ktfs_free_files = file;
+
+    lock_release(&ktfs_master->ktfs_lock);
 
     return;
 }
 
-int ktfs_get_data_block(struct ktfs_inode * inode, int file_block_index){
-    if (file_block_index < KTFS_NUM_DIRECT_DATA_BLOCKS) {
-        return inode->block[file_block_index];
-    }
-    if(file_block_index < 128 + KTFS_NUM_DIRECT_DATA_BLOCKS){
-        uint32_t *ind_array;
-        int ret = cache_get_block(file_system_cache, (inode->indirect + ktfs_master->data_start_block) * KTFS_BLKSZ, (void **)&ind_array);
-        if (ret < 0) {
-            // handle error: maybe return 0 or store the error in a global?
-            return -1;
-        }
+// Called when an open instance is closed. Drops its reference to the shared
+// file object, which is closed with the last one.
+
+static void ktfs_fd_close(struct io * io)
+{
+    struct ktfs_fd * const fd = (void*)io - offsetof(struct ktfs_fd, io);
+
+    ioclose(&fd->file->io);
+    kfree(fd);
+}
 
-        // find the pointer
-        uint32_t blocknum = ind_array[file_block_index - KTFS_NUM_DIRECT_DATA_BLOCKS];
+// Drops the file object's inode reference. Later I/O through the file fails.
+// The slot itself is freed by ktfs_close() once nothing refers to it.
 
-        cache_release_block(file_system_cache, ind_array, 0);
+static void ktfs_detach(struct ktfs_file * file)
+{
+    struct ktfs_incore_inode * const ip = ktfs_lock_file(file);
 
-        return blocknum;
+    if (ip == NULL) {
+        return;
     }
 
+    lock_acquire(&ktfs_master->ktfs_lock);
 
-    // Each double-indirect covers 128*128 blocks
-    int blocks_in_dind = 128 * 128;
+    file->ip = NULL;
+    file->in_use = 0;
+    ip->file = NULL;
+    lock_release(&ip->lock);
+    ktfs_iput(ip);
 
-    if (file_block_index < blocks_in_dind + 131) { // there are 128 indirect blocks and 3 direct blocks
-        uint32_t dind_block_num = inode->dindirect[0];
-        if (dind_block_num == 0) {
-            // not allocated => read is out of range => return 0
-            return -1;
-        }
+    lock_release(&ktfs_master->ktfs_lock);
+}
 
-        int index_in_dind = file_block_index - (KTFS_NUM_DIRECT_DATA_BLOCKS + 128);
+// Locks the inode of open file /file/ and returns it, or returns NULL if
+// the file was detached, perhaps while we waited for the lock.
 
-        int top_index = index_in_dind / 128;
+static struct ktfs_incore_inode * ktfs_lock_file(struct ktfs_file * file)
+{
+    struct ktfs_incore_inode * ip;
 
-        int bottom_index = index_in_dind % 128;
+    while ((ip = file->ip) != NULL) {
+        lock_acquire(&ip->lock);
 
-        // read the double-indirect block
-        uint32_t *dind_array;
-        int ret = cache_get_block(file_system_cache, (dind_block_num + ktfs_master->data_start_block) * KTFS_BLKSZ,
-                                    (void **)&dind_array);
-        if (ret < 0) {
-            // handle error
-            return -1;
-        }
+        if (file->ip == ip)
+            return ip;
 
-        uint32_t second_level_block = dind_array[top_index];
-        cache_release_block(file_system_cache, dind_array, 0);
+        lock_release(&ip->lock);
+    }
 
-        if (second_level_block == 0) {
-            return -1;  // not allocated
-        }
+    return NULL;
+}
 
-        uint32_t *second_level_array;
-        ret = cache_get_block(file_system_cache, (second_level_block + ktfs_master->data_start_block) * KTFS_BLKSZ, (void **)&second_level_array);
-        if (ret < 0) {
-            return -1;
-        }
+// Maps file block /file_block_index/ of /inode/ to a data block index, or
+// returns -1 if it is beyond the inode's reach or an index block on the way
+// is not allocated. If /bmap/ is not NULL, the last index block read is kept
+// there, so the next 127 lookups in the same index block need no cache
+// access at all.
 
-        uint32_t real_block = second_level_array[bottom_index];
-        cache_release_block(file_system_cache, second_level_array, 0);
+int ktfs_map_block (
+    struct ktfs_inode * inode, unsigned int file_block_index,
+    struct ktfs_bmap * bmap)
+{
+    unsigned int b = file_block_index;
+    unsigned int depth, idx;
+    uint32_t blkno, * ind;
+    int i, ret;
+
+    // Blocks mapped by the inode itself, by its indirect block and by each
+    // of its doubly-indirect blocks, in file order.
+
+    static const struct {
+        unsigned int count;
+        unsigned int depth;
+    } levels[] = {
+        { KTFS_NUM_DIRECT_DATA_BLOCKS, 0 },
+        { KTFS_PTRS_PER_BLK, 1 },
+        { KTFS_PTRS_PER_BLK * KTFS_PTRS_PER_BLK, 2 },
+        { KTFS_PTRS_PER_BLK * KTFS_PTRS_PER_BLK, 2 }
+    };
+
+    if (bmap != NULL && bmap->valid &&
+        bmap->base <= b && b - bmap->base < KTFS_PTRS_PER_BLK)
+    {
+        return bmap->map[b - bmap->base];
+    }
 
-        return real_block;
-    } 
-    else if(file_block_index < 2*blocks_in_dind + 131){
-        uint32_t dind_block_num = inode->dindirect[1];
-        if (dind_block_num == 0) {
-            // not allocated => read is out of range => return 0
-            return -1;
-        }
+    for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        if (b < levels[i].count)
+            break;
+        b -= levels[i].count;
+    }
+
+    if (i == sizeof(levels) / sizeof(levels[0]))
+        return -1;
 
-        int index_in_dind = file_block_index - (131 + 128*128);
+    depth = levels[i].depth;
 
-        int top_index = index_in_dind / 128;
-        int bottom_index = index_in_dind % 128;
+    if (i == 0)
+        return inode->block[b];
+    else if (i == 1)
+        blkno = inode->indirect;
+    else
+        blkno = inode->dindirect[i-2];
 
-        uint32_t *dind_array;
-        int ret = cache_get_block(file_system_cache, (dind_block_num + ktfs_master->data_start_block) * KTFS_BLKSZ,
-                                    (void **)&dind_array);
-        if (ret < 0) {
-            // handle error
-            return -1;
-        }
+    // Walk down the index blocks. Data block 0 is the root directory's, so a
+    // zero index pointer means the index block is not allocated.
 
-        uint32_t second_level_block = dind_array[top_index];
-        cache_release_block(file_system_cache, dind_array, 0);
+    while (0 < depth--) {
+        if (blkno == 0)
+            return -1;
 
-        if (second_level_block == 0) {
-            return -1;  // not allocated
-        }
+        idx = b;
+        for (unsigned int d = 0; d < depth; d++)
+            idx /= KTFS_PTRS_PER_BLK;
+        idx %= KTFS_PTRS_PER_BLK;
 
-        uint32_t *second_level_array;
-        ret = cache_get_block(file_system_cache, (second_level_block + ktfs_master->data_start_block) * KTFS_BLKSZ, (void **)&second_level_array);
-        if (ret < 0) {
+        ret = cache_get_block(file_system_cache,
+            (blkno + ktfs_master->data_start_block) *
+            (unsigned long long)KTFS_BLKSZ, (void**)&ind);
+        if (ret < 0)
             return -1;
+
+        if (depth == 0 && bmap != NULL) {
+            memcpy(bmap->map, ind, sizeof(bmap->map));
+            bmap->base = file_block_index - idx;
+            bmap->valid = 1;
         }
 
-        uint32_t real_block = second_level_array[bottom_index];
-        cache_release_block(file_system_cache, second_level_array, 0);
+        blkno = ind[idx];
+        cache_release_block(file_system_cache, ind, 0);
+    }
 
+    return blkno;
+}
 
-        return real_block;
-    }
+int ktfs_get_data_block(struct ktfs_inode * inode, int file_block_index){
+    if (file_block_index < 0)
+        return -1;
+    return ktfs_map_block(inode, file_block_index, NULL);
+}
 
-    // // If we get here we are out of range
-    return -1;
+// Maps a block of an open file using its block map cache. Caller holds the
+// file's inode lock.
+
+static int ktfs_file_block(struct ktfs_file * file, unsigned int file_block_index)
+{
+    return ktfs_map_block(&file->ip->inode, file_block_index, &file->bmap);
 }
 
 long ktfs_writeat (struct io * io, unsigned long long pos, const void * buf, long len)
 {
-    struct ktfs_file * file = (void*)io - offsetof(struct ktfs_file, io);
+    struct ktfs_fd * const fd = (void*)io - offsetof(struct ktfs_fd, io);
+    struct ktfs_file * const file = fd->file;
 
-    if (pos >= file->fsize)
-        return 0;
     if (len < 0)
         return -EINVAL;
 
-    if (pos + len > file->fsize) {
-        len = file->fsize - pos;
+    struct ktfs_incore_inode * const ip = ktfs_lock_file(file);
+
+    if (ip == NULL) {
+        return -EINVAL;
     }
 
-    struct ktfs_inode file_inode;
+    int ret;
 
-    lock_acquire(&ktfs_master->ktfs_lock);
-    
-    int ret = get_inode(file->ktfs_dir_entry.inode, &file_inode, 0);
+    ip->version = __atomic_add_fetch(&ktfs_last_version, 1, __ATOMIC_RELAXED);
 
-    if(ret < 0){
-        lock_release(&ktfs_master->ktfs_lock);
-        return ret;
+    // Writing past the end grows the file
+
+    if (pos + len > file->fsize) {
+        if (pos >= KTFS_MAX_FILE_SIZE) {
+            lock_release(&ip->lock);
+            return 0;
+        }
+
+        if (pos + len > KTFS_MAX_FILE_SIZE)
+            len = KTFS_MAX_FILE_SIZE - pos;
+
+        ret = ktfs_grow(file, pos + len);
+
+        if (ret < 0 && pos >= file->fsize) {
+            lock_release(&ip->lock);
+            return ret;
+        }
+
+        if (pos + len > file->fsize)
+            len = file->fsize - pos;
     }
 
     int block_index = 0;
@@ -592,15 +1468,15 @@ long ktfs_writeat (struct io * io, unsigned long long pos, const void * buf, lon
             chunk = remaining;
         }
 
-        uint32_t curr_block_num = ktfs_get_data_block(&file_inode, block_index);
+        uint32_t curr_block_num = ktfs_file_block(file, block_index);
 
         if (curr_block_num == (uint32_t)-1) {
             // block is not allocated or out of range
             if (total_written > 0) {
-                lock_release(&ktfs_master->ktfs_lock);
+                lock_release(&ip->lock);
                 return total_written;  // partial write success
             } else {
-                lock_release(&ktfs_master->ktfs_lock);
+                lock_release(&ip->lock);
                 return -EIO;           // or some error code if no bytes were written yet
             }
         }
@@ -609,7 +1485,7 @@ long ktfs_writeat (struct io * io, unsigned long long pos, const void * buf, lon
         ret = cache_get_block(file_system_cache, (curr_block_num + ktfs_master->data_start_block) * KTFS_BLKSZ, (void**)&blk_ptr);
         if (ret < 0) {
             // partial read so far is total_read
-            lock_release(&ktfs_master->ktfs_lock);
+            lock_release(&ip->lock);
             return (total_written > 0) ? total_written : ret;
         }
 
@@ -621,364 +1497,1353 @@ long ktfs_writeat (struct io * io, unsigned long long pos, const void * buf, lon
 
     }
 
-    lock_release(&ktfs_master->ktfs_lock);
+    lock_release(&ip->lock);
 
     return total_written;
 
 
 }
 
-long ktfs_readat(struct io* io, unsigned long long pos, void * buf, long len)
+// Reads the run of physically contiguous data blocks starting at file block
+// /block_index/ (device data block /first/) into /buf/, up to /len/ bytes of
+// whole blocks. Caller holds the file's inode lock. Returns the number of
+// bytes read, or zero if the run is a single block or the device read failed.
+
+static long ktfs_readat_extent (
+    struct ktfs_file * file, int block_index, uint32_t first,
+    char * buf, long len)
+{
+    long nblks, maxblks;
+    long rcnt;
+
+    maxblks = len / KTFS_BLKSZ;
+    if (KTFS_EXTENT_MAX < maxblks)
+        maxblks = KTFS_EXTENT_MAX;
+
+    nblks = 1;
+    while (nblks < maxblks && ktfs_file_block(file, block_index + nblks)
+        == first + nblks)
+    {
+        nblks++;
+    }
+
+    if (nblks < 2)
+        return 0;
+
+    rcnt = cache_read_direct(file_system_cache,
+        (first + ktfs_master->data_start_block) * (unsigned long long)KTFS_BLKSZ,
+        buf, nblks * KTFS_BLKSZ);
+
+    if (rcnt < 0)
+        return 0;
+
+    return rcnt - rcnt % KTFS_BLKSZ;
+}
+
+long ktfs_readat(struct io* io, unsigned long long pos, void * buf, long len)
+{
+
+
+    struct ktfs_fd * const fd = (void*)io - offsetof(struct ktfs_fd, io);
+    struct ktfs_file * const file = fd->file;
+
+    if (len < 0)
+        return -EINVAL;
+
+    struct ktfs_incore_inode * const ip = ktfs_lock_file(file);
+
+    if (ip == NULL) {
+        return -EINVAL;
+    }
+
+    // the size may change until we hold the inode lock
+
+    if (pos >= file->fsize) {
+        lock_release(&ip->lock);
+        return 0;
+    }
+
+    if (pos + len > file->fsize) {
+        len = file->fsize - pos;
+    }
+
+    int ret;
+
+    int block_index = 0;
+
+    int block_offset = 0;
+
+    long total_read = 0;
+
+    while(total_read < len){
+
+        unsigned long long curr_offset = pos + total_read;
+
+        block_index = curr_offset / 512;
+
+        block_offset = curr_offset % 512;
+
+        long remaining = len - total_read;
+
+        long chunk = 512 - block_offset;
+
+        if(chunk > remaining){
+            chunk = remaining;
+        }
+
+        uint32_t curr_block_num = ktfs_file_block(file, block_index);
+
+        if(curr_block_num == -1) {
+            // means no block allocated do a partial of zeroes ig
+            memset((char*)buf + total_read, 0, chunk);
+            total_read += chunk;
+            continue;
+        }
+
+        // Whole-block reads: find how many of the following blocks are
+        // physically contiguous and fetch them with one device request
+        // directly into the caller's buffer.
+
+        if (block_offset == 0 && 2 * KTFS_BLKSZ <= remaining) {
+            long run = ktfs_readat_extent(file, block_index,
+                curr_block_num, (char*)buf + total_read, remaining);
+
+            if (0 < run) {
+                total_read += run;
+                continue;
+            }
+
+            // Single block or device error: fall through to the cached path
+        }
+
+        void *blk_ptr;
+        ret = cache_get_block(file_system_cache, (curr_block_num + ktfs_master->data_start_block) * KTFS_BLKSZ, (void**)&blk_ptr);
+        if (ret < 0) {
+            // partial read so far is total_read
+            lock_release(&ip->lock);
+            return (total_read > 0) ? total_read : ret;
+        }
+
+        memcpy((char*)buf + total_read, (char*)blk_ptr + block_offset, chunk);
+
+        cache_release_block(file_system_cache, blk_ptr, 0);
+
+        total_read += chunk;
+
+    }
+
+    ktfs_readahead(fd, pos, total_read);
+
+    lock_release(&ip->lock);
+
+    return total_read;
+
+}
+
+// Writes up to /len/ bytes of the file from /pos/ to /sink/, straight from
+// the cached data blocks. The inode lock is dropped around each write to
+// the sink, which may block for long (a full pipe, a slow UART); the pinned
+// cache block stays valid meanwhile. Holes are written as zeros.
+
+long ktfs_sendto (
+    struct io * io, unsigned long long pos, struct io * sink, long len)
+{
+    static const char zero_block[KTFS_BLKSZ];
+    struct ktfs_fd * const fd = (void*)io - offsetof(struct ktfs_fd, io);
+    struct ktfs_file * const file = fd->file;
+    struct ktfs_incore_inode * ip;
+    unsigned long long curr;
+    uint32_t blkno;
+    long total = 0;
+    long chunk, wcnt;
+    void * blk;
+    int ret;
+
+    if (len < 0)
+        return -EINVAL;
+
+    while (total < len) {
+        ip = ktfs_lock_file(file);
+        if (ip == NULL)
+            break;
+
+        curr = pos + total;
+        if (file->fsize <= curr) {
+            lock_release(&ip->lock);
+            break;
+        }
+
+        chunk = KTFS_BLKSZ - curr % KTFS_BLKSZ;
+        if (len - total < chunk)
+            chunk = len - total;
+        if (file->fsize - curr < chunk)
+            chunk = file->fsize - curr;
+
+        blkno = ktfs_file_block(file, curr / KTFS_BLKSZ);
+        blk = NULL;
+
+        if (blkno != (uint32_t)-1) {
+            ret = cache_get_block(file_system_cache,
+                (blkno + ktfs_master->data_start_block) * KTFS_BLKSZ, &blk);
+            if (ret < 0) {
+                lock_release(&ip->lock);
+                return (total > 0) ? total : ret;
+            }
+        }
+
+        lock_release(&ip->lock);
+
+        if (blk != NULL) {
+            wcnt = iowrite(sink, (char*)blk + curr % KTFS_BLKSZ, chunk);
+            cache_release_block(file_system_cache, blk, 0);
+        } else
+            wcnt = iowrite(sink, zero_block, chunk);
+
+        if (wcnt < 0)
+            return (total > 0) ? total : wcnt;
+        
+        total += wcnt;
+
+        if (wcnt < chunk)
+            break;
+    }
+
+    return total;
+}
+
+// Finds a clear bit in /map/ (/nwords/ 64-bit words), starting at word
+// /*cursor/ and wrapping around, sets it and moves the cursor to its word.
+// Returns the bit number or -1 if every bit is set.
+
+static int ktfs_map_claim(uint64_t * map, uint32_t nwords, uint32_t * cursor)
+{
+    uint32_t i, w;
+    uint64_t bits;
+    int b;
+
+    for (i = 0; i < nwords; i++) {
+        w = (*cursor + i) % nwords;
+
+        if (map[w] == ~0ULL)
+            continue;
+
+        bits = ~map[w];
+        for (b = 0; !(bits & 1); b++)
+            bits >>= 1;
+
+        map[w] |= 1ULL << b;
+        *cursor = w;
+        return w * 64 + b;
+    }
+
+    return -1;
+}
+
+// Makes the on-disk bitmap byte holding the bit of device block /gblk/
+// match the in-memory bitmap.
+
+static int ktfs_bitmap_sync(uint32_t gblk)
+{
+    uint8_t * block;
+    int ret;
+
+    ret = cache_get_block(file_system_cache,
+        (ktfs_master->bitmap_start_block + gblk / (KTFS_BLKSZ * 8)) *
+        (unsigned long long)KTFS_BLKSZ, (void**)&block);
+    if (ret < 0)
+        return ret;
+
+    // Copy only this block's bit: neighbouring bits may be set in memory for
+    // blocks that are merely reserved
+
+    if (ktfs_master->blkmap[gblk / 64] & (1ULL << (gblk % 64)))
+        block[gblk % (KTFS_BLKSZ * 8) / 8] |= 1 << (gblk % 8);
+    else
+        block[gblk % (KTFS_BLKSZ * 8) / 8] &= ~(1 << (gblk % 8));
+
+    ktfs_log_write(block,
+        ktfs_master->bitmap_start_block + gblk / (KTFS_BLKSZ * 8));
+    cache_release_block(file_system_cache, block, 1);
+    return 0;
+}
+
+// Returns the device block number of a newly allocated block, or -1 if the
+// disk is full.
+
+int find_free_data_block(void)
+{
+    int gblk = -1;
+
+    lock_acquire(&ktfs_master->bitmap_lock);
+
+    if (ktfs_master->free_blocks != 0) {
+        gblk = ktfs_map_claim(ktfs_master->blkmap,
+            ktfs_master->blkmap_words, &ktfs_master->blkmap_next);
+    }
+
+    if (0 <= gblk) {
+        if (ktfs_bitmap_sync(gblk) < 0) {
+            ktfs_master->blkmap[gblk / 64] &= ~(1ULL << (gblk % 64));
+            gblk = -1;
+        } else
+            ktfs_master->free_blocks -= 1;
+    }
+
+    lock_release(&ktfs_master->bitmap_lock);
+    return gblk;
+}
+
+// Frees data block /blkno/ (data-region index).
+
+static int ktfs_free_data_block(uint32_t blkno)
+{
+    uint32_t gblk = blkno + ktfs_master->data_start_block;
+    uint64_t mask = 1ULL << (gblk % 64);
+    int ret = 0;
+
+    lock_acquire(&ktfs_master->bitmap_lock);
+
+    if (ktfs_master->blkmap[gblk / 64] & mask) {
+        ktfs_master->blkmap[gblk / 64] &= ~mask;
+        ktfs_master->free_blocks += 1;
+        ret = ktfs_bitmap_sync(gblk);
+    }
+
+    lock_release(&ktfs_master->bitmap_lock);
+    return ret;
+}
+
+// Loads the block bitmap and builds the inode bitmap. An inode is in use if
+// it is the root directory, is named by a directory entry, or is not all
+// zeroes on disk. Called at mount after the directory index is built.
+
+static int ktfs_load_bitmaps(void)
+{
+    const uint32_t nblks = ktfs_master->superblock.block_count;
+    const uint32_t ninodes = ktfs_master->superblock.inode_block_count *
+        (KTFS_BLKSZ / KTFS_INOSZ);
+    struct ktfs_inode zero_inode;
+    struct ktfs_inode * inode_block;
+    struct ktfs_dir_node * node;
+    uint8_t * block;
+    uint64_t w;
+    uint32_t i, n;
+    int ret;
+
+    ktfs_master->blkmap_words = (nblks + 63) / 64;
+    ktfs_master->inomap_words = (ninodes + 63) / 64;
+
+    ktfs_master->blkmap = alloc_phys_pages (
+        (ktfs_master->blkmap_words * 8 + PAGE_SIZE - 1) / PAGE_SIZE);
+    ktfs_master->inomap = alloc_phys_pages (
+        (ktfs_master->inomap_words * 8 + PAGE_SIZE - 1) / PAGE_SIZE);
+
+    if (ktfs_master->blkmap == NULL || ktfs_master->inomap == NULL)
+        return -ENOMEM;
+
+    memset(ktfs_master->blkmap, 0, ktfs_master->blkmap_words * 8);
+    memset(ktfs_master->inomap, 0, ktfs_master->inomap_words * 8);
+
+    // The bitmap is byte-addressed with bit j of byte i for block 8i+j,
+    // which on a little-endian machine is bit k of word w for block 64w+k.
+
+    for (i = 0; i < ktfs_master->superblock.bitmap_block_count &&
+        i * KTFS_BLKSZ < (nblks + 7) / 8; i++)
+    {
+        n = (nblks + 7) / 8 - i * KTFS_BLKSZ;
+        if (KTFS_BLKSZ < n)
+            n = KTFS_BLKSZ;
+
+        ret = cache_get_block(file_system_cache,
+            (ktfs_master->bitmap_start_block + i) *
+            (unsigned long long)KTFS_BLKSZ, (void**)&block);
+        if (ret < 0)
+            return ret;
+
+        memcpy((uint8_t*)ktfs_master->blkmap + i * KTFS_BLKSZ, block, n);
+        cache_release_block(file_system_cache, block, 0);
+    }
+
+    // Bits past the last block are never allocated
+
+    for (i = nblks; i < ktfs_master->blkmap_words * 64; i++)
+        ktfs_master->blkmap[i / 64] |= 1ULL << (i % 64);
+    for (i = ninodes; i < ktfs_master->inomap_words * 64; i++)
+        ktfs_master->inomap[i / 64] |= 1ULL << (i % 64);
+
+    ktfs_master->free_blocks = 0;
+    for (i = 0; i < ktfs_master->blkmap_words; i++) {
+        for (w = ~ktfs_master->blkmap[i]; w != 0; w &= w - 1)
+            ktfs_master->free_blocks += 1;
+    }
+
+    // Inode usage
+
+    memset(&zero_inode, 0, sizeof zero_inode);
+
+    for (i = 0; i < ktfs_master->superblock.inode_block_count; i++) {
+        ret = cache_get_block(file_system_cache,
+            (ktfs_master->inode_start_block + i) *
+            (unsigned long long)KTFS_BLKSZ, (void**)&inode_block);
+        if (ret < 0)
+            return ret;
+
+        for (n = 0; n < KTFS_BLKSZ / KTFS_INOSZ; n++) {
+            if (memcmp(&inode_block[n], &zero_inode, sizeof zero_inode) != 0) {
+                w = i * (KTFS_BLKSZ / KTFS_INOSZ) + n;
+                ktfs_master->inomap[w / 64] |= 1ULL << (w % 64);
+            }
+        }
+
+        cache_release_block(file_system_cache, inode_block, 0);
+    }
+
+    w = ktfs_master->superblock.root_directory_inode;
+    ktfs_master->inomap[w / 64] |= 1ULL << (w % 64);
+
+    for (i = 0; i < KTFS_DIR_NBUCKETS; i++) {
+        for (node = ktfs_dir_buckets[i]; node; node = node->next)
+            ktfs_master->inomap[node->inode / 64] |= 1ULL << (node->inode % 64);
+    }
+
+    return 0;
+}
+
+// Zeroes data block /blk_no/ (data-region index). If the device can zero a
+// range itself, the zeroes are not written from the cache.
+
+static int zero_block(uint32_t blk_no)
+{
+    const unsigned long long pos =
+        (blk_no + ktfs_master->data_start_block) * (unsigned long long)KTFS_BLKSZ;
+    void *p;
+    int ret;
+
+    if (ktfs_master->can_zero &&
+        cache_write_zeroes(file_system_cache, pos, KTFS_BLKSZ) == 0)
+    {
+        return 0;
+    }
+
+    ret = cache_get_block(file_system_cache, pos, (void**)&p);
+    if (ret < 0) return ret;
+    memset(p, 0, KTFS_BLKSZ);
+    cache_release_block(file_system_cache, p, 1);
+    return 0;
+}
+
+// Allocates a zeroed data block and returns its data-region index in
+// /*blknoptr/.
+
+static int ktfs_alloc_data_block(uint32_t * blknoptr)
+{
+    int blk;
+
+    blk = find_free_data_block();
+    if (blk < 0)
+        return -ENODATABLKS;
+
+    // find_free_data_block returns global block number not data relative
+    *blknoptr = blk - ktfs_master->data_start_block;
+    return zero_block(*blknoptr);
+}
+
+// Sets entry /idx/ of index block /iblk/ (data-region index) to /blkno/.
+
+static int ktfs_set_index_entry(uint32_t iblk, unsigned int idx, uint32_t blkno)
+{
+    uint32_t * ind;
+    int ret;
+
+    ret = cache_get_block(file_system_cache,
+        (iblk + ktfs_master->data_start_block) * (unsigned long long)KTFS_BLKSZ,
+        (void**)&ind);
+    if (ret < 0)
+        return ret;
+
+    ind[idx] = blkno;
+    ktfs_log_write(ind, iblk + ktfs_master->data_start_block);
+    cache_release_block(file_system_cache, ind, 1);
+    return 0;
+}
+
+// Releases the unused part of /ip/'s block reservation.
+
+static void ktfs_unreserve(struct ktfs_incore_inode * ip)
+{
+    uint32_t gblk;
+
+    lock_acquire(&ktfs_master->bitmap_lock);
+
+    for (gblk = ip->resv_next; gblk < ip->resv_end; gblk++) {
+        ktfs_master->blkmap[gblk / 64] &= ~(1ULL << (gblk % 64));
+        ktfs_master->free_blocks += 1;
+    }
+
+    ip->resv_next = ip->resv_end = 0;
+
+    lock_release(&ktfs_master->bitmap_lock);
+}
+
+// Reserves the first run of /nblks/ free blocks at or after device block
+// /goal/ for /ip/ (or the longest shorter run if there is none), replacing
+// its current reservation. Reserved blocks are marked in use in the
+// in-memory bitmap only; the on-disk bit is set when the file actually
+// takes the block, so a reservation never reaches the disk.
+
+static void ktfs_reserve(struct ktfs_incore_inode * ip, uint32_t goal, uint32_t nblks)
+{
+    const uint32_t nbits = ktfs_master->blkmap_words * 64;
+    uint32_t i, bit, run, start, best, best_start;
+
+    ktfs_unreserve(ip);
+
+    lock_acquire(&ktfs_master->bitmap_lock);
+
+    if (ktfs_master->free_blocks < nblks)
+        nblks = ktfs_master->free_blocks;
+
+    run = start = best = best_start = 0;
+
+    for (i = 0; i < nbits && best < nblks; i++) {
+        bit = (goal + i) % nbits;
+
+        if (bit == 0)
+            run = 0; // runs do not wrap around
+
+        if (bit % 64 == 0 && ktfs_master->blkmap[bit / 64] == ~0ULL) {
+            run = 0;
+            i += 63;
+            continue;
+        }
+
+        if (ktfs_master->blkmap[bit / 64] & (1ULL << (bit % 64))) {
+            run = 0;
+            continue;
+        }
+
+        if (run++ == 0)
+            start = bit;
+
+        if (best < run) {
+            best = run;
+            best_start = start;
+        }
+    }
+
+    for (i = best_start; i < best_start + best; i++)
+        ktfs_master->blkmap[i / 64] |= 1ULL << (i % 64);
+
+    ktfs_master->free_blocks -= best;
+    ip->resv_next = best_start;
+    ip->resv_end = best_start + best;
+
+    lock_release(&ktfs_master->bitmap_lock);
+}
+
+// Allocates a zeroed data block for file data of /ip/ from its reservation,
+// making a new reservation of KTFS_RESV_BLKS blocks starting at device block
+// /goal/ if the old one is used up, so a growing file gets contiguous runs
+// of blocks even when other files grow at the same time.
+
+static int ktfs_alloc_reserved_block (
+    struct ktfs_incore_inode * ip, uint32_t goal, uint32_t * blknoptr)
+{
+    uint32_t gblk;
+    int ret;
+
+    if (ip->resv_next == ip->resv_end)
+        ktfs_reserve(ip, goal, KTFS_RESV_BLKS);
+
+    if (ip->resv_next == ip->resv_end)
+        return -ENODATABLKS;
+
+    lock_acquire(&ktfs_master->bitmap_lock);
+    gblk = ip->resv_next;
+    ret = ktfs_bitmap_sync(gblk);
+    if (ret == 0)
+        ip->resv_next += 1;
+    lock_release(&ktfs_master->bitmap_lock);
+
+    if (ret < 0)
+        return ret;
+
+    *blknoptr = gblk - ktfs_master->data_start_block;
+    return zero_block(*blknoptr);
+}
+
+// Allocates file block /b/ of /ip/, together with the indirect and
+// doubly-indirect blocks needed to reach it. The block must not already be
+// allocated. Data blocks come from the inode's reservation; index blocks
+// are allocated separately so they do not break up its runs. Block pointers
+// are stored in the in-core inode as they are allocated; the caller marks it
+// dirty.
+
+static int ktfs_alloc_file_block(struct ktfs_incore_inode * ip, unsigned int b)
+{
+    struct ktfs_inode * const inode = &ip->inode;
+    uint32_t data_blk, iblk, goal;
+    int prev;
+    uint32_t * dind;
+    unsigned int rel, dind_index, top_index;
+    int ret;
+
+    // Try to place the block right after the file's previous block
+
+    prev = (b == 0) ? -1 : ktfs_map_block(inode, b - 1, NULL);
+    goal = (prev < 0) ? ktfs_master->blkmap_next * 64 :
+        prev + ktfs_master->data_start_block + 1;
+
+    if (b < KTFS_NUM_DIRECT_DATA_BLOCKS) {
+        ret = ktfs_alloc_reserved_block(ip, goal, &data_blk);
+        if (ret == 0)
+            inode->block[b] = data_blk;
+        return ret;
+    }
+
+    if (b < KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_PTRS_PER_BLK) {
+        if (inode->indirect == 0) {
+            ret = ktfs_alloc_data_block(&iblk);
+            if (ret < 0)
+                return ret;
+            inode->indirect = iblk;
+        }
+
+        ret = ktfs_alloc_reserved_block(ip, goal, &data_blk);
+        if (ret < 0)
+            return ret;
+
+        return ktfs_set_index_entry(inode->indirect,
+            b - KTFS_NUM_DIRECT_DATA_BLOCKS, data_blk);
+    }
+
+    rel = b - (KTFS_NUM_DIRECT_DATA_BLOCKS + KTFS_PTRS_PER_BLK);
+
+    if (KTFS_NUM_DINDIRECT_BLOCKS * KTFS_PTRS_PER_BLK * KTFS_PTRS_PER_BLK <= rel)
+        return -EINVAL;
+
+    dind_index = rel / (KTFS_PTRS_PER_BLK * KTFS_PTRS_PER_BLK);
+
+    if (inode->dindirect[dind_index] == 0) {
+        ret = ktfs_alloc_data_block(&iblk);
+        if (ret < 0)
+            return ret;
+        inode->dindirect[dind_index] = iblk;
+    }
+
+    top_index = rel / KTFS_PTRS_PER_BLK % KTFS_PTRS_PER_BLK;
+
+    ret = cache_get_block(file_system_cache,
+        (inode->dindirect[dind_index] + ktfs_master->data_start_block) *
+        (unsigned long long)KTFS_BLKSZ, (void**)&dind);
+    if (ret < 0)
+        return ret;
+
+    iblk = dind[top_index];
+
+    if (iblk == 0) {
+        ret = ktfs_alloc_data_block(&iblk);
+        if (ret < 0) {
+            cache_release_block(file_system_cache, dind, 0);
+            return ret;
+        }
+        dind[top_index] = iblk;
+        ktfs_log_write(dind,
+            inode->dindirect[dind_index] + ktfs_master->data_start_block);
+        cache_release_block(file_system_cache, dind, 1);
+    } else
+        cache_release_block(file_system_cache, dind, 0);
+
+    ret = ktfs_alloc_reserved_block(ip, goal, &data_blk);
+    if (ret < 0)
+        return ret;
+
+    return ktfs_set_index_entry(iblk, rel % KTFS_PTRS_PER_BLK, data_blk);
+}
+
+// Grows /file/ to /new_size/ bytes, allocating the blocks it needs. If not
+// all of them can be allocated, the file grows to the end of the last block
+// allocated and the error is returned. Caller holds the inode lock.
+
+static int ktfs_grow(struct ktfs_file * file, unsigned long long new_size)
+{
+    struct ktfs_incore_inode * const ip = file->ip;
+    unsigned int b, old_blocks, new_blocks;
+    int ret = 0;
+
+    if (new_size <= ip->inode.size)
+        return 0;
+
+    if (KTFS_MAX_FILE_SIZE < new_size)
+        return -EINVAL;
+
+    old_blocks = (ip->inode.size + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+    new_blocks = (new_size + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+
+    // Block pointers are recorded in the in-core inode as they are
+    // allocated, so it is dirty even if we fail part way through. Newly
+    // allocated blocks may also fall in the cached index block.
+
+    ip->dirty = 1;
+    ip->version = __atomic_add_fetch(&ktfs_last_version, 1, __ATOMIC_RELAXED);
+    file->bmap.valid = 0;
+
+    for (b = old_blocks; b < new_blocks; b++) {
+        ret = ktfs_alloc_file_block(ip, b);
+        if (ret < 0)
+            break;
+    }
+
+    if (b < new_blocks)
+        new_size = (unsigned long long)b * KTFS_BLKSZ;
+
+    if (ip->inode.size < new_size)
+        ip->inode.size = new_size;
+
+    file->fsize = ip->inode.size;
+    return ret;
+}
+
+
+
+
+
+int ktfs_cntl(struct io *io, int cmd, void *arg)
+{
+    struct ktfs_fd * const fd = (void*)io - offsetof(struct ktfs_fd, io);
+    struct ktfs_file * const file = fd->file;
+    switch (cmd) {
+        case IOCTL_GETBLKSZ:
+            return 1;
+    
+        case IOCTL_GETEND:
+            // Return the file size via *(uint64_t*)arg
+            if (!arg) {
+                return -EINVAL;  // must provide a pointer
+            }
+            *(unsigned long long*)arg = file->fsize;
+            return 0;
+        
+        case IOCTL_SETEND:
+            unsigned long long new_size = *(unsigned long long *)arg;
+
+            struct ktfs_incore_inode * const ip = ktfs_lock_file(file);
+
+            if(ip == NULL){
+                return -EINVAL;
+            }
+
+            struct ktfs_inode * const inode = &ip->inode;
+            int ret;
+
+
+            if(new_size < inode->size || new_size > KTFS_MAX_FILE_SIZE){
+                lock_release(&ip->lock);
+                return -EINVAL;
+            }
+
+            ret = ktfs_grow(file, new_size);
+            
+            lock_release(&ip->lock);
+
+            return ret;
+
+        case IOCTL_RESERVE:
+            if (!arg) {
+                return -EINVAL;
+            }
+
+            // Reserve a contiguous run for the blocks the file is about to
+            // grow by, starting after its current last block.
+
+            unsigned long long nbytes = *(const unsigned long long *)arg;
+            unsigned int nblks;
+            uint32_t goal;
+            int last;
+
+            if (KTFS_MAX_FILE_SIZE < nbytes)
+                nbytes = KTFS_MAX_FILE_SIZE;
+
+            nblks = (nbytes + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+
+            struct ktfs_incore_inode * const rip = ktfs_lock_file(file);
+
+            if (rip == NULL) {
+                return -EINVAL;
+            }
+
+            last = (rip->inode.size == 0) ? -1 :
+                ktfs_map_block(&rip->inode,
+                    (rip->inode.size - 1) / KTFS_BLKSZ, NULL);
+            goal = (last < 0) ? ktfs_master->blkmap_next * 64 :
+                last + ktfs_master->data_start_block + 1;
+
+            ktfs_reserve(rip, goal, nblks);
+            ret = (rip->resv_next == rip->resv_end && nblks != 0) ?
+                -ENODATABLKS : 0;
+
+            lock_release(&rip->lock);
+            return ret;
+
+        case IOCTL_GETCSTATS:
+            if (!arg) {
+                return -EINVAL;
+            }
+            cache_get_stats(file_system_cache, arg);
+            return 0;
+
+        case IOCTL_RSTCSTATS:
+            cache_reset_stats(file_system_cache);
+            return 0;
+
+        case IOCTL_SETRA:
+            if (!arg) {
+                return -EINVAL;
+            }
+            fd->ra_max = *(const unsigned int *)arg;
+            fd->ra_window = 0;
+            return 0;
+
+        case IOCTL_GETID:
+            if (!arg) {
+                return -EINVAL;
+            }
+
+            struct ktfs_incore_inode * const vip = ktfs_lock_file(file);
+
+            if (vip == NULL) {
+                return -EINVAL;
+            }
+
+            *(unsigned long long *)arg = vip->version;
+            lock_release(&vip->lock);
+            return 0;
+
+        default:
+            return -ENOTSUP;
+        }
+}
+
+// Called at the end of a read of /len/ bytes at /pos/ with the file's inode
+// lock held.
+// Grows the window if the read continued the previous one and queues the
+// blocks of the window that have not been queued yet.
+
+void ktfs_readahead (
+    struct ktfs_fd * fd, unsigned long long pos, long len)
+{
+    unsigned int first, last, nblks, b;
+    int blkno;
+
+    if (fd->ra_max == 0 || len <= 0)
+        return;
+
+    if (pos != fd->ra_next) {
+        // Random access: stop reading ahead until the pattern is sequential
+        fd->ra_next = pos + len;
+        fd->ra_window = 0;
+        fd->ra_issued = 0;
+        return;
+    }
+
+    fd->ra_next = pos + len;
+
+    if (fd->ra_window == 0)
+        fd->ra_window = KTFS_RA_MIN;
+    else if (fd->ra_window < fd->ra_max)
+        fd->ra_window *= 2;
+
+    if (fd->ra_max < fd->ra_window)
+        fd->ra_window = fd->ra_max;
+
+    nblks = (fd->file->fsize + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+    first = (pos + len + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+    last = first + fd->ra_window;
+
+    if (first < fd->ra_issued)
+        first = fd->ra_issued;
+    if (nblks < last)
+        last = nblks;
+
+    for (b = first; b < last; b++) {
+        // Drop the rest of the window if the queue is full
+        if (ktfs_raq.tail - ktfs_raq.head == KTFS_RA_QLEN)
+            break;
+
+        blkno = ktfs_file_block(fd->file, b);
+        if (blkno < 0)
+            continue;
+
+        ktfs_raq.pos[ktfs_raq.tail++ % KTFS_RA_QLEN] =
+            (blkno + ktfs_master->data_start_block) *
+            (unsigned long long)KTFS_BLKSZ;
+    }
+
+    if (fd->ra_issued < b)
+        fd->ra_issued = b;
+
+    if (ktfs_raq.head != ktfs_raq.tail)
+        condition_signal(&ktfs_raq.not_empty); // one readahead thread
+}
+
+// Readahead thread: loads queued blocks into the block cache.
+
+void ktfs_readahead_func(void) {
+    unsigned long long pos;
+
+    for (;;) {
+        while (ktfs_raq.head == ktfs_raq.tail)
+            condition_wait(&ktfs_raq.not_empty);
+
+        pos = ktfs_raq.pos[ktfs_raq.head++ % KTFS_RA_QLEN];
+        cache_prefetch(file_system_cache, pos);
+    }
+}
+
+// METADATA LOG
+//
+// A create or delete changes several metadata blocks: directory blocks,
+// inode blocks and bitmap blocks. Each runs as one operation between
+// ktfs_log_begin() and ktfs_log_end(). The blocks it changes are held in the
+// cache instead of being written in place, and the blocks of successive
+// operations are gathered into one record. Committing a record writes it to
+// the log with a single device write, writes the held blocks home and then
+// clears the log, so after a crash a record found at mount is replayed and
+// every operation is either wholly on disk or not at all.
+
+static uint32_t ktfs_log_sum(const void * buf, unsigned long len)
+{
+    const uint32_t * p = buf;
+    uint32_t sum = 0;
+    unsigned long i;
+
+    for (i = 0; i < len / sizeof(uint32_t); i++)
+        sum = ((sum << 5) | (sum >> 27)) + p[i];
+
+    return sum;
+}
+
+static int ktfs_log_setup(uint32_t start, uint32_t nblks)
+{
+    ktfs_log.buf = alloc_phys_pages (
+        ((1 + nblks) * KTFS_BLKSZ + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (ktfs_log.buf == NULL)
+        return -ENOMEM;
+
+    ktfs_log.start = start;
+    ktfs_log.nblks = nblks;
+    return 0;
+}
+
+// Writes an empty header, so that the last record is not replayed.
+
+static int ktfs_log_clear(void)
+{
+    long wcnt;
+
+    memset(ktfs_log.buf, 0, KTFS_BLKSZ);
+    wcnt = iowriteat(ktfs_master->devio,
+        ktfs_log.start * (unsigned long long)KTFS_BLKSZ,
+        ktfs_log.buf, KTFS_BLKSZ);
+
+    return (wcnt < 0) ? wcnt : 0;
+}
+
+// Replays the record in the log, if there is a complete one. Called at mount
+// before metadata is read.
+
+int ktfs_log_recover(void)
+{
+    const struct ktfs_log_super * const lsb = &ktfs_master->log_super;
+    const uint32_t nblks = ktfs_master->superblock.block_count;
+    struct ktfs_log_header * hdr;
+    uint32_t sum, i;
+    void * blk;
+    long rcnt;
+    int ret;
+
+    if (lsb->magic != KTFS_LOG_MAGIC)
+        return 0;
+
+    if (lsb->nblks == 0 || KTFS_LOG_MAXBLKS < lsb->nblks ||
+        lsb->start < ktfs_master->data_start_block ||
+        nblks < lsb->start + 1 + lsb->nblks)
+    {
+        return -EBADFMT;
+    }
+
+    ret = ktfs_log_setup(lsb->start, lsb->nblks);
+    if (ret < 0)
+        return ret;
+
+    hdr = (void*)ktfs_log.buf;
+
+    rcnt = ioreadat(ktfs_master->devio,
+        ktfs_log.start * (unsigned long long)KTFS_BLKSZ, hdr, KTFS_BLKSZ);
+    if (rcnt < 0)
+        return rcnt;
+
+    if (hdr->magic != KTFS_LOG_MAGIC || hdr->count == 0 ||
+        ktfs_log.nblks < hdr->count)
+    {
+        return 0;
+    }
+
+    rcnt = ioreadat(ktfs_master->devio,
+        (ktfs_log.start + 1) * (unsigned long long)KTFS_BLKSZ,
+        ktfs_log.buf + KTFS_BLKSZ, hdr->count * KTFS_BLKSZ);
+    if (rcnt < 0)
+        return rcnt;
+
+    // A record whose write did not complete fails the checksum; none of its
+    // blocks were written home, so it is simply dropped.
+
+    sum = hdr->checksum;
+    hdr->checksum = 0;
+
+    if (ktfs_log_sum(hdr, (1 + hdr->count) * KTFS_BLKSZ) != sum) {
+        debug("ktfs: dropping incomplete log record %u", hdr->seq);
+        return 0;
+    }
+
+    trace("ktfs: replaying log record %u (%u blocks)", hdr->seq, hdr->count);
+
+    for (i = 0; i < hdr->count; i++) {
+        if (hdr->blkno[i] == 0 || nblks <= hdr->blkno[i])
+            return -EBADFMT;
+
+        ret = cache_get_block(file_system_cache,
+            hdr->blkno[i] * (unsigned long long)KTFS_BLKSZ, &blk);
+        if (ret < 0)
+            return ret;
+
+        memcpy(blk, ktfs_log.buf + (1 + i) * KTFS_BLKSZ, KTFS_BLKSZ);
+        cache_release_block(file_system_cache, blk, 1);
+    }
+
+    ktfs_log.seq = hdr->seq;
+
+    ret = cache_flush(file_system_cache);
+    if (ret < 0)
+        return ret;
+
+    return ktfs_log_clear();
+}
+
+// Gives a file system without a log one: the first run of KTFS_LOG_NBLKS
+// free blocks is marked in use and recorded after the superblock. Does
+// nothing if there is no such run. Called at mount after the bitmaps are
+// loaded.
+
+int ktfs_log_create(void)
 {
+    struct ktfs_log_super * const lsb = &ktfs_master->log_super;
+    const uint32_t nblks = ktfs_master->superblock.block_count;
+    uint32_t gblk, run;
+    void * blk;
+    int ret;
 
+    run = 0;
 
-    struct ktfs_file * file = (void*)io - offsetof(struct ktfs_file, io);
+    for (gblk = ktfs_master->data_start_block;
+        gblk < nblks && run < KTFS_LOG_NBLKS; gblk++)
+    {
+        if (ktfs_master->blkmap[gblk / 64] & (1ULL << (gblk % 64)))
+            run = 0;
+        else
+            run += 1;
+    }
 
-    if (pos >= file->fsize)
+    if (run < KTFS_LOG_NBLKS) {
+        debug("ktfs: no room for a metadata log");
         return 0;
-    if (len < 0)
-        return -EINVAL;
-
-    if (pos + len > file->fsize) {
-        len = file->fsize - pos;
     }
 
-    struct ktfs_inode file_inode;
+    ret = ktfs_log_setup(gblk - run, run - 1);
+    if (ret < 0)
+        return ret;
 
-    lock_acquire(&ktfs_master->ktfs_lock);
-    
-    int ret = get_inode(file->ktfs_dir_entry.inode, &file_inode, 0);
+    for (gblk = ktfs_log.start; gblk < ktfs_log.start + run; gblk++) {
+        ktfs_master->blkmap[gblk / 64] |= 1ULL << (gblk % 64);
+        ret = ktfs_bitmap_sync(gblk);
+        if (ret < 0)
+            return ret;
+    }
 
-    if(ret < 0){
-        lock_release(&ktfs_master->ktfs_lock);
+    ktfs_master->free_blocks -= run;
+
+    ret = ktfs_log_clear();
+    if (ret < 0)
         return ret;
-    }
 
-    int block_index = 0;
+    lsb->magic = KTFS_LOG_MAGIC;
+    lsb->start = ktfs_log.start;
+    lsb->nblks = ktfs_log.nblks;
 
-    int block_offset = 0;
+    ret = cache_get_block(file_system_cache, 0ULL, &blk);
+    if (ret < 0)
+        return ret;
 
-    long total_read = 0;
+    memcpy(blk + sizeof(struct ktfs_superblock), lsb, sizeof *lsb);
+    cache_release_block(file_system_cache, blk, 1);
 
-    while(total_read < len){
+    return cache_flush(file_system_cache);
+}
 
-        unsigned long long curr_offset = pos + total_read;
+// Starts an operation, first committing the current record if it might not
+// have room for the operation's blocks. Caller holds dir_lock.
 
-        block_index = curr_offset / 512;
+int ktfs_log_begin(void)
+{
+    int ret = 0;
 
-        block_offset = curr_offset % 512;
+    if (ktfs_log.start == 0)
+        return 0;
 
-        long remaining = len - total_read;
+    if (ktfs_log.nblks < ktfs_log.count + ktfs_log.opblks)
+        ret = ktfs_log_commit();
 
-        long chunk = 512 - block_offset;
+    if (ret == 0)
+        ktfs_log.owner = running_thread();
 
-        if(chunk > remaining){
-            chunk = remaining;
-        }
+    return ret;
+}
 
-        uint32_t curr_block_num = ktfs_get_data_block(&file_inode, block_index);
+// Ends the operation started by ktfs_log_begin(). The root directory inode
+// changes with every operation, so it is written into the same record.
 
-        if(curr_block_num == -1) {
-            // means no block allocated do a partial of zeroes ig
-            memset((char*)buf + total_read, 0, chunk);
-            total_read += chunk;
-            continue;
-        }
+int ktfs_log_end(void)
+{
+    int ret = 0;
 
-        void *blk_ptr;
-        ret = cache_get_block(file_system_cache, (curr_block_num + ktfs_master->data_start_block) * KTFS_BLKSZ, (void**)&blk_ptr);
-        if (ret < 0) {
-            // partial read so far is total_read
-            lock_release(&ktfs_master->ktfs_lock);
-            return (total_read > 0) ? total_read : ret;
-        }
+    if (ktfs_root->dirty) {
+        ret = put_inode(ktfs_root->inum, &ktfs_root->inode);
+        if (ret == 0)
+            ktfs_root->dirty = 0;
+    }
 
-        memcpy((char*)buf + total_read, (char*)blk_ptr + block_offset, chunk);
+    ktfs_log.owner = -1;
+    return ret;
+}
 
-        cache_release_block(file_system_cache, blk_ptr, 0);
+// Adds cache block /blk/, which holds device block /gblk/ and is pinned by
+// the caller, to the current record. Blocks changed outside an operation,
+// and those of an operation that overflows the log, are written in place.
 
-        total_read += chunk;
+void ktfs_log_write(void * blk, uint32_t gblk)
+{
+    uint32_t i;
 
-    }
+    if (ktfs_log.start == 0 || ktfs_log.owner != running_thread())
+        return;
 
-    lock_release(&ktfs_master->ktfs_lock);
+    for (i = 0; i < ktfs_log.count; i++) {
+        if (ktfs_log.blkno[i] == gblk)
+            return;
+    }
 
-    return total_read;
+    if (ktfs_log.count == ktfs_log.nblks) {
+        debug("ktfs: log full, block %u written in place", gblk);
+        return;
+    }
 
+    cache_hold_block(file_system_cache, blk);
+    ktfs_log.blks[ktfs_log.count] = blk;
+    ktfs_log.blkno[ktfs_log.count++] = gblk;
 }
 
-int find_free_data_block(void)
+// Commits the current record. Caller holds dir_lock.
+
+int ktfs_log_commit(void)
 {
-    uint32_t bits_per_block = KTFS_BLKSZ * 8;
+    struct ktfs_log_header * const hdr = (void*)ktfs_log.buf;
+    uint32_t i;
+    long wcnt;
+    int ret;
 
-    for(uint32_t bmp_block = ktfs_master->bitmap_start_block; bmp_block < ktfs_master->data_start_block; ++bmp_block){
-        uint8_t * block;
-        int ret = cache_get_block(file_system_cache, bmp_block * KTFS_BLKSZ, (void**)&block);
-        if(ret < 0) return ret;
+    if (ktfs_log.count == 0)
+        return 0;
 
-        for(int i = 0; i < KTFS_BLKSZ; ++i){
-            if(block[i] == 0xFF) continue;
+    memset(hdr, 0, KTFS_BLKSZ);
+    hdr->magic = KTFS_LOG_MAGIC;
+    hdr->seq = ++ktfs_log.seq;
+    hdr->count = ktfs_log.count;
 
-            for(int j = 0; j < 8; ++j){
-                if(!(block[i] & (1u << j))){
-                    block[i] |= (1u << j);
-                    int page_index = bmp_block - ktfs_master->bitmap_start_block;
-                    int block_idx = page_index * bits_per_block + i*8 + j;
-                    cache_release_block(file_system_cache, block, 1);
-                    return block_idx;
-                }
-            }
-        }
-        cache_release_block(file_system_cache, block, 0);
+    for (i = 0; i < ktfs_log.count; i++) {
+        hdr->blkno[i] = ktfs_log.blkno[i];
+        memcpy(ktfs_log.buf + (1 + i) * KTFS_BLKSZ,
+            ktfs_log.blks[i], KTFS_BLKSZ);
     }
 
-    return -1;
-}
+    hdr->checksum = ktfs_log_sum(hdr, (1 + ktfs_log.count) * KTFS_BLKSZ);
 
-static int zero_block(uint32_t blk_no)
-{
-    void *p;
-    int ret = cache_get_block(file_system_cache, (blk_no + ktfs_master->data_start_block) * KTFS_BLKSZ, (void**)&p);
-    if (ret < 0) return ret;
-    memset(p, 0, KTFS_BLKSZ);
-    cache_release_block(file_system_cache, p, 1);
-    return 0;
-}
+    wcnt = iowriteat(ktfs_master->devio,
+        ktfs_log.start * (unsigned long long)KTFS_BLKSZ,
+        ktfs_log.buf, (1 + ktfs_log.count) * KTFS_BLKSZ);
 
+    // The record must be durable before any of its blocks can go home
 
+    if (0 <= wcnt) {
+        ret = ioctl(ktfs_master->devio, IOCTL_FLUSH, NULL);
+        if (ret < 0 && ret != -ENOTSUP)
+            wcnt = ret;
+    }
 
-int ktfs_cntl(struct io *io, int cmd, void *arg)
-{
-    struct ktfs_file * file = (void*)io - offsetof(struct ktfs_file, io);
-    switch (cmd) {
-        case IOCTL_GETBLKSZ:
-            return 1;
-    
-        case IOCTL_GETEND:
-            // Return the file size via *(uint64_t*)arg
-            if (!arg) {
-                return -EINVAL;  // must provide a pointer
-            }
-            *(unsigned long long*)arg = file->fsize;
-            return 0;
-        
-        case IOCTL_SETEND:
-            unsigned long long new_size = *(unsigned long long *)arg;
+    // The blocks go home even if the record could not be written, as they
+    // would without a log
 
-            struct ktfs_inode inode;
+    for (i = 0; i < ktfs_log.count; i++)
+        cache_unhold_block(file_system_cache, ktfs_log.blks[i]);
 
-            lock_acquire(&ktfs_master->ktfs_lock);
+    ktfs_log.count = 0;
 
-            int ret = get_inode(file->ktfs_dir_entry.inode, &inode, 0);
+    // The deletes in the record are on disk once it is, and only then may
+    // the blocks they freed be discarded
 
-            if(ret < 0){
-                lock_release(&ktfs_master->ktfs_lock);
-                return ret;
-            }
+    ktfs_discard_run(0 <= wcnt);
 
+    if (wcnt < 0)
+        return wcnt;
 
-            if(new_size < inode.size || new_size > 16844288){
-                lock_release(&ktfs_master->ktfs_lock);
-                return -EINVAL;
-            }
+    // If writing the blocks home fails, the record stays for replay
 
+    ret = cache_flush(file_system_cache);
+    if (ret < 0)
+        return ret;
 
-            unsigned old_blocks = (inode.size   + KTFS_BLKSZ-1) / KTFS_BLKSZ;
-            unsigned new_blocks = (new_size     + KTFS_BLKSZ-1) / KTFS_BLKSZ;
-            // unsigned blocks_needed = new_blocks - old_blocks;      //  can be zero 
-
-
-            for(unsigned b = old_blocks; b < new_blocks; ++b){
-                uint32_t data_blk = find_free_data_block() - ktfs_master->data_start_block; // find_free_data_block returns global block number not data relative
-                if(data_blk == -1){
-                    lock_release(&ktfs_master->ktfs_lock);
-                    return -1;
-                }
-
-                void* ptr;
-                ret = cache_get_block(file_system_cache, (data_blk + ktfs_master->data_start_block)*KTFS_BLKSZ, (void**)&ptr);
-                if(ret < 0){
-                    lock_release(&ktfs_master->ktfs_lock);
-                    return ret;
-                }
-                memset(ptr, 0, KTFS_BLKSZ);
-                cache_release_block(file_system_cache, ptr, 1);
-
-                if(b < KTFS_NUM_DIRECT_DATA_BLOCKS){
-                    inode.block[b] = data_blk;
-                }
-                else if(b < KTFS_NUM_DIRECT_DATA_BLOCKS + 128){
-                    if(inode.indirect == 0){
-                        inode.indirect = find_free_data_block() - ktfs_master->data_start_block;
-                        if(inode.indirect == -1) return -1;
-                        zero_block(inode.indirect);
-                    }
-                    uint32_t *indirect;
-                    ret = cache_get_block(file_system_cache, (inode.indirect + ktfs_master->data_start_block)*KTFS_BLKSZ, (void**)&indirect);
-                    if(ret < 0){
-                        lock_release(&ktfs_master->ktfs_lock);
-                        return ret;
-                    }
-                    indirect[b - KTFS_NUM_DIRECT_DATA_BLOCKS] = data_blk;
-
-                    cache_release_block(file_system_cache, indirect, 1);
-                }
-                else{
-                    unsigned rel = b - (KTFS_NUM_DIRECT_DATA_BLOCKS + 128);
-                    unsigned dind_index = rel / (128*128); // either 0 or 1
-                    unsigned inside_dind = rel % (128*128);
-                    unsigned top_index = inside_dind / 128;
-                    unsigned bottom_index = inside_dind % 128;
-
-                    if(inode.dindirect[dind_index] == 0){
-                        inode.dindirect[dind_index] = find_free_data_block() - ktfs_master->data_start_block;
-                        if(inode.dindirect[dind_index] == -1){
-                            lock_release(&ktfs_master->ktfs_lock);
-                            return -1;
-                        }
-
-                        zero_block(inode.dindirect[dind_index]);
-                    }
-
-                    uint32_t * dind;
-                    ret = cache_get_block(file_system_cache, (inode.dindirect[dind_index] + ktfs_master->data_start_block)*KTFS_BLKSZ, (void**)&dind);
-                    if(ret < 0){
-                        lock_release(&ktfs_master->ktfs_lock);
-                        return ret;
-                    }
-                    if(dind[top_index] == 0){
-                        dind[top_index] = find_free_data_block() - ktfs_master->data_start_block;
-                        if(dind[top_index] == -1){
-                            cache_release_block(file_system_cache, dind, 0);
-                            lock_release(&ktfs_master->ktfs_lock);
-                            return -1;
-                        }
-                        zero_block(dind[top_index]);
-                    }
-
-                    uint32_t *ind;
-
-                    ret = cache_get_block(file_system_cache, (dind[top_index] + ktfs_master->data_start_block)*KTFS_BLKSZ, (void**)&ind);
-                    if(ret < 0){
-                        cache_release_block(file_system_cache, dind, 1);
-                        lock_release(&ktfs_master->ktfs_lock);
-                        return ret;
-                    }
-
-                    ind[bottom_index] = data_blk;
-
-                    cache_release_block(file_system_cache, ind, 1);
-                    cache_release_block(file_system_cache, dind, 1);
-                }
-            }
+    return ktfs_log_clear();
+}
 
-            inode.size = new_size;
-            put_inode(file->ktfs_dir_entry.inode, &inode);
+// Commit thread: commits the current record every KTFS_LOG_COMMIT_MS, so
+// operations reach the disk even when nothing fills the log.
 
-            file->fsize = new_size;
-            
-            lock_release(&ktfs_master->ktfs_lock);
+void ktfs_log_func(void) {
+    struct alarm al;
 
-            return 0;
+    alarm_init(&al, "ktfs_log");
 
-        default:
-            return -ENOTSUP;
-        }
+    for (;;) {
+        alarm_sleep_ms(&al, KTFS_LOG_COMMIT_MS);
+
+        if (ktfs_log.count == 0)
+            continue;
+
+        rwlock_write_acquire(&ktfs_master->dir_lock);
+        ktfs_log_commit();
+        rwlock_write_release(&ktfs_master->dir_lock);
+    }
 }
 
 
 int ktfs_flush(void)
 {
-    int ret = cache_flush(file_system_cache);
+    int ret;
+
+    // Inodes first: writing them back dirties their inode blocks
+
+    lock_acquire(&ktfs_master->ktfs_lock);
+    ret = ktfs_isync();
+    lock_release(&ktfs_master->ktfs_lock);
+
+    if (ret < 0)
+        return ret;
+
+    rwlock_write_acquire(&ktfs_master->dir_lock);
+    ret = ktfs_log_commit();
+    rwlock_write_release(&ktfs_master->dir_lock);
+
+    if (ret < 0)
+        return ret;
+
+    ret = cache_flush(file_system_cache);
+
+    if (ret == 0 && ktfs_ramdisk != NULL && ktfs_ramdisk->writeback)
+        ret = ktfs_ramdisk_sync();
 
     return ret;
 }
 
+// Claims a free inode number. Returns -ENOINODEBLKS if there is none.
+
 int find_free_inode(void)
 {
-    int inodes_per_block = KTFS_BLKSZ / sizeof(struct ktfs_inode);
+    int inum;
 
-    struct ktfs_inode zero_inode;
-    memset(&zero_inode, 0, sizeof zero_inode);
+    lock_acquire(&ktfs_master->bitmap_lock);
+    inum = ktfs_map_claim(ktfs_master->inomap, ktfs_master->inomap_words,
+        &ktfs_master->inomap_next);
+    lock_release(&ktfs_master->bitmap_lock);
 
-    for (int blk = ktfs_master->inode_start_block;
-         blk < ktfs_master->data_start_block;
-         ++blk)
-    {
-        struct ktfs_inode *inode_block;
-        int ret = cache_get_block(file_system_cache,
-                    blk * KTFS_BLKSZ, (void**)&inode_block);
-        if (ret < 0) return ret;
-
-        for (int i = 0; i < inodes_per_block; ++i) {
-            if (memcmp(&inode_block[i], &zero_inode, sizeof zero_inode) == 0) {
-                int inode_num = (blk - ktfs_master->inode_start_block) *
-                                inodes_per_block + i;
-                cache_release_block(file_system_cache, inode_block, 0);
-                return inode_num;
-            }
-        }
-        cache_release_block(file_system_cache, inode_block, 0);
-    }
-    return -1;          /* or -1 if you prefer */
+    return (inum < 0) ? -ENOINODEBLKS : inum;
+}
+
+// Returns inode /inum/ to the free inode bitmap.
+
+static void ktfs_free_inode(uint16_t inum)
+{
+    lock_acquire(&ktfs_master->bitmap_lock);
+    ktfs_master->inomap[inum / 64] &= ~(1ULL << (inum % 64));
+    lock_release(&ktfs_master->bitmap_lock);
 }
 
 
 
 int ktfs_create	(const char * name){
 
+    int ret, end_ret;
+
     if(name == NULL){
         return -EINVAL;
     }
 
-    uint16_t filler;
-
-    lock_acquire(&ktfs_master->ktfs_lock);
+    rwlock_write_acquire(&ktfs_master->dir_lock);
 
-    int ret = find_inode_by_name(name, &filler, 0);
+    ret = ktfs_log_begin();
 
-    if(ret != -7){
-        lock_release(&ktfs_master->ktfs_lock);
-        return -EINVAL;
+    if(ret == 0){
+        ret = ktfs_create_entry(name);
+        end_ret = ktfs_log_end();
+        if(ret == 0)
+            ret = end_ret;
     }
 
-    struct ktfs_inode root;
+    rwlock_write_release(&ktfs_master->dir_lock);
+
+    return ret;
+}
 
-    ret = get_inode(ktfs_master->superblock.root_directory_inode, &root, 0);
+// Adds directory entry /name/ for a new, empty file. Runs as one log
+// operation with dir_lock held.
 
-    if(ret < 0){
-        lock_release(&ktfs_master->ktfs_lock);
-        return ret;
+static int ktfs_create_entry(const char * name)
+{
+    if(ktfs_dir_lookup(name) != NULL){
+        return -EINVAL;
     }
 
-    if(root.size >= 3 * KTFS_BLKSZ){ // root_directory file is alr full with 96 dentries
-        lock_release(&ktfs_master->ktfs_lock);
-        return -1;
-    }
+    struct ktfs_inode * const root = &ktfs_root->inode;
 
- 
-    int direct_block = root.size / KTFS_BLKSZ;
+    uint32_t idx = root->size / sizeof(struct ktfs_dir_entry);
 
-    if(direct_block > 0){
-        if(root.block[direct_block] == 0){
-            root.block[direct_block] = find_free_data_block();
-            if(root.block[direct_block] == -1){
-                lock_release(&ktfs_master->ktfs_lock);
-                return -1;
-            }
-        }
-    }
+    int ret;
 
-    int block_offset = root.size % KTFS_BLKSZ;
+    // Directory is full up to its last block: grow it by one block. The
+    // index keeps lookups constant time however large it gets.
 
-    int dentry_index = block_offset / sizeof(struct ktfs_dir_entry);
+    if(idx % KTFS_DENTS_PER_BLK == 0 && idx != 0){
+        ret = ktfs_alloc_file_block(ktfs_root, idx / KTFS_DENTS_PER_BLK);
+        ktfs_root->dirty = 1;
+        if(ret < 0){
+                return ret;
+        }
+    }
 
     struct ktfs_dir_entry * dir_block;
+    uint32_t dir_gblk;
 
-    ret = cache_get_block(file_system_cache, (root.block[direct_block] + ktfs_master->data_start_block)*KTFS_BLKSZ, (void**)&dir_block);
+    ret = ktfs_dir_get_block(idx, &dir_block, &dir_gblk);
 
     if(ret < 0){
-        lock_release(&ktfs_master->ktfs_lock);
         return ret;
     }
 
@@ -988,8 +2853,7 @@ int ktfs_create	(const char * name){
     if (new_inode_num < 0) {
         // release the block we read, not dirty
         cache_release_block(file_system_cache, dir_block, 0);
-        lock_release(&ktfs_master->ktfs_lock);
-        return new_inode_num; // e.g. -ENOSPC if no free inode
+        return new_inode_num; // -ENOINODEBLKS if no free inode
     }
 
 
@@ -1001,9 +2865,8 @@ int ktfs_create	(const char * name){
     ret = put_inode(new_inode_num, &new_file_inode);
 
     if (ret < 0) {
-        // Optionally free the inode in your bitmap if needed
+        ktfs_free_inode(new_inode_num);
         cache_release_block(file_system_cache, dir_block, 0);
-        lock_release(&ktfs_master->ktfs_lock);
         return ret;
     }
 
@@ -1015,19 +2878,21 @@ int ktfs_create	(const char * name){
 
     addition.inode = (uint16_t)new_inode_num;
 
-    dir_block[dentry_index] = addition;
-
-    cache_release_block(file_system_cache, dir_block, 1);
-
-    root.size += sizeof(struct ktfs_dir_entry);
+    ret = ktfs_dir_insert(&addition, idx);
 
-    ret = put_inode(ktfs_master->superblock.root_directory_inode, &root);
     if (ret < 0) {
-        lock_release(&ktfs_master->ktfs_lock);
-        return ret; 
+        ktfs_free_inode(new_inode_num);
+        cache_release_block(file_system_cache, dir_block, 0);
+        return ret;
     }
 
-    lock_release(&ktfs_master->ktfs_lock);
+    dir_block[idx % KTFS_DENTS_PER_BLK] = addition;
+
+    ktfs_log_write(dir_block, dir_gblk);
+    cache_release_block(file_system_cache, dir_block, 1);
+
+    root->size += sizeof(struct ktfs_dir_entry);
+    ktfs_root->dirty = 1;
 
     return 0;
 
@@ -1044,210 +2909,245 @@ int ktfs_delete (const char * name)
     for(int i = 0; i < MAX_OPEN_FILES; i++){
         if(open_files[i].in_use == 1){
             if(strcmp(open_files[i].ktfs_dir_entry.name, name) == 0){
-                ktfs_close(&open_files[i].io);
+                ktfs_detach(&open_files[i]);
             }
         }
     }
 
     uint16_t inode_number;
+    struct ktfs_inode inode;
+    int ret, end_ret;
 
     lock_acquire(&ktfs_master->ktfs_lock);
+    rwlock_write_acquire(&ktfs_master->dir_lock);
 
-    int ret = find_inode_by_name(name, &inode_number, 1);
+    ret = ktfs_log_begin();
 
-    if(ret == -ENOENT){
+    if(ret < 0){
+        rwlock_write_release(&ktfs_master->dir_lock);
         lock_release(&ktfs_master->ktfs_lock);
-        return -1;
+        return ret;
     }
 
-    struct ktfs_inode inode;
+    ret = find_inode_by_name(name, &inode_number, 1);
 
-    get_inode(inode_number, &inode, 1);
+    if(ret == 0)
+        ktfs_iforget(inode_number);
 
-    int num_blocks = (inode.size + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+    lock_release(&ktfs_master->ktfs_lock);
 
-    int blocks_cleared = 0;
+    // The inode can no longer be found or opened. Freeing it and its blocks
+    // is part of the same log operation as removing its entry.
 
-    int byte_index = 0;
+    if(ret == 0)
+        ret = get_inode(inode_number, &inode, 1);
 
-    int bit_offset = 0;
+    if(ret == 0){
+        ktfs_free_inode(inode_number);
+        ret = ktfs_free_file_blocks(&inode);
+    }
 
-    int block_number = 0;
+    end_ret = ktfs_log_end();
 
-    ret = 0;
-    
-    int bit_in_block = 0;
+    // Without a log the delete's metadata is still dirty in the cache. It
+    // must reach the device before the blocks are discarded, or a crash could
+    // leave the file pointing at them. If the flush fails they are only
+    // freed.
 
-    //clear the direct data blocks
+    if (ktfs_log.start == 0) {
+        ktfs_discard_run(ktfs_master->can_discard && ktfs_discard.n != 0 &&
+            cache_flush(file_system_cache) == 0);
+    }
 
-    for(int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS && blocks_cleared < num_blocks; i++){
-        block_number = (inode.block[i] + ktfs_master->data_start_block) / (KTFS_BLKSZ * 8);
+    rwlock_write_release(&ktfs_master->dir_lock);
+
+    if(ret == -ENOENT){
+        return -1;
+    }
+
+    return (ret < 0) ? ret : end_ret;
+}
+
+// Frees the data and index blocks of deleted inode /inode/, queueing them to
+// be discarded (see ktfs_discard_block()).
 
-        bit_in_block = (inode.block[i] + ktfs_master->data_start_block) % (KTFS_BLKSZ * 8);
+static int ktfs_free_file_blocks(const struct ktfs_inode * inode)
+{
+    int num_blocks = (inode->size + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+
+    int blocks_cleared = 0;
 
-        byte_index = bit_in_block / 8;
-        bit_offset = bit_in_block % 8;
+    int ret = 0;
 
-        uint8_t * byte_ptr;
+    //clear the direct data blocks
 
-        ret = cache_get_block(file_system_cache, (block_number + ktfs_master->bitmap_start_block)*KTFS_BLKSZ, (void**)&byte_ptr);
+    for(int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS && blocks_cleared < num_blocks; i++){
+        ret = ktfs_discard_block(inode->block[i]);
 
         if(ret < 0){
-            lock_release(&ktfs_master->ktfs_lock);
             return ret;
         }
 
-        byte_ptr[byte_index] &= ~(1 << bit_offset); // little ender dragon (endian)
-
-        cache_release_block(file_system_cache, byte_ptr, 1);
-        
         blocks_cleared++;
     }
 
+    // clear the indirect blocks
 
-
-    // clear the indirect blocks type shi
-
-    if (inode.indirect != 0) {
+    if (inode->indirect != 0) {
         uint32_t *ind_array;
-        ret = cache_get_block(file_system_cache, (inode.indirect + ktfs_master->data_start_block) * KTFS_BLKSZ, (void **)&ind_array);
+        ret = cache_get_block(file_system_cache, (inode->indirect + ktfs_master->data_start_block) * KTFS_BLKSZ, (void **)&ind_array);
 
         if(ret < 0){
-            lock_release(&ktfs_master->ktfs_lock);
             return ret;
         }
 
-        for(int i = 0; i < 128 && blocks_cleared < num_blocks; i++){
+        for(int i = 0; i < KTFS_PTRS_PER_BLK && blocks_cleared < num_blocks; i++){
             if(ind_array[i] == 0) continue;
-            
-            block_number = (ind_array[i] + ktfs_master->data_start_block) / (KTFS_BLKSZ * 8);
-            
-            bit_in_block = (ind_array[i] + ktfs_master->data_start_block) % (KTFS_BLKSZ *8);
-
-            byte_index = bit_in_block / 8;
-            bit_offset = bit_in_block % 8;
 
-            uint8_t * byte_ptr;
-
-            ret = cache_get_block(file_system_cache, (block_number + ktfs_master->bitmap_start_block)*KTFS_BLKSZ, (void**)&byte_ptr);
+            ret = ktfs_discard_block(ind_array[i]);
 
             if(ret < 0){
                 cache_release_block(file_system_cache, ind_array, 0);
-                lock_release(&ktfs_master->ktfs_lock);
                 return ret;
             }
 
-            byte_ptr[byte_index] &= ~(1 << bit_offset);
-
-            cache_release_block(file_system_cache, byte_ptr, 1);
-
             blocks_cleared++;
         }
 
-        block_number = (inode.indirect + ktfs_master->data_start_block) / (KTFS_BLKSZ * 8);
-        bit_in_block = (inode.indirect + ktfs_master->data_start_block) % (KTFS_BLKSZ * 8);
-        byte_index = bit_in_block / 8;
-        bit_offset = bit_in_block % 8;
-    
-        uint8_t *byte_ptr;
-        ret = cache_get_block(file_system_cache, (block_number + ktfs_master->bitmap_start_block) * KTFS_BLKSZ, (void**)&byte_ptr);
+        cache_release_block(file_system_cache, ind_array, 0);
+
+        ret = ktfs_discard_block(inode->indirect);
         if (ret < 0){
-            lock_release(&ktfs_master->ktfs_lock);
             return ret;
         }
-        byte_ptr[byte_index] &= ~(1 << bit_offset);
-
-        cache_release_block(file_system_cache, byte_ptr, 1);
-
-        cache_release_block(file_system_cache, ind_array, 0);
     }
 
-    
-
-    //clear dindirect blocks now frfr
+    //clear dindirect blocks
 
     for(int i = 0; i < KTFS_NUM_DINDIRECT_BLOCKS && blocks_cleared < num_blocks; i++){
-        if (inode.dindirect[i] == 0) continue; 
+        if (inode->dindirect[i] == 0) continue; 
 
         uint32_t *dind_array;
-        ret = cache_get_block(file_system_cache, (inode.dindirect[i] + ktfs_master->data_start_block) * KTFS_BLKSZ, (void **)&dind_array);
+        ret = cache_get_block(file_system_cache, (inode->dindirect[i] + ktfs_master->data_start_block) * KTFS_BLKSZ, (void **)&dind_array);
 
         if(ret < 0){
-            lock_release(&ktfs_master->ktfs_lock);
             return ret;
         }
 
-        for(int j = 0; j < 128 && blocks_cleared < num_blocks; j++){
+        for(int j = 0; j < KTFS_PTRS_PER_BLK && blocks_cleared < num_blocks; j++){
             if (dind_array[j] == 0) continue;
             uint32_t * ind_array;
 
             ret = cache_get_block(file_system_cache, (dind_array[j] + ktfs_master->data_start_block) * KTFS_BLKSZ,(void **)&ind_array);
             if (ret < 0) {
-                lock_release(&ktfs_master->ktfs_lock);
                 cache_release_block(file_system_cache, dind_array, 0);
                 return ret;
             }
 
-            for (int k = 0; k < 128 && blocks_cleared < num_blocks; k++) {
+            for (int k = 0; k < KTFS_PTRS_PER_BLK && blocks_cleared < num_blocks; k++) {
                 if (ind_array[k] == 0) continue;
-    
-                block_number = (ind_array[k] + ktfs_master->data_start_block) / (KTFS_BLKSZ * 8);
-                bit_in_block = (ind_array[k] + ktfs_master->data_start_block) % (KTFS_BLKSZ * 8);
-                byte_index = bit_in_block / 8;
-                bit_offset = bit_in_block % 8;
-    
-                uint8_t *byte_ptr;
-                ret = cache_get_block(file_system_cache,(block_number + ktfs_master->bitmap_start_block) * KTFS_BLKSZ, (void **)&byte_ptr);
-                if (ret < 0) {
-                    cache_release_block(file_system_cache, ind_array, 0);
-                    cache_release_block(file_system_cache, dind_array, 0);
-                    lock_release(&ktfs_master->ktfs_lock);
-                    return ret;
-                }
-    
-                byte_ptr[byte_index] &= ~(1 << bit_offset);
-                cache_release_block(file_system_cache, byte_ptr, 1);
-    
+
+                ret = ktfs_discard_block(ind_array[k]);
+                if (ret < 0)
+                    break;
+
                 blocks_cleared++;
             }
+
+            cache_release_block(file_system_cache, ind_array, 0);
+
             //clear the intermediate indirect blocks
-            block_number = (dind_array[j] + ktfs_master->data_start_block) / (KTFS_BLKSZ * 8);
-            bit_in_block = (dind_array[j] + ktfs_master->data_start_block) % (KTFS_BLKSZ * 8);
-            byte_index = bit_in_block / 8;
-            bit_offset = bit_in_block % 8;
-            uint8_t *byte_ptr;
-            ret = cache_get_block(file_system_cache, (block_number + ktfs_master->bitmap_start_block) * KTFS_BLKSZ, (void**)&byte_ptr);
-            
+            if (ret == 0)
+                ret = ktfs_discard_block(dind_array[j]);
+
             if (ret < 0){
-                lock_release(&ktfs_master->ktfs_lock);
+                cache_release_block(file_system_cache, dind_array, 0);
                 return ret;
             }
-            byte_ptr[byte_index] &= ~(1 << bit_offset);
-
-            cache_release_block(file_system_cache, byte_ptr, 1);
-            cache_release_block(file_system_cache, ind_array, 0);
         }
+
+        cache_release_block(file_system_cache, dind_array, 0);
+
         //clear the dindirect blocks themselves
-        block_number = (inode.dindirect[i] + ktfs_master->data_start_block) / (KTFS_BLKSZ * 8);
-        bit_in_block = (inode.dindirect[i] + ktfs_master->data_start_block) % (KTFS_BLKSZ * 8);
-        byte_index = bit_in_block / 8;
-        bit_offset = bit_in_block % 8;
+        ret = ktfs_discard_block(inode->dindirect[i]);
 
-        uint8_t *byte_ptr;
-        ret = cache_get_block(file_system_cache, (block_number + ktfs_master->bitmap_start_block) * KTFS_BLKSZ, (void**)&byte_ptr);
-        
         if (ret < 0){
-            lock_release(&ktfs_master->ktfs_lock);
             return ret;
         }
-        byte_ptr[byte_index] &= ~(1 << bit_offset);
-        cache_release_block(file_system_cache, byte_ptr, 1);
-        cache_release_block(file_system_cache, dind_array, 0);
     }
-    lock_release(&ktfs_master->ktfs_lock);
     return 0;
 }
 
+// Frees data block /blkno/ (data-region index) of a deleted file on disk and
+// queues it to be discarded when the delete is committed, keeping it set in
+// the in-memory bitmap until then. Frees it outright if the device cannot
+// discard or the queue is full. Caller holds dir_lock.
 
-    
+static int ktfs_discard_block(uint32_t blkno)
+{
+    const uint32_t gblk = blkno + ktfs_master->data_start_block;
+    const uint64_t mask = 1ULL << (gblk % 64);
+    const uint32_t n = ktfs_discard.n;
+    int extend, ret = 0;
+
+    if (!ktfs_master->can_discard)
+        return ktfs_free_data_block(blkno);
+
+    extend = (n != 0 &&
+        ktfs_discard.start[n-1] + ktfs_discard.count[n-1] == gblk);
+
+    if (!extend && n == KTFS_DISCARD_MAX)
+        return ktfs_free_data_block(blkno);
+
+    lock_acquire(&ktfs_master->bitmap_lock);
+
+    if (ktfs_master->blkmap[gblk / 64] & mask) {
+        // Clear the bit on disk only
+        ktfs_master->blkmap[gblk / 64] &= ~mask;
+        ret = ktfs_bitmap_sync(gblk);
+        ktfs_master->blkmap[gblk / 64] |= mask;
+
+        if (ret == 0 && extend)
+            ktfs_discard.count[n-1] += 1;
+        else if (ret == 0) {
+            ktfs_discard.start[n] = gblk;
+            ktfs_discard.count[n] = 1;
+            ktfs_discard.n = n + 1;
+        }
+    }
+
+    lock_release(&ktfs_master->bitmap_lock);
+    return ret;
+}
+
+// Discards the queued runs of blocks, if /discard/ is non-zero, and returns
+// them to the in-memory bitmap. Discard errors are ignored: the blocks are
+// free either way. Caller holds dir_lock.
+
+static void ktfs_discard_run(int discard)
+{
+    struct ioextent ext;
+    uint32_t i, gblk;
+
+    for (i = 0; i < ktfs_discard.n; i++) {
+        if (discard && ktfs_master->can_discard) {
+            ext.pos = ktfs_discard.start[i] * (unsigned long long)KTFS_BLKSZ;
+            ext.len = ktfs_discard.count[i] * (unsigned long long)KTFS_BLKSZ;
+            if (ioctl(ktfs_master->devio, IOCTL_DISCARD, &ext) == -ENOTSUP)
+                ktfs_master->can_discard = 0;
+        }
+
+        lock_acquire(&ktfs_master->bitmap_lock);
+
+        for (gblk = ktfs_discard.start[i];
+            gblk < ktfs_discard.start[i] + ktfs_discard.count[i]; gblk++)
+        {
+            ktfs_master->blkmap[gblk / 64] &= ~(1ULL << (gblk % 64));
+        }
+
+        ktfs_master->free_blocks += ktfs_discard.count[i];
+        lock_release(&ktfs_master->bitmap_lock);
+    }
 
+    ktfs_discard.n = 0;
+}
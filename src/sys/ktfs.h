@@ -49,6 +49,11 @@ struct filesystem {
     struct ktfs_data_block data_blocks[];
 };
 
+The metadata log is a run of data blocks, marked in use in the bitmap,
+whose location is kept in the padding right after the superblock (struct
+ktfs_log_super). Its first block is a struct ktfs_log_header followed by
+copies of the blocks it names.
+
 NOTE: The ((packed)) attribute is used to ensure that the struct is packed and 
 there is no padding between the members or struct alignment requirements.
 */
@@ -61,6 +66,26 @@ struct ktfs_superblock {
     uint16_t root_directory_inode;
 } __attribute__((packed));
 
+// Metadata log location, stored right after the superblock in block 0
+#define KTFS_LOG_MAGIC 0x474f4c4b // "KLOG"
+
+struct ktfs_log_super {
+    uint32_t magic;                                 // KTFS_LOG_MAGIC if present
+    uint32_t start;                                 // Block index of log header
+    uint32_t nblks;                                 // Log blocks after header
+} __attribute__((packed));
+
+// Header of a committed log record
+#define KTFS_LOG_MAXBLKS ((KTFS_BLKSZ - 4 * sizeof(uint32_t)) / sizeof(uint32_t))
+
+struct ktfs_log_header {
+    uint32_t magic;                                 // KTFS_LOG_MAGIC if valid
+    uint32_t seq;                                   // Record sequence number
+    uint32_t count;                                 // Blocks in the record
+    uint32_t checksum;                              // Of header and blocks
+    uint32_t blkno[KTFS_LOG_MAXBLKS];               // Home block of each copy
+} __attribute__((packed));
+
 // Inode with indirect and doubly-indirect blocks
 struct ktfs_inode {
     uint32_t size;                                  // Size in bytes
@@ -0,0 +1,154 @@
+// ktrace.c - Kernel event trace buffer
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef KTRACE_TRACE
+#define TRACE
+#endif
+
+#ifdef KTRACE_DEBUG
+#define DEBUG
+#endif
+
+#include "ktrace.h"
+#include "device.h"
+#include "ioimpl.h"
+#include "thread.h"
+#include "riscv.h"
+#include "error.h"
+#include "string.h"
+#include "console.h"
+
+#include <stddef.h>
+
+// The ring holds the last KTRACE_NREC records, which must be a power of two.
+// Each tracepoint claims the next record by bumping ktrace_head atomically.
+// A record's seq is cleared before it is filled in and set to its index plus
+// one afterwards, so a reader that sees the same expected seq before and
+// after copying a record knows it got all of it.
+//
+// The ktrace device ("ktrace", instance 0) gives user programs the buffer.
+// A read returns as many of the most recent records as fit in the buffer,
+// oldest first, without consuming them. IOCTL_SETTRACE sets the mask of
+// events to record (0 turns tracing off); IOCTL_GETBLKSZ returns the record
+// size.
+
+#ifndef KTRACE_NREC
+#define KTRACE_NREC 1024
+#endif
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int ktrace_open(struct io ** ioptr, void * aux);
+static int ktrace_cntl(struct io * io, int cmd, void * arg);
+static long ktrace_read(struct io * io, void * buf, long bufsz);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct ktrace_rec ktrace_ring[KTRACE_NREC];
+static uint64_t ktrace_head; // index of next record
+
+static const struct iointf ktrace_intf = {
+    .cntl = &ktrace_cntl,
+    .read = &ktrace_read
+};
+
+static struct io ktrace_io;
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+volatile unsigned int ktrace_mask;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void ktrace_attach(void) {
+    ioinit0(&ktrace_io, &ktrace_intf);
+    register_device("ktrace", ktrace_open, NULL);
+}
+
+void ktrace_record(unsigned int event, uint64_t arg0, uint64_t arg1) {
+    struct ktrace_rec * rec;
+    uint64_t idx;
+
+    idx = __atomic_fetch_add(&ktrace_head, 1, __ATOMIC_RELAXED);
+    rec = &ktrace_ring[idx % KTRACE_NREC];
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    rec->time = rdtime();
+    rec->event = event;
+    rec->hart = running_hart();
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+
+    __atomic_store_n(&rec->seq, (uint32_t)(idx + 1), __ATOMIC_RELEASE);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+int ktrace_open(struct io ** ioptr, void * aux) {
+    *ioptr = ioaddref(&ktrace_io);
+    return 0;
+}
+
+int ktrace_cntl(struct io * io, int cmd, void * arg) {
+    switch (cmd) {
+    case IOCTL_GETBLKSZ:
+        return sizeof(struct ktrace_rec);
+    case IOCTL_SETTRACE:
+        if (arg == NULL)
+            return -EINVAL;
+        ktrace_mask = *(const unsigned int *)arg;
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+// Copies the most recent records that fit in _buf_, oldest first. Records
+// overwritten while being copied are left out. Returns the number of bytes
+// written, a multiple of the record size.
+
+long ktrace_read(struct io * io, void * buf, long bufsz) {
+    struct ktrace_rec * const out = buf;
+    struct ktrace_rec * rec;
+    uint64_t head, idx, n;
+    uint32_t seq;
+    long cnt = 0;
+
+    if (bufsz < 0)
+        return -EINVAL;
+    
+    head = __atomic_load_n(&ktrace_head, __ATOMIC_ACQUIRE);
+
+    n = bufsz / sizeof(struct ktrace_rec);
+    if (KTRACE_NREC < n)
+        n = KTRACE_NREC;
+    if (head < n)
+        n = head;
+    
+    for (idx = head - n; idx < head; idx++) {
+        rec = &ktrace_ring[idx % KTRACE_NREC];
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+        if (seq != (uint32_t)(idx + 1))
+            continue;
+        
+        memcpy(&out[cnt], rec, sizeof(struct ktrace_rec));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq)
+            cnt++;
+    }
+
+    trace("%s: %ld of %lu records", __func__, cnt, (unsigned long)n);
+    return cnt * sizeof(struct ktrace_rec);
+}
@@ -0,0 +1,66 @@
+// ktrace.h - Kernel event trace buffer
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _KTRACE_H_
+#define _KTRACE_H_
+
+#include <stdint.h>
+
+// Tracepoints append fixed-size binary records to a ring buffer in memory.
+// Recording takes no lock, so tracepoints may be placed in ISRs and on any
+// hart. Events are off until enabled through the ktrace device (see
+// ktrace.c); a disabled tracepoint costs a load and a branch. Building with
+// KTRACE=0 removes the tracepoints altogether.
+
+#ifndef KTRACE
+#define KTRACE 1
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// Event ids and the meaning of their two arguments. The mask given to
+// IOCTL_SETTRACE has bit n set to record event n.
+
+enum ktrace_event {
+    KTRACE_SWITCH = 1,      // from tid, to tid
+    KTRACE_SYSCALL_ENTER,   // syscall number, tid
+    KTRACE_SYSCALL_EXIT,    // syscall number, return value
+    KTRACE_INTR,            // scause, PLIC source (0 if not external)
+    KTRACE_BIO_SUBMIT,      // sector, request type | len << 8
+    KTRACE_BIO_DONE,        // descriptor head, status
+    KTRACE_CACHE_MISS       // block position, 0
+};
+
+// A trace record, as read from the ktrace device. The sequence number orders
+// records and lets a reader detect one that was overwritten while it read it.
+
+struct ktrace_rec {
+    uint64_t time; // rdtime()
+    uint32_t seq;
+    uint16_t event;
+    uint16_t hart;
+    uint64_t arg0;
+    uint64_t arg1;
+};
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+extern volatile unsigned int ktrace_mask;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+extern void ktrace_attach(void);
+extern void ktrace_record(unsigned int event, uint64_t arg0, uint64_t arg1);
+
+static inline void ktrace(unsigned int event, uint64_t arg0, uint64_t arg1) {
+    if (KTRACE && (ktrace_mask & (1U << event)))
+        ktrace_record(event, arg0, arg1);
+}
+
+#endif // _KTRACE_H_
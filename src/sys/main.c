@@ -84,71 +84,215 @@
 #include "elf.h"
 #include "assert.h"
 #include "thread.h"
+#include "timer.h"
 #include "process.h"
 #include "memory.h"
 #include "fs.h"
 #include "io.h"
 #include "device.h"
 #include "rtc.h"
+#include "ktrace.h"
+#include "klog.h"
+#include "ioring.h"
+#include "stripe.h"
+#include "kbench.h"
 #include "uart.h"
 #include "intr.h"
 #include "dev/virtio.h"
 #include "heap.h"
 #include "string.h"
+#include "riscv.h"
 
 #define VIRTIO_MMIO_STEP (VIRTIO1_MMIO_BASE-VIRTIO0_MMIO_BASE)
-extern char _kimg_end[]; 
+extern char _kimg_end[];
+
+// Define RAMDISK to serve the file system from a copy of the disk in memory.
+// With RAMDISK_WRITEBACK non-zero, fsflush() writes changes to the disk.
+
+#ifndef RAMDISK_WRITEBACK
+#define RAMDISK_WRITEBACK 1
+#endif 
+
+// Define STRIPE_NDISK greater than 1 to mount the file system from a stripe
+// device over the first STRIPE_NDISK vioblk disks, STRIPE_SIZE bytes per
+// unit. The disk images must already be laid out that way.
+
+#ifndef STRIPE_NDISK
+#define STRIPE_NDISK 1
+#endif
+
+#ifndef STRIPE_SIZE
+#define STRIPE_SIZE 4096
+#endif
+
+// With BOOT_TIMELINE non-zero, main() notes the time each boot phase ends
+// and prints the timeline just before the first exec. Times are from reset.
+
+#ifndef BOOT_TIMELINE
+#define BOOT_TIMELINE 1
+#endif
+
+#define BOOT_NMARK 32
+
+static struct {
+    const char * name;
+    int arg; // virtio slot, or -1
+    unsigned long long time; // rdtime() at the end of the phase
+} boot_marks[BOOT_NMARK];
+
+static int boot_nmark;
+static unsigned long long boot_start; // rdtime() on entry to main()
+
+static struct io * open_disk(void);
+static void boot_mark(const char * name, int arg);
+static void print_boot_timeline(void);
 
 void main(void) {
-    struct io *blkio, *shellio;
+    struct io *blkio, *shellio, *uartio;
     int result;
     int i;
 
+    boot_start = rdtime();
     
     console_init();
     devmgr_init();
+    boot_mark("devmgr_init", -1);
     intrmgr_init();
     thrmgr_init();
+    boot_mark("intrmgr_init, thrmgr_init", -1);
     memory_init();
+    boot_mark("memory_init", -1);
     procmgr_init();
-    start_interrupter();
+    timer_init();
+    start_intr_worker();
+    klog_attach();
+    ioring_init();
+    boot_mark("procmgr, timer, workers", -1);
+    smp_start();
+    boot_mark("smp_start", -1);
 
 
 
     uart_attach((void*)UART0_MMIO_BASE, UART0_INTR_SRCNO+0);
     uart_attach((void*)UART1_MMIO_BASE, UART0_INTR_SRCNO+1);
     rtc_attach((void*)RTC_MMIO_BASE);
+    ktrace_attach();
+    boot_mark("uart, rtc, ktrace", -1);
     
+    // Devices not needed for the root file system only record where they
+    // are here and attach on first open (see VIRTIO_LAZY in virtio.c).
+
     for (i = 0; i < 8; i++) {
         virtio_attach ((void*)VIRTIO0_MMIO_BASE + i*VIRTIO_MMIO_STEP, VIRTIO0_INTR_SRCNO + i);
+        boot_mark("virtio_attach", i);
     }
 
-    result = open_device("vioblk", 0, &blkio);
-    if (result < 0) {
-        kprintf("Error: %d\n", result);
-        panic("Failed to open vioblk\n");
-    }
+    blkio = open_disk();
 
+#ifdef RAMDISK
+    result = fsmount_ramdisk(blkio, RAMDISK_WRITEBACK);
+#else
     result = fsmount(blkio);
+#endif
     if (result < 0) {
         kprintf("Error: %d\n", result);
         panic("Failed to mount filesystem\n");
     }
 
-    result = open_device("uart", 1, &current_process()->iotab[2]);
+    boot_mark("fsmount", -1);
+
+    result = open_device("uart", 1, &uartio);
+    if (result == 0)
+        result = process_installio(current_process(), 2, uartio);
     if (result < 0) {
         kprintf("Error: %d\n", result);
         panic("Failed to open UART\n");
     }
 
+#ifdef BENCH
+    kbench_run(blkio);
+#endif
+
     result = fsopen("shell.elf", &shellio);
     if (result < 0) panic("Failed to open shell.elf");
 
     kprintf("GOT HERE TYPE ISH");
 
+    boot_mark("open shell.elf", -1);
+    print_boot_timeline();
+
     result = process_exec(shellio, 0, NULL);
 
     kprintf("GOT HERE TYPE SHIII");
     
     panic("Should not return from shell");
 }
+
+// Opens the disk that holds the file system: vioblk 0, or a stripe device
+// over vioblk 0 to STRIPE_NDISK-1.
+
+struct io * open_disk(void) {
+    struct io * disks[STRIPE_NDISK];
+    struct io * blkio;
+    int result;
+    int i;
+
+    for (i = 0; i < STRIPE_NDISK; i++) {
+        result = open_device("vioblk", i, &disks[i]);
+        if (result < 0) {
+            kprintf("Error: %d\n", result);
+            panic("Failed to open vioblk\n");
+        }
+    }
+
+    if (STRIPE_NDISK == 1)
+        return disks[0];
+
+    blkio = create_stripe_io(disks, STRIPE_NDISK, STRIPE_SIZE);
+
+    for (i = 0; i < STRIPE_NDISK; i++)
+        ioclose(disks[i]);
+
+    if (blkio == NULL)
+        panic("Failed to create stripe device\n");
+
+    return blkio;
+}
+
+void boot_mark(const char * name, int arg) {
+    if (boot_nmark < BOOT_NMARK) {
+        boot_marks[boot_nmark].name = name;
+        boot_marks[boot_nmark].arg = arg;
+        boot_marks[boot_nmark].time = rdtime();
+        boot_nmark++;
+    }
+}
+
+// Prints each phase with the time it ended and how long it took, in
+// microseconds. The first line is the time main() was entered.
+
+void print_boot_timeline(void) {
+    const unsigned long long tpus = TIMER_FREQ / 1000000;
+    unsigned long long prev = boot_start;
+    int i;
+
+    if (!BOOT_TIMELINE)
+        return;
+
+    kprintf("\nboot: %llu us: main\n", boot_start / tpus);
+
+    for (i = 0; i < boot_nmark; i++) {
+        if (boot_marks[i].arg < 0) {
+            kprintf("boot: %llu us: %s (+%llu us)\n",
+                boot_marks[i].time / tpus, boot_marks[i].name,
+                (boot_marks[i].time - prev) / tpus);
+        } else {
+            kprintf("boot: %llu us: %s %d (+%llu us)\n",
+                boot_marks[i].time / tpus, boot_marks[i].name,
+                boot_marks[i].arg, (boot_marks[i].time - prev) / tpus);
+        }
+        prev = boot_marks[i].time;
+    }
+
+    kprintf("boot: %llu us: first exec\n", rdtime() / tpus);
+}
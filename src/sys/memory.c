@@ -33,6 +33,25 @@
 #define HEAP_INIT_MIN 256
 #endif
 
+// Largest block managed by the page allocator is 2^PAGE_MAX_ORDER pages.
+
+#ifndef PAGE_MAX_ORDER
+#define PAGE_MAX_ORDER 10
+#endif
+
+// Number of zeroed pages the idle thread keeps ready for page tables and
+// freshly mapped user memory.
+
+#ifndef ZERO_POOL_MAX
+#define ZERO_POOL_MAX 32
+#endif
+
+// Most reclaimers that can be registered (see register_reclaimer())
+
+#ifndef RECLAIMER_MAX
+#define RECLAIMER_MAX 4
+#endif
+
 // INTERNAL CONSTANT DEFINITIONS
 //
 
@@ -50,6 +69,11 @@
 #define ROOT_LEVEL 2
 #endif
 
+// End of the lower half of the Sv39 address space, above which only kernel
+// mappings live
+
+#define USER_SPAN_END ((uintptr_t)PTE_CNT / 2 * GIGA_SIZE)
+
 // IMPORTED GLOBAL SYMBOLS
 //
 
@@ -71,19 +95,26 @@ char memory_initialized = 0;
 // INTERNAL TYPE DEFINITIONS
 //
 
-// We keep free physical pages in a linked list of _chunks_, where each chunk
-// consists of several consecutive pages of memory. Initially, all free pages
-// are in a single large chunk. To allocate a block of pages, we break up the
-// smallest chunk on the list.
+// Free physical pages are kept by a buddy allocator. A free block of order k
+// is 2^k pages aligned to 2^k pages from RAM_START and sits on the list of
+// free blocks of that order. Its own first page holds the list links. When a
+// block is freed and its buddy (the other half of the order k+1 block) is
+// also free, the two are merged, and so on up the orders.
 
 /**
- * @brief Section of consecutive physical pages. We keep free physical pages in a
- * linked list of chunks. Initially, all free pages are in a single large chunk. To
- * allocate a block of pages, we break up the smallest chunk in the list
+ * @brief Free block of 2^order consecutive physical pages, on a doubly-linked
+ * list of free blocks of the same order.
  */
 struct page_chunk {
-    struct page_chunk * next; ///< Next page in list
-    unsigned long pagecnt; ///< Number of pages in chunk
+    struct page_chunk * next; ///< Next block in list
+    struct page_chunk * prev; ///< Previous block in list
+};
+
+/**
+ * @brief Page in the zeroed page pool. Everything except the link is zero.
+ */
+struct zero_page {
+    struct zero_page * next; ///< Next page in pool
 };
 
 /**
@@ -118,6 +149,19 @@ struct pte {
 #define PTE_GLOBAL(pte) (((pte).flags & PTE_G) != 0)
 #define PTE_LEAF(pte) (((pte).flags & (PTE_R | PTE_W | PTE_X)) != 0)
 
+// A leaf mapped with PTE_SHARED has this bit set in its RSW field
+
+#define PTE_RSW_SHARED 1
+#define PTE_SHARED_PAGE(pte) (((pte).rsw & PTE_RSW_SHARED) != 0)
+
+// A writable page shared copy-on-write after fork is mapped read-only with
+// this bit set in its RSW field
+
+#define PTE_RSW_COW 2
+#define PTE_COW_PAGE(pte) (((pte).rsw & PTE_RSW_COW) != 0)
+
+#define PAGE_INDEX(pp) (((uintptr_t)(pp) - RAM_START_PMA) / PAGE_SIZE)
+
 #define PT_INDEX(lvl, vpn) (((vpn) & (0x1FF << (lvl * (PAGE_ORDER - PTE_ORDER)))) \
                              >> (lvl * (PAGE_ORDER - PTE_ORDER)))
 // INTERNAL FUNCTION DECLARATIONS
@@ -129,6 +173,8 @@ static inline mtag_t active_space_mtag(void);
 static inline mtag_t ptab_to_mtag(struct pte * root, unsigned int asid);
 static inline struct pte * mtag_to_ptab(mtag_t mtag);
 static inline struct pte * active_space_ptab(void);
+static inline unsigned int mtag_asid(mtag_t mtag);
+static inline void flush_active_tlb(void);
 
 static inline void * pageptr(uintptr_t n);
 static inline uintptr_t pagenum(const void * p);
@@ -138,11 +184,40 @@ static inline struct pte leaf_pte(const void * pp, uint_fast8_t rwxug_flags);
 static inline struct pte ptab_pte(const struct pte * pt, uint_fast8_t g_flag);
 static inline struct pte null_pte(void);
 
+static struct pte * walk_leaf(uintptr_t vma);
+static int split_megapage(struct pte * pte1);
+static int unmap_subtree (
+    struct pte * pt, int lvl, uintptr_t base, uintptr_t start, uintptr_t end,
+    int keep_tables);
+static void * map_megapage(uintptr_t vma, void * pp, int rwxug_flags);
+static int fault_user_page(uintptr_t vma, int store, int fetch);
+
+static void free_block(unsigned long idx, unsigned int order);
+static void reclaim_pages(unsigned long want);
+static void chunk_insert(unsigned long idx, unsigned int order);
+static void chunk_remove(unsigned long idx, unsigned int order);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
 static mtag_t main_mtag;
 
+// Address space identifiers. ASID 0 belongs to the main memory space and to
+// spaces not yet given an ASID; switching to it flushes the whole TLB. Other
+// ASIDs are handed out in order. When they run out, the generation number is
+// bumped, the TLB is flushed, and numbering starts over, so any space holding
+// an ASID from an earlier generation must get a new one before it runs.
+//
+// Each hart has its own TLB. A hart flushes its whole TLB the first time it
+// switches spaces in a new generation, and flushes a space's ASID when the
+// space arrives from another hart, since changes made there were only flushed
+// there.
+
+static unsigned int asid_max;   // largest ASID the hart implements
+static unsigned int asid_next;  // next ASID to hand out
+static unsigned long asid_gen = 1;
+static unsigned long asid_hart_gen[NHART]; // generation seen by each hart
+
 static struct pte main_pt2[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
 
@@ -152,7 +227,43 @@ static struct pte main_pt1_0x80000[PTE_CNT]
 static struct pte main_pt0_0x80000[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
 
-static struct page_chunk * free_chunk_list;
+static struct page_chunk * free_chunk_list[PAGE_MAX_ORDER+1];
+
+// For each page that starts a free block, the block's order plus one. Zero
+// for every other page.
+
+static uint8_t * free_order;
+
+// Range of pages managed by the page allocator, as page indices from
+// RAM_START, and the number of them currently free.
+
+static unsigned long first_free_idx;
+static unsigned long end_free_idx;
+static unsigned long free_page_cnt;
+static unsigned long free_block_cnt[PAGE_MAX_ORDER+1];
+
+// Pool of pages zeroed ahead of time by the idle thread. Its pages are not
+// counted as free.
+
+static struct zero_page * zero_pool;
+static unsigned int zero_pool_cnt;
+
+// Registered reclaimers, and whether they are being called, so that an
+// allocation made by one does not call them again
+
+static struct {
+    unsigned long (*fn)(void * aux, unsigned long want);
+    void * aux;
+} reclaimers[RECLAIMER_MAX];
+
+static int reclaimer_cnt;
+static char reclaiming;
+
+// Pages that fork left shared between memory spaces have a count of the
+// spaces sharing them beyond the first. Freeing such a page only drops one
+// sharer.
+
+static uint16_t * page_sharers;
 
 // EXPORTED FUNCTION DECLARATIONS
 // 
@@ -233,6 +344,15 @@ void memory_init(void) {
     main_mtag = ptab_to_mtag(main_pt2, 0);
     csrw_satp(main_mtag);
 
+    // Find out how many ASID bits are implemented by writing all ones to the
+    // ASID field and reading back what sticks.
+
+    csrw_satp(main_mtag | (((1UL << RISCV_SATP_ASID_nbits) - 1) << RISCV_SATP_ASID_shift));
+    asid_max = mtag_asid(csrr_satp());
+    asid_next = 1;
+    csrw_satp(main_mtag);
+    sfence_vma();
+
     // Give the memory between the end of the kernel image and the next page
     // boundary to the heap allocator, but make sure it is at least
     // HEAP_INIT_MIN bytes.
@@ -255,14 +375,25 @@ void memory_init(void) {
     kprintf("Heap allocator: [%p,%p): %zu KB free\n",
         heap_start, heap_end, (heap_end - heap_start) / 1024);
     
-    // TODO: Initialize the free chunk list here
-    // Initialize free chunk list to point to the end of the heap
-    free_chunk_list = (struct page_chunk*)heap_end;
-    uintptr_t free_start = (uintptr_t)heap_end;
-    uintptr_t free_end = (uintptr_t)RAM_END;
-
-    free_chunk_list->next = NULL;
-    free_chunk_list->pagecnt = (free_end - free_start) / PAGE_SIZE;
+    // The per-page tables (sharer counts and free block orders) go right
+    // after the heap. Everything after them is handed to the page allocator.
+
+    page_sharers = heap_end;
+    free_order = (uint8_t*)(page_sharers + RAM_SIZE / PAGE_SIZE);
+    pp = (void*)ROUND_UP (
+        (uintptr_t)(free_order + RAM_SIZE / PAGE_SIZE), PAGE_SIZE);
+
+    if (RAM_END <= pp)
+        panic("out of memory");
+
+    memset(heap_end, 0, pp - heap_end);
+
+    first_free_idx = PAGE_INDEX(pp);
+    end_free_idx = RAM_SIZE / PAGE_SIZE;
+    free_phys_pages((void*)pp, end_free_idx - first_free_idx);
+
+    kprintf("Page allocator: [%p,%p): %lu pages free\n",
+        pp, RAM_END, free_page_cnt);
     
     // Allow supervisor to access user memory. We could be more precise by only
     // enabling supervisor access to user memory when we are explicitly trying
@@ -271,9 +402,20 @@ void memory_init(void) {
 
     csrs_sstatus(RISCV_SSTATUS_SUM);
 
+    asid_hart_gen[0] = asid_gen;
     memory_initialized = 1;
 }
 
+void memory_init_hart(void) {
+    assert (memory_initialized);
+
+    csrw_satp(main_mtag);
+    sfence_vma();
+    csrs_sstatus(RISCV_SSTATUS_SUM);
+
+    asid_hart_gen[running_hart()] = asid_gen;
+}
+
 
 mtag_t active_mspace(void) {
     return active_space_mtag();
@@ -283,19 +425,61 @@ mtag_t switch_mspace(mtag_t mtag) {
     mtag_t prev;
     
     prev = csrrw_satp(mtag);
-    sfence_vma();
+    // translations tagged with a live ASID are still good
+    if (mtag_asid(mtag) == 0)
+        sfence_vma();
     return prev;
 }
 
+// Returns /mtag/ with an ASID of the current generation, ready to be switched
+// to on this hart. /*genptr/ holds the generation of the ASID currently in
+// /mtag/ and is updated when a new ASID is assigned. /*hartptr/ holds the hart
+// the space last ran on. Returns /mtag/ unchanged if the hart has no ASIDs or
+// if /mtag/ is the main memory space.
+
+mtag_t assign_asid(mtag_t mtag, unsigned long * genptr, int * hartptr) {
+    const mtag_t asid_mask =
+        ((1UL << RISCV_SATP_ASID_nbits) - 1) << RISCV_SATP_ASID_shift;
+    const int hart = running_hart();
+
+    if (asid_max == 0 || mtag_to_ptab(mtag) == main_pt2)
+        return mtag;
+    
+    // another hart started a new generation
+    if (asid_hart_gen[hart] != asid_gen) {
+        asid_hart_gen[hart] = asid_gen;
+        sfence_vma();
+    }
+
+    if (mtag_asid(mtag) != 0 && *genptr == asid_gen) {
+        if (*hartptr != hart) {
+            *hartptr = hart;
+            sfence_vma_asid(mtag_asid(mtag));
+        }
+        return mtag;
+    }
+    
+    // out of ASIDs: start a new generation
+    if (asid_max < asid_next) {
+        asid_gen++;
+        asid_next = 1;
+        asid_hart_gen[hart] = asid_gen;
+        sfence_vma();
+    }
+
+    *genptr = asid_gen;
+    *hartptr = hart;
+    return (mtag & ~asid_mask) |
+        ((unsigned long)asid_next++ << RISCV_SATP_ASID_shift);
+}
+
 mtag_t clone_active_mspace(void)
 {
     struct pte *old_pt2 = active_space_ptab();
-    struct pte *new_pt2 = alloc_phys_page();
+    struct pte *new_pt2 = alloc_zeroed_phys_page();
     if (!new_pt2)
         return 0;                         
 
-    memset(new_pt2, 0, PAGE_SIZE);
-
     // walk L2 (root) 
     for (int i2 = 0; i2 < PTE_CNT; i2++) {
         struct pte pte2 = old_pt2[i2];
@@ -310,9 +494,8 @@ mtag_t clone_active_mspace(void)
 
         // allocate new level‑1 table 
         struct pte *old_pt1 = (struct pte *)pageptr(pte2.ppn);
-        struct pte *new_pt1 = alloc_phys_page();
+        struct pte *new_pt1 = alloc_zeroed_phys_page();
         if (!new_pt1) goto oom;
-        memset(new_pt1, 0, PAGE_SIZE);
         new_pt2[i2] = ptab_pte(new_pt1, 0);
 
         // walk L1 
@@ -321,17 +504,23 @@ mtag_t clone_active_mspace(void)
             if (!PTE_VALID(pte1))
                 continue;
 
-            // share megapage or global entry
-            if (PTE_LEAF(pte1) || PTE_GLOBAL(pte1)) {
+            // share global entry
+            if (PTE_GLOBAL(pte1)) {
                 new_pt1[i1] = pte1;
                 continue;
             }
 
+            // user megapages are split so their pages can be shared
+            // copy-on-write one by one
+            if (PTE_LEAF(pte1)) {
+                if (split_megapage(&old_pt1[i1]) != 0) goto oom;
+                pte1 = old_pt1[i1];
+            }
+
             // allocate new level‑0 table
             struct pte *old_pt0 = (struct pte *)pageptr(pte1.ppn);
-            struct pte *new_pt0 = alloc_phys_page();
+            struct pte *new_pt0 = alloc_zeroed_phys_page();
             if (!new_pt0) goto oom;
-            memset(new_pt0, 0, PAGE_SIZE);
             new_pt1[i1] = ptab_pte(new_pt0, 0);
 
             // walk L0 (4 KiB leafs) 
@@ -340,19 +529,26 @@ mtag_t clone_active_mspace(void)
                 if (!PTE_VALID(pte0))
                     continue;
 
-                if (PTE_GLOBAL(pte0)) {
+                if (PTE_GLOBAL(pte0) || PTE_SHARED_PAGE(pte0)) {
                     new_pt0[i0] = pte0;
                 } else {
-                    void *old_page = pageptr(pte0.ppn);
-                    void *new_page = alloc_phys_page();
-                    if (!new_page) goto oom;
-                    memcpy(new_page, old_page, PAGE_SIZE);
-                    new_pt0[i0] = leaf_pte(new_page, pte0.flags & 0xFF);
+                    // share the page; a writable page loses write access in
+                    // both spaces and is copied by the first store to it
+                    if (pte0.flags & PTE_W) {
+                        pte0.flags &= ~PTE_W;
+                        pte0.rsw |= PTE_RSW_COW;
+                        old_pt0[i0] = pte0;
+                    }
+                    new_pt0[i0] = pte0;
+                    page_sharers[PAGE_INDEX(pageptr(pte0.ppn))]++;
                 }
             }
         }
     }
 
+    // write access was taken away from our own pages too
+    flush_active_tlb();
+
     return ptab_to_mtag(new_pt2, 0);
 
 oom:
@@ -360,55 +556,80 @@ oom:
     return 0;
 }
 
-void reset_active_mspace(void) {
-    // get the root page table
-    struct pte* pt2 = active_space_ptab();
-    // iterate thru all entries in the root page table
+// Returns a new memory space with only the global (kernel) mappings of the
+// main space and no user pages, or 0 if there is no memory for its root
+// table. Unlike clone_active_mspace, nothing of the active space is copied.
+
+mtag_t create_mspace(void) {
+    struct pte * const new_pt2 = alloc_zeroed_phys_page();
+
+    if (!new_pt2)
+        return 0;
+
     for (int i2 = 0; i2 < PTE_CNT; i2++) {
-        // make a local copy
-        struct pte pte2 = pt2[i2];
-        // skip invalid entries
-        if (!PTE_VALID(pte2) || PTE_LEAF(pte2)) {
-            continue;
-        }
-        // iterate thru all entries in the level 1 page table
-        struct pte* pt1 = (struct pte*)pageptr(pte2.ppn);
-        for (int i1 = 0; i1 < PTE_CNT; i1++) {
-            struct pte pte1 = pt1[i1];
-            // skip invalid entries
-            if (!PTE_VALID(pte1) || PTE_LEAF(pte1)) {
-                continue;
-            }
-            // iterate thru all entries in the level 0 page table
-            struct pte* pt0 = (struct pte*)pageptr(pte1.ppn);
-            for (int i0 = 0; i0 < PTE_CNT; i0++) {
-                struct pte pte0 = pt0[i0];
-                // skip invalid entries
-                if (!PTE_VALID(pte0) || !PTE_LEAF(pte0)) {
-                    continue;
-                }
-                // free only non-global pages
-                if (!PTE_GLOBAL(pte0)) {
-                    void* pp = pageptr(pte0.ppn);
-                    // free the page
-                    free_phys_page(pp);
-                    // unmap the page
-                    pt0[i0] = null_pte();
-                }
-            }
-        }
+        if (PTE_VALID(main_pt2[i2]) && PTE_GLOBAL(main_pt2[i2]))
+            new_pt2[i2] = main_pt2[i2];
     }
-    return; 
+
+    return ptab_to_mtag(new_pt2, 0);
+}
+
+void reset_active_mspace(void) {
+    // unmap everything below the kernel half, freeing emptied tables
+    unmap_subtree(active_space_ptab(), ROOT_LEVEL, 0, 0, USER_SPAN_END, 0);
+    flush_active_tlb();
+}
+
+// As reset_active_mspace(), but the page tables are kept, so an image mapped
+// at the same addresses as the last one (as by exec) reuses them instead of
+// allocating new ones.
+
+void clear_active_mspace(void) {
+    unmap_subtree(active_space_ptab(), ROOT_LEVEL, 0, 0, USER_SPAN_END, 1);
+    flush_active_tlb();
 }
 
 mtag_t discard_active_mspace(void) {
+    struct pte * const root = active_space_ptab();
+
     // unmaps and frees all non-global pages from the previously active memory space
     reset_active_mspace();
     // Switches memory spaces to main
     switch_mspace(main_mtag);
+    // the root table of a cloned space goes too
+    if (root != main_pt2)
+        free_phys_page(root);
     return main_mtag; 
 }
 
+// Switches to the main memory space and returns the space that was active,
+// with everything in it left in place, so that it can be freed later with
+// discard_mspace(). Returns 0 if the main space was active.
+
+mtag_t leave_active_mspace(void) {
+    const mtag_t mtag = active_mspace();
+
+    switch_mspace(main_mtag);
+    return (mtag_to_ptab(mtag) != main_pt2) ? mtag : 0;
+}
+
+// Frees memory space /mtag/, which must be neither the main space nor the
+// active one. Its tables are walked directly, so it is never switched to. Its
+// ASID is not reused before every hart has flushed it (see assign_asid()),
+// so only this hart's TLB needs flushing.
+
+void discard_mspace(mtag_t mtag) {
+    struct pte * const root = mtag_to_ptab(mtag);
+
+    assert (root != main_pt2 && root != active_space_ptab());
+
+    unmap_subtree(root, ROOT_LEVEL, 0, 0, USER_SPAN_END, 0);
+    free_phys_page(root);
+
+    if (mtag_asid(mtag) != 0)
+        sfence_vma_asid(mtag_asid(mtag));
+}
+
 // The map_page() function maps a single page into the active address space at
 // the specified address. The map_range() function maps a range of contiguous
 // pages into the active address space. Note that map_page() is a special case
@@ -416,8 +637,9 @@ mtag_t discard_active_mspace(void) {
 // map_range() can be implemented by calling map_page() for each page in the
 // range. The current implementation does the latter.
 
-// We currently map 4K pages only. At some point it may be disirable to support
-// mapping megapages and gigapages.
+// map_range() and alloc_and_map_range() use a 2MB megapage for any part of
+// the range that is megapage aligned in both virtual and physical memory.
+// Operations that only cover part of a megapage split it into 4K pages first.
 
 
 void * map_page(uintptr_t vma, void * pp, int rwxug_flags) {
@@ -430,26 +652,26 @@ void * map_page(uintptr_t vma, void * pp, int rwxug_flags) {
     struct pte* pt1;
     // if the root page table entry is not valid, create a new level 1 page table
     if (!PTE_VALID(pt2[VPN2(vma)])) {
-        pt1 = (struct pte*)alloc_phys_page();
+        pt1 = (struct pte*)alloc_zeroed_phys_page();
         if (pt1 == NULL) {
             return NULL;
         }
-        // zero out the page
-        memset(pt1, 0, PAGE_SIZE);
         pt2[VPN2(vma)] = ptab_pte(pt1, 0);
     } else {
         pt1 = (struct pte*)pageptr(pt2[VPN2(vma)].ppn);
     }
     // level 1 -> level 0
     struct pte* pt0;
+    // already mapped as part of a megapage
+    if (PTE_LEAF(pt1[VPN1(vma)])) {
+        return NULL;
+    }
     // if the level 1 page table entry is not valid, create a new level 0 page table
     if (!PTE_VALID(pt1[VPN1(vma)])) {
-        pt0 = (struct pte*)alloc_phys_page();
+        pt0 = (struct pte*)alloc_zeroed_phys_page();
         if (pt0 == NULL) {
             return NULL;
         }
-        // zero out the page
-        memset(pt0, 0, PAGE_SIZE);
         pt1[VPN1(vma)] = ptab_pte(pt0, 0);
     } else {
         pt0 = (struct pte*)pageptr(pt1[VPN1(vma)].ppn);
@@ -461,6 +683,9 @@ void * map_page(uintptr_t vma, void * pp, int rwxug_flags) {
         return NULL;
     }
     pt0[VPN0(vma)] = leaf_pte(pp, rwxug_flags);
+
+    if (rwxug_flags & PTE_SHARED)
+        pt0[VPN0(vma)].rsw = PTE_RSW_SHARED;
     
     return (void *)vma;
 }
@@ -469,19 +694,27 @@ void * map_range(uintptr_t vma, size_t size, void * pp, int rwxug_flags) {
     if (!wellformed(vma) || (vma % PAGE_SIZE) != 0 || pp == NULL || (size % PAGE_SIZE) != 0 || size == 0) {
         return NULL;
     }
-    // number of pages to map
-    size_t pages = size / PAGE_SIZE;
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t virt_addr = vma + i * PAGE_SIZE;
-        void * phys_addr = (void *)((uintptr_t)pp + i * PAGE_SIZE);
+    size_t off = 0;
+    while (off < size) {
+        uintptr_t virt_addr = vma + off;
+        void * phys_addr = (void *)((uintptr_t)pp + off);
+        // whole megapage left to map
+        if (virt_addr % MEGA_SIZE == 0 && (uintptr_t)phys_addr % MEGA_SIZE == 0 &&
+            MEGA_SIZE <= size - off &&
+            map_megapage(virt_addr, phys_addr, rwxug_flags))
+        {
+            off += MEGA_SIZE;
+            continue;
+        }
         // map the page
         if (!map_page(virt_addr, phys_addr, rwxug_flags)) {
             free_phys_page(phys_addr);
-            unmap_and_free_range((void *)vma, i * PAGE_SIZE);
+            unmap_and_free_range((void *)vma, off);
             return NULL;
         }
+        off += PAGE_SIZE;
     }
-    return (void *)vma; 
+    return (void *)vma;
 }
 
 // void * alloc_and_map_range(uintptr_t vma, size_t size, int rwxug_flags) {
@@ -525,21 +758,37 @@ void * alloc_and_map_range(uintptr_t vma, size_t size, int rwxug_flags) {
     if (!wellformed(vma) || (vma % PAGE_SIZE) != 0 || (size % PAGE_SIZE) != 0 || size == 0) {
         return NULL;
     }
-    // number of pages to map
-    size_t pages = size / PAGE_SIZE;
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t virt_addr = vma + i * PAGE_SIZE;
-        void * phys_addr = alloc_phys_page();
+    size_t off = 0;
+    while (off < size) {
+        uintptr_t virt_addr = vma + off;
+        void * phys_addr;
+        // try a megapage when a whole aligned one fits; an order 9 block
+        // from the page allocator is megapage aligned
+        if (virt_addr % MEGA_SIZE == 0 && MEGA_SIZE <= size - off) {
+            phys_addr = alloc_phys_pages(PTE_CNT);
+            if (phys_addr != NULL) {
+                if ((uintptr_t)phys_addr % MEGA_SIZE == 0 &&
+                    map_megapage(virt_addr, phys_addr, rwxug_flags))
+                {
+                    memset(phys_addr, 0, MEGA_SIZE);
+                    off += MEGA_SIZE;
+                    continue;
+                }
+                free_phys_pages(phys_addr, PTE_CNT);
+            }
+        }
+        phys_addr = alloc_zeroed_phys_page();
         if (phys_addr == NULL) {
-            unmap_and_free_range((void *)vma, i * PAGE_SIZE);
+            unmap_and_free_range((void *)vma, off);
             return NULL;
         }
         // map the page
         if (!map_page(virt_addr, phys_addr, rwxug_flags)) {
             free_phys_page(phys_addr);
-            unmap_and_free_range((void *)vma, i * PAGE_SIZE);
+            unmap_and_free_range((void *)vma, off);
             return NULL;
         }
+        off += PAGE_SIZE;
     }
     return (void *)vma; 
 }
@@ -548,23 +797,19 @@ void set_range_flags(const void * vp, size_t size, int rwxug_flags) {
     if (!wellformed((uintptr_t)vp) || (uintptr_t)vp % PAGE_SIZE != 0 || (size % PAGE_SIZE) != 0 || size == 0) {
         return;
     }
-    // number of pages to map
-    size = ROUND_UP(size, PAGE_SIZE);
-    size_t pages = size / PAGE_SIZE;
-
-    uintptr_t virt_addr = (uintptr_t)vp;
+    uintptr_t curr_va = (uintptr_t)vp;
+    uintptr_t end_va = curr_va + size;
 
     // get the root page table
     struct pte* pt2 = active_space_ptab();
 
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t curr_va = virt_addr + i * PAGE_SIZE;
+    for (; curr_va < end_va; curr_va += PAGE_SIZE) {
         if (!wellformed(curr_va)) {
             continue;
         }
         struct pte* pt1, *pt0;
         // root -> level 1
-        if (!PTE_VALID(pt2[VPN2(curr_va)])) {
+        if (!PTE_VALID(pt2[VPN2(curr_va)]) || PTE_LEAF(pt2[VPN2(curr_va)])) {
             continue;
         } else {
             pt1 = (struct pte*)pageptr(pt2[VPN2(curr_va)].ppn);
@@ -572,9 +817,22 @@ void set_range_flags(const void * vp, size_t size, int rwxug_flags) {
         // level 1 -> level 0
         if (!PTE_VALID(pt1[VPN1(curr_va)])) {
             continue;
-        } else {
-            pt0 = (struct pte*)pageptr(pt1[VPN1(curr_va)].ppn);
         }
+        if (PTE_LEAF(pt1[VPN1(curr_va)])) {
+            if (PTE_GLOBAL(pt1[VPN1(curr_va)])) {
+                continue;
+            }
+            // change a megapage covered by the range as a whole
+            if (curr_va % MEGA_SIZE == 0 && MEGA_SIZE <= end_va - curr_va) {
+                pt1[VPN1(curr_va)].flags = rwxug_flags | PTE_A | PTE_D | PTE_V;
+                curr_va += MEGA_SIZE - PAGE_SIZE;
+                continue;
+            }
+            if (split_megapage(&pt1[VPN1(curr_va)]) != 0) {
+                continue;
+            }
+        }
+        pt0 = (struct pte*)pageptr(pt1[VPN1(curr_va)].ppn);
         // leaf entry
         struct pte *leaf_pte = &pt0[VPN0(curr_va)];
         if (PTE_VALID(*leaf_pte) && PTE_LEAF(*leaf_pte)) {
@@ -584,6 +842,7 @@ void set_range_flags(const void * vp, size_t size, int rwxug_flags) {
             continue;
         }
     }
+    flush_active_tlb();
     return;
 }
 
@@ -591,113 +850,333 @@ void unmap_and_free_range(void * vp, size_t size) {
     if (!wellformed((uintptr_t)vp) || (uintptr_t)vp % PAGE_SIZE != 0 || (size % PAGE_SIZE) != 0 || size == 0) {
         return;
     }
-    size = ROUND_UP(size, PAGE_SIZE);
-    size_t pages = size / PAGE_SIZE;
-    uintptr_t virt_addr = (uintptr_t)vp;
-    // get the root page table
-    struct pte* pt2 = active_space_ptab();
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t curr_va = virt_addr + i * PAGE_SIZE;
-        if (!wellformed(curr_va)) {
-            continue;
-        }
-        struct pte* pt1, *pt0;
-        if (!PTE_VALID(pt2[VPN2(curr_va)])) {
-            continue;
-        } else {
-            pt1 = (struct pte*)pageptr(pt2[VPN2(curr_va)].ppn);
-        }
-        // level 1 -> level 0
-        if (!PTE_VALID(pt1[VPN1(curr_va)])) {
-            continue;
-        } else {
-            pt0 = (struct pte*)pageptr(pt1[VPN1(curr_va)].ppn);
-        }
-        struct pte *leaf_pte = &pt0[VPN0(curr_va)];
-        if (PTE_VALID(*leaf_pte) && PTE_LEAF(*leaf_pte)) {
-            void *pp = pageptr(leaf_pte->ppn); // convert ppn => address
-            free_phys_page(pp); // free the page
-            *leaf_pte = null_pte(); // unmap the page
-        }
+    unmap_subtree(active_space_ptab(), ROOT_LEVEL, 0,
+        (uintptr_t)vp, (uintptr_t)vp + size, 0);
+    flush_active_tlb();
+}
+
+// Returns the page mapped at /vma/ in the active space, or NULL if there is
+// none. Its flags, with PTE_SHARED for a shared page, are returned in
+// /*flagsptr/ if /flagsptr/ is not NULL. A page awaiting copy-on-write
+// counts as writable.
+
+void * lookup_page(uintptr_t vma, int * flagsptr) {
+    struct pte * const pte = walk_leaf(vma);
+
+    if (pte == NULL)
+        return NULL;
+
+    if (flagsptr != NULL) {
+        *flagsptr = pte->flags | (PTE_SHARED_PAGE(*pte) ? PTE_SHARED : 0) |
+            (PTE_COW_PAGE(*pte) ? PTE_W : 0);
     }
-    return;
+
+    return pageptr(pte->ppn);
+}
+
+// Removes the mapping of the page at /vma/ without freeing the page, which is
+// returned (NULL if nothing was mapped). Flags are returned as by
+// lookup_page().
+
+void * unmap_page(uintptr_t vma, int * flagsptr) {
+    struct pte * const pte = walk_leaf(vma);
+    void * pp;
+
+    if (pte == NULL)
+        return NULL;
+
+    if (flagsptr != NULL) {
+        *flagsptr = pte->flags | (PTE_SHARED_PAGE(*pte) ? PTE_SHARED : 0) |
+            (PTE_COW_PAGE(*pte) ? PTE_W : 0);
+    }
+
+    pp = pageptr(pte->ppn);
+    *pte = null_pte();
+    flush_active_tlb();
+    return pp;
+}
+
+// Remaps the page at /vma/ with /rwxug_flags/, first giving the active space
+// its own copy if fork left the page shared with other spaces. Returns 0 or
+// a negative error code.
+
+int unshare_page(uintptr_t vma, int rwxug_flags) {
+    struct pte * const pte = walk_leaf(vma);
+    void * pp, * copy;
+
+    if (pte == NULL || PTE_SHARED_PAGE(*pte))
+        return -EINVAL;
+
+    pp = pageptr(pte->ppn);
+
+    if (page_sharers[PAGE_INDEX(pp)] != 0) {
+        copy = alloc_phys_page();
+        if (copy == NULL)
+            return -ENOMEM;
+        copy_page(copy, pp);
+        page_sharers[PAGE_INDEX(pp)]--;
+        pp = copy;
+    }
+
+    *pte = leaf_pte(pp, rwxug_flags);
+    flush_active_tlb();
+    return 0;
 }
 
 void * alloc_phys_page(void) {
+    struct zero_page * zp;
+    void * pp;
+
     // return the address of the allocated page
-    return alloc_phys_pages(1);
+    pp = alloc_phys_pages(1);
+
+    // the zeroed pool is the last reserve
+    if (pp == NULL && zero_pool != NULL) {
+        zp = zero_pool;
+        zero_pool = zp->next;
+        zero_pool_cnt--;
+        pp = zp;
+    }
+
+    return pp;
+}
+
+// Returns a zero-filled page, taken from the pool filled by the idle thread
+// if it has one. Falls back to zeroing a page from the allocator.
+
+void * alloc_zeroed_phys_page(void) {
+    struct zero_page * zp;
+    void * pp;
+
+    if (zero_pool != NULL) {
+        zp = zero_pool;
+        zero_pool = zp->next;
+        zero_pool_cnt--;
+        zp->next = NULL;
+        return zp;
+    }
+
+    pp = alloc_phys_pages(1);
+    if (pp != NULL)
+        zero_page(pp);
+    return pp;
+}
+
+// Zeroes one free page and adds it to the zeroed pool. Returns 1 if a page
+// was added and 0 if the pool is full or no page is free. Called by the idle
+// thread, one page at a time so that it can go back to checking for ready
+// threads.
+
+int refill_zeroed_pages(void) {
+    struct zero_page * zp;
+
+    if (ZERO_POOL_MAX <= zero_pool_cnt)
+        return 0;
+
+    zp = alloc_phys_pages(1);
+    if (zp == NULL)
+        return 0;
+
+    zero_page(zp);
+    zp->next = zero_pool;
+    zero_pool = zp;
+    zero_pool_cnt++;
+    return 1;
 }
 
 void free_phys_page(void * pp) {
+    // a page still shared after fork only loses a sharer
+    if (pp != NULL && page_sharers[PAGE_INDEX(pp)] != 0) {
+        page_sharers[PAGE_INDEX(pp)]--;
+        return;
+    }
     free_phys_pages(pp, 1);
     return; 
 }
 
+// Allocates /cnt/ physically contiguous pages. The request is served from
+// the smallest free block of at least /cnt/ pages, splitting larger blocks as
+// needed, and the unused tail of the block is freed again, so exactly /cnt/
+// pages are taken. Returns NULL if no block is large enough.
+
 void * alloc_phys_pages(unsigned int cnt) {
-    if (cnt ==0 || cnt > free_phys_page_count()) {
+    unsigned int order, k;
+    unsigned long idx;
+
+    if (free_page_cnt < RECLAIM_LOWAT + cnt)
+        reclaim_pages(2 * RECLAIM_LOWAT + cnt - free_page_cnt);
+
+    if (cnt == 0 || cnt > (1UL << PAGE_MAX_ORDER) || cnt > free_page_cnt) {
         return NULL;
     }
-    struct page_chunk **curr_ptr = &free_chunk_list;
-    struct page_chunk *best_chunk = NULL;
-    // for the new head
-    struct page_chunk **best_ptr = NULL;
-    // find the smallest chunk
-    while (*curr_ptr) {
-        // local copy
-        struct page_chunk *curr = *curr_ptr;
-        // check if the chunk is big enough
-        if (curr->pagecnt >= cnt) {
-            if (!best_chunk || curr->pagecnt < best_chunk->pagecnt) {
-                best_chunk = curr;
-                best_ptr = curr_ptr;
-            }
-        }
-        curr_ptr = &curr->next;
+
+    order = 0;
+    while ((1UL << order) < cnt)
+        order++;
+
+    // smallest order with a free block
+    for (k = order; k <= PAGE_MAX_ORDER; k++) {
+        if (free_chunk_list[k] != NULL)
+            break;
     }
-    if (!best_chunk) {
-        panic("no chunk found");
+
+    if (PAGE_MAX_ORDER < k)
+        return NULL;
+
+    idx = PAGE_INDEX(free_chunk_list[k]);
+    chunk_remove(idx, k);
+
+    // split, keeping the lower half and freeing the upper half
+    while (order < k) {
+        k--;
+        chunk_insert(idx + (1UL << k), k);
     }
-    if (best_chunk->pagecnt == cnt) {
-        *best_ptr = best_chunk->next;
-    } else {
-        // Create a new chunk in the remaining space after allocation
-        struct page_chunk *new_chunk = (struct page_chunk *)((uintptr_t)best_chunk + cnt * PAGE_SIZE);
-        new_chunk->next = best_chunk->next;
-        new_chunk->pagecnt = best_chunk->pagecnt - cnt;
-        *best_ptr = new_chunk;
+
+    free_page_cnt -= 1UL << order;
+
+    // give back the part of the block past cnt
+    if (cnt < (1UL << order)) {
+        free_phys_pages (
+            pageptr(pagenum(RAM_START) + idx + cnt), (1UL << order) - cnt);
     }
-    void *result = (void *)best_chunk;
-    return result;
+
+    return pageptr(pagenum(RAM_START) + idx);
 }
 
+// Frees /cnt/ pages starting at /pp/. The range does not have to be what a
+// single alloc_phys_pages() call returned; it is split into the largest
+// aligned blocks that fit and each is merged with its free buddies.
+
 void free_phys_pages(void * pp, unsigned int cnt) {
+    unsigned long idx, end;
+    unsigned int order;
+
     if (pp == NULL || cnt == 0) {
         return;
     }
-    struct page_chunk * chunk = (struct page_chunk*)pp;
-    // add the chunk to the free chunk list
-    chunk->next = free_chunk_list;
-    chunk->pagecnt = cnt;
-    // update the free chunk list
-    free_chunk_list = chunk;
-    return; 
+
+    idx = PAGE_INDEX(pp);
+    end = idx + cnt;
+
+    assert (first_free_idx <= idx && end <= end_free_idx);
+
+    while (idx < end) {
+        order = 0;
+        while (order < PAGE_MAX_ORDER &&
+            (idx & (1UL << order)) == 0 &&
+            idx + (2UL << order) <= end)
+        {
+            order++;
+        }
+
+        free_block(idx, order);
+        idx += 1UL << order;
+    }
 }
 
 unsigned long free_phys_page_count(void) {
-    unsigned long cnt = 0;
-    struct page_chunk * curr = free_chunk_list;
-    while (curr) {
-        cnt += curr->pagecnt;
-        curr = curr->next;
+    return free_page_cnt;
+}
+
+int register_reclaimer (
+    unsigned long (*fn)(void * aux, unsigned long want), void * aux)
+{
+    if (RECLAIMER_MAX <= reclaimer_cnt)
+        return -EBUSY;
+
+    reclaimers[reclaimer_cnt].fn = fn;
+    reclaimers[reclaimer_cnt].aux = aux;
+    reclaimer_cnt++;
+    return 0;
+}
+
+// Fills in the system-wide fields of /*ms/.
+
+void memory_stats(struct memstat * ms) {
+    unsigned int order;
+
+    ms->total_pages = end_free_idx - first_free_idx;
+    ms->free_pages = free_page_cnt;
+    ms->zeroed_pages = zero_pool_cnt;
+    ms->free_blocks = 0;
+    ms->largest_free = 0;
+
+    for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+        ms->free_blocks += free_block_cnt[order];
+        if (free_block_cnt[order] != 0)
+            ms->largest_free = 1UL << order;
+    }
+
+    heap_usage(&ms->heap_bytes, &ms->heap_pages);
+}
+
+// Fills in the per-process fields of /*ms/ for memory space /mtag/ by
+// walking its page tables. Global mappings (the kernel's) are not counted.
+// Pages shared with other spaces count in each of them.
+
+void mspace_stats(mtag_t mtag, struct memstat * ms) {
+    struct pte * const pt2 = mtag_to_ptab(mtag);
+    struct pte * pt1, * pt0;
+    int i2, i1, i0;
+
+    ms->user_pages = 0;
+    ms->ptab_pages = (pt2 != main_pt2);
+
+    for (i2 = 0; i2 < PTE_CNT; i2++) {
+        if (!PTE_VALID(pt2[i2]) || PTE_GLOBAL(pt2[i2]) || PTE_LEAF(pt2[i2]))
+            continue;
+        
+        pt1 = pageptr(pt2[i2].ppn);
+        ms->ptab_pages++;
+
+        for (i1 = 0; i1 < PTE_CNT; i1++) {
+            if (!PTE_VALID(pt1[i1]) || PTE_GLOBAL(pt1[i1]))
+                continue;
+            
+            if (PTE_LEAF(pt1[i1])) {
+                ms->user_pages += PTE_CNT;
+                continue;
+            }
+
+            pt0 = pageptr(pt1[i1].ppn);
+            ms->ptab_pages++;
+
+            for (i0 = 0; i0 < PTE_CNT; i0++) {
+                if (PTE_VALID(pt0[i0]) && !PTE_GLOBAL(pt0[i0]))
+                    ms->user_pages++;
+            }
+        }
     }
-    return cnt;
 }
 
 int handle_umode_page_fault(struct trap_frame * tfr, uintptr_t vma) {
-    if (!wellformed(vma) || (vma % PAGE_SIZE) != 0 || vma < UMEM_START_VMA || vma >= UMEM_END_VMA) {
+    // stval holds the faulting address, not its page
+    vma = ROUND_DOWN(vma, PAGE_SIZE);
+    if (!wellformed(vma) || vma < UMEM_START_VMA || vma >= UMEM_END_VMA) {
         return 0; // no handled
     }
-    void *pp = alloc_phys_page();
+    const int store = (csrr_scause() == RISCV_SCAUSE_STORE_PAGE_FAULT);
+    const int fetch = (csrr_scause() == RISCV_SCAUSE_INSTR_PAGE_FAULT);
+    return fault_user_page(vma, store, fetch);
+}
+
+// Takes a fault on user page /vma/ as a user access would: a store to a
+// copy-on-write page copies it, a page of a file mapping is filled from the
+// file, and any other page is mapped zeroed on first touch. Instruction
+// fetches only fault in file pages. Returns 1 if the page is now mapped.
+
+int fault_user_page(uintptr_t vma, int store, int fetch) {
+    // first store to a page shared copy-on-write
+    struct pte * const pte = walk_leaf(vma);
+    if (store && pte != NULL && PTE_COW_PAGE(*pte)) {
+        return (unshare_page(vma, (pte->flags & (PTE_R | PTE_X | PTE_U)) | PTE_W) == 0);
+    }
+    // pages of file mappings are filled from the file
+    int result = process_mmap_fault(vma, store);
+    if (result != 0 || fetch) {
+        return (0 < result);
+    }
+    void *pp = alloc_zeroed_phys_page();
     if (pp == NULL) {
         return 0; // no handled
     }
@@ -728,6 +1207,22 @@ static inline struct pte * active_space_ptab(void) {
     return mtag_to_ptab(active_space_mtag());
 }
 
+static inline unsigned int mtag_asid(mtag_t mtag) {
+    return (mtag >> RISCV_SATP_ASID_shift) &
+        ((1UL << RISCV_SATP_ASID_nbits) - 1);
+}
+
+// Flushes the TLB entries of the active space only, if it has an ASID.
+
+static inline void flush_active_tlb(void) {
+    const unsigned int asid = mtag_asid(active_space_mtag());
+
+    if (asid != 0)
+        sfence_vma_asid(asid);
+    else
+        sfence_vma();
+}
+
 static inline void * pageptr(uintptr_t n) {
     return (void*)(n << PAGE_ORDER);
 }
@@ -761,6 +1256,213 @@ static inline struct pte null_pte(void) {
     return (struct pte) { };
 }
 
+// Asks the reclaimers for /want/ pages, in the order they registered, until
+// they have freed that many.
+
+void reclaim_pages(unsigned long want) {
+    unsigned long freed = 0;
+    int i;
+
+    if (reclaiming)
+        return;
+
+    reclaiming = 1;
+
+    for (i = 0; i < reclaimer_cnt && freed < want; i++)
+        freed += reclaimers[i].fn(reclaimers[i].aux, want - freed);
+
+    reclaiming = 0;
+    trace("%s: %lu of %lu pages", __func__, freed, want);
+}
+
+// Frees the order /order/ block at page index /idx/, merging it with its
+// buddy for as long as the buddy is a free block of the same order.
+
+void free_block(unsigned long idx, unsigned int order) {
+    unsigned long buddy;
+
+    assert (free_order[idx] == 0);
+
+    free_page_cnt += 1UL << order;
+
+    while (order < PAGE_MAX_ORDER) {
+        buddy = idx ^ (1UL << order);
+
+        if (buddy < first_free_idx || end_free_idx <= buddy ||
+            free_order[buddy] != order + 1)
+        {
+            break;
+        }
+
+        chunk_remove(buddy, order);
+        idx &= ~(1UL << order);
+        order++;
+    }
+
+    chunk_insert(idx, order);
+}
+
+void chunk_insert(unsigned long idx, unsigned int order) {
+    struct page_chunk * const chunk = pageptr(pagenum(RAM_START) + idx);
+
+    chunk->prev = NULL;
+    chunk->next = free_chunk_list[order];
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk;
+    free_chunk_list[order] = chunk;
+    free_order[idx] = order + 1;
+    free_block_cnt[order]++;
+}
+
+void chunk_remove(unsigned long idx, unsigned int order) {
+    struct page_chunk * const chunk = pageptr(pagenum(RAM_START) + idx);
+
+    if (chunk->prev != NULL)
+        chunk->prev->next = chunk->next;
+    else
+        free_chunk_list[order] = chunk->next;
+    
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk->prev;
+    
+    free_order[idx] = 0;
+    free_block_cnt[order]--;
+}
+
+// Unmaps the non-global pages mapped in [start,end) under page table /pt/
+// at level /lvl/, whose first entry maps address /base/, and frees them.
+// Invalid entries are skipped without descending, and subtables left empty
+// are freed and unlinked unless /keep_tables/ is set. A megapage only partly
+// in the range is split. No TLB flush is done; callers do one at the end.
+// Returns 1 if /pt/ is left with no valid entries.
+
+int unmap_subtree (
+    struct pte * pt, int lvl, uintptr_t base, uintptr_t start, uintptr_t end,
+    int keep_tables)
+{
+    const uintptr_t span = (uintptr_t)PAGE_SIZE << (lvl * (PAGE_ORDER - PTE_ORDER));
+    int empty = 1;
+    int i;
+
+    for (i = 0; i < PTE_CNT; i++) {
+        struct pte * const pte = &pt[i];
+        const uintptr_t lo = base + i * span;
+
+        if (!PTE_VALID(*pte))
+            continue;
+        
+        if (PTE_GLOBAL(*pte) || lo + span <= start || end <= lo) {
+            empty = 0;
+            continue;
+        }
+
+        if (PTE_LEAF(*pte)) {
+            if (start <= lo && lo + span <= end && lvl <= 1) {
+                if (!PTE_SHARED_PAGE(*pte)) {
+                    if (lvl == 0)
+                        free_phys_page(pageptr(pte->ppn));
+                    else
+                        free_phys_pages(pageptr(pte->ppn), PTE_CNT);
+                }
+                *pte = null_pte();
+                continue;
+            }
+
+            if (lvl != 1 || split_megapage(pte) != 0) {
+                empty = 0;
+                continue;
+            }
+        }
+
+        if (unmap_subtree(pageptr(pte->ppn), lvl-1, lo, start, end,
+            keep_tables) && !keep_tables)
+        {
+            free_phys_page(pageptr(pte->ppn));
+            *pte = null_pte();
+        } else
+            empty = 0;
+    }
+
+    return empty;
+}
+
+// Returns the valid leaf PTE mapping 4K page /vma/ in the active space, or
+// NULL if there is none. A user megapage covering /vma/ is split into 4K
+// pages first.
+
+static struct pte * walk_leaf(uintptr_t vma) {
+    struct pte * const pt2 = active_space_ptab();
+    struct pte * pt1, * pt0;
+
+    if (!wellformed(vma) || !PTE_VALID(pt2[VPN2(vma)]) || PTE_LEAF(pt2[VPN2(vma)]))
+        return NULL;
+
+    pt1 = (struct pte*)pageptr(pt2[VPN2(vma)].ppn);
+    if (!PTE_VALID(pt1[VPN1(vma)]))
+        return NULL;
+    
+    if (PTE_LEAF(pt1[VPN1(vma)])) {
+        if (PTE_GLOBAL(pt1[VPN1(vma)]) || split_megapage(&pt1[VPN1(vma)]) != 0)
+            return NULL;
+    }
+
+    pt0 = (struct pte*)pageptr(pt1[VPN1(vma)].ppn);
+    if (!PTE_VALID(pt0[VPN0(vma)]) || !PTE_LEAF(pt0[VPN0(vma)]))
+        return NULL;
+
+    return &pt0[VPN0(vma)];
+}
+
+// Replaces the megapage leaf at /pte1/ with a level 0 table of 4K leaves
+// mapping the same pages with the same flags. Returns 0 or -ENOMEM.
+
+int split_megapage(struct pte * pte1) {
+    struct pte * const pt0 = alloc_zeroed_phys_page();
+    int i0;
+
+    if (pt0 == NULL)
+        return -ENOMEM;
+
+    for (i0 = 0; i0 < PTE_CNT; i0++) {
+        pt0[i0] = *pte1;
+        pt0[i0].ppn = pte1->ppn + i0;
+    }
+
+    *pte1 = ptab_pte(pt0, 0);
+    flush_active_tlb();
+    return 0;
+}
+
+// Maps the 2MB of physical memory at /pp/ as a single megapage at /vma/.
+// Both must be megapage aligned and nothing may be mapped in the range yet.
+// Returns /vma/, or NULL on failure.
+
+void * map_megapage(uintptr_t vma, void * pp, int rwxug_flags) {
+    struct pte * const pt2 = active_space_ptab();
+    struct pte * pt1;
+
+    if (PTE_VALID(pt2[VPN2(vma)])) {
+        if (PTE_LEAF(pt2[VPN2(vma)]))
+            return NULL;
+        pt1 = (struct pte*)pageptr(pt2[VPN2(vma)].ppn);
+    } else {
+        pt1 = (struct pte*)alloc_zeroed_phys_page();
+        if (pt1 == NULL)
+            return NULL;
+        pt2[VPN2(vma)] = ptab_pte(pt1, 0);
+    }
+
+    if (PTE_VALID(pt1[VPN1(vma)]))
+        return NULL;
+
+    pt1[VPN1(vma)] = leaf_pte(pp, rwxug_flags);
+
+    if (rwxug_flags & PTE_SHARED)
+        pt1[VPN1(vma)].rsw = PTE_RSW_SHARED;
+
+    return (void*)vma;
+}
+
 int validate_vptr(const void *vp, size_t len, uint_fast8_t rwxug_flags) {
     if (vp == NULL || len == 0) {
         return -EINVAL;
@@ -770,26 +1472,45 @@ int validate_vptr(const void *vp, size_t len, uint_fast8_t rwxug_flags) {
     if (!wellformed(virt_addr) || !wellformed(end_addr - 1)) {
         return -EINVAL;
     }
+    // A page that has not been touched yet, such as fresh heap or stack or
+    // a page of a file mapping, or a file page mapped read-only until
+    // written, is faulted in once, as the process itself would on access.
+    uintptr_t faulted = 0;
     while (virt_addr < end_addr) {
+        struct pte *leaf_pte = NULL;
+        size_t leaf_size = PAGE_SIZE;
         // get the root page table
         struct pte* pt2 = active_space_ptab();
-        if (!PTE_VALID(pt2[VPN2(virt_addr)])) {
-            return -EINVAL;
-        }
-        struct pte* pt1 = (struct pte*)pageptr(pt2[VPN2(virt_addr)].ppn);
-        if (!PTE_VALID(pt1[VPN1(virt_addr)])) {
-            return -EINVAL;
+        if (PTE_VALID(pt2[VPN2(virt_addr)]) && !PTE_LEAF(pt2[VPN2(virt_addr)])) {
+            struct pte* pt1 = (struct pte*)pageptr(pt2[VPN2(virt_addr)].ppn);
+            if (PTE_VALID(pt1[VPN1(virt_addr)])) {
+                leaf_pte = &pt1[VPN1(virt_addr)];
+                leaf_size = MEGA_SIZE;
+                if (!PTE_LEAF(*leaf_pte)) {
+                    struct pte* pt0 = (struct pte*)pageptr(leaf_pte->ppn);
+                    leaf_pte = &pt0[VPN0(virt_addr)];
+                    leaf_size = PAGE_SIZE;
+                }
+            }
         }
-        struct pte* pt0 = (struct pte*)pageptr(pt1[VPN1(virt_addr)].ppn);
-        struct pte *leaf_pte = &pt0[VPN0(virt_addr)];
-        if (!PTE_VALID(*leaf_pte) || !PTE_LEAF(*leaf_pte)) {
-            return -EINVAL;
+        // a copy-on-write page is writable as far as the caller is concerned
+        int leaf_flags = 0;
+        if (leaf_pte != NULL && PTE_VALID(*leaf_pte) && PTE_LEAF(*leaf_pte)) {
+            leaf_flags = leaf_pte->flags | (PTE_COW_PAGE(*leaf_pte) ? PTE_W : 0);
         }
-        if ((leaf_pte->flags & rwxug_flags) != rwxug_flags) {
-            return -EACCESS;
+        if ((leaf_flags & rwxug_flags) != rwxug_flags) {
+            uintptr_t const page = ROUND_DOWN(virt_addr, PAGE_SIZE);
+            if (faulted != page + 1 && (rwxug_flags & PTE_U) &&
+                page >= UMEM_START_VMA && page < UMEM_END_VMA &&
+                fault_user_page(page, (rwxug_flags & PTE_W) != 0, 0))
+            {
+                faulted = page + 1;
+                continue;
+            }
+            return (leaf_flags != 0) ? -EACCESS : -EINVAL;
         }
         // Advance to next page or stop at end
-        uintptr_t next_page = ROUND_UP(virt_addr + 1, PAGE_SIZE);
+        uintptr_t next_page = ROUND_UP(virt_addr + 1, leaf_size);
         virt_addr = (next_page < end_addr) ? next_page : end_addr;
     }
     return 0;
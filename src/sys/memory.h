@@ -4,6 +4,7 @@
 #define _MEMORY_H_
 
 #include "trap.h" // for struct trap_frame
+#include "conf.h" // for RAM_SIZE
 
 #include <stddef.h>
 #include <stdint.h>
@@ -30,6 +31,11 @@
 #define PTE_A (1 << 6) // internal use only
 #define PTE_D (1 << 7) // internal use only
 
+// Page is not owned by the memory space: it is shared by the spaces mapping
+// it and is neither freed nor copied with them (map_page() only).
+
+#define PTE_SHARED (1 << 8)
+
 // EXPORTED TYPE DEFINITIONS
 //
 
@@ -37,6 +43,23 @@
 
 typedef unsigned long mtag_t;
 
+// Memory statistics returned by the memstat system call. Sizes are in pages
+// unless noted. The first group is system-wide, the second is for one
+// process.
+
+struct memstat {
+    unsigned long total_pages;  // pages managed by the page allocator
+    unsigned long free_pages;   // pages free in the page allocator
+    unsigned long zeroed_pages; // pages in the pre-zeroed pool
+    unsigned long free_blocks;  // free blocks; higher is more fragmented
+    unsigned long largest_free; // pages in the largest free block
+    unsigned long heap_bytes;   // kernel heap bytes allocated
+    unsigned long heap_pages;   // pages held by the kernel heap
+    
+    unsigned long user_pages;   // resident user pages
+    unsigned long ptab_pages;   // page table pages, including the root
+};
+
 // EXPORTED FUNCTION DECLARATIONS
 //
 
@@ -45,17 +68,33 @@ extern char memory_initialized;
 
 extern void memory_init(void);
 
+// Sets up paging on a secondary hart, using the main memory space. Called by
+// each secondary hart after memory_init has run on hart 0.
+
+extern void memory_init_hart(void);
+
 
 extern mtag_t active_mspace(void);
 
 extern mtag_t switch_mspace(mtag_t mtag);
 
+extern mtag_t assign_asid (
+    mtag_t mtag, unsigned long * genptr, int * hartptr);
+
 extern mtag_t clone_active_mspace(void);
 
+extern mtag_t create_mspace(void);
+
 extern void reset_active_mspace(void);
 
+extern void clear_active_mspace(void);
+
 extern mtag_t discard_active_mspace(void);
 
+extern mtag_t leave_active_mspace(void);
+
+extern void discard_mspace(mtag_t mtag);
+
 extern void * map_page(uintptr_t vma, void * pp, int rwxug_flags);
 
 extern void * map_range (
@@ -68,8 +107,18 @@ extern void set_range_flags(const void * vp, size_t size, int rwxug_flags);
 
 extern void unmap_and_free_range(void * vp, size_t size);
 
+extern void * lookup_page(uintptr_t vma, int * flagsptr);
+
+extern void * unmap_page(uintptr_t vma, int * flagsptr);
+
+extern int unshare_page(uintptr_t vma, int rwxug_flags);
+
 extern void * alloc_phys_page(void);
 
+extern void * alloc_zeroed_phys_page(void);
+
+extern int refill_zeroed_pages(void);
+
 extern void free_phys_page(void * pp);
 
 extern void * alloc_phys_pages(unsigned int cnt);
@@ -78,6 +127,25 @@ extern void free_phys_pages(void * pp, unsigned int cnt);
 
 extern unsigned long free_phys_page_count(void);
 
+// Caches that hold pages they could do without register a reclaimer. When an
+// allocation would leave fewer than RECLAIM_LOWAT pages free, the allocator
+// asks the reclaimers for enough pages to get back to twice that, calling
+// /fn/ with /aux/ and the number of pages wanted. The reclaimer frees what it
+// can and returns the number of pages freed. It may be called from any
+// allocation, including one its own cache makes, so it must not block.
+// Caches should only grow while more than twice RECLAIM_LOWAT pages are free.
+
+#ifndef RECLAIM_LOWAT
+#define RECLAIM_LOWAT (RAM_SIZE / PAGE_SIZE / 16)
+#endif
+
+extern int register_reclaimer (
+    unsigned long (*fn)(void * aux, unsigned long want), void * aux);
+
+extern void memory_stats(struct memstat * ms);
+
+extern void mspace_stats(mtag_t mtag, struct memstat * ms);
+
 extern int handle_umode_page_fault (
     struct trap_frame * tfr, uintptr_t vma);
 
@@ -15,6 +15,7 @@
 #include "conf.h"
 #include "plic.h"
 #include "assert.h"
+#include "thread.h" // running_hart()
 
 #include <stdint.h>
 
@@ -79,10 +80,9 @@ static void plic_complete_context_interrupt (
 static void plic_enable_all_sources_for_context(uint_fast32_t ctxno);
 static void plic_disable_all_sources_for_context(uint_fast32_t ctxno);
 
-// We currently only support single-hart operation, sending interrupts to S mode
-// on hart 0 (context 0). The low-level PLIC functions already understand
-// contexts, so we only need to modify the high-level functions (plit_init,
-// plic_claim_request, plic_finish_request)to add support for multiple harts.
+// Interrupts are sent to S mode on every hart (context CTX(i,1) for hart i).
+// Whichever hart claims a source first handles it; the others claim 0 and
+// return. Each hart claims and completes through its own context.
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
@@ -95,12 +95,13 @@ void plic_init(void) {
 	for (i = 0; i < PLIC_SRC_CNT; i++)
 		plic_set_source_priority(i, 0);
 	
-	// Route all sources to S mode on hart 0 only
+	// Route all sources to S mode on each hart
 
 	for (int i = 0; i < PLIC_CTX_CNT; i++)
 		plic_disable_all_sources_for_context(i);
 	
-	plic_enable_all_sources_for_context(CTX(0,1));
+	for (int i = 0; i < NHART; i++)
+		plic_enable_all_sources_for_context(CTX(i,1));
 }
 
 extern void plic_enable_source(int srcno, int prio) {
@@ -119,15 +120,13 @@ extern void plic_disable_source(int irqno) {
 }
 
 extern int plic_claim_interrupt(void) {
-	// FIXME: Hardwired S-mode hart 0
 	trace("%s()", __func__);
-	return plic_claim_context_interrupt(CTX(0,1));
+	return plic_claim_context_interrupt(CTX(running_hart(),1));
 }
 
 extern void plic_finish_interrupt(int irqno) {
-	// FIXME: Hardwired S-mode hart 0
 	trace("%s(irqno=%d)", __func__, irqno);
-	plic_complete_context_interrupt(CTX(0,1), irqno);
+	plic_complete_context_interrupt(CTX(running_hart(),1), irqno);
 }
 
 // INTERNAL FUNCTION DEFINITIONS
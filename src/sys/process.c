@@ -27,6 +27,8 @@
 #include "memory.h"
 #include "heap.h"
 #include "error.h"
+#include "ioring.h"
+#include "rtc.h"
 
 // COMPILE-TIME PARAMETERS
 //
@@ -36,6 +38,56 @@
 #define NPROC 16
 #endif
 
+// Hash buckets of the shared file mapping pages (power of two)
+
+#ifndef MMAP_NHASH
+#define MMAP_NHASH 64
+#endif
+
+// Most shared file pages kept after their last mapping goes
+
+#ifndef MMAP_CACHE_MAX
+#define MMAP_CACHE_MAX 256
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Pages of read-only file mappings are shared by all processes mapping the
+// same page of the same file. They are found by the file's contents id (see
+// IOCTL_GETID) and the page's file position. A file without an id is known
+// by its I/O endpoint instead, which a mapping's file reference keeps valid
+// while the mapping lasts, so such pages are freed with their last mapping.
+// Pages of a file with an id stay resident when their last mapping goes, on
+// an LRU list of at most MMAP_CACHE_MAX pages, so the next exec of the same
+// executable maps its text without reading the file. The page allocator takes
+// them back when memory runs low (see mmap_reclaim()). A write to the file
+// changes its id, so stale pages are never found again and age out.
+
+struct mmap_page {
+    struct mmap_page * next; // next in hash chain or free list
+    struct mmap_page * lru_next; // LRU list links, valid while unmapped
+    struct mmap_page * lru_prev;
+    struct io * endpt; // file I/O endpoint (see ioendpoint()) if no id
+    unsigned long long fileid; // file contents id, 0 if none
+    unsigned long long pos; // file position of page
+    void * pp; // physical page
+    unsigned int refcnt; // mappings of the page
+};
+
+// What process_spawn hands to the thread of the new process. It lives on
+// the parent's stack, which stays valid since the parent waits on /done/
+// until the child has loaded its executable (or failed to).
+
+struct spawn_args {
+    struct condition done; // signaled once result is set
+    struct io * exeio; // executable, reference owned by the child
+    void * stack; // initial stack page built by the parent
+    int argc; // argument count for the entry point
+    int stksz; // bytes of stack in use
+    int result; // 0 or negative error from the child
+};
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -44,6 +96,28 @@ static int build_stack(void * stack, int argc, char ** argv);
 
 static void fork_func(struct condition * forked, struct trap_frame * tfr);
 
+static void spawn_func(struct spawn_args * args);
+
+static struct mmap_region * mmap_find(struct process * proc, uintptr_t vma);
+static int mmap_fill(struct mmap_region * rgn, size_t off, void * pp);
+static struct mmap_page ** mmap_page_link (
+    const struct mmap_region * rgn, unsigned long long pos);
+static int mmap_page_get(struct mmap_region * rgn, size_t off, void ** ppptr);
+static void mmap_page_put(struct mmap_region * rgn, size_t off);
+static void mmap_cache_trim(unsigned int max);
+static unsigned long mmap_reclaim(void * aux, unsigned long want);
+static void mmap_region_setid(struct mmap_region * rgn);
+static void mmap_share(struct mmap_region * rgn);
+static int mmap_release(struct mmap_region * rgn);
+static void mmap_release_all(struct process * proc);
+
+static void reaper_func(void);
+static unsigned long reaper_reclaim(void * aux, unsigned long want);
+
+static int iotab_free_fd(const struct iotab * tab);
+static struct iotab * iotab_own(struct process * proc, int size);
+static void iotab_release(struct iotab * tab);
+
 // static void fork_func(struct condition * forked, struct trap_frame * tfr);
 
 // INTERNAL GLOBAL VARIABLES
@@ -57,6 +131,31 @@ static struct process * proctab[NPROC] = {
     &main_proc
 };
 
+static struct mmap_page * mmap_hash[MMAP_NHASH];
+static struct mmap_page * mmap_free_pages;
+static struct mmap_page * mmap_lru_head; // least recently unmapped first
+static struct mmap_page * mmap_lru_tail;
+static unsigned int mmap_ncached; // pages on the LRU list
+
+// Memory spaces of exited processes, freed by the reaper thread so that
+// process_exit() does not wait for every page to be freed. The page
+// allocator has the reaper's work done at once when memory runs low (see
+// reaper_reclaim()).
+
+static mtag_t reaper_queue[NPROC];
+static unsigned int reaper_head; // index of oldest
+static unsigned int reaper_count;
+static struct condition reaper_work;
+
+// Object caches for what fork allocates
+
+static struct kcache process_cache =
+    KCACHE_INITIALIZER("process", struct process, NULL);
+static struct kcache trap_frame_cache =
+    KCACHE_INITIALIZER("trap_frame", struct trap_frame, NULL);
+static struct kcache condition_cache =
+    KCACHE_INITIALIZER("condition", struct condition, NULL);
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -73,6 +172,12 @@ void procmgr_init(void) {
     main_proc.tid = running_thread();
     main_proc.mtag = active_mspace();
     thread_set_process(main_proc.tid, &main_proc);
+    register_reclaimer(&mmap_reclaim, NULL);
+
+    condition_init(&reaper_work, "reaper");
+    register_reclaimer(&reaper_reclaim, NULL);
+    thread_spawn("reaper", &reaper_func);
+
     procmgr_initialized = 1;
 }
 
@@ -121,7 +226,13 @@ int process_exec(struct io * exeio, int argc, char ** argv) {
         thread_exit();
     }
 
-    reset_active_mspace();
+    ioring_release(current_process());
+    mmap_release_all(current_process());
+
+    // The new image is mapped at much the same addresses as the old one, so
+    // its page tables are kept for it
+    clear_active_mspace();
+    current_process()->brk = 0;
 
     void (*entry)(void);
     if (elf_load(exeio, &entry) < 0) {
@@ -134,6 +245,9 @@ int process_exec(struct io * exeio, int argc, char ** argv) {
         thread_exit();
     }
 
+    if (rtc_map_time_page() < 0)
+        thread_exit();
+
 
     // Set up trap frame for user mode
     struct trap_frame tf = {0};
@@ -169,10 +283,16 @@ int process_fork(const struct trap_frame * tfr) {
         return -ENOMEM;
     }
     
-    // create a new process
-    struct process * child_proc = kcalloc(1, sizeof(struct process));
-    if (!child_proc) {
-        discard_active_mspace();
+    // create a new process; on failure the new space is discarded, not the
+    // active one
+    struct process * child_proc = kcache_alloc(&process_cache);
+    struct trap_frame * child_tfr = kcache_alloc(&trap_frame_cache);
+    struct condition * done = kcache_alloc(&condition_cache);
+    if (!child_proc || !child_tfr || !done) {
+        kcache_free(&process_cache, child_proc);
+        kcache_free(&trap_frame_cache, child_tfr);
+        kcache_free(&condition_cache, done);
+        discard_mspace(new_mtag);
         return -ENOMEM;
     }
     
@@ -186,29 +306,38 @@ int process_fork(const struct trap_frame * tfr) {
         }
     }
 
-    // Copy IO table from parent
+    if (child_proc->mtag == 0) {
+        kcache_free(&process_cache, child_proc);
+        kcache_free(&trap_frame_cache, child_tfr);
+        kcache_free(&condition_cache, done);
+        discard_mspace(new_mtag);
+        return -EMPROC;
+    }
+
+    // Share IO table with parent; the first change to it makes a copy
     struct process* parent_proc = current_process();
-    for (int i = 0; i < PROCESS_IOMAX; i++) {
-        struct io * io = parent_proc->iotab[i];
-        if (io) {
-            child_proc->iotab[i] = ioaddref(io);  // increments refcount
-        }
+    child_proc->iotab = parent_proc->iotab;
+    if (child_proc->iotab) {
+        child_proc->iotab->refcnt += 1;
     }
 
-    struct trap_frame * child_tfr = kmalloc(sizeof(struct trap_frame));
-    if (!child_tfr) {
-        for (int i = 0; i < PROCESS_IOMAX; i++) {
-            ioclose(child_proc->iotab[i]);
+    child_proc->brk = parent_proc->brk;
+
+    // The clone shares the pages of read-only file mappings
+    for (int i = 0; i < PROCESS_MMAPMAX; i++) {
+        struct mmap_region * rgn = &parent_proc->mmaps[i];
+        if (rgn->start != 0) {
+            child_proc->mmaps[i] = *rgn;
+            child_proc->mmaps[i].io = ioaddref(rgn->io);
+            if (!(rgn->flags & MMAP_WRITE)) {
+                mmap_share(rgn);
+            }
         }
-        kfree(child_proc);
-        discard_active_mspace();
-        return -ENOMEM;
     }
 
     memcpy(child_tfr, tfr, sizeof(struct trap_frame));
     child_tfr->a0 = 0; // Return value for child process is 0
 
-    struct condition* done = kmalloc(sizeof(struct condition));
     condition_init(done, "done");
 
     // spawn a new thread for the child process
@@ -222,9 +351,11 @@ int process_fork(const struct trap_frame * tfr) {
     // kprintf("child thread id %d\n", child_tid);
     thread_set_process(child_tid, child_proc);  
 
-    // wait for child to finish
+    // wait for child to finish; it jumps to user mode without yielding once
+    // it has signaled, so its trap frame is no longer needed either
     condition_wait(done);
-    kfree(done);
+    kcache_free(&condition_cache, done);
+    kcache_free(&trap_frame_cache, child_tfr);
     ((struct trap_frame *)tfr)->a0 = child_tid; 
 
     kprintf("end of process fork\n");
@@ -232,6 +363,130 @@ int process_fork(const struct trap_frame * tfr) {
 
 }
 
+// Creates a process running executable /exeio/ with arguments /argc/ and
+// /argv/ and returns the TID of its thread. The process starts in a fresh
+// memory space, so nothing of the caller's memory is copied as fork then
+// exec would. Its I/O table is built from the caller's: if /fd_map/ is NULL
+// the child shares the caller's table as a forked child would, otherwise it
+// is PROCESS_FDMAP entries long and descriptor i of the child refers to
+// descriptor fd_map[i] of the caller, a negative entry leaving it closed. The
+// caller
+// blocks until the executable is loaded, so a bad executable is reported
+// here.
+
+int process_spawn (
+    struct io * exeio, int argc, char ** argv, const int * fd_map)
+{
+    struct process * const parent_proc = current_process();
+    struct process * child_proc;
+    struct spawn_args args;
+    struct io * io;
+    int child_tid;
+    int i, fd;
+
+    if (!exeio || argc < 0)
+        return -EINVAL;
+    
+    if (fd_map != NULL) {
+        for (i = 0; i < PROCESS_FDMAP; i++) {
+            fd = fd_map[i];
+            if (0 <= fd && !process_getio(parent_proc, fd))
+                return -EBADFD;
+        }
+    }
+
+    // the arguments are in our own memory space, so the child's stack page
+    // is built here
+
+    args.stack = alloc_phys_page();
+    if (!args.stack)
+        return -ENOMEM;
+    
+    args.stksz = build_stack(args.stack, argc, argv);
+    if (args.stksz < 0) {
+        free_phys_page(args.stack);
+        return args.stksz;
+    }
+
+    child_proc = kcache_alloc(&process_cache);
+    if (!child_proc) {
+        free_phys_page(args.stack);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < NPROC; i++) {
+        if (proctab[i] == NULL)
+            break;
+    }
+
+    if (i == NPROC) {
+        kcache_free(&process_cache, child_proc);
+        free_phys_page(args.stack);
+        return -EMPROC;
+    }
+
+    child_proc->mtag = create_mspace();
+    if (!child_proc->mtag) {
+        kcache_free(&process_cache, child_proc);
+        free_phys_page(args.stack);
+        return -ENOMEM;
+    }
+
+    proctab[i] = child_proc;
+    child_proc->idx = i;
+
+    child_tid = 0;
+
+    if (fd_map == NULL) {
+        child_proc->iotab = parent_proc->iotab;
+        if (child_proc->iotab)
+            child_proc->iotab->refcnt += 1;
+    } else {
+        for (i = 0; i < PROCESS_FDMAP && 0 <= child_tid; i++) {
+            fd = fd_map[i];
+            if (fd < 0)
+                continue;
+            io = ioaddref(process_getio(parent_proc, fd));
+            child_tid = process_installio(child_proc, i, io);
+            if (child_tid < 0)
+                ioclose(io);
+        }
+    }
+
+    condition_init(&args.done, "spawned");
+    args.exeio = ioaddref(exeio);
+    args.argc = argc;
+    args.result = 0;
+
+    // child_tid holds the error, if any, from building the child's table
+    if (0 <= child_tid)
+        child_tid = thread_spawn("child", (void(*)(void))&spawn_func, &args);
+
+    if (child_tid < 0) {
+        iotab_release(child_proc->iotab);
+        ioclose(args.exeio);
+        discard_mspace(child_proc->mtag);
+        proctab[child_proc->idx] = NULL;
+        kcache_free(&process_cache, child_proc);
+        free_phys_page(args.stack);
+        return child_tid;
+    }
+
+    child_proc->tid = child_tid;
+    thread_set_process(child_tid, child_proc);
+
+    // the child has not run yet, so it cannot have signaled
+    condition_wait(&args.done);
+
+    if (args.result < 0) {
+        // it exits without returning to user mode
+        thread_join(child_tid);
+        return args.result;
+    }
+
+    return child_tid;
+}
+
 void process_exit(void) {
     //trace("process_exit");
     struct process * proc = current_process();
@@ -242,30 +497,349 @@ void process_exit(void) {
     
     thread_yield();
 
+    ioring_release(proc);
+
+    // write back file mappings while their pages are still mapped
+    mmap_release_all(proc);
+
     // for (int i = 1;  i  < NPROC; i++) {
     //     if (proctab[i] != NULL) {
     //         kprintf("proctab[%d] = %d\n", i, proctab[i]->idx);
     //     }
     // }
-    discard_active_mspace();
-    for (int i = 0; i < PROCESS_IOMAX; i++) {
-        struct io * io = proc->iotab[i];
-        if (io) {
-            ioclose(io);
-        }
+    // The reaper frees the memory space, unless its queue is full. Should
+    // closing a file below block, we resume in the main space.
+    mtag_t mtag = leave_active_mspace();
+    proc->mtag = active_mspace();
+    if (mtag != 0) {
+        if (reaper_count < NPROC) {
+            reaper_queue[(reaper_head + reaper_count++) % NPROC] = mtag;
+            condition_signal(&reaper_work);
+        } else
+            discard_mspace(mtag);
     }
 
+    struct iotab * iotab = proc->iotab;
+    proc->iotab = NULL;
+    iotab_release(iotab);
+
     proctab[proc->idx] = NULL;
 
     // if (proctab[proc->idx] == NULL) {
     //     kprintf("proctab[%d] is NULL\n", proc->idx);
     // }
-    // kfree(proc);
+    // proc is freed when our thread is reclaimed (see process_reclaim())
 
     //kprintf("am i here\n");
     thread_exit();
 }
 
+// Frees /proc/, whose thread has exited and is being reclaimed (see
+// thread_reclaim()). Until then thread_process() may still return it.
+
+void process_reclaim(struct process * proc) {
+    if (proc == &main_proc)
+        return;
+
+    // a process whose thread exited without process_exit() is still listed
+    if (proctab[proc->idx] == proc)
+        proctab[proc->idx] = NULL;
+
+    kcache_free(&process_cache, proc);
+}
+
+// Maps /len/ bytes of file /io/, from its start, at a free range of user
+// memory, whose address is returned. A /len/ of 0 maps the whole file. Pages
+// are filled when first touched; bytes past the end of the file read as 0.
+// With MMAP_WRITE the mapping is writable and pages written to are written
+// back to the file (not past its end) when the mapping is removed, including
+// at exit. Read-only mappings share their pages with other processes
+// mapping the same file.
+
+long process_mmap(struct io * io, size_t len, int flags) {
+    struct process * const proc = current_process();
+    struct mmap_region * rgn = NULL;
+    unsigned long long fsize;
+    uintptr_t vma;
+    int i, moved, result;
+
+    if (io == NULL) {
+        return -EBADFD;
+    }
+
+    if (flags & ~MMAP_WRITE) {
+        return -EINVAL;
+    }
+
+    result = ioctl(io, IOCTL_GETEND, &fsize);
+    if (result < 0) {
+        return result;
+    }
+
+    if (len == 0) {
+        len = fsize;
+    }
+
+    if (len == 0 || UMEM_MMAP_END_VMA - UMEM_MMAP_START_VMA < len) {
+        return -EINVAL;
+    }
+
+    len = ROUND_UP(len, PAGE_SIZE);
+
+    for (i = 0; i < PROCESS_MMAPMAX; i++) {
+        if (proc->mmaps[i].start == 0) {
+            rgn = &proc->mmaps[i];
+            break;
+        }
+    }
+
+    if (rgn == NULL) {
+        return -ENOMEM;
+    }
+
+    // First fit: move past every region the range overlaps until none does
+
+    vma = UMEM_MMAP_START_VMA;
+
+    do {
+        moved = 0;
+        for (i = 0; i < PROCESS_MMAPMAX; i++) {
+            struct mmap_region * const r = &proc->mmaps[i];
+            if (r->start != 0 && vma < r->start + r->len && r->start < vma + len) {
+                vma = r->start + r->len;
+                moved = 1;
+            }
+        }
+    } while (moved);
+
+    if (UMEM_MMAP_END_VMA - vma < len) {
+        return -ENOMEM;
+    }
+
+    rgn->start = vma;
+    rgn->len = len;
+    rgn->off = 0;
+    rgn->fsize = (fsize < len) ? fsize : len;
+    rgn->io = ioaddref(io);
+    rgn->flags = flags;
+    mmap_region_setid(rgn);
+
+    trace("%s: [%p,%p)", __func__, (void*)vma, (void*)(vma + len));
+    return vma;
+}
+
+// Maps /len/ bytes of executable /io/ at /vma/ for elf_load(), starting at
+// file position /off/. Only the first /fsize/ bytes come from the file; the
+// rest read as 0. Both /vma/ and /off/ must be page aligned. With
+// MMAP_PRIVATE, written pages stay private to the process. Pages are filled
+// when first touched.
+
+int process_map_segment (
+    struct io * io, uintptr_t vma, size_t len,
+    unsigned long long off, unsigned long long fsize, int flags)
+{
+    struct process * const proc = current_process();
+    struct mmap_region * rgn = NULL;
+    int i;
+
+    if (io == NULL || proc == NULL) {
+        return -EINVAL;
+    }
+
+    len = ROUND_UP(len, PAGE_SIZE);
+
+    if (vma % PAGE_SIZE != 0 || off % PAGE_SIZE != 0 || len == 0 ||
+        vma < UMEM_START_VMA || UMEM_END_VMA - vma < len)
+    {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < PROCESS_MMAPMAX; i++) {
+        struct mmap_region * const r = &proc->mmaps[i];
+        if (r->start == 0) {
+            if (rgn == NULL)
+                rgn = r;
+        } else if (vma < r->start + r->len && r->start < vma + len) {
+            return -EINVAL;
+        }
+    }
+
+    if (rgn == NULL) {
+        return -ENOMEM;
+    }
+
+    rgn->start = vma;
+    rgn->len = len;
+    rgn->off = off;
+    rgn->fsize = (fsize < len) ? fsize : len;
+    rgn->io = ioaddref(io);
+    rgn->flags = flags;
+    mmap_region_setid(rgn);
+
+    trace("%s: [%p,%p) at %llu", __func__, (void*)vma, (void*)(vma + len), off);
+    return 0;
+}
+
+// Moves the end of the heap of the current process by /incr/ bytes and
+// returns the old end, or a negative error code if the end would leave
+// [UMEM_HEAP_START_VMA, UMEM_MMAP_START_VMA). Heap pages are filled with
+// zeroes when first touched (see handle_umode_page_fault()), so growing only
+// moves the end; shrinking frees the pages wholly past the new end.
+
+long process_sbrk(long incr) {
+    struct process * const proc = current_process();
+    uintptr_t old, new;
+
+    old = (proc->brk != 0) ? proc->brk : UMEM_HEAP_START_VMA;
+
+    if ((incr < 0) ? (old - UMEM_HEAP_START_VMA < -(unsigned long)incr) :
+        (UMEM_MMAP_START_VMA - old < incr))
+    {
+        return -ENOMEM;
+    }
+
+    new = old + incr;
+
+    if (ROUND_UP(new, PAGE_SIZE) < ROUND_UP(old, PAGE_SIZE)) {
+        unmap_and_free_range((void*)ROUND_UP(new, PAGE_SIZE),
+            ROUND_UP(old, PAGE_SIZE) - ROUND_UP(new, PAGE_SIZE));
+    }
+
+    proc->brk = new;
+    return old;
+}
+
+// Removes the file mapping starting at /vma/. Returns an error if it does not
+// exist or if its pages could not be written back.
+
+int process_munmap(uintptr_t vma) {
+    struct process * const proc = current_process();
+    struct mmap_region * const rgn = mmap_find(proc, vma);
+
+    if (rgn == NULL || rgn->start != vma) {
+        return -EINVAL;
+    }
+
+    return mmap_release(rgn);
+}
+
+// Handles a page fault at /vma/ (page aligned) in the current process if it
+// falls in one of its file mappings. Returns 1 if the page is now mapped, 0
+// if /vma/ is not in a mapping, or a negative error code if the access is
+// not allowed or the page could not be filled.
+
+int process_mmap_fault(uintptr_t vma, int store) {
+    struct process * const proc = current_process();
+    struct mmap_region * const rgn = proc ? mmap_find(proc, vma) : NULL;
+    const int xflag = (rgn && (rgn->flags & MMAP_EXEC)) ? PTE_X : 0;
+    size_t off;
+    void * pp;
+    int result;
+
+    if (rgn == NULL) {
+        return 0;
+    }
+
+    off = vma - rgn->start;
+
+    if (store && !(rgn->flags & MMAP_WRITE)) {
+        return -EACCESS;
+    }
+
+    // Pages of writable mappings are mapped read-only until written, so
+    // that only written pages are written back. A store to such a page
+    // lands here.
+
+    if (lookup_page(vma, NULL) != NULL) {
+        if (!store) {
+            return -EACCESS;
+        }
+        // the page may still be shared with a forked child
+        result = unshare_page(vma, PTE_R | PTE_W | PTE_U | xflag);
+        return (result < 0) ? result : 1;
+    }
+
+    // Read-only pages wholly backed by the file are shared with every other
+    // mapping of the same file position. A page cut short by fsize is not,
+    // since another mapping may see more of the file there.
+
+    if (!(rgn->flags & MMAP_WRITE) && off + PAGE_SIZE <= rgn->fsize) {
+        result = mmap_page_get(rgn, off, &pp);
+        if (result < 0) {
+            return result;
+        }
+        if (!map_page(vma, pp, PTE_R | PTE_U | xflag | PTE_SHARED)) {
+            mmap_page_put(rgn, off);
+            return -ENOMEM;
+        }
+        return 1;
+    }
+
+    pp = alloc_phys_page();
+    if (pp == NULL) {
+        return -ENOMEM;
+    }
+
+    result = mmap_fill(rgn, off, pp);
+
+    if (result == 0 && !map_page(vma, pp, PTE_R | PTE_U | xflag | (store ? PTE_W : 0))) {
+        result = -ENOMEM;
+    }
+
+    if (result < 0) {
+        free_phys_page(pp);
+        return result;
+    }
+
+    return 1;
+}
+
+// Installs /io/ as /fd/ in the I/O table of /proc/, or as its lowest free fd
+// if /fd/ is -1, and returns the fd. The table takes over the caller's
+// reference to /io/ only if this succeeds.
+
+int process_installio(struct process * proc, int fd, struct io * io) {
+    struct iotab * tab;
+
+    if (fd < -1 || PROCESS_IOMAX <= fd)
+        return -EBADFD;
+
+    if (fd < 0) {
+        fd = iotab_free_fd(proc->iotab);
+        if (PROCESS_IOMAX <= fd)
+            return -EMFILE;
+    } else if (process_getio(proc, fd) != NULL)
+        return -EBADFD;
+
+    tab = iotab_own(proc, fd + 1);
+    if (tab == NULL)
+        return -ENOMEM;
+
+    tab->ios[fd] = io;
+    tab->used[fd / 64] |= 1ULL << (fd % 64);
+    return fd;
+}
+
+// Removes /fd/ from the I/O table of /proc/ and closes its I/O object.
+
+int process_closeio(struct process * proc, int fd) {
+    struct iotab * tab;
+    struct io * io;
+
+    io = process_getio(proc, fd);
+    if (io == NULL)
+        return -EBADFD;
+
+    tab = iotab_own(proc, 0);
+    if (tab == NULL)
+        return -ENOMEM;
+
+    tab->ios[fd] = NULL;
+    tab->used[fd / 64] &= ~(1ULL << (fd % 64));
+    ioclose(io);
+    return 0;
+}
+
 // INTERNAL FUNCTION DEFINITIONS
 //
 
@@ -327,8 +901,456 @@ int build_stack(void * stack, int argc, char ** argv) {
 void fork_func(struct condition * done, struct trap_frame * tfr) {
     //kprintf("fork_func: child process\n");
 
-    switch_mspace(current_process()->mtag);
-    condition_broadcast(done);
+    struct process * const proc = current_process();
+
+    proc->mtag = assign_asid(proc->mtag, &proc->asid_gen, &proc->asid_hart);
+    switch_mspace(proc->mtag);
+    ioring_unmap(); // the parent's ring stays with the parent
+    condition_signal(done);
 
     trap_frame_jump(tfr, current_stack_anchor());
-}
\ No newline at end of file
+}
+
+// Thread function of a process created by process_spawn. Loads the
+// executable into the (empty) memory space of the process, maps the stack
+// page built by the parent and starts the process in user mode. On failure
+// the process exits, which frees whatever was loaded.
+
+void spawn_func(struct spawn_args * args) {
+    struct process * const proc = current_process();
+    void * const stack = args->stack;
+    const int argc = args->argc;
+    const int stksz = args->stksz;
+    struct trap_frame tf = {0};
+    void (*entry)(void);
+    int result;
+
+    proc->mtag = assign_asid(proc->mtag, &proc->asid_gen, &proc->asid_hart);
+    switch_mspace(proc->mtag);
+
+    // the segments hold their own references to the executable
+    result = elf_load(args->exeio, &entry);
+    ioclose(args->exeio);
+
+    if (result == 0 && !map_page (
+        UMEM_END_VMA - PAGE_SIZE, stack, PTE_R | PTE_W | PTE_U))
+    {
+        result = -ENOMEM;
+    }
+
+    if (result < 0)
+        free_phys_page(stack);
+    else
+        result = rtc_map_time_page();
+    
+    // args is gone once the parent runs
+    args->result = (result < 0) ? result : 0;
+    condition_signal(&args->done);
+
+    if (result < 0)
+        process_exit();
+
+    tf.sp = (void *)((uintptr_t)UMEM_END_VMA - stksz);
+    tf.sepc = entry;
+    tf.a0 = argc;
+    tf.a1 = (uintptr_t)UMEM_END_VMA - stksz;
+    tf.sstatus = (csrr_sstatus() & ~RISCV_SSTATUS_SPP & ~RISCV_SSTATUS_SIE);
+
+    trap_frame_jump(&tf, current_stack_anchor());
+}
+
+// Returns the file mapping of /proc/ containing /vma/, or NULL.
+
+struct mmap_region * mmap_find(struct process * proc, uintptr_t vma) {
+    for (int i = 0; i < PROCESS_MMAPMAX; i++) {
+        struct mmap_region * const rgn = &proc->mmaps[i];
+        if (rgn->start != 0 && rgn->start <= vma && vma - rgn->start < rgn->len) {
+            return rgn;
+        }
+    }
+
+    return NULL;
+}
+
+// Reads the page at offset /off/ in /rgn/ into /pp/. Whatever lies past
+// the part backed by the file is zeroed.
+
+int mmap_fill(struct mmap_region * rgn, size_t off, void * pp) {
+    long rcnt = 0;
+
+    if (off < rgn->fsize) {
+        rcnt = ioreadat(rgn->io, rgn->off + off, pp,
+            (rgn->fsize - off < PAGE_SIZE) ? rgn->fsize - off : PAGE_SIZE);
+        if (rcnt < 0) {
+            return rcnt;
+        }
+    }
+
+    memset(pp + rcnt, 0, PAGE_SIZE - rcnt);
+    return 0;
+}
+
+// Records the contents id of the file of /rgn/, if it has one. Only
+// read-only mappings share pages, so only they need it.
+
+void mmap_region_setid(struct mmap_region * rgn) {
+    if ((rgn->flags & MMAP_WRITE) ||
+        ioctl(rgn->io, IOCTL_GETID, &rgn->fileid) != 0)
+    {
+        rgn->fileid = 0;
+    }
+}
+
+// Returns the link to the shared page of the file of /rgn/ at file position
+// /pos/ in its hash chain. The link holds NULL if there is no such page.
+
+struct mmap_page ** mmap_page_link (
+    const struct mmap_region * rgn, unsigned long long pos)
+{
+    struct io * const endpt = (rgn->fileid != 0) ? NULL : ioendpoint(rgn->io);
+    const uintptr_t key = (rgn->fileid != 0) ?
+        rgn->fileid : (uintptr_t)endpt / sizeof(void*);
+    struct mmap_page ** link = &mmap_hash[(key + pos / PAGE_SIZE) % MMAP_NHASH];
+    struct mmap_page * pg;
+
+    while ((pg = *link) != NULL) {
+        if (pg->fileid == rgn->fileid && pg->endpt == endpt && pg->pos == pos)
+            break;
+        link = &pg->next;
+    }
+
+    return link;
+}
+
+// Gets a reference to the shared page at offset /off/ in /rgn/, filling it
+// from the file if no other mapping has that file position.
+
+int mmap_page_get(struct mmap_region * rgn, size_t off, void ** ppptr) {
+    const unsigned long long pos = rgn->off + off;
+    struct mmap_page * pg;
+    void * pp;
+    int result;
+
+    pg = *mmap_page_link(rgn, pos);
+
+    if (pg == NULL) {
+        pp = alloc_phys_page();
+        if (pp == NULL) {
+            return -ENOMEM;
+        }
+
+        result = mmap_fill(rgn, off, pp);
+        if (result < 0) {
+            free_phys_page(pp);
+            return result;
+        }
+
+        // Another process may have filled the same page while we were
+        // reading
+
+        pg = *mmap_page_link(rgn, pos);
+
+        if (pg != NULL) {
+            free_phys_page(pp);
+        }
+    }
+
+    if (pg != NULL) {
+        if (pg->refcnt++ == 0) {
+            if (pg->lru_prev != NULL)
+                pg->lru_prev->lru_next = pg->lru_next;
+            else
+                mmap_lru_head = pg->lru_next;
+            if (pg->lru_next != NULL)
+                pg->lru_next->lru_prev = pg->lru_prev;
+            else
+                mmap_lru_tail = pg->lru_prev;
+            mmap_ncached -= 1;
+        }
+        *ppptr = pg->pp;
+        return 0;
+    }
+
+    // Page descriptors are carved out of whole pages and never freed
+
+    if (mmap_free_pages == NULL) {
+        struct mmap_page * const blk = alloc_phys_page();
+        if (blk == NULL) {
+            free_phys_page(pp);
+            return -ENOMEM;
+        }
+        for (int i = 0; i < PAGE_SIZE / sizeof(struct mmap_page); i++) {
+            blk[i].next = mmap_free_pages;
+            mmap_free_pages = &blk[i];
+        }
+    }
+
+    pg = mmap_free_pages;
+    mmap_free_pages = pg->next;
+
+    pg->fileid = rgn->fileid;
+    pg->endpt = (rgn->fileid != 0) ? NULL : ioendpoint(rgn->io);
+    pg->pos = pos;
+    pg->pp = pp;
+    pg->refcnt = 1;
+    pg->lru_next = pg->lru_prev = NULL;
+    pg->next = *mmap_page_link(rgn, pos);
+    *mmap_page_link(rgn, pos) = pg;
+
+    *ppptr = pp;
+    return 0;
+}
+
+// Drops a reference to the shared page at offset /off/ in /rgn/. With the
+// last reference, a page of a file with an id goes to the end of the LRU
+// list; any other page is freed.
+
+void mmap_page_put(struct mmap_region * rgn, size_t off) {
+    struct mmap_page ** const link = mmap_page_link(rgn, rgn->off + off);
+    struct mmap_page * const pg = *link;
+
+    assert (pg != NULL && 0 < pg->refcnt);
+
+    if (--pg->refcnt != 0) {
+        return;
+    }
+
+    if (pg->fileid == 0) {
+        *link = pg->next;
+        free_phys_page(pg->pp);
+        pg->next = mmap_free_pages;
+        mmap_free_pages = pg;
+        return;
+    }
+
+    pg->lru_next = NULL;
+    pg->lru_prev = mmap_lru_tail;
+    if (mmap_lru_tail != NULL)
+        mmap_lru_tail->lru_next = pg;
+    else
+        mmap_lru_head = pg;
+    mmap_lru_tail = pg;
+    mmap_ncached += 1;
+
+    mmap_cache_trim(MMAP_CACHE_MAX);
+}
+
+// Frees unmapped shared pages, least recently used first, until at most
+// /max/ remain.
+
+void mmap_cache_trim(unsigned int max) {
+    struct mmap_page ** link;
+    struct mmap_page * pg;
+
+    while (max < mmap_ncached) {
+        pg = mmap_lru_head;
+        mmap_lru_head = pg->lru_next;
+        if (mmap_lru_head != NULL)
+            mmap_lru_head->lru_prev = NULL;
+        else
+            mmap_lru_tail = NULL;
+        mmap_ncached -= 1;
+
+        link = &mmap_hash[(pg->fileid + pg->pos / PAGE_SIZE) % MMAP_NHASH];
+        while (*link != pg)
+            link = &(*link)->next;
+        *link = pg->next;
+
+        free_phys_page(pg->pp);
+        pg->next = mmap_free_pages;
+        mmap_free_pages = pg;
+    }
+}
+
+// Reclaimer (see register_reclaimer()): frees up to /want/ unmapped shared
+// pages.
+
+unsigned long mmap_reclaim(void * aux, unsigned long want) {
+    const unsigned int before = mmap_ncached;
+
+    mmap_cache_trim((want < before) ? before - want : 0);
+    return before - mmap_ncached;
+}
+
+// Takes a reference to each shared page of read-only mapping /rgn/ that is
+// mapped in the active space, for the clone of it made by fork.
+
+void mmap_share(struct mmap_region * rgn) {
+    struct mmap_page * pg;
+    int flags;
+
+    for (size_t off = 0; off < rgn->len; off += PAGE_SIZE) {
+        // private pages are copied or shared copy-on-write by the clone
+        if (lookup_page(rgn->start + off, &flags) == NULL ||
+            !(flags & PTE_SHARED))
+        {
+            continue;
+        }
+        pg = *mmap_page_link(rgn, rgn->off + off);
+        assert (pg != NULL && pg->refcnt != 0);
+        pg->refcnt++;
+    }
+}
+
+// Unmaps /rgn/ from the active space and frees its slot. Pages of a writable
+// mapping that were written to are written back to the file first, unless
+// it is private. Returns the first write-back error, if any.
+
+int mmap_release(struct mmap_region * rgn) {
+    int flags, result = 0;
+    long wcnt;
+    void * pp;
+
+    for (size_t off = 0; off < rgn->len; off += PAGE_SIZE) {
+        pp = unmap_page(rgn->start + off, &flags);
+        if (pp == NULL) {
+            continue;
+        }
+
+        if (flags & PTE_SHARED) {
+            mmap_page_put(rgn, off);
+            continue;
+        }
+
+        if ((rgn->flags & (MMAP_WRITE | MMAP_PRIVATE)) == MMAP_WRITE &&
+            (flags & PTE_W) && off < rgn->fsize)
+        {
+            wcnt = iowriteat(rgn->io, rgn->off + off, pp,
+                (rgn->fsize - off < PAGE_SIZE) ? rgn->fsize - off : PAGE_SIZE);
+            if (wcnt < 0 && result == 0) {
+                result = wcnt;
+            }
+        }
+
+        free_phys_page(pp);
+    }
+
+    ioclose(rgn->io);
+    memset(rgn, 0, sizeof(struct mmap_region));
+    return result;
+}
+
+void mmap_release_all(struct process * proc) {
+    for (int i = 0; i < PROCESS_MMAPMAX; i++) {
+        if (proc->mmaps[i].start != 0) {
+            mmap_release(&proc->mmaps[i]);
+        }
+    }
+}
+
+// Reaper thread: frees the memory spaces of exited processes, oldest first.
+
+void reaper_func(void) {
+    mtag_t mtag;
+
+    for (;;) {
+        while (reaper_count == 0)
+            condition_wait(&reaper_work);
+
+        mtag = reaper_queue[reaper_head];
+        reaper_head = (reaper_head + 1) % NPROC;
+        reaper_count -= 1;
+
+        discard_mspace(mtag);
+    }
+}
+
+// Called by the page allocator when memory runs low: frees the memory spaces
+// still waiting for the reaper right away. Returns the number of pages freed.
+
+unsigned long reaper_reclaim(void * aux, unsigned long want) {
+    const unsigned long before = free_phys_page_count();
+    mtag_t mtag;
+
+    while (reaper_count != 0 && free_phys_page_count() - before < want) {
+        mtag = reaper_queue[reaper_head];
+        reaper_head = (reaper_head + 1) % NPROC;
+        reaper_count -= 1;
+
+        discard_mspace(mtag);
+    }
+
+    return free_phys_page_count() - before;
+}
+
+// Returns the lowest fd free in /tab/, which may be NULL, or its size if it
+// is full.
+
+int iotab_free_fd(const struct iotab * tab) {
+    int i;
+
+    if (tab == NULL)
+        return 0;
+
+    for (i = 0; i < tab->size / 64; i++) {
+        if (~tab->used[i] != 0)
+            return 64 * i + lowest_bit(~tab->used[i]);
+    }
+
+    return tab->size;
+}
+
+// Makes the I/O table of /proc/ its own and at least /size/ slots long, at
+// most PROCESS_IOMAX, copying it if it is shared or too short. Returns the
+// table, or NULL if there is no memory for the copy.
+
+struct iotab * iotab_own(struct process * proc, int size) {
+    struct iotab * const tab = proc->iotab;
+    struct iotab * new;
+    uint64_t w;
+    int n, i;
+
+    if (tab != NULL && tab->refcnt == 1 && size <= tab->size)
+        return tab;
+
+    n = (tab != NULL) ? tab->size : 64;
+    while (n < size)
+        n *= 2;
+
+    new = kcalloc(1, sizeof(struct iotab) +
+        n * sizeof(struct io *) + n / 64 * sizeof(uint64_t));
+    if (new == NULL)
+        return NULL;
+
+    new->refcnt = 1;
+    new->size = n;
+    new->used = (uint64_t *)&new->ios[n];
+
+    if (tab != NULL) {
+        memcpy(new->ios, tab->ios, tab->size * sizeof(struct io *));
+        memcpy(new->used, tab->used, tab->size / 64 * sizeof(uint64_t));
+
+        // the copy holds its own reference to each object the shared
+        // table keeps for the other processes
+
+        if (tab->refcnt != 1) {
+            tab->refcnt -= 1;
+            for (i = 0; i < tab->size / 64; i++) {
+                for (w = tab->used[i]; w != 0; w &= w - 1)
+                    ioaddref(tab->ios[64 * i + lowest_bit(w)]);
+            }
+        } else
+            kfree(tab);
+    }
+
+    proc->iotab = new;
+    return new;
+}
+
+// Drops a reference to I/O table /tab/, which may be NULL, closing what is
+// open in it and freeing it with the last.
+
+void iotab_release(struct iotab * tab) {
+    uint64_t w;
+    int i;
+
+    if (tab == NULL || --tab->refcnt != 0)
+        return;
+
+    for (i = 0; i < tab->size / 64; i++) {
+        for (w = tab->used[i]; w != 0; w &= w - 1)
+            ioclose(tab->ios[64 * i + lowest_bit(w)]);
+    }
+
+    kfree(tab);
+}
@@ -11,9 +11,24 @@
 
 
 #ifndef PROCESS_IOMAX
-#define PROCESS_IOMAX 16
+#define PROCESS_IOMAX 1024 // 64 times a power of two
 #endif
 
+#define PROCESS_FDMAP 16 // entries of a process_spawn() fd map
+
+#ifndef PROCESS_MMAPMAX
+#define PROCESS_MMAPMAX 12 // includes the segments of the executable
+#endif
+
+// Flags for process_mmap()
+
+#define MMAP_WRITE (1 << 0) // writable; written pages go back to the file
+
+// Flags used only for the segments of an executable
+
+#define MMAP_EXEC (1 << 1) // pages are executable
+#define MMAP_PRIVATE (1 << 2) // written pages are not written back
+
 #include "conf.h"
 #include "io.h"
 #include "thread.h"
@@ -24,11 +39,43 @@
 //
 
 
+// A file mapped into user memory. Its pages are filled from the file when
+// first touched.
+
+struct mmap_region {
+    uintptr_t start; // first address, 0 if the slot is free
+    size_t len; // length, a multiple of PAGE_SIZE
+    unsigned long long off; // file position of start, a multiple of PAGE_SIZE
+    unsigned long long fsize; // bytes of the region backed by the file
+    struct io * io; // the mapped file
+    unsigned long long fileid; // IOCTL_GETID of io when mapped, or 0
+    int flags; // MMAP_ flags
+};
+
+// The I/O table of a process, indexed by fd. Bit fd of used[] is set while
+// ios[fd] is open, so the lowest free fd is found a word at a time. A forked
+// child shares its parent's table until either changes it, when the one
+// changing it gets its own copy (see process_installio()).
+
+struct iotab {
+    unsigned int refcnt; // processes sharing the table
+    int size; // slots in ios[], a multiple of 64
+    uint64_t * used; // size/64 words, after ios[] in the same allocation
+    struct io * ios[];
+};
+
+struct ioring; // ioring.h
+
 struct process {
     int idx; // index into proctab
     int tid; // thread id of our thread
     mtag_t mtag; // memory space
-    struct io * iotab[PROCESS_IOMAX]; // IO objects associated with current process
+    unsigned long asid_gen; // generation of the ASID in mtag
+    int asid_hart; // hart that last ran with mtag
+    struct iotab * iotab; // IO objects associated with current process, or NULL
+    struct mmap_region mmaps[PROCESS_MMAPMAX]; // file mappings
+    struct ioring * ioring; // submission and completion rings, if set up
+    uintptr_t brk; // end of the heap, 0 until first moved (see process_sbrk())
 };
 
 // EXPORTED FUNCTION DECLARATIONS
@@ -43,13 +90,34 @@ extern int process_exec(struct io * exeio, int argc, char ** argv);
 
 
 extern int process_fork(const struct trap_frame * tfr);
+
+extern int process_spawn (
+    struct io * exeio, int argc, char ** argv, const int * fd_map);
  
 
 extern void __attribute__ ((noreturn)) process_exit(void);
 
+extern void process_reclaim(struct process * proc);
+
+extern long process_mmap(struct io * io, size_t len, int flags);
+
+extern int process_map_segment (
+    struct io * io, uintptr_t vma, size_t len,
+    unsigned long long off, unsigned long long fsize, int flags);
+
+extern int process_munmap(uintptr_t vma);
+
+extern int process_mmap_fault(uintptr_t vma, int store);
+
+extern long process_sbrk(long incr);
+
+extern int process_installio(struct process * proc, int fd, struct io * io);
+extern int process_closeio(struct process * proc, int fd);
+
 
 
 static inline struct process * current_process(void);
+static inline struct io * process_getio(const struct process * proc, int fd);
 
 // INLINE FUNCTION DEFINITIONS
 // 
@@ -58,4 +126,15 @@ static inline struct process * current_process(void) {
     return running_thread_process();
 }
 
+// Returns the I/O object open as /fd/ in /proc/, or NULL if there is none.
+
+static inline struct io * process_getio(const struct process * proc, int fd) {
+    const struct iotab * const tab = proc->iotab;
+
+    if (tab == NULL || fd < 0 || tab->size <= fd)
+        return NULL;
+
+    return tab->ios[fd];
+}
+
 #endif // _PROCESS_H_
\ No newline at end of file
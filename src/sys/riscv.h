@@ -187,6 +187,12 @@ static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
 
+// Flushes non-global translations tagged with /asid/ only
+
+static inline void sfence_vma_asid(unsigned long asid) {
+    asm inline ("sfence.vma zero, %0" :: "r" (asid) : "memory");
+}
+
 static inline unsigned long long rdtime(void) {
 #if __riscv_xlen == 64
     unsigned long long time;
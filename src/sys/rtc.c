@@ -20,6 +20,8 @@
 #include "console.h"
 #include "string.h"
 #include "heap.h"
+#include "memory.h"
+#include "riscv.h"
 
 #include "error.h"
 
@@ -48,6 +50,12 @@ static int rtc_cntl(struct io * io, int cmd, void * arg);
 static long rtc_read(struct io * io, void * buf, long bufsz);
 
 static uint64_t read_real_time(volatile struct rtc_regs * regs);
+static void init_time_page(volatile struct rtc_regs * regs);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct time_page * time_page; // see rtc.h
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
@@ -68,6 +76,24 @@ void rtc_attach(void * mmio_base) {
     rtc->regs = mmio_base; //set base
 
     rtc->instno = register_device("rtc", rtc_open, rtc); // register rtc device
+
+    init_time_page(rtc->regs);
+}
+
+// The page is shared, so fork leaves it mapped in both spaces and
+// reset_active_mspace() does not free it.
+
+int rtc_map_time_page(void) {
+    if (time_page == NULL)
+        return 0;
+
+    if (map_page(UMEM_TIME_PAGE_VMA, time_page,
+        PTE_R | PTE_U | PTE_SHARED) == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    return 0;
 }
 
 
@@ -190,4 +216,28 @@ uint64_t read_real_time(volatile struct rtc_regs * regs) {
     high = regs->time_high; // read higher register that holds time as well
 
     return ((uint64_t)high << 32) | low; // splice the two together to form the entire time signature
-}
\ No newline at end of file
+}
+// Allocates the time page and fills it in from the RTC. If there is no page
+// to be had, processes run without one and must ask the rtc device.
+
+void init_time_page(volatile struct rtc_regs * regs) {
+    uint64_t ticks, now;
+
+    time_page = alloc_zeroed_phys_page();
+    if (time_page == NULL)
+        return;
+
+    ticks = rdtime();
+    now = read_real_time(regs);
+
+    // avoid overflowing ticks * 10^9 for long uptimes
+    ticks = ticks / TIMER_FREQ * 1000000000UL +
+        ticks % TIMER_FREQ * 1000000000UL / TIMER_FREQ;
+
+    time_page->seq += 1;
+    __sync_synchronize();
+    time_page->timer_freq = TIMER_FREQ;
+    time_page->boot_ns = now - ticks;
+    __sync_synchronize();
+    time_page->seq += 1;
+}
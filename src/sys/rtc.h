@@ -1,12 +1,36 @@
-// rtc.h -  Goldfish RTC driver
+// rtc.h -  Goldfish RTC driver
 //
-// Copyright (c) 2024-2025 University of Illinois
-// SPDX-License-identifier: NCSA
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
 //
 
 #ifndef _RTC_H_
 #define _RTC_H_
 
+#include <stdint.h>
+
+// The time page is one read-only page, mapped into every process at
+// UMEM_TIME_PAGE_VMA, from which user code tells the time with rdtime and no
+// syscall:
+//
+//     monotonic ns = rdtime() converted at timer_freq
+//     wall-clock ns since the epoch = boot_ns + monotonic ns
+//
+// The kernel makes seq odd while it updates the page and even again after.
+// A reader retries if it sees seq odd, or changed after it read the fields.
+
+struct time_page {
+    volatile uint32_t seq;
+    uint32_t reserved;
+    uint64_t timer_freq; // rdtime ticks per second
+    uint64_t boot_ns; // wall-clock time at rdtime() == 0, ns since the epoch
+};
+
 extern void rtc_attach(void * mmio_base);
 
-#endif // _RTC_H_
\ No newline at end of file
+// Maps the time page into the active memory space. Returns 0, or -ENOMEM if
+// the mapping could not be made. Does nothing before rtc_attach().
+
+extern int rtc_map_time_page(void);
+
+#endif // _RTC_H_
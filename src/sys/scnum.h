@@ -25,4 +25,20 @@
 #define SYSCALL_IOCTL   19  // issue ioctl on fd
 #define SYSCALL_PIPE    20  // create a pipe
 #define SYSCALL_IODUP   21 
+#define SYSCALL_MMAP    22  // map a file into memory
+#define SYSCALL_MUNMAP  23  // remove a file mapping
+#define SYSCALL_MEMSTAT 24  // get memory usage statistics
+#define SYSCALL_SETPRIO 25  // get or set scheduling priority
+#define SYSCALL_THRSTAT 26  // get scheduler statistics of a thread
+#define SYSCALL_SPAWN 27  // create a process running an executable
+#define SYSCALL_READV 28  // read into several buffers
+#define SYSCALL_WRITEV 29  // write from several buffers
+#define SYSCALL_PREAD 30  // read at a position, leaving the fd's own
+#define SYSCALL_PWRITE 31  // write at a position, leaving the fd's own
+#define SYSCALL_IORING_SETUP 32  // map submission and completion rings
+#define SYSCALL_IORING_ENTER 33  // submit queued operations, wait for some
+#define SYSCALL_SENDFILE 34  // copy between two fds inside the kernel
+#define SYSCALL_POLL 35  // wait for one of several fds to be ready
+#define SYSCALL_SBRK 36  // move the end of the user heap
+#define SYSCALL_INTRSTAT 37  // get statistics of an interrupt source
 #endif // _SCNUM_H_
\ No newline at end of file
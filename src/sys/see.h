@@ -13,4 +13,11 @@ extern void halt_success(void) __attribute__ ((noreturn));
 extern void halt_failure(void) __attribute__ ((noreturn)) ;
 extern void set_stcmp(uint64_t stcmp_value);
 
+// Sends an inter-processor interrupt to a hart, which takes it as a supervisor
+// software interrupt. The receiving hart must call clear_ipi() from its
+// handler to acknowledge the interrupt and re-arm it.
+
+extern void send_ipi(unsigned int hartid);
+extern void clear_ipi(void);
+
 #endif // _SEE_H_
\ No newline at end of file
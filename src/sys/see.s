@@ -7,12 +7,15 @@
 # The code below implements M mode services:
 # 
 # 1. HALT, using virt test device, and
-# 2. TIME, using mtime and mtimecmp MMIO registers.
+# 2. TIME, using mtime and mtimecmp MMIO registers, and
+# 3. IPI, using the msip MMIO registers.
 # 
-# To support (2), we need to handle timer interrupts in M mode.
+# To support (2) and (3), we need to handle timer and software interrupts in M
+# mode. Each hart has its own mtimecmp and msip register.
 #
 
         .equ    VTEST_ADDR, 0x100000
+        .equ    MSIP_ADDR, 0x2000000
         .equ    MTCMP_ADDR, 0x2004000
         .equ    MTIME_ADDR, 0x200BFF8
 
@@ -23,6 +26,10 @@
         .equ    TIME_EID, 0x54494D45
         .equ    SET_STCMP_FID, 0
 
+        .equ    IPI_EID, 0x735049
+        .equ    SEND_IPI_FID, 0
+        .equ    CLEAR_IPI_FID, 1
+
         .text
     	.global halt_success
     	.type   halt_success, @function
@@ -51,6 +58,24 @@ set_stcmp:
         ecall
         ret
 
+    	.global send_ipi
+    	.type   send_ipi, @function
+
+send_ipi:
+        li      a7, IPI_EID
+        li      a6, SEND_IPI_FID
+        ecall
+        ret
+
+    	.global clear_ipi
+    	.type   clear_ipi, @function
+
+clear_ipi:
+        li      a7, IPI_EID
+        li      a6, CLEAR_IPI_FID
+        ecall
+        ret
+
         .global _mmode_trap_entry
     	.type   _mmode_trap_entry, @function
 
@@ -68,11 +93,14 @@ _mmode_trap_entry:
 
 mmode_intr_handler:
 
-	# The only interrupt we handle in M mode is the timer interrupt, to
-	# provide a virtualized timer to S mode.
+	# We handle two interrupts in M mode: the timer interrupt, to provide a
+	# virtualized timer to S mode, and the software interrupt, to pass IPIs
+	# on to S mode.
 
 	slli	t0, t0, 1
-	addi	t0, t0, -7 << 1
+	addi	t0, t0, -3 << 1
+	beqz	t0, mmode_soft_intr
+	addi	t0, t0, -4 << 1
 	bnez	t0, unexp_mmode_interrupt
 
         # Set STIP, clear MTIE
@@ -87,6 +115,19 @@ mmode_intr_handler:
 	csrr    t0, mscratch
         mret
 
+mmode_soft_intr:
+
+        # Set SSIP, clear MSIE. We only have one free register, so msip is
+        # cleared by the CLEAR_IPI function when S mode acknowledges.
+
+        li      t0, 0x2         # SSIP
+        csrs    mip, t0
+        slli    t0, t0, 2       # MSIE
+        csrc    mie, t0
+
+	csrr    t0, mscratch
+        mret
+
 mmode_excp_handler:
 
         # The only exception we handle is an environment call from S mode or
@@ -118,7 +159,10 @@ handle_ecall_from_smode:
         # can use a0 and a1 as temporary registers. Just need to zero a0 before
         # returning to indicate success.
 
+        csrr    a1, mhartid
+        slli    a1, a1, 3
         li      t0, MTCMP_ADDR
+        add     t0, t0, a1
         sd      a0, (t0)
 
         # Depending on the value written to mtcmp, the timer interrupt may
@@ -165,6 +209,42 @@ unexp_mmode_exception:
         li      t1, 0x5555
         sw      t1, (t0)
 
+1:      # IPI service has two functions:
+        #
+        # void send_ipi(unsigned int hartid)
+        # void clear_ipi(void)
+        #
+        # Sending sets the msip register of the target hart. Clearing resets
+        # the msip register of this hart and re-enables MSIE, which the
+        # software interrupt handler above disabled.
+
+        li      t0, IPI_EID
+        bne     a7, t0, 1f
+
+        li      t0, SEND_IPI_FID
+        bne     a6, t0, 2f
+        slli    a0, a0, 2
+        li      t0, MSIP_ADDR
+        add     t0, t0, a0
+        li      a0, 1
+        sw      a0, (t0)
+        li      a0, 0
+        csrr    t0, mscratch
+        mret
+
+2:      li      t0, CLEAR_IPI_FID
+        bne     a6, t0, unsupported_function
+        csrr    a0, mhartid
+        slli    a0, a0, 2
+        li      t0, MSIP_ADDR
+        add     t0, t0, a0
+        sw      zero, (t0)
+        li      t0, 0x8 # MSIE
+        csrs    mie, t0
+        li      a0, 0
+        csrr    t0, mscratch
+        mret
+
 1:      # Add additional M mode service handlers here
 
         # Fall though: handle request for unsupported function
@@ -0,0 +1,38 @@
+// spinlock.h - Spin locks for mutual exclusion between harts
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+// A spin lock protects data shared between harts. It does not disable
+// interrupts; a caller that also shares the data with an ISR must disable
+// interrupts before acquiring it. Spin locks are not recursive.
+
+struct spinlock {
+    volatile int locked;
+};
+
+#define SPINLOCK_INITIALIZER { .locked = 0 }
+
+static inline void spinlock_init(struct spinlock * lk) {
+    lk->locked = 0;
+}
+
+static inline void spinlock_acquire(struct spinlock * lk) {
+    // amoswap.w.aq until we swap in the 1, reading in between so that a
+    // waiting hart does not keep the cache line busy
+
+    while (__atomic_exchange_n(&lk->locked, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (lk->locked)
+            continue;
+    }
+}
+
+static inline void spinlock_release(struct spinlock * lk) {
+    __atomic_store_n(&lk->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif // _SPINLOCK_H_
@@ -8,9 +8,14 @@
 
         .global _mmode_trap_entry # defined in see.s
         .global _smode_trap_entry # defined in trap.s
+        .global _hart_cnt # defined in thread.c
+        .global _hart_boot_sp # defined in thread.c
+        .global secondary_main # defined in thread.c
 
 # QEMU RISC-V virt system zero-stage bootloader jumps to 0x8000'0000 to start
 # kernel. The linker script kernel.ld arranges for start.s to be placed here.
+# All harts come here at once. They all configure their own M mode state, but
+# only hart 0 goes on to main; the others wait in smode_secondary.
  
         .section        .text.start, "xa", @progbits
         .balign         4
@@ -60,6 +65,11 @@ mmode_start:
 
         csrs    mcounteren, 7
 
+        # Enable M mode software interrupts (IPIs, see see.s)
+
+        li      t0, 0x8 # MSIE
+        csrs    mie, t0
+
         # Switch to S mode with M mode interrupts now enabled
 
         li      t0, 0x1002 # bits to clear in mstatus (MPP=0b01,SIE=0)
@@ -68,6 +78,7 @@ mmode_start:
         csrs    mstatus, t1
         la      t0, smode_start
         csrw    mepc, t0
+        csrr    a0, mhartid
         mret
 
 smode_start:
@@ -85,7 +96,9 @@ smode_start:
 
         csrw    sscratch, zero
 
-        # Set initial frame and stack pointer for main thread. Set up ra so we
+        bnez    a0, smode_secondary
+
+        # Set initial frame and stack pointer for main thread. Set up ra so we
         # jump to halt_failure if main returns.
 
         mv      fp, zero
@@ -93,6 +106,32 @@ smode_start:
         la      ra, halt_failure # see.s
         j       main
 
+smode_secondary:
+
+        # Harts beyond the configured count are never used. The others sleep
+        # until smp_start (thread.c) gives them a stack, which it follows with
+        # an IPI, and then enter secondary_main(hartid).
+
+        la      t0, _hart_cnt
+        lw      t0, (t0)
+        bgeu    a0, t0, park_hart
+
+        la      t0, _hart_boot_sp
+        slli    t1, a0, 3
+        add     t0, t0, t1
+1:      wfi
+        ld      sp, (t0)
+        beqz    sp, 1b
+        fence   r, rw
+
+        mv      fp, zero
+        la      ra, halt_failure # see.s
+        j       secondary_main
+
+park_hart:
+        wfi
+        j       park_hart
+
         .section        .data.stack, "wa", @progbits
         .balign		16
         
@@ -6,9 +6,21 @@
 
 #include "string.h"
 #include "console.h"
+#include "memory.h" // PAGE_SIZE
 #include <stdint.h>
 #include <limits.h>
 
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Memory functions access memory of any type through word_t
+
+typedef uint64_t __attribute__ ((__may_alias__)) word_t;
+
+#define WORD_SIZE sizeof(word_t)
+#define WORD_MASK (WORD_SIZE - 1)
+#define WORD_ONES 0x0101010101010101UL // byte repeated by multiplying
+
 // INTERNAL STRUCTURE DEFINITIONS
 // 
 
@@ -125,26 +137,106 @@ char * strrchr(const char * s, int c) {
     return p;
 }
 
+// The memory functions move eight bytes at a time once the destination is
+// aligned, four words per iteration. memcpy() handles a source that is not
+// aligned the same way as the destination by shifting together two aligned
+// source words per destination word, so it never makes a misaligned access.
+// An aligned word never crosses a page, so reading all of the last source
+// word is safe even when only part of it is copied.
+
 void * memset(void * s, int c, size_t n) {
-  char * p = s;
+    unsigned char * p = s;
+    word_t * w;
+    word_t v;
 
-  while (n != 0) {
-    *p++ = c;
-    n -= 1;
-  }
+    while (n != 0 && ((uintptr_t)p & WORD_MASK) != 0) {
+        *p++ = c;
+        n -= 1;
+    }
+
+    v = WORD_ONES * (unsigned char)c;
+    w = (word_t *)p;
+
+    while (4 * WORD_SIZE <= n) {
+        w[0] = v;
+        w[1] = v;
+        w[2] = v;
+        w[3] = v;
+        w += 4;
+        n -= 4 * WORD_SIZE;
+    }
+
+    while (WORD_SIZE <= n) {
+        *w++ = v;
+        n -= WORD_SIZE;
+    }
+
+    p = (unsigned char *)w;
 
-  return s;
+    while (n != 0) {
+        *p++ = c;
+        n -= 1;
+    }
+
+    return s;
 }
 
 void * memcpy(void * restrict dst, const void * restrict src, size_t n) {
-    const char * q = src;
-    char *p = dst;
+    const unsigned char * q = src;
+    unsigned char * p = dst;
+    const word_t * u;
+    word_t * w;
+    word_t lo, hi;
+    unsigned int rsh, lsh;
+
+    while (n != 0 && ((uintptr_t)p & WORD_MASK) != 0) {
+        *p++ = *q++;
+        n -= 1;
+    }
+
+    w = (word_t *)p;
+
+    if (((uintptr_t)q & WORD_MASK) == 0) {
+        u = (const word_t *)q;
+
+        while (4 * WORD_SIZE <= n) {
+            w[0] = u[0];
+            w[1] = u[1];
+            w[2] = u[2];
+            w[3] = u[3];
+            w += 4;
+            u += 4;
+            n -= 4 * WORD_SIZE;
+        }
+
+        while (WORD_SIZE <= n) {
+            *w++ = *u++;
+            n -= WORD_SIZE;
+        }
+
+        q = (const unsigned char *)u;
+    } else if (WORD_SIZE <= n) {
+        // Little-endian: the low bytes of each destination word are the
+        // high bytes of one aligned source word.
+
+        rsh = 8 * ((uintptr_t)q & WORD_MASK);
+        lsh = 8 * WORD_SIZE - rsh;
+        u = (const word_t *)((uintptr_t)q & ~(uintptr_t)WORD_MASK);
+        lo = *u++;
+
+        while (WORD_SIZE <= n) {
+            hi = *u++;
+            *w++ = (lo >> rsh) | (hi << lsh);
+            lo = hi;
+            q += WORD_SIZE;
+            n -= WORD_SIZE;
+        }
+    }
+
+    p = (unsigned char *)w;
+
     while (n != 0) {
-        // kprintf("buf_address_dst: %p\n", p);
-        // kprintf("buf_address_src: %p\n", q);
-        *p = *q;
-        p += 1;
-        q += 1;
+        *p++ = *q++;
         n -= 1;
     }
 
@@ -155,6 +247,27 @@ int memcmp(const void * p1, const void * p2, size_t n) {
     const uint8_t * u = p1;
     const uint8_t * v = p2;
 
+    // Skip equal words when both are aligned alike, leaving the first
+    // differing word to the byte loop.
+
+    if ((((uintptr_t)u ^ (uintptr_t)v) & WORD_MASK) == 0) {
+        while (n != 0 && ((uintptr_t)u & WORD_MASK) != 0) {
+            if (*u != *v)
+                return (*u - *v);
+            u += 1;
+            v += 1;
+            n -= 1;
+        }
+
+        while (WORD_SIZE <= n &&
+            *(const word_t *)u == *(const word_t *)v)
+        {
+            u += WORD_SIZE;
+            v += WORD_SIZE;
+            n -= WORD_SIZE;
+        }
+    }
+
     while (n != 0) {
         if (*u != *v)
             return (*u - *v);
@@ -166,6 +279,60 @@ int memcmp(const void * p1, const void * p2, size_t n) {
     return 0;
 }
 
+// copy_page() and zero_page() are for whole, page-aligned pages, such as
+// copy-on-write copies and freshly allocated page table and data pages.
+
+void copy_page(void * restrict dst, const void * restrict src) {
+    const word_t * u = src;
+    word_t * w = dst;
+    size_t n;
+
+    for (n = PAGE_SIZE / WORD_SIZE; n != 0; n -= 8) {
+        w[0] = u[0];
+        w[1] = u[1];
+        w[2] = u[2];
+        w[3] = u[3];
+        w[4] = u[4];
+        w[5] = u[5];
+        w[6] = u[6];
+        w[7] = u[7];
+        w += 8;
+        u += 8;
+    }
+}
+
+void zero_page(void * pp) {
+    word_t * w = pp;
+    size_t n;
+
+    for (n = PAGE_SIZE / WORD_SIZE; n != 0; n -= 8) {
+        w[0] = 0;
+        w[1] = 0;
+        w[2] = 0;
+        w[3] = 0;
+        w[4] = 0;
+        w[5] = 0;
+        w[6] = 0;
+        w[7] = 0;
+        w += 8;
+    }
+}
+
+// Returns the index of the lowest set bit of _x_, which must not be zero. The
+// kernel is not linked with libgcc, which __builtin_ctzll would need without
+// Zbb, so this uses a de Bruijn multiply instead.
+
+int lowest_bit(uint64_t x) {
+    static const unsigned char debruijn_idx[64] = {
+        0, 1, 48, 2, 57, 49, 28, 3, 61, 58, 50, 42, 38, 29, 17, 4,
+        62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+        63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+        46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9, 13, 8, 7, 6
+    };
+
+    return debruijn_idx[((x & -x) * 0x03f79d71b4cb0a89ULL) >> 58];
+}
+
 unsigned long strtoul(const char * str, char ** endptr, int base) {
     unsigned long val = 0;
     int neg = 0;
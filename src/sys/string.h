@@ -8,6 +8,7 @@
 #define _STRING_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdarg.h>
 
 extern size_t strlen(const char * s);
@@ -20,6 +21,9 @@ extern char * strrchr(const char * s, int c);
 extern void * memset(void * s, int c, size_t n);
 extern int memcmp(const void * p1, const void * p2, size_t n);
 extern void * memcpy(void * restrict dst, const void * restrict src, size_t n);
+extern void copy_page(void * restrict dst, const void * restrict src);
+extern void zero_page(void * pp);
+extern int lowest_bit(uint64_t x);
 extern unsigned long strtoul(const char * str, char ** endptr, int base);
 
 extern size_t snprintf(char * buf, size_t bufsz, const char * fmt, ...);
@@ -0,0 +1,317 @@
+// stripe.c - Block device striped across several disks
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifdef STRIPE_TRACE
+#define TRACE
+#endif
+
+#ifdef STRIPE_DEBUG
+#define DEBUG
+#endif
+
+#include "stripe.h"
+#include "dev/vioblk.h"
+#include "ioimpl.h"
+#include "heap.h"
+#include "error.h"
+#include "console.h"
+
+#include <stdint.h>
+
+// Requests to vioblk disks are started with vioblk_start_io() and only
+// waited for once later ones have been started, up to STRIPE_MAXREQ at a
+// time. Any other kind of disk is read and written synchronously, one unit
+// at a time.
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct stripe_io {
+    struct io io;
+    int ndisk;
+    uint32_t blksz;
+    unsigned int stripesz; // bytes per unit
+    unsigned long long disk_end; // bytes used on each disk, whole units
+    struct io * disks[STRIPE_MAXDISK];
+};
+
+struct stripe_req {
+    struct io * disk;
+    int handle; // from vioblk_start_io()
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void stripe_close(struct io * io);
+static int stripe_cntl(struct io * io, int cmd, void * arg);
+
+static long stripe_readat (
+    struct io * io, unsigned long long pos, void * buf, long bufsz);
+
+static long stripe_writeat (
+    struct io * io, unsigned long long pos, const void * buf, long len);
+
+static long stripe_transfer (
+    struct stripe_io * sio, int write,
+    unsigned long long pos, void * buf, long len);
+
+static int stripe_range_cntl (
+    struct stripe_io * sio, int cmd, const struct ioextent * ext);
+
+static int disk_blksz(struct io * disk);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static const struct iointf stripe_iointf = {
+    .close = &stripe_close,
+    .cntl = &stripe_cntl,
+    .readat = &stripe_readat,
+    .writeat = &stripe_writeat
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+struct io * create_stripe_io (
+    struct io * const * disks, int ndisk, unsigned int stripesz)
+{
+    struct stripe_io * sio;
+    unsigned long long end, min_end;
+    int blksz;
+    int i;
+
+    if (ndisk < 1 || STRIPE_MAXDISK < ndisk)
+        return NULL;
+
+    blksz = disk_blksz(disks[0]);
+    if (blksz <= 0 || stripesz == 0 || stripesz % blksz != 0)
+        return NULL;
+
+    min_end = ~0ULL;
+
+    for (i = 0; i < ndisk; i++) {
+        if (disk_blksz(disks[i]) != blksz) {
+            kprintf("stripe: disk %d block size differs\n", i);
+            return NULL;
+        }
+
+        if (ioctl(disks[i], IOCTL_GETEND, &end) != 0)
+            return NULL;
+
+        if (end < min_end)
+            min_end = end;
+    }
+
+    min_end -= min_end % stripesz;
+    if (min_end == 0)
+        return NULL;
+
+    sio = kcalloc(1, sizeof(struct stripe_io));
+    if (sio == NULL)
+        return NULL;
+
+    sio->ndisk = ndisk;
+    sio->blksz = blksz;
+    sio->stripesz = stripesz;
+    sio->disk_end = min_end;
+
+    for (i = 0; i < ndisk; i++)
+        sio->disks[i] = ioaddref(disks[i]);
+
+    return ioinit1(&sio->io, &stripe_iointf);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void stripe_close(struct io * io) {
+    struct stripe_io * const sio = (void*)io - offsetof(struct stripe_io, io);
+    int i;
+
+    for (i = 0; i < sio->ndisk; i++)
+        ioclose(sio->disks[i]);
+
+    kfree(sio);
+}
+
+int stripe_cntl(struct io * io, int cmd, void * arg) {
+    struct stripe_io * const sio = (void*)io - offsetof(struct stripe_io, io);
+    int result, i;
+
+    switch (cmd) {
+    case IOCTL_GETBLKSZ:
+        if (arg != NULL)
+            *(uint32_t *)arg = sio->blksz;
+        return sio->blksz;
+    case IOCTL_GETEND:
+        if (arg == NULL)
+            return -EINVAL;
+        *(unsigned long long *)arg = sio->disk_end * sio->ndisk;
+        return 0;
+    case IOCTL_DISCARD:
+    case IOCTL_WRZEROES:
+        return stripe_range_cntl(sio, cmd, arg);
+    case IOCTL_FLUSH:
+        for (i = 0; i < sio->ndisk; i++) {
+            result = ioctl(sio->disks[i], IOCTL_FLUSH, NULL);
+            if (result != 0 && result != -ENOTSUP)
+                return result;
+        }
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
+long stripe_readat (
+    struct io * io, unsigned long long pos, void * buf, long bufsz)
+{
+    struct stripe_io * const sio = (void*)io - offsetof(struct stripe_io, io);
+
+    return stripe_transfer(sio, 0, pos, buf, bufsz);
+}
+
+long stripe_writeat (
+    struct io * io, unsigned long long pos, const void * buf, long len)
+{
+    struct stripe_io * const sio = (void*)io - offsetof(struct stripe_io, io);
+
+    return stripe_transfer(sio, 1, pos, (void *)buf, len);
+}
+
+// Moves /len/ bytes at /pos/ between the disks and /buf/, one request per
+// unit touched. On an error, no more requests are started, the ones in
+// flight are waited for and the first error is returned.
+
+long stripe_transfer (
+    struct stripe_io * sio, int write,
+    unsigned long long pos, void * buf, long len)
+{
+    struct stripe_req reqs[STRIPE_MAXREQ];
+    unsigned long long unit, dpos;
+    struct io * disk;
+    int first, nreq;
+    long done, n, result;
+    int err = 0;
+
+    if (len < 0 || len % sio->blksz != 0 || pos % sio->blksz != 0)
+        return -EINVAL;
+
+    if (sio->disk_end * sio->ndisk < pos ||
+        sio->disk_end * sio->ndisk - pos < len)
+    {
+        return -EINVAL;
+    }
+
+    first = 0;
+    nreq = 0;
+
+    for (done = 0; done < len && err == 0; done += n) {
+        unit = (pos + done) / sio->stripesz;
+        dpos = unit / sio->ndisk * sio->stripesz + (pos + done) % sio->stripesz;
+        disk = sio->disks[unit % sio->ndisk];
+
+        n = sio->stripesz - (pos + done) % sio->stripesz;
+        if (len - done < n)
+            n = len - done;
+
+        if (nreq == STRIPE_MAXREQ) {
+            result = vioblk_finish_io(reqs[first].disk, reqs[first].handle);
+            if (result < 0 && err == 0)
+                err = result;
+            first = (first + 1) % STRIPE_MAXREQ;
+            nreq -= 1;
+        }
+
+        result = vioblk_start_io(disk, write, dpos, (char *)buf + done, n);
+
+        if (result == -ENOTSUP) {
+            result = write ?
+                iowriteat(disk, dpos, (char *)buf + done, n) :
+                ioreadat(disk, dpos, (char *)buf + done, n);
+            if (result != n && err == 0)
+                err = (result < 0) ? result : -EIO;
+        } else if (result < 0) {
+            err = result;
+        } else {
+            reqs[(first + nreq) % STRIPE_MAXREQ].disk = disk;
+            reqs[(first + nreq) % STRIPE_MAXREQ].handle = result;
+            nreq += 1;
+        }
+    }
+
+    while (nreq != 0) {
+        result = vioblk_finish_io(reqs[first].disk, reqs[first].handle);
+        if (result < 0 && err == 0)
+            err = result;
+        first = (first + 1) % STRIPE_MAXREQ;
+        nreq -= 1;
+    }
+
+    return (err != 0) ? err : len;
+}
+
+// Passes IOCTL_DISCARD or IOCTL_WRZEROES for /ext/ on to the disks, one
+// unit at a time. A zero-length range asks every disk, since the command is
+// supported only if all of them support it.
+
+int stripe_range_cntl (
+    struct stripe_io * sio, int cmd, const struct ioextent * ext)
+{
+    struct ioextent dext;
+    unsigned long long pos, end, unit;
+    int result, i;
+
+    if (ext == NULL)
+        return -EINVAL;
+
+    if (ext->len == 0) {
+        for (i = 0; i < sio->ndisk; i++) {
+            result = ioctl(sio->disks[i], cmd, (void *)ext);
+            if (result != 0)
+                return result;
+        }
+        return 0;
+    }
+
+    if (ext->pos % sio->blksz != 0 || ext->len % sio->blksz != 0 ||
+        sio->disk_end * sio->ndisk < ext->pos ||
+        sio->disk_end * sio->ndisk - ext->pos < ext->len)
+    {
+        return -EINVAL;
+    }
+
+    end = ext->pos + ext->len;
+
+    for (pos = ext->pos; pos < end; pos += dext.len) {
+        unit = pos / sio->stripesz;
+        dext.pos = unit / sio->ndisk * sio->stripesz + pos % sio->stripesz;
+        dext.len = sio->stripesz - pos % sio->stripesz;
+        if (end - pos < dext.len)
+            dext.len = end - pos;
+
+        result = ioctl(sio->disks[unit % sio->ndisk], cmd, &dext);
+        if (result != 0)
+            return result;
+    }
+
+    return 0;
+}
+
+// Returns the block size of /disk/. Some devices return it from
+// IOCTL_GETBLKSZ, others store it through the argument.
+
+int disk_blksz(struct io * disk) {
+    uint32_t blksz = 0;
+    int result;
+
+    result = ioctl(disk, IOCTL_GETBLKSZ, &blksz);
+    if (0 < result)
+        return result;
+    return (result == 0) ? blksz : result;
+}
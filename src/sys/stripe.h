@@ -0,0 +1,35 @@
+// stripe.h - Block device striped across several disks
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _STRIPE_H_
+#define _STRIPE_H_
+
+// A stripe device (RAID-0) lays its bytes out across its disks in units of
+// the stripe size: unit u lives on disk u % ndisk at offset
+// (u / ndisk) * stripesz. A transfer that spans several units is split into
+// one request per unit and the requests are issued together, so the disks
+// work on them at the same time.
+
+#ifndef STRIPE_MAXDISK
+#define STRIPE_MAXDISK 8
+#endif
+
+#ifndef STRIPE_MAXREQ
+#define STRIPE_MAXREQ 16 // requests in flight per transfer
+#endif
+
+struct io; // io.h
+
+// Returns a stripe device over the /ndisk/ block devices in /disks/, with
+// /stripesz/ bytes per unit, a multiple of their (common) block size. The
+// device holds its own reference to each disk. Its size is that of the
+// smallest disk, rounded down to whole units, times /ndisk/. Returns NULL if
+// the disks or stripe size do not fit together or memory runs out.
+
+extern struct io * create_stripe_io (
+    struct io * const * disks, int ndisk, unsigned int stripesz);
+
+#endif // _STRIPE_H_
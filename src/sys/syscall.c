@@ -28,6 +28,21 @@
 #include "thread.h"
 #include "process.h"
 #include "ioimpl.h"
+#include "ktrace.h"
+#include "string.h"
+#include "ioring.h"
+
+#include <limits.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Most descriptors one _poll() call waits on
+
+#ifndef POLL_MAX
+#define POLL_MAX 16
+#endif
+
 // EXPORTED FUNCTION DECLARATIONS
 //
 
@@ -41,6 +56,7 @@ static int64_t syscall(const struct trap_frame * tfr);
 static int sysexit(void);
 static int sysexec(int fd, int argc, char ** argv);
 static int sysfork(const struct trap_frame * tfr);
+static int sysspawn(int fd, int argc, char ** argv, const int * fd_map);
 static int syswait(int tid);
 static int sysprint(const char * msg);
 static int sysusleep(unsigned long us);
@@ -51,12 +67,32 @@ static int sysfsopen(int fd, const char * name);
 static int sysclose(int fd);
 static long sysread(int fd, void * buf, size_t bufsz);
 static long syswrite(int fd, const void * buf, size_t len);
+static long sysreadv(int fd, const struct iovec * iov, int iovcnt);
+static long syswritev(int fd, const struct iovec * iov, int iovcnt);
+static long syspread(int fd, void * buf, size_t len, unsigned long long pos);
+static long syspwrite (
+    int fd, const void * buf, size_t len, unsigned long long pos);
+static long syssendfile (
+    int out_fd, int in_fd, unsigned long long pos, size_t len);
+static int syspoll(struct pollfd * fds, int nfds, long timeout_us);
+static long sysioring_setup(void);
+static int sysioring_enter(unsigned int min_complete);
+static long syssbrk(long incr);
+static int copyin_iov (
+    struct iovec * kiov, const struct iovec * iov, int iovcnt, int flags);
 static int sysioctl(int fd, int cmd, void * arg);
 static int sysiodup(int oldfd, int newfd);
 static int syspipe(int * wfdptr, int * rfdptr);
 
 static int sysfscreate(const char* name); 
 static int sysfsdelete(const char* name);
+
+static long sysmmap(int fd, size_t len, int flags);
+static int sysmunmap(void * addr);
+static int sysmemstat(int tid, struct memstat * buf);
+static int syssetprio(int prio);
+static int systhrstat(int tid, struct thread_stats * buf);
+static int sysintrstat(int srcno, struct intr_stats * buf);
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -64,7 +100,9 @@ static int sysfsdelete(const char* name);
 
 void handle_syscall(struct trap_frame * tfr) {  
     tfr->sepc += 4; // each instruction is 4 bytes, so update sepc so that it won't get stuck in the syscall loop
+    ktrace(KTRACE_SYSCALL_ENTER, tfr->a7, running_thread());
     tfr->a0 = syscall(tfr); // return value
+    ktrace(KTRACE_SYSCALL_EXIT, tfr->a7, tfr->a0);
 }
 
 // INTERNAL FUNCTION DEFINITIONS
@@ -78,6 +116,9 @@ int64_t syscall(const struct trap_frame * tfr) {
             return sysexec(tfr->a0, tfr->a1, (char **)tfr->a2);
         case SYSCALL_FORK:
             return sysfork(tfr);
+        case SYSCALL_SPAWN:
+            return sysspawn (
+                tfr->a0, tfr->a1, (char **)tfr->a2, (const int *)tfr->a3);
         case SYSCALL_WAIT:
             return syswait(tfr->a0);
         case SYSCALL_PRINT:
@@ -98,12 +139,45 @@ int64_t syscall(const struct trap_frame * tfr) {
             return sysread(tfr->a0, (void *)tfr->a1, (size_t)tfr->a2);
         case SYSCALL_WRITE:
             return syswrite(tfr->a0, (const void *)tfr->a1, (size_t)tfr->a2);
+        case SYSCALL_READV:
+            return sysreadv(tfr->a0, (const struct iovec *)tfr->a1, tfr->a2);
+        case SYSCALL_WRITEV:
+            return syswritev(tfr->a0, (const struct iovec *)tfr->a1, tfr->a2);
+        case SYSCALL_PREAD:
+            return syspread (
+                tfr->a0, (void *)tfr->a1, (size_t)tfr->a2, tfr->a3);
+        case SYSCALL_PWRITE:
+            return syspwrite (
+                tfr->a0, (const void *)tfr->a1, (size_t)tfr->a2, tfr->a3);
+        case SYSCALL_SENDFILE:
+            return syssendfile (
+                tfr->a0, tfr->a1, tfr->a2, (size_t)tfr->a3);
+        case SYSCALL_POLL:
+            return syspoll((struct pollfd *)tfr->a0, tfr->a1, tfr->a2);
+        case SYSCALL_IORING_SETUP:
+            return sysioring_setup();
+        case SYSCALL_IORING_ENTER:
+            return sysioring_enter(tfr->a0);
+        case SYSCALL_SBRK:
+            return syssbrk(tfr->a0);
         case SYSCALL_IOCTL:
             return sysioctl(tfr->a0, tfr->a1, (void *)tfr->a2);
         case SYSCALL_PIPE:
             return syspipe((int *)tfr->a0, (int *)tfr->a1);
         case SYSCALL_IODUP:
             return sysiodup(tfr->a0, tfr->a1);
+        case SYSCALL_MMAP:
+            return sysmmap(tfr->a0, (size_t)tfr->a1, tfr->a2);
+        case SYSCALL_MUNMAP:
+            return sysmunmap((void *)tfr->a0);
+        case SYSCALL_MEMSTAT:
+            return sysmemstat(tfr->a0, (struct memstat *)tfr->a1);
+        case SYSCALL_SETPRIO:
+            return syssetprio(tfr->a0);
+        case SYSCALL_THRSTAT:
+            return systhrstat(tfr->a0, (struct thread_stats *)tfr->a1);
+        case SYSCALL_INTRSTAT:
+            return sysintrstat(tfr->a0, (struct intr_stats *)tfr->a1);
         default:
             return -ENOTSUP;
     }
@@ -115,9 +189,6 @@ int sysexit(void) {
 }
 
 int sysexec(int fd, int argc, char ** argv) {
-    if (fd < 0 || fd >= PROCESS_IOMAX) {
-        return -EBADFD;
-    }
     // for (int i = 0; i < argc; i++) {
     //     if (argv[i] == NULL) {
     //         return -EINVAL;
@@ -126,8 +197,7 @@ int sysexec(int fd, int argc, char ** argv) {
     //         return -EACCESS;
     //     }
     // }
-    struct process* proc = current_process();
-    struct io* io = proc->iotab[fd];
+    struct io* io = process_getio(current_process(), fd);
     if (io == NULL) {
         return -EBADFD;
     }
@@ -138,6 +208,42 @@ int sysfork(const struct trap_frame * tfr) {
     return process_fork(tfr); 
 }
 
+int sysspawn(int fd, int argc, char ** argv, const int * fd_map) {
+    struct process * proc = current_process();
+    int result;
+
+    if (process_getio(proc, fd) == NULL) {
+        return -EBADFD;
+    }
+
+    if (argc < 0) {
+        return -EINVAL;
+    }
+    
+    if (argc > 0) {
+        result = validate_vptr(argv, argc * sizeof(char *), PTE_R | PTE_U);
+        if (result < 0) {
+            return result;
+        }
+        for (int i = 0; i < argc; i++) {
+            result = validate_vstr(argv[i], PTE_R | PTE_U);
+            if (result < 0) {
+                return result;
+            }
+        }
+    }
+
+    if (fd_map != NULL) {
+        result = validate_vptr(fd_map,
+            PROCESS_FDMAP * sizeof(int), PTE_R | PTE_U);
+        if (result < 0) {
+            return result;
+        }
+    }
+
+    return process_spawn(process_getio(proc, fd), argc, argv, fd_map);
+}
+
 int syswait(int tid) {
     trace("%s(%d)", __func__, tid);
     if (0 <= tid) {
@@ -178,31 +284,12 @@ int sysdevopen(int fd, const char * name, int instno) {
         // device does not exist
         return result;
     }
-    struct process* proc = current_process();
-    int target_fd = -1;
-    if (fd == -1) {
-        // find the first available fd
-        for (int i = 0; i < PROCESS_IOMAX; i++) {
-            if (proc->iotab[i] == NULL) {
-                target_fd = i;
-                break;
-            }
-        }
-        // if no available fd, return error
-        if (target_fd == -1) {
-            ioclose(io);
-            return -EMFILE;
-        }
-    } else {
-        // use the given fd
-        if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] != NULL) {
-            ioclose(io);
-            return -EBADFD;
-        }
-        target_fd = fd;
+    // install at the given fd, or the first available one if fd is -1
+    result = process_installio(current_process(), fd, io);
+    if (result < 0) {
+        ioclose(io);
     }
-    proc->iotab[target_fd] = io;
-    return target_fd;
+    return result;
 }
 
 int sysfsopen(int fd, const char * name) {
@@ -220,63 +307,29 @@ int sysfsopen(int fd, const char * name) {
         // file does not exist
         return result;
     }
-    struct process* proc = current_process();
-    int target_fd = -1;
-    if (fd == -1) {
-        // find the first available fd
-        for (int i = 0; i < PROCESS_IOMAX; i++) {
-            if (proc->iotab[i] == NULL) {
-                target_fd = i;
-                break;
-            }
-        }
-        // if no available fd, return error
-        if (target_fd == -1) {
-            ioclose(io);
-            return -EMFILE;
-        }
-    } else {
-        // use the given fd
-        if (fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] != NULL) {
-            ioclose(io);
-            return -EBADFD;
-        }
-        target_fd = fd;
+    // install at the given fd, or the first available one if fd is -1
+    result = process_installio(current_process(), fd, io);
+    if (result < 0) {
+        ioclose(io);
     }
-    proc->iotab[target_fd] = io;
-    return target_fd; 
+    return result;
 }
 
 int sysclose(int fd) {
-    if (fd < 0 || fd >= PROCESS_IOMAX) {
-        return -EBADFD;
-    }
-    struct process* proc = current_process();
-    struct io* io = proc->iotab[fd];
-    if (io == NULL) {
-        return -EBADFD;
-    }
-    // close file/dev
-    ioclose(io);
-    // mark fd as used
-    proc->iotab[fd] = NULL;
-    return 0;
+    // close file/dev and mark fd as free
+    return process_closeio(current_process(), fd);
 }
 
 long sysread(int fd, void * buf, size_t bufsz) {
     if (buf == NULL) {
         return -EINVAL;
     }
-    if (fd < 0 || fd >= PROCESS_IOMAX || bufsz == 0) {
-        return -EBADFD;
-    }
     // kernel writes to memory so we check W flag
     // if (validate_vptr(buf, bufsz, PTE_U | PTE_W) != 0) {
     //     return -EACCESS;
     // }
-    struct process* proc = current_process();
-    struct io* io = proc->iotab[fd];
-    if (io == NULL) {
+    struct io* io = process_getio(current_process(), fd);
+    if (io == NULL || bufsz == 0) {
         return -EBADFD;
     }
     if (io->intf == NULL || io->intf->read == NULL) {
@@ -286,7 +339,8 @@ long sysread(int fd, void * buf, size_t bufsz) {
 }
 
 long syswrite(int fd, const void * buf, size_t len) {
-    if (fd < 0 || fd >= PROCESS_IOMAX ) {
+    struct io* io = process_getio(current_process(), fd);
+    if (io == NULL) {
         return -EBADFD;
     }
     if (buf == NULL || len == 0) {
@@ -296,23 +350,191 @@ long syswrite(int fd, const void * buf, size_t len) {
     // if (validate_vptr(buf, len, PTE_U | PTE_R) != 0) {
     //     return -EACCESS;
     // }
-    struct process* proc = current_process();
-    struct io* io = proc->iotab[fd];
-    if (io == NULL) {
-        return -EBADFD;
-    }
     if (io->intf == NULL || io->intf->write == NULL) {
         return -ENOTSUP;
     }
     return iowrite(io, buf, len); // write to file/dev
 }
 
-int sysioctl(int fd, int cmd, void * arg) {
-    if (fd < 0 || fd >= PROCESS_IOMAX) {
+long sysreadv(int fd, const struct iovec * iov, int iovcnt) {
+    struct iovec kiov[IOV_MAX];
+    int result;
+
+    struct io* io = process_getio(current_process(), fd);
+    if (io == NULL) {
+        return -EBADFD;
+    }
+    // kernel writes to the buffers so we check W flag
+    result = copyin_iov(kiov, iov, iovcnt, PTE_W | PTE_U);
+    if (result < 0) {
+        return result;
+    }
+    return ioreadv(io, kiov, iovcnt);
+}
+
+long syswritev(int fd, const struct iovec * iov, int iovcnt) {
+    struct iovec kiov[IOV_MAX];
+    int result;
+
+    struct io* io = process_getio(current_process(), fd);
+    if (io == NULL) {
+        return -EBADFD;
+    }
+    result = copyin_iov(kiov, iov, iovcnt, PTE_R | PTE_U);
+    if (result < 0) {
+        return result;
+    }
+    return iowritev(io, kiov, iovcnt);
+}
+
+// Reads /len/ bytes at /pos/ with a single ioreadat() on the fd's endpoint.
+// The fd's position is neither used nor moved, so processes sharing the fd
+// after a fork do not race on it.
+
+long syspread(int fd, void * buf, size_t len, unsigned long long pos) {
+    int result;
+
+    struct io* io = process_getio(current_process(), fd);
+    if (io == NULL) {
         return -EBADFD;
     }
+    if (len == 0) {
+        return 0;
+    }
+    if (len > LONG_MAX) {
+        return -EINVAL;
+    }
+    result = validate_vptr(buf, len, PTE_W | PTE_U);
+    if (result < 0) {
+        return result;
+    }
+    return ioreadat(io, pos, buf, len);
+}
+
+long syspwrite(int fd, const void * buf, size_t len, unsigned long long pos) {
+    int result;
+
+    struct io* io = process_getio(current_process(), fd);
+    if (io == NULL) {
+        return -EBADFD;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (len > LONG_MAX) {
+        return -EINVAL;
+    }
+    result = validate_vptr(buf, len, PTE_R | PTE_U);
+    if (result < 0) {
+        return result;
+    }
+    return iowriteat(io, pos, buf, len);
+}
+
+// Copies up to /len/ bytes from /in_fd/, starting at /pos/ if it is a file
+// or block device, to /out_fd/ without a trip through user memory. Returns
+// the number of bytes written.
+
+long syssendfile(int out_fd, int in_fd, unsigned long long pos, size_t len) {
     struct process* proc = current_process();
-    struct io* io = proc->iotab[fd];
+    struct io* out = process_getio(proc, out_fd);
+    struct io* in = process_getio(proc, in_fd);
+    if (out == NULL || in == NULL) {
+        return -EBADFD;
+    }
+    if (len > LONG_MAX) {
+        len = LONG_MAX;
+    }
+    return iosendfile(out, in, pos, len);
+}
+
+// Waits until one of /fds/ is ready as iopoll() does. Open descriptors are
+// polled for their events; any other gets POLLNVAL and counts as ready.
+
+int syspoll(struct pollfd * fds, int nfds, long timeout_us) {
+    struct pollfd kfds[POLL_MAX];
+    struct io * ios[POLL_MAX];
+    int events[POLL_MAX];
+    int revents[POLL_MAX];
+    struct process* proc = current_process();
+    int result, nbad = 0;
+
+    if (nfds < 0 || nfds > POLL_MAX) {
+        return -EINVAL;
+    }
+    if (nfds > 0) {
+        result = validate_vptr(fds, nfds * sizeof(struct pollfd), PTE_R | PTE_W | PTE_U);
+        if (result < 0) {
+            return result;
+        }
+        memcpy(kfds, fds, nfds * sizeof(struct pollfd));
+    }
+
+    for (int i = 0; i < nfds; i++) {
+        ios[i] = process_getio(proc, kfds[i].fd);
+        events[i] = kfds[i].events;
+        revents[i] = 0;
+        if (ios[i] == NULL) {
+            revents[i] = POLLNVAL;
+            nbad++;
+        }
+    }
+
+    result = iopoll(ios, events, revents, nfds, nbad ? 0 : timeout_us);
+
+    for (int i = 0; i < nfds; i++) {
+        fds[i].revents = revents[i];
+    }
+    return result + nbad;
+}
+
+long sysioring_setup(void) {
+    return ioring_setup(current_process());
+}
+
+int sysioring_enter(unsigned int min_complete) {
+    return ioring_enter(current_process(), min_complete);
+}
+
+long syssbrk(long incr) {
+    return process_sbrk(incr);
+}
+
+// Copies the user vector /iov/ of /iovcnt/ buffers to /kiov/, checking that
+// it and each buffer in it are accessible with /flags/. The copy keeps the
+// user from changing the vector while the kernel walks it.
+
+int copyin_iov (
+    struct iovec * kiov, const struct iovec * iov, int iovcnt, int flags)
+{
+    int result;
+
+    if (iovcnt < 0 || iovcnt > IOV_MAX) {
+        return -EINVAL;
+    }
+    if (iovcnt == 0) {
+        return 0;
+    }
+    result = validate_vptr(iov, iovcnt * sizeof(struct iovec), PTE_R | PTE_U);
+    if (result < 0) {
+        return result;
+    }
+    memcpy(kiov, iov, iovcnt * sizeof(struct iovec));
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (kiov[i].len == 0) {
+            continue;
+        }
+        result = validate_vptr(kiov[i].base, kiov[i].len, flags);
+        if (result < 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+int sysioctl(int fd, int cmd, void * arg) {
+    struct io* io = process_getio(current_process(), fd);
     if (io == NULL) {
         return -EBADFD;
     }
@@ -333,49 +555,19 @@ int syspipe(int *wfdptr, int *rfdptr)
 
     if (wfd == rfd && wfd >= 0) {
         return -EBADFD;
-    }                
-    if ((wfd >= PROCESS_IOMAX) || (rfd >= PROCESS_IOMAX)) {
-        return -EBADFD;
     }
-
+    // a negative fd asks for the lowest free one
     if (wfd < 0) {
         wfd = -1;
-        for (int i = 0; i < PROCESS_IOMAX; i++) {
-            if (!proc->iotab[i]) { 
-                wfd = i; 
-                break; 
-            }
-        }
-        if (wfd < 0) {
-            return -EMFILE;
-        }                       
-    } else if (proc->iotab[wfd]) {     
+    } else if (process_getio(proc, wfd)) {
         return -EBADFD;
     }
-
     if (rfd < 0) {
         rfd = -1;
-        for (int i = 0; i < PROCESS_IOMAX; i++) {
-            if (i == wfd) {
-                continue;     
-            }    
-            if (!proc->iotab[i]) { 
-                rfd = i; 
-                break; 
-            }
-        }
-        if (rfd < 0)  {
-            return -EMFILE;
-        }                     
-    } else if (proc->iotab[rfd]) {
+    } else if (process_getio(proc, rfd)) {
         return -EBADFD;
     }
 
-    if (wfd == rfd) {
-        return -EBADFD;
-    }                        
-
-
     struct io *wio = NULL, *rio = NULL;
     create_pipe(&wio, &rio);
     if (!wio || !rio) {                     
@@ -388,8 +580,18 @@ int syspipe(int *wfdptr, int *rfdptr)
         return -EMFILE;
     }
 
-    proc->iotab[wfd] = wio;
-    proc->iotab[rfd] = rio;
+    wfd = process_installio(proc, wfd, wio);
+    if (wfd < 0) {
+        ioclose(wio);
+        ioclose(rio);
+        return wfd;
+    }
+    rfd = process_installio(proc, rfd, rio);
+    if (rfd < 0) {
+        process_closeio(proc, wfd);
+        ioclose(rio);
+        return rfd;
+    }
 
     *wfdptr = wfd;
     *rfdptr = rfd;
@@ -437,11 +639,9 @@ int sysfsdelete(const char* name) {
 int sysiodup(int oldfd, int newfd)
 {
     struct process *proc = current_process();
+    struct io *oldio = process_getio(proc, oldfd);
+    int result;
 
-    if (oldfd < 0 || oldfd >= PROCESS_IOMAX) {
-        return -EBADFD;
-    }
-    struct io *oldio = proc->iotab[oldfd];
     if (!oldio) {
         return -EBADFD;
     }
@@ -450,26 +650,108 @@ int sysiodup(int oldfd, int newfd)
         return oldfd;
     }
 
-    if (newfd == -1) {
-        for (int i = 0; i < PROCESS_IOMAX; i++) {
-            if (!proc->iotab[i]) { 
-                newfd = i; break;
-            }
-        }
-        if (newfd == -1) {
-            return -EMFILE;
+    if (newfd != -1 && process_getio(proc, newfd)) {
+        result = process_closeio(proc, newfd);
+        if (result < 0) {
+            return result;
         }
     }
 
-    if (newfd < 0 || newfd >= PROCESS_IOMAX) {
+    // newfd of -1 takes the lowest free fd
+    oldio = ioaddref(oldio);
+    result = process_installio(proc, newfd, oldio);
+    if (result < 0) {
+        ioclose(oldio);
+    }
+    return result;
+}
+
+long sysmmap(int fd, size_t len, int flags) {
+    struct io* io = process_getio(current_process(), fd);
+    if (io == NULL) {
         return -EBADFD;
     }
+    // the mapping keeps its own reference, so fd may be closed after this
+    return process_mmap(io, len, flags);
+}
+
+int sysmunmap(void * addr) {
+    return process_munmap((uintptr_t)addr);
+}
+
+// Fills in /*buf/ with system-wide memory statistics and those of the
+// process whose thread is /tid/, or of the caller if /tid/ is negative.
+
+int sysmemstat(int tid, struct memstat * buf) {
+    struct process * proc;
+    struct memstat ms;
+    int result;
+
+    result = validate_vptr(buf, sizeof(struct memstat), PTE_W | PTE_U);
+    if (result < 0) {
+        return result;
+    }
 
-    if (proc->iotab[newfd]) {
-        ioclose(proc->iotab[newfd]);
-        proc->iotab[newfd] = NULL;
+    proc = (tid < 0) ? current_process() : thread_process(tid);
+    if (proc == NULL) {
+        return -EINVAL;
     }
 
-    proc->iotab[newfd] = ioaddref(oldio);
-    return newfd;
-}
\ No newline at end of file
+    memory_stats(&ms);
+    mspace_stats(proc->mtag, &ms);
+    *buf = ms;
+    return 0;
+}
+
+// Sets the scheduling priority of the calling thread to _prio_ (0 is the
+// highest) and returns the previous one. A negative _prio_ leaves the priority
+// unchanged, so _setprio(-1) just reads it.
+
+int syssetprio(int prio) {
+    if (prio < 0)
+        return thread_priority(running_thread());
+    else
+        return thread_set_priority(running_thread(), prio);
+}
+
+// Fills in /*buf/ with the scheduler statistics of thread /tid/. Returns
+// -ENOENT for an unused thread id and -EINVAL past the last one.
+
+int systhrstat(int tid, struct thread_stats * buf) {
+    struct thread_stats st;
+    int result;
+
+    result = validate_vptr(buf, sizeof(struct thread_stats), PTE_W | PTE_U);
+    if (result < 0) {
+        return result;
+    }
+
+    result = thread_get_stats(tid, &st);
+    if (result < 0) {
+        return result;
+    }
+
+    *buf = st;
+    return 0;
+}
+
+// Fills in /*buf/ with the statistics of interrupt source /srcno/. Returns
+// -ENOENT for a source that never had an ISR and -EINVAL past the last one.
+
+int sysintrstat(int srcno, struct intr_stats * buf) {
+    struct intr_stats st;
+    int result;
+
+    result = validate_vptr(buf, sizeof(struct intr_stats), PTE_W | PTE_U);
+    if (result < 0) {
+        return result;
+    }
+
+    result = intr_get_stats(srcno, &st);
+    if (result < 0) {
+        return result;
+    }
+
+    *buf = st;
+    return 0;
+}
@@ -25,22 +25,40 @@
 #include "memory.h"
 #include "error.h"
 #include "process.h"
+#include "spinlock.h"
+#include "see.h"
+#include "ktrace.h"
+#include "klog.h"
+#include "conf.h"
 
 #include <stdarg.h>
 
 // COMPILE-TIME PARAMETERS
 //
 
-// NTHR is the maximum number of threads
+// NTHR is the initial size of the thread table, which grows as needed.
+// THREAD_POOL_MAX is the number of reclaimed threads kept with their stacks
+// for reuse by later spawns.
 
 #ifndef NTHR
 #define NTHR 16
 #endif
 
+#ifndef THREAD_POOL_MAX
+#define THREAD_POOL_MAX 16
+#endif
+
 #ifndef STACK_SIZE
 #define STACK_SIZE PAGE_SIZE
 #endif
 
+// THREAD_QUANTUM_US is the time slice of a thread at priority 0. Each lower
+// level doubles it, so CPU-bound threads switch less often.
+
+#ifndef THREAD_QUANTUM_US
+#define THREAD_QUANTUM_US 10000
+#endif
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -81,6 +99,26 @@ struct thread {
     struct condition * wait_cond;
     struct condition child_exit;
     struct process* proc;
+    int base_prio; // highest level the thread runs at
+    int prio; // current level, base_prio <= prio < THREAD_NPRIO
+    unsigned long long run_start; // rdtime() when last scheduled
+    unsigned long long run_used; // time used at current level, under its quantum when ready
+    int hart; // hart it runs or last ran on; its ready lists when ready
+    unsigned long long ready_time; // rdtime() when it last became ready
+    struct thread_stats stats; // name, state and prio filled in on request
+};
+
+// Each hart has its own idle thread and ready-to-run lists. The ready-to-run
+// threads are kept in one list per priority level. Bit _n_ of ready_mask is
+// set when ready_lists[n] is not empty, so picking the next thread is the
+// lowest set bit followed by a list removal. A hart with nothing of its own
+// to run steals from the hart with the most ready threads.
+
+struct hart {
+    struct thread * idle;
+    struct thread_list ready_lists[THREAD_NPRIO];
+    unsigned int ready_mask;
+    unsigned int ready_cnt; // threads on ready_lists
 };
 
 // INTERNAL MACRO DEFINITIONS
@@ -90,6 +128,15 @@ struct thread {
 
 #define TP ((struct thread*)__builtin_thread_pointer())
 
+// The hart we are running on
+
+#define CURHART (&harts[TP->hart])
+
+// Time slice of a thread at priority level _lvl_, in timer counts.
+
+#define THREAD_QUANTUM(lvl) \
+    ((THREAD_QUANTUM_US * (TIMER_FREQ / 1000 / 1000)) << (lvl))
+
 // Macro for changing thread state. If compiled for debugging (DEBUG is
 // defined), prints function that changed thread state.
 
@@ -100,6 +147,7 @@ struct thread {
         thread_state_name(s), \
         TP->name, TP->id, \
         __func__); \
+    thread_account((t), (s)); \
     (t)->state = (s); \
 } while (0)
 
@@ -115,6 +163,11 @@ static void init_idle_thread(void);
 
 static void set_running_thread(struct thread * thr);
 
+// Updates the wait time and latency histogram of a thread about to change to
+// state _s_. Called by set_thread_state().
+
+static void thread_account(struct thread * thr, enum thread_state s);
+
 // Returns a string representing the state name. Used by debug and trace
 // statements, so marked unused to avoid compiler warnings.
 
@@ -136,6 +189,19 @@ static void thread_reclaim(int tid);
 
 static struct thread * create_thread(const char * name);
 
+// Doubles the size of the thread table. Returns 0 or -ENOMEM.
+
+static int thrtab_grow(void);
+
+// int spawn_actual(const char * name, int prio, void (*entry)(void), va_list ap)
+//
+// Common part of thread_spawn and thread_spawn_prio. Creates a thread at
+// priority _prio_ whose entry function gets the arguments in _ap_ and makes it
+// ready to run.
+
+static int spawn_actual (
+    const char * name, int prio, void (*entry)(void), va_list ap);
+
 // void running_thread_suspend(void)
 // Suspends the currently running thread and resumes the next thread on the
 // ready-to-run list using _thread_swtch (in threasm.s). Must be called with
@@ -148,7 +214,7 @@ static void running_thread_suspend(void);
 
 // The following functions manipulate a thread list (struct thread_list). Note
 // that threads form a linked list via the list_next member of each thread
-// structure. Thread lists are used for the ready-to-run list (ready_list) and
+// structure. Thread lists are used for the ready-to-run lists (ready_lists) and
 // for the list of waiting threads of each condition variable. These functions
 // are not interrupt-safe! The caller must disable interrupts before calling any
 // thread list function that may modify a list that is used in an ISR.
@@ -157,10 +223,26 @@ static void tlclear(struct thread_list * list);
 static int tlempty(const struct thread_list * list);
 static void tlinsert(struct thread_list * list, struct thread * thr);
 static struct thread * tlremove(struct thread_list * list);
-static void tlappend(struct thread_list * l0, struct thread_list * l1);
+
+// Functions for the ready-to-run lists of struct hart. An idle thread is
+// never on a ready list; it runs when ready_remove returns NULL. Like the
+// thread list functions, these must be called with interrupts disabled.
+
+static void ready_insert(struct thread * thr);
+static struct thread * ready_remove(struct hart * h);
+static int ready_pending(const struct hart * h);
+
+// Makes a thread taken off a condition wait list ready to run. Must be called
+// with interrupts disabled.
+
+static void wake_waiter(struct thread * thr);
 
 static void idle_thread_func(void);
 
+// Entry of the secondary harts, called from start.s
+
+extern void secondary_main(unsigned int hartid);
+
 // IMPORTED FUNCTION DECLARATIONS
 // defined in thrasm.s
 //
@@ -188,6 +270,8 @@ static struct thread main_thread = {
     .stack_anchor = (void*)_main_stack_anchor,
     .stack_lowest = _main_stack_lowest,
     .child_exit.name = "main.child_exit",
+    .base_prio = 0,
+    .prio = 0
 };
 
 extern char _idle_stack_lowest[]; // from thrasm.s
@@ -203,19 +287,51 @@ static struct thread idle_thread = {
     .ctx.sp = _idle_stack_anchor,
     .ctx.ra = &_thread_startup,
     // FIXME your code goes here
-    .ctx.s[8] = (uint64_t)&idle_thread_func
+    .ctx.s[8] = (uint64_t)&idle_thread_func,
+    .base_prio = THREAD_NPRIO-1,
+    .prio = THREAD_NPRIO-1
 };
 
-static struct thread * thrtab[NTHR] = {
+static struct thread * initial_thrtab[NTHR] = {
     [MAIN_TID] = &main_thread,
     [IDLE_TID] = &idle_thread
 };
 
-static struct thread_list ready_list = {
-    .head = &idle_thread,
-    .tail = &idle_thread
+// The thread table starts out as initial_thrtab and is replaced by one twice
+// the size whenever create_thread finds it full. The idle thread keeps its
+// slot at NTHR-1.
+
+static struct thread ** thrtab = initial_thrtab;
+static int thrtab_len = NTHR;
+
+// Reclaimed threads, linked through list_next. Each keeps its stack page, so
+// spawning one needs no page allocation.
+
+static struct thread * thread_pool;
+static int thread_pool_cnt;
+
+static struct hart harts[NHART] = {
+    [0] = { .idle = &idle_thread }
 };
 
+// The kernel lock is held by the hart running kernel code. A hart takes it on
+// a trap from U mode and drops it on the way back to U mode and while its idle
+// thread waits for an interrupt, so harts run user code in parallel but kernel
+// code one at a time. Everything that used to rely on disabling interrupts for
+// mutual exclusion still does, since interrupts are only taken in S mode by the
+// hart holding the lock. Hart 0 boots holding it.
+
+static struct spinlock kernel_spinlock = { .locked = 1 };
+
+// Read by start.s: secondary harts wait for their entry in _hart_boot_sp to
+// become non-zero and take it as their stack pointer.
+
+const unsigned int _hart_cnt = NHART;
+void * volatile _hart_boot_sp[NHART];
+
+static struct kcache thread_cache =
+    KCACHE_INITIALIZER("thread", struct thread, NULL);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -223,11 +339,86 @@ int running_thread(void) {
     return TP->id;
 }
 
+int running_hart(void) {
+    return TP->hart;
+}
+
+void kernel_lock(void) {
+    if (1 < NHART)
+        spinlock_acquire(&kernel_spinlock);
+}
+
+void kernel_unlock(void) {
+    if (1 < NHART)
+        spinlock_release(&kernel_spinlock);
+}
+
+// void smp_start(void)
+// Inputs: 
+//   None
+// Outputs: 
+//   None
+// Description: 
+//   Gives each secondary hart an idle thread and a stack, then wakes it with
+//   an IPI. The hart enters secondary_main on the stack of its idle thread.
+// Side Effects: 
+//   Allocates a struct thread and a stack page per secondary hart.
+
+void smp_start(void) {
+    struct thread_stack_anchor * anchor;
+    struct thread * idle;
+    void * stack_page;
+    int i;
+
+    for (i = 1; i < NHART; i++) {
+        idle = kcache_alloc(&thread_cache);
+        stack_page = alloc_phys_page();
+        if (idle == NULL || stack_page == NULL)
+            panic("smp_start: out of memory");
+        
+        anchor = (struct thread_stack_anchor*)(stack_page + STACK_SIZE) - 1;
+        anchor->ktp = idle;
+        anchor->kgp = NULL;
+
+        idle->id = IDLE_TID;
+        idle->name = "idle";
+        idle->state = THREAD_RUNNING;
+        idle->stack_anchor = anchor;
+        idle->stack_lowest = stack_page;
+        idle->base_prio = THREAD_NPRIO-1;
+        idle->prio = THREAD_NPRIO-1;
+        idle->hart = i;
+        harts[i].idle = idle;
+
+        __atomic_store_n(&_hart_boot_sp[i], anchor, __ATOMIC_RELEASE);
+        send_ipi(i);
+    }
+}
+
+// Entered from start.s on each secondary hart once smp_start has given it a
+// stack. Sets up the per-hart state of each subsystem and becomes the idle
+// thread of the hart.
+
+void secondary_main(unsigned int hartid) {
+    kernel_lock();
+    set_running_thread(harts[hartid].idle);
+
+    memory_init_hart();
+    intrmgr_init_hart();
+    timer_init();
+
+    kprintf("Hart %u online\n", hartid);
+
+    enable_interrupts();
+    idle_thread_func();
+}
+
 void thrmgr_init(void) {
     trace("%s()", __func__);
     init_main_thread();
     init_idle_thread();
     set_running_thread(&main_thread);
+    main_thread.run_start = rdtime();
     thrmgr_initialized = 1;
 }
 
@@ -249,34 +440,83 @@ int thread_spawn (
     void (*entry)(void),
     ...)
 {
-    struct thread * child;
     va_list ap;
-    int pie;
-    int i;
-
-    child = create_thread(name);
-
-    if (child == NULL)
-        return -EMTHR;
-    set_thread_state(child, THREAD_READY);
+    int tid;
 
-    pie = disable_interrupts();
-    tlinsert(&ready_list, child);
-    restore_interrupts(pie);
+    va_start(ap, entry);
+    tid = spawn_actual(name, TP->base_prio, entry, ap);
+    va_end(ap);
+    return tid;
+}
 
-    // FIXME your code goes here
-    // filling in entry function arguments is given below, the rest is up to you
+int thread_spawn_prio (
+    int prio,
+    const char * name,
+    void (*entry)(void),
+    ...)
+{
+    va_list ap;
+    int tid;
 
-    child->ctx.sp = child->stack_anchor; // set it to base of stack
-    child->ctx.ra = &_thread_startup; // since we will need to go to startup
+    if (prio < 0 || THREAD_NPRIO <= prio)
+        return -EINVAL;
 
     va_start(ap, entry);
-    child->ctx.s[8] = (uint64_t) entry; // s0-s7 are taken for arguments so this is where the entry reference will go
-    for (i = 0; i < 8; i++)
-        child->ctx.s[i] = va_arg(ap, uint64_t);
+    tid = spawn_actual(name, prio, entry, ap);
     va_end(ap);
+    return tid;
+}
+
+int thread_set_priority(int tid, int prio) {
+    struct thread * thr;
+    int old;
+
+    if (tid < 0 || thrtab_len <= tid || tid == IDLE_TID)
+        return -EINVAL;
+    if (prio < 0 || THREAD_NPRIO <= prio)
+        return -EINVAL;
     
-    return child->id;
+    thr = thrtab[tid];
+    if (thr == NULL)
+        return -EINVAL;
+    
+    trace("%s(<%s:%d>,%d)", __func__, thr->name, tid, prio);
+
+    old = thr->base_prio;
+    thr->base_prio = prio;
+    thr->prio = prio;
+    thr->run_used = 0;
+    return old;
+}
+
+int thread_priority(int tid) {
+    if (tid < 0 || thrtab_len <= tid || thrtab[tid] == NULL)
+        return -EINVAL;
+    return thrtab[tid]->base_prio;
+}
+
+int thread_get_stats(int tid, struct thread_stats * st) {
+    struct thread * thr;
+
+    if (tid < 0 || thrtab_len <= tid)
+        return -EINVAL;
+    
+    thr = thrtab[tid];
+    if (thr == NULL)
+        return -ENOENT;
+    
+    *st = thr->stats;
+    strncpy(st->name, thr->name, sizeof(st->name) - 1);
+    st->name[sizeof(st->name) - 1] = '\0';
+    st->state = thr->state;
+    st->prio = thr->prio;
+
+    // Count the current turn of a running thread too
+
+    if (thr->state == THREAD_RUNNING)
+        st->run_ticks += rdtime() - thr->run_start;
+    
+    return 0;
 }
 
 // void thread_exit(void)
@@ -292,6 +532,7 @@ int thread_spawn (
 void thread_exit(void) {
     // FIXME your code goes here
     if(TP->id == MAIN_TID){
+        klog_sync(); // write out the log before the machine stops
         halt_success();
     }
     else{
@@ -312,6 +553,22 @@ void thread_yield(void) {
     running_thread_suspend();
 }
 
+int thread_preempt_pending(void) {
+    if (TP == CURHART->idle)
+        return ready_pending(CURHART);
+    
+    // Is a thread of higher priority ready?
+
+    if (CURHART->ready_mask & ((1U << TP->prio) - 1))
+        return 1;
+    
+    // Has the quantum run out? We yield even if no other thread is ready so
+    // that running_thread_suspend charges the quantum and sets the next one.
+
+    return (THREAD_QUANTUM(TP->prio) <=
+        TP->run_used + (rdtime() - TP->run_start));
+}
+
 
 // int thread_join(int tid)
 // Inputs: 
@@ -324,7 +581,7 @@ void thread_yield(void) {
 //   Suspends execution until the specified thread terminates.
 
 int thread_join(int tid) {
-    if (tid < 0 || tid >= NTHR) {
+    if (tid < 0 || tid >= thrtab_len) {
         return -EINVAL;
     }
 
@@ -333,7 +590,7 @@ int thread_join(int tid) {
             int have_children = 0;
 
             // Look for any child that has exited
-            for (int i = 1; i < NTHR; i++) {
+            for (int i = 1; i < thrtab_len; i++) {
                 struct thread * child = thrtab[i];
                 if (child && child->parent == TP) {
                     have_children = 1;
@@ -350,7 +607,7 @@ int thread_join(int tid) {
             }
 
             // Otherwise, wait on any child that hasn't exited yet
-            for (int i = 1; i < NTHR; i++) {
+            for (int i = 1; i < thrtab_len; i++) {
                 struct thread * child = thrtab[i];
                 if (child && child->parent == TP && child->state != THREAD_EXITED) {
                     condition_wait(&child->child_exit);
@@ -383,7 +640,7 @@ int thread_join(int tid) {
 
 
 const char * thread_name(int tid) {
-    assert (0 <= tid && tid < NTHR);
+    assert (0 <= tid && tid < thrtab_len);
     assert (thrtab[tid] != NULL);
     return thrtab[tid]->name;
 }
@@ -439,25 +696,29 @@ void condition_wait(struct condition * cond) {
 //   Moves waiting threads to the ready list and updates their states.
 
 void condition_broadcast(struct condition * cond) {
+    struct thread * thr;
     int oldlevel = disable_interrupts();
 
-    // Move all waiting threads to the ready list
-    tlappend(&ready_list, &cond->wait_list);
+    // Move all waiting threads to the ready lists
 
-    // Iterate through the ready list and update thread states
-    struct thread * thr = ready_list.head;
-    while (thr != NULL) {
-        if (thr->wait_cond == cond) {
-            set_thread_state(thr, THREAD_READY);
-            thr->wait_cond = NULL;  // Clear wait condition
-        }
-        thr = thr->list_next;
-    }
+    while ((thr = tlremove(&cond->wait_list)) != NULL)
+        wake_waiter(thr);
 
     restore_interrupts(oldlevel);
 
 }
 
+void condition_signal(struct condition * cond) {
+    struct thread * thr;
+    int pie = disable_interrupts();
+
+    thr = tlremove(&cond->wait_list);
+    if (thr != NULL)
+        wake_waiter(thr);
+    
+    restore_interrupts(pie);
+}
+
 // INTERNAL FUNCTION DEFINITIONS
 //
 
@@ -494,25 +755,37 @@ void thread_reclaim(int tid) {
     struct thread * const thr = thrtab[tid];
     int ctid;
 
-    assert (0 < tid && tid < NTHR && thr != NULL);
+    assert (0 < tid && tid < thrtab_len && thr != NULL);
     assert (thr->state == THREAD_EXITED);
 
     // Make our parent thread the parent of our child threads. We need to scan
     // all threads to find our children. We could keep a list of all of a
     // thread's children to make this operation more efficient.
 
-    for (ctid = 1; ctid < NTHR; ctid++) {
+    for (ctid = 1; ctid < thrtab_len; ctid++) {
         if (thrtab[ctid] != NULL && thrtab[ctid]->parent == thr)
             thrtab[ctid]->parent = thr->parent;
     }
 
     thrtab[tid] = NULL;
 
+    if (thr->proc != NULL)
+        process_reclaim(thr->proc);
+
+    // Keep the thread and its stack for the next spawn if the pool has room
+
+    if (thr->stack_lowest != NULL && thread_pool_cnt < THREAD_POOL_MAX) {
+        thr->list_next = thread_pool;
+        thread_pool = thr;
+        thread_pool_cnt++;
+        return;
+    }
+
     if(thr->stack_lowest){
         free_phys_page(thr->stack_lowest);
     }
 
-    kfree(thr);
+    kcache_free(&thread_cache, thr);
 }
 
 struct thread * create_thread(const char * name) {
@@ -523,36 +796,39 @@ struct thread * create_thread(const char * name) {
 
     trace("%s(name=\"%s\") in <%s:%d>", __func__, name, TP->name, TP->id);
 
-    // Find a free thread slot.
+    // Find a free thread slot, growing the table if there is none.
 
     tid = 0;
-    while (++tid < NTHR)
+    while (++tid < thrtab_len)
         if (thrtab[tid] == NULL)
             break;
     
-    if (tid == NTHR)
-        return NULL;
-    
-    // Allocate a struct thread and a stack
-
-    thr = kcalloc(1, sizeof(struct thread));
-    if(!thr){
+    if (tid == thrtab_len && thrtab_grow() < 0)
         return NULL;
-    }
     
-    stack_page = alloc_phys_page();
-    if(!stack_page){
-        kfree(thr);
-        return NULL;
+    // Take a struct thread and its stack from the pool, or allocate them
+
+    if (thread_pool != NULL) {
+        thr = thread_pool;
+        thread_pool = thr->list_next;
+        thread_pool_cnt--;
+        stack_page = thr->stack_lowest;
+        memset(thr, 0, sizeof(struct thread));
+    } else {
+        thr = kcache_alloc(&thread_cache);
+        if(!thr){
+            return NULL;
+        }
+        
+        stack_page = alloc_phys_page();
+        if(!stack_page){
+            kcache_free(&thread_cache, thr);
+            return NULL;
+        }
     }
 
-    //old version
-    // anchor = stack_page + STACK_SIZE;
-    // anchor -= 1; // anchor is at base of stack
-
-    char *base = (char*)stack_page;
     // place the anchor struct in the last bytes of the page
-    anchor = (struct thread_stack_anchor*)(base + STACK_SIZE) - 1; //anchor lives at top of page
+    anchor = (struct thread_stack_anchor*)(stack_page + STACK_SIZE) - 1;
 
     thr->stack_lowest = stack_page;
     thr->stack_anchor = anchor;
@@ -564,9 +840,58 @@ struct thread * create_thread(const char * name) {
     thr->id = tid;
     thr->name = name;
     thr->parent = TP;
+    thr->hart = TP->hart;
     return thr;
 }
 
+int thrtab_grow(void) {
+    struct thread ** newtab;
+
+    newtab = kcalloc(2 * thrtab_len, sizeof(struct thread *));
+    if (newtab == NULL)
+        return -ENOMEM;
+    
+    memcpy(newtab, thrtab, thrtab_len * sizeof(struct thread *));
+
+    if (thrtab != initial_thrtab)
+        kfree(thrtab);
+    
+    thrtab = newtab;
+    thrtab_len *= 2;
+    return 0;
+}
+
+int spawn_actual (
+    const char * name, int prio, void (*entry)(void), va_list ap)
+{
+    struct thread * child;
+    int pie;
+    int i;
+
+    child = create_thread(name);
+
+    if (child == NULL)
+        return -EMTHR;
+
+    child->ctx.sp = child->stack_anchor; // set it to base of stack
+    child->ctx.ra = &_thread_startup; // since we will need to go to startup
+
+    child->ctx.s[8] = (uint64_t) entry; // s0-s7 are taken for arguments so this is where the entry reference will go
+    for (i = 0; i < 8; i++)
+        child->ctx.s[i] = va_arg(ap, uint64_t);
+
+    child->base_prio = prio;
+    child->prio = prio;
+    child->run_used = 0;
+    set_thread_state(child, THREAD_READY);
+
+    pie = disable_interrupts();
+    ready_insert(child);
+    restore_interrupts(pie);
+    
+    return child->id;
+}
+
 // void running_thread_suspend(void)
 // Inputs: 
 //   None
@@ -578,28 +903,71 @@ struct thread * create_thread(const char * name) {
 //   Modifies the thread state and may trigger a context switch.
 
 void running_thread_suspend(void) {
-    // FIXME your code goes here
+    enum thread_state prev_state;
+
+    // FIXME your code goes here
     
     //this is where we call thread_switch
     disable_interrupts();
 
+    // Charge the time since the thread was scheduled to its quantum. A thread
+    // that is still running has burned through it if it is used up, and moves
+    // down a level with a longer quantum.
+
+    prev_state = TP->state;
+    TP->stats.run_ticks += rdtime() - TP->run_start;
+
+    if (TP != CURHART->idle) {
+        TP->run_used += rdtime() - TP->run_start;
+
+        if (TP->state == THREAD_RUNNING &&
+            THREAD_QUANTUM(TP->prio) <= TP->run_used)
+        {
+            if (TP->prio < THREAD_NPRIO-1)
+                TP->prio++;
+            TP->run_used = 0;
+        }
+    }
+
     if(TP->state == THREAD_RUNNING){
         set_thread_state(TP, THREAD_READY);
-        tlinsert(&ready_list, TP);
+        if (TP != CURHART->idle)
+            ready_insert(TP);
     }
 
-    struct thread * switchto = tlremove(&ready_list);
+    struct thread * switchto = ready_remove(CURHART);
     if (switchto == NULL) {
         // If no one is ready, run the idle thread
-        switchto = &idle_thread;
+        switchto = CURHART->idle;
+    }
+
+    if (switchto != TP) {
+        if (prev_state == THREAD_RUNNING)
+            TP->stats.nivcsw++;
+        else
+            TP->stats.nvcsw++;
     }
 
     set_thread_state(switchto, THREAD_RUNNING);
+    switchto->run_start = rdtime();
+
+    // Ask for a timer interrupt when the quantum of the new thread ends. The
+    // idle thread has no quantum; any thread becoming ready ends its turn.
+
+    if (switchto == CURHART->idle)
+        timer_preempt_at(UINT64_MAX);
+    else
+        timer_preempt_at(switchto->run_start +
+            THREAD_QUANTUM(switchto->prio) - switchto->run_used);
 
     //switch memory space (only if this is a user thread)
     if (switchto->proc != NULL) {
+        switchto->proc->mtag = assign_asid (
+            switchto->proc->mtag, &switchto->proc->asid_gen,
+            &switchto->proc->asid_hart);
         switch_mspace(switchto->proc->mtag);
     }
+    ktrace(KTRACE_SWITCH, TP->id, switchto->id);
     enable_interrupts();
     _thread_swtch(switchto);
 
@@ -655,47 +1023,157 @@ struct thread * tlremove(struct thread_list * list) {
     return thr;
 }
 
-// Appends elements of l1 to the end of l0 and clears l1.
+// Puts a thread on the ready lists of the hart it last ran on. If that hart is
+// idle, it is asleep in wfi (without the kernel lock) and needs an IPI to
+// notice. If it is busy, we wake an idle hart instead so it can steal.
 
-void tlappend(struct thread_list * l0, struct thread_list * l1) {
-    if (l0->head != NULL) {
-        assert(l0->tail != NULL);
-        
-        if (l1->head != NULL) {
-            assert(l1->tail != NULL);
-            l0->tail->list_next = l1->head;
-            l0->tail = l1->tail;
+void ready_insert(struct thread * thr) {
+    struct hart * h = &harts[thr->hart];
+    int i;
+
+    assert (0 <= thr->prio && thr->prio < THREAD_NPRIO);
+    tlinsert(&h->ready_lists[thr->prio], thr);
+    h->ready_mask |= 1U << thr->prio;
+    h->ready_cnt++;
+
+    if (h->idle->state != THREAD_RUNNING) {
+        h = NULL;
+        for (i = 0; i < NHART; i++) {
+            if (harts[i].idle != NULL &&
+                harts[i].idle->state == THREAD_RUNNING)
+            {
+                h = &harts[i];
+                break;
+            }
         }
-    } else {
-        assert(l0->tail == NULL);
-        l0->head = l1->head;
-        l0->tail = l1->tail;
     }
 
-    l1->head = NULL;
-    l1->tail = NULL;
+    if (h != NULL && h != CURHART)
+        send_ipi(h - harts);
+}
+
+// Removes the next thread to run on hart /h/: the head of its highest-priority
+// non-empty ready list, or if it has none, the same from the hart with the
+// most ready threads. Returns NULL if no hart has a ready thread.
+
+struct thread * ready_remove(struct hart * h) {
+    struct hart * victim;
+    struct thread * thr;
+    int lvl;
+    int i;
+
+    if (h->ready_mask == 0) {
+        victim = h;
+        for (i = 0; i < NHART; i++) {
+            if (harts[i].ready_cnt > victim->ready_cnt)
+                victim = &harts[i];
+        }
+
+        if (victim->ready_mask == 0)
+            return NULL;
+    } else
+        victim = h;
+    
+    // There are only THREAD_NPRIO levels, and without Zbb __builtin_ctz
+    // would be a libgcc call, which the kernel is not linked with.
+
+    lvl = 0;
+    while ((victim->ready_mask & (1U << lvl)) == 0)
+        lvl++;
+
+    thr = tlremove(&victim->ready_lists[lvl]);
+    victim->ready_cnt--;
+
+    if (tlempty(&victim->ready_lists[lvl]))
+        victim->ready_mask &= ~(1U << lvl);
+    
+    thr->hart = h - harts;
+    return thr;
+}
+
+void thread_account(struct thread * thr, enum thread_state s) {
+    const unsigned long long now = rdtime();
+    unsigned long long us;
+    int bkt;
+
+    if (s == THREAD_READY && thr->state != THREAD_READY)
+        thr->ready_time = now;
+    else if (s == THREAD_RUNNING && thr->state == THREAD_READY) {
+        thr->stats.wait_ticks += now - thr->ready_time;
+
+        us = (now - thr->ready_time) / (TIMER_FREQ / 1000 / 1000);
+        bkt = 0;
+        while (1 < us && bkt < THREAD_LAT_NBKT-1) {
+            us >>= 1;
+            bkt++;
+        }
+
+        thr->stats.lat_hist[bkt]++;
+    }
+}
+
+// A thread that blocked before using up its quantum is interactive or
+// I/O-bound, so it moves up a level (but not above its base priority) with a
+// fresh quantum.
+
+void wake_waiter(struct thread * thr) {
+    thr->wait_cond = NULL;  // Clear wait condition
+    if (thr->base_prio < thr->prio)
+        thr->prio--;
+    thr->run_used = 0;
+    set_thread_state(thr, THREAD_READY);
+    ready_insert(thr);
+}
+
+// Returns 1 if hart /h/ has something to run if it suspends its thread.
+
+int ready_pending(const struct hart * h) {
+    int i;
+
+    if (h->ready_mask != 0)
+        return 1;
+    
+    for (i = 0; i < NHART; i++) {
+        if (harts[i].ready_cnt != 0)
+            return 1;
+    }
+
+    return 0;
 }
 
 void idle_thread_func(void) {
-    // The idle thread sleeps using wfi if the ready list is empty. Note that we
-    // need to disable interrupts before checking if the thread list is empty to
-    // avoid a race condition where an ISR marks a thread ready to run between
-    // the call to tlempty() and the wfi instruction.
+    struct hart * const h = CURHART; // idle threads never move
+
+    // The idle thread sleeps using wfi if the ready list is empty. Note that we
+    // need to disable interrupts before checking if the thread list is empty to
+    // avoid a race condition where an ISR marks a thread ready to run between
+    // the call to tlempty() and the wfi instruction.
 
     for (;;) {
-        // If there are runnable threads, yield to them.
+        // If there are runnable threads, yield to them.
 
-        while (!tlempty(&ready_list))
+        while (ready_pending(h))
             thread_yield();
         
-        // No runnable threads. Sleep using the wfi instruction. Note that we
-        // need to disable interrupts and check the runnable thread list one
-        // more time (make sure it is empty) to avoid a race condition where an
-        // ISR marks a thread ready before we call the wfi instruction.
+        // No runnable threads. Use the time to zero pages for later page
+        // faults and forks, checking for ready threads after each one.
+
+        if (refill_zeroed_pages())
+            continue;
+
+        // Still nothing to do. Sleep using the wfi instruction. Note that we
+        // need to disable interrupts and check the runnable thread list one
+        // more time (make sure it is empty) to avoid a race condition where an
+        // ISR marks a thread ready before we call the wfi instruction. Other
+        // harts may use the kernel while we sleep; one that makes a thread
+        // ready for us sends an IPI, which ends the wfi.
 
         disable_interrupts();
-        if (tlempty(&ready_list))
+        if (!ready_pending(h)) {
+            kernel_unlock();
             asm ("wfi");
+            kernel_lock();
+        }
         enable_interrupts();
     }
 }
@@ -721,12 +1199,16 @@ void lock_acquire(struct lock * lock){
     if(lock->holder == TP){
         lock->count++;
     }
+    else if(lock->holder == NULL){
+        lock->holder = TP;
+        lock->count = 1;
+    }
     else{
-        while(lock->holder != NULL){
+        // lock_release hands the lock straight to the longest waiter, so by
+        // the time we run again it is already ours.
+        while(lock->holder != TP){
             condition_wait(&lock->released);
         }
-        lock->holder = TP;
-        lock->count = 1;
     }
 
     restore_interrupts(pie);
@@ -745,17 +1227,129 @@ void lock_release(struct lock * lock){
 
     lock->count--;
 
+    // Hand the lock to the first waiter instead of letting every waiter race
+    // for it. Waiters get it in FIFO order, and only the new holder wakes up.
+
     if(lock->count == 0){
-        lock->holder = NULL;
-        condition_broadcast(&lock->released);
+        lock->holder = lock->released.wait_list.head;
+        if(lock->holder != NULL){
+            lock->count = 1;
+            condition_signal(&lock->released);
+        }
+    }
+
+    restore_interrupts(pie);
+
+}
+
+void rwlock_init(struct rwlock * rwl) {
+    rwl->writer = NULL;
+    rwl->wcount = 0;
+    rwl->readers = 0;
+    rwl->writers_waiting = 0;
+    condition_init(&rwl->readers_ok, "readers_ok");
+    condition_init(&rwl->writer_ok, "writer_ok");
+}
+
+void rwlock_read_acquire(struct rwlock * rwl) {
+    int pie;
+
+    // The writer reading its own data just nests another write hold
+
+    if (rwl->writer == TP) {
+        rwl->wcount++;
+        return;
     }
 
+    pie = disable_interrupts();
+
+    while (rwl->writer != NULL || 0 < rwl->writers_waiting)
+        condition_wait(&rwl->readers_ok);
+    
+    rwl->readers++;
     restore_interrupts(pie);
+}
+
+void rwlock_read_release(struct rwlock * rwl) {
+    int pie;
+
+    if (rwl->writer == TP) {
+        rwlock_write_release(rwl);
+        return;
+    }
 
+    pie = disable_interrupts();
+
+    assert (0 < rwl->readers);
+
+    if (--rwl->readers == 0 && 0 < rwl->writers_waiting)
+        condition_signal(&rwl->writer_ok);
+    
+    restore_interrupts(pie);
+}
+
+void rwlock_write_acquire(struct rwlock * rwl) {
+    int pie;
+
+    if (rwl->writer == TP) {
+        rwl->wcount++;
+        return;
+    }
+
+    pie = disable_interrupts();
+
+    rwl->writers_waiting++;
+
+    while (rwl->writer != NULL || 0 < rwl->readers)
+        condition_wait(&rwl->writer_ok);
+    
+    rwl->writers_waiting--;
+    rwl->writer = TP;
+    rwl->wcount = 1;
+    restore_interrupts(pie);
+}
+
+int rwlock_write_tryacquire(struct rwlock * rwl) {
+    int pie;
+    int result = 0;
+
+    pie = disable_interrupts();
+
+    if (rwl->writer == NULL && rwl->readers == 0 && rwl->writers_waiting == 0) {
+        rwl->writer = TP;
+        rwl->wcount = 1;
+        result = 1;
+    }
+
+    restore_interrupts(pie);
+    return result;
+}
+
+void rwlock_write_release(struct rwlock * rwl) {
+    int pie;
+
+    assert (rwl->writer == TP);
+
+    if (--rwl->wcount != 0)
+        return;
+    
+    pie = disable_interrupts();
+
+    // Another writer goes next if one is waiting; the readers that queued up
+    // behind it get in together once no writer is left.
+
+    rwl->writer = NULL;
+
+    if (0 < rwl->writers_waiting)
+        condition_signal(&rwl->writer_ok);
+    else
+        condition_broadcast(&rwl->readers_ok);
+    
+    restore_interrupts(pie);
 }
 
 struct process* thread_process(int tid) {
-    if (tid < 0 || tid >= NTHR) {
+    if (tid < 0 || tid >= thrtab_len) {
         return NULL;
     }
     // get current thread
@@ -775,7 +1369,7 @@ struct process * running_thread_process() {
 }
 
 void thread_set_process(int tid, struct process * proc) {
-    if (tid < 0 || tid >= NTHR) {
+    if (tid < 0 || tid >= thrtab_len) {
         return;
     }
     struct thread *thr = thrtab[tid];
@@ -795,16 +1389,3 @@ void thread_set_anchor_ktp(void) {
     TP->stack_anchor->ktp = TP;
     TP->stack_anchor->kgp = NULL;
 }
-
-void interrupter(void) {
-    struct alarm al;
-    alarm_init(&al, "interrupter");
-
-    for (;;) {
-        alarm_sleep_ms(&al, 10);  // 10ms sleep triggers timer interrupt
-    }
-}
-
-void start_interrupter(void) {
-    thread_spawn("interrupter", &interrupter);
-}
\ No newline at end of file
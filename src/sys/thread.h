@@ -25,6 +25,15 @@ struct lock {
     int count;
 };
 
+struct rwlock {
+    struct condition readers_ok;  // no writer holds or waits for the lock
+    struct condition writer_ok;   // no thread holds the lock
+    struct thread * writer;       // Thread holding the lock for writing
+    int wcount;                   // recursion depth of writer
+    int readers;                  // threads holding the lock for reading
+    int writers_waiting;
+};
+
 // EXPORTED FUNCTION DECLARATIONS
 //
 
@@ -36,6 +45,20 @@ extern void thrmgr_init(void);
 
 extern int running_thread(void);
 
+// Returns the hartid of the hart we are running on.
+
+extern int running_hart(void);
+
+// The kernel lock serializes kernel code across harts (see thread.c). It is
+// taken and dropped by the trap entry and exit code in trap.s.
+
+extern void kernel_lock(void);
+extern void kernel_unlock(void);
+
+// Brings up the secondary harts. Called once from main.
+
+extern void smp_start(void);
+
 // int thread_spawn(const char * name, void (*start)(void *), ...)
 // 
 // Creates and starts a new thread. Argument _name_ is the name of the thread
@@ -49,13 +72,78 @@ extern int thread_spawn (
     void (*entry)(void),
     ...);
 
-// void thread_yield(void)
+// Scheduling priorities. Level 0 is the highest. A thread's priority is the
+// highest level it may run at; the scheduler demotes it a level each time it
+// uses up its quantum and moves it back up each time it blocks.
+
+#ifndef THREAD_NPRIO
+#define THREAD_NPRIO 4
+#endif
+
+// int thread_spawn_prio(int prio, const char * name, void (*entry)(void), ...)
+//
+// Like thread_spawn, but the new thread runs with priority _prio_ instead of
+// that of the running thread. Returns -EINVAL if _prio_ is out of range.
+
+extern int thread_spawn_prio (
+    int prio,
+    const char * name,
+    void (*entry)(void),
+    ...);
+
+// int thread_set_priority(int tid, int prio)
+//
+// Sets the priority of a thread and returns its previous priority. A thread on
+// the ready-to-run list keeps its place until it is next scheduled. Returns
+// -EINVAL if _tid_ or _prio_ is invalid.
+
+extern int thread_set_priority(int tid, int prio);
+
+// Returns the priority of a thread, or -EINVAL if _tid_ is invalid.
+
+extern int thread_priority(int tid);
+
+// Scheduler statistics of a thread. Bucket n of lat_hist counts the times the
+// thread waited at least 2^n but less than 2^(n+1) microseconds between
+// becoming ready and running; bucket 0 also counts waits under a microsecond
+// and the last bucket everything longer.
+
+#define THREAD_LAT_NBKT 16
+
+struct thread_stats {
+    char name[16];
+    int state;                      // enum thread_state
+    int prio;
+    unsigned long long run_ticks;   // timer ticks spent running
+    unsigned long long wait_ticks;  // timer ticks spent ready but not running
+    unsigned long nvcsw;            // switches away because it blocked or exited
+    unsigned long nivcsw;           // switches away while still runnable
+    unsigned long lat_hist[THREAD_LAT_NBKT];
+};
+
+// int thread_get_stats(int tid, struct thread_stats * st)
+//
+// Fills in _st_ with the statistics of thread _tid_. Returns 0, -ENOENT if
+// there is no thread _tid_, or -EINVAL if _tid_ is past the end of the thread
+// table, so a caller can walk all threads by counting _tid_ up from 0.
+
+extern int thread_get_stats(int tid, struct thread_stats * st);
+
+// void thread_yield(void)
 // 
 // Yields the CPU to another thread and returns when the current thread is next
 // scheduled to run.
 
 extern void thread_yield(void);
 
+// int thread_preempt_pending(void)
+//
+// Returns 1 if the running thread should give up the CPU because its quantum
+// has ended or a thread of higher priority is ready, and 0 otherwise. Called
+// on the way back to U mode from an interrupt.
+
+extern int thread_preempt_pending(void);
+
 // int thread_join(int tid)
 //
 // Waits for a child of the current thread to exit. if _tid_ is not zero, the
@@ -92,6 +180,13 @@ extern const char * running_thread_name(void);
 
 extern void condition_init(struct condition * cond, const char * name);
 
+// Kernel code is not preempted: a thread keeps the CPU and the kernel lock
+// until it blocks, yields or returns to U mode. No other thread runs between
+// releasing a lock and calling condition_wait(), so a condition signalled
+// only by threads cannot be missed there, and data touched only by threads
+// needs no lock of its own across code that does not block. Interrupt
+// handlers still run unless interrupts are disabled.
+
 // void condition_wait(struct condition * cond)
 // Suspends the current thread until a condition is signalled by another thread
 // or interrupt service routine. The condition_wait function may be called with
@@ -113,6 +208,15 @@ extern void condition_wait(struct condition * cond);
 
 extern void condition_broadcast(struct condition * cond);
 
+// void condition_signal(struct condition * cond)
+//
+// Wakes up the thread that has waited longest on a condition, if any. Use it
+// instead of condition_broadcast when whatever changed can only be used by one
+// waiter. Like condition_broadcast, it may be called from an ISR and does not
+// cause a context switch.
+
+extern void condition_signal(struct condition * cond);
+
 // lock operations
 
 extern void lock_init (struct lock * lock);
@@ -121,6 +225,31 @@ extern void lock_acquire(struct lock * lock);
 
 extern void lock_release(struct lock * lock);
 
+// reader-writer lock operations
+//
+// Any number of threads may hold a struct rwlock for reading at once, or one
+// thread for writing. Writers are preferred: once a writer waits, new readers
+// wait behind it, so a steady stream of lookups cannot starve an update. The
+// writer may acquire the lock again, for reading or writing, but a reader must
+// not: a second read acquire would wait for a writer blocked on the first. It
+// is valid to initialize a struct rwlock with all zeroes.
+
+extern void rwlock_init(struct rwlock * rwl);
+
+extern void rwlock_read_acquire(struct rwlock * rwl);
+
+extern void rwlock_read_release(struct rwlock * rwl);
+
+extern void rwlock_write_acquire(struct rwlock * rwl);
+
+// Takes the lock for writing if that needs no wait and returns 1, or returns
+// 0. Fails even if the caller already holds the lock, since it may be in the
+// middle of an update.
+
+extern int rwlock_write_tryacquire(struct rwlock * rwl);
+
+extern void rwlock_write_release(struct rwlock * rwl);
+
 // struct process * thread_process(int tid)
 //
 // Returns a pointer to the process struct of a thread's process, or NULL if the
@@ -142,5 +271,4 @@ extern void thread_set_process(int tid, struct process * proc);
  
 extern void * current_stack_anchor(void);
 extern void thread_set_anchor_ktp(void);
-extern void start_interrupter(void);
 #endif // _THREAD_H_
\ No newline at end of file
@@ -18,8 +18,51 @@
 #include "assert.h"
 #include "intr.h"
 #include "conf.h"
+#include "string.h"
 #include "see.h" // for set_stcmp
 
+// The scheduler asks for a timer interrupt at the end of the running thread's
+// quantum (see timer_preempt_at). With TIMER_TICKLESS non-zero, the timer is
+// programmed only for that and the next alarm, so an idle system takes no
+// timer interrupts at all. With TIMER_TICKLESS zero, the timer also fires
+// every TIMER_TICK_US microseconds. TIMER_TICK_US is also the retry interval
+// when a quantum ends while the thread cannot be preempted (in S mode).
+
+#ifndef TIMER_TICKLESS
+#define TIMER_TICKLESS 1
+#endif
+
+#ifndef TIMER_TICK_US
+#define TIMER_TICK_US 10000
+#endif
+
+#define TIMER_TICK (TIMER_TICK_US * (TIMER_FREQ / 1000 / 1000))
+
+// Sleeping alarms are kept in a hierarchical timer wheel. Time is counted in
+// wheel ticks of TIMER_WHEEL_RES_US microseconds; an alarm expires at the
+// start of the first wheel tick at or after its twake, so it may fire up to
+// one wheel tick late. Level 0 has a slot for each of the next WHEEL_SIZE
+// wheel ticks, and each slot of level n covers WHEEL_SIZE slots of level n-1.
+// An alarm goes into the lowest level whose range reaches its expiry tick.
+// When the wheel reaches the start of a level n slot, its alarms are moved
+// down to the levels below (cascaded), and when it reaches a level 0 slot,
+// every alarm in it expires. Alarms further out than the top level reaches
+// wait in its last slot and are put back there until they come in range.
+//
+// Inserting and cancelling an alarm take constant time, and the ISR expires a
+// whole slot in one pass. A bitmap of non-empty slots per level gives the next
+// wheel tick with something to do, which is when the timer is programmed for.
+
+#ifndef TIMER_WHEEL_RES_US
+#define TIMER_WHEEL_RES_US 100
+#endif
+
+#define WHEEL_RES (TIMER_WHEEL_RES_US * (TIMER_FREQ / 1000 / 1000))
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS) // slots per level
+#define WHEEL_LEVELS 4
+#define WHEEL_NONE UINT64_MAX
+
 // EXPORTED GLOBAL VARIABLE DEFINITIONS
 // 
 
@@ -28,19 +71,75 @@ char timer_initialized = 0;
 // INTERNVAL GLOBAL VARIABLE DEFINITIONS
 //
 
-static struct alarm * sleep_list;
+static struct alarm * wheel[WHEEL_LEVELS * WHEEL_SIZE];
+static uint64_t wheel_map[WHEEL_LEVELS]; // bit n set if slot n is not empty
+static unsigned long long wheel_now; // first wheel tick not yet expired
+static unsigned long wheel_cnt; // alarms in the wheel
 
-// INTERNAL FUNCTION DECLARATIONS
+// Each hart has its own timer and runs its own thread, so the time at which
+// to preempt it is per hart. The wheel is shared; every hart programs its
+// timer for the next wheel event as well, and whichever takes the interrupt
+// first wakes the sleepers.
+
+static unsigned long long preempt_twake[NHART] = {
+    [0 ... NHART-1] = UINT64_MAX
+};
+
+// INTERNAL FUNCTION DECLARATIONS
 //
 
+// Programs the timer of this hart for the earlier of the next alarm and its
+// preempt_twake, or disables its timer interrupts if there is neither. Must be
+// called with interrupts disabled.
+
+static void timer_program(void);
+
+static unsigned long long alarm_tick(const struct alarm * al);
+static void wheel_insert(struct alarm * al);
+static void wheel_remove(struct alarm * al);
+static unsigned long long wheel_next(void);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
+// Called on each hart; sets up the timer of the calling hart.
+
 void timer_init(void) {
     set_stcmp(UINT64_MAX);
+
+    if (!TIMER_TICKLESS) {
+        preempt_twake[running_hart()] = rdtime() + TIMER_TICK;
+        timer_program();
+    }
+
     timer_initialized = 1;
 }
 
+// void timer_preempt_at(unsigned long long twhen)
+// Inputs: 
+//   unsigned long long twhen - Time at which the running thread's quantum ends,
+//   or UINT64_MAX if it has none.
+// Outputs: 
+//   None
+// Description: 
+//   Called by the scheduler each time it switches threads. In tickless mode,
+//   moves the preemption interrupt to _twhen_. In periodic mode, the next tick
+//   comes soon enough and nothing changes.
+// Side Effects: 
+//   May reprogram the timer comparator.
+
+void timer_preempt_at(unsigned long long twhen) {
+    int pie;
+
+    if (!TIMER_TICKLESS)
+        return;
+
+    pie = disable_interrupts();
+    preempt_twake[running_hart()] = twhen;
+    timer_program();
+    restore_interrupts(pie);
+}
+
 // void alarm_init(struct alarm * al, const char * name)
 // Inputs: 
 //   struct alarm * al - Pointer to an alarm structure to be initialized.
@@ -66,6 +165,8 @@ void alarm_init(struct alarm * al, const char * name) {
     al->cond.wait_list.tail = NULL;
 
     al->next = NULL;
+    al->prev = NULL;
+    al->slot = -1;
 
     al->twake = rdtime(); //only thing that makes sense
 
@@ -79,14 +180,12 @@ void alarm_init(struct alarm * al, const char * name) {
 //   None
 // Description: 
 //   Puts the calling thread to sleep until the specified number of timer counts elapses.
-//   The function inserts the alarm into the sleep queue and enables timer interrupts if needed.
+//   The function inserts the alarm into the timer wheel and reprograms the timer.
 // Side Effects: 
-//   Modifies the global sleep queue and puts the calling thread to sleep.
+//   Modifies the timer wheel and puts the calling thread to sleep.
 
 void alarm_sleep(struct alarm * al, unsigned long long tcnt) {
     unsigned long long now;
-    unsigned long sie_val;
-
     int pie;
 
     now = rdtime();
@@ -103,45 +202,19 @@ void alarm_sleep(struct alarm * al, unsigned long long tcnt) {
     if (al->twake < now)
         return;
 
-
-    // FIXME your code goes here
-
-    //insertion into linked list logic
-
     pie = disable_interrupts();
 
-    if (sleep_list == NULL || al->twake < sleep_list->twake) { // if alarm is going to be the new head
-        al->next = sleep_list; // make it the new head
-        sleep_list = al; // adjust sleep list pointer to the new head
-    } else {
-        struct alarm *prev = sleep_list;
-        struct alarm *curr = sleep_list->next;
-        while (curr != NULL && curr->twake <= al->twake) { // find the correct place to insert this alarm based on twake
-            prev = curr;
-            curr = curr->next;
-        }
-        al->next = curr;
-        prev->next = al;
-    }
-
-    if(sleep_list == al){
-        set_stcmp(al->twake); // if alarm is the new head mtcmp gets set to this alarm's twake
-    }
-
-    //put thread to sleep?
+    // An empty wheel may have been left far behind while no interrupts came
 
+    if (wheel_cnt == 0)
+        wheel_now = now / WHEEL_RES;
 
-    //enable timer interrupts
+    wheel_insert(al);
+    timer_program();
 
-    sie_val = RISCV_SIE_STIE;
-    csrs_sie(sie_val);
-
-
-    condition_wait(&al->cond); // wait until this alarm gets awoken
+    condition_wait(&al->cond); // wait until this alarm expires or is cancelled
 
     restore_interrupts(pie);
-
-
 }
 
 // Resets the alarm so that the next sleep increment is relative to the time
@@ -151,6 +224,20 @@ void alarm_reset(struct alarm * al) {
     al->twake = rdtime();
 }
 
+void alarm_cancel(struct alarm * al) {
+    int pie;
+
+    pie = disable_interrupts();
+
+    if (0 <= al->slot) {
+        wheel_remove(al);
+        condition_broadcast(&al->cond);
+        timer_program();
+    }
+
+    restore_interrupts(pie);
+}
+
 void alarm_sleep_sec(struct alarm * al, unsigned int sec) {
     alarm_sleep(al, sec * TIMER_FREQ);
 }
@@ -186,45 +273,159 @@ void sleep_us(unsigned long us) {
 // Outputs: 
 //   None
 // Description: 
-//   Handles a timer interrupt by checking the sleep queue, waking up expired alarms, and updating the timer comparator register.
-//   If no alarms remain in the queue, timer interrupts are disabled.
+//   Handles a timer interrupt by advancing the timer wheel to the current time,
+//   cascading and expiring its slots on the way, and reprogramming the timer
+//   comparator. If nothing is left to wait for, timer interrupts are disabled.
 // Side Effects: 
-//   Modifies the sleep queue, potentially wakes up threads, and updates the timer comparator register.
+//   Modifies the timer wheel, potentially wakes up threads, and updates the timer comparator register.
 
 void handle_timer_interrupt(void) {
-    struct alarm * head = sleep_list;
-    struct alarm * next;
+    unsigned long long now_tick;
+    unsigned long long t;
+    struct alarm * al;
     uint64_t now;
-    unsigned long sie_val;
+    int lvl, slot;
 
     now = rdtime();
 
     trace("[%lu] %s()", now, __func__);
     debug("[%lu] mtcmp = %lu", now, rdtime());
 
-    if(head == NULL){
-        //disable timer interrupts somehow?
-        return;
-    }
+    // The quantum end (or tick) has passed. The interrupt return path will
+    // preempt the running thread if it can; either way, the next chance comes
+    // a tick from now unless the scheduler asks for something else first.
 
-    while(head != NULL && head->twake <= now){
-        next = head->next;
-        condition_broadcast(&head->cond); // as we wake up the alarms we need to broadcast
-        head = next;
-    }
+    if (preempt_twake[running_hart()] <= now)
+        preempt_twake[running_hart()] = now + TIMER_TICK;
 
-    sleep_list = head; // once we have awoken the necessary alarms, we need to set sleep_list to the first alarm that is not awake
+    // Jump from one wheel event to the next; the ticks in between have
+    // nothing in them.
 
-    if(sleep_list != NULL){
-        set_stcmp(sleep_list->twake); // if there are still alarms in the sleep list mtcmp gets updated with the smallest twake
-    }
-    else{
-        //disable timer interrupts here 
-        sie_val = RISCV_SIE_STIE;
-        csrc_sie(sie_val);
+    now_tick = now / WHEEL_RES;
+
+    while ((t = wheel_next()) <= now_tick) {
+        wheel_now = t;
+
+        for (lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+            if ((t & ((1ULL << (WHEEL_BITS * lvl)) - 1)) != 0)
+                break;
+            
+            slot = lvl * WHEEL_SIZE + ((t >> (WHEEL_BITS * lvl)) & (WHEEL_SIZE-1));
+
+            while ((al = wheel[slot]) != NULL) {
+                wheel_remove(al);
+                wheel_insert(al);
+            }
+        }
+
+        while ((al = wheel[t & (WHEEL_SIZE-1)]) != NULL) {
+            wheel_remove(al);
+            condition_broadcast(&al->cond);
+        }
+
+        wheel_now = t + 1;
     }
 
-    return;
+    timer_program();
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void timer_program(void) {
+    unsigned long long twake = preempt_twake[running_hart()];
+    unsigned long long tnext = wheel_next();
+
+    if (tnext != WHEEL_NONE && tnext * WHEEL_RES < twake)
+        twake = tnext * WHEEL_RES;
     
-    // FIXME your code goes here
-}
\ No newline at end of file
+    if (twake != UINT64_MAX) {
+        set_stcmp(twake);
+        csrs_sie(RISCV_SIE_STIE);
+    } else
+        csrc_sie(RISCV_SIE_STIE);
+}
+
+// Returns the wheel tick at whose start alarm _al_ expires.
+
+unsigned long long alarm_tick(const struct alarm * al) {
+    return al->twake / WHEEL_RES + (al->twake % WHEEL_RES != 0);
+}
+
+// Puts alarm _al_ into the slot for its expiry tick. If that has already
+// passed, the alarm goes into the slot for wheel_now and expires with it.
+
+void wheel_insert(struct alarm * al) {
+    unsigned long long tick = alarm_tick(al);
+    unsigned long long delta;
+    int lvl;
+
+    if (tick < wheel_now)
+        tick = wheel_now;
+    
+    delta = tick - wheel_now;
+    lvl = 0;
+
+    while (lvl < WHEEL_LEVELS-1 && (1ULL << (WHEEL_BITS * (lvl+1))) <= delta)
+        lvl++;
+    
+    if ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) <= delta)
+        tick = wheel_now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    
+    al->slot = lvl * WHEEL_SIZE + ((tick >> (WHEEL_BITS * lvl)) & (WHEEL_SIZE-1));
+    al->prev = NULL;
+    al->next = wheel[al->slot];
+    if (al->next != NULL)
+        al->next->prev = al;
+    wheel[al->slot] = al;
+
+    wheel_map[lvl] |= 1ULL << (al->slot % WHEEL_SIZE);
+    wheel_cnt++;
+}
+
+void wheel_remove(struct alarm * al) {
+    if (al->prev != NULL)
+        al->prev->next = al->next;
+    else
+        wheel[al->slot] = al->next;
+    
+    if (al->next != NULL)
+        al->next->prev = al->prev;
+    
+    if (wheel[al->slot] == NULL)
+        wheel_map[al->slot / WHEEL_SIZE] &= ~(1ULL << (al->slot % WHEEL_SIZE));
+
+    al->next = NULL;
+    al->prev = NULL;
+    al->slot = -1;
+    wheel_cnt--;
+}
+
+// Returns the first wheel tick at or after wheel_now at which a slot has to be
+// cascaded or expired, or WHEEL_NONE if the wheel is empty. A level n slot is
+// reached at the first multiple of WHEEL_SIZE^n at or after wheel_now whose
+// level n index is that slot; the alarms on a level never span more than one
+// turn of it, so the search starts there and wraps around.
+
+unsigned long long wheel_next(void) {
+    unsigned long long tnext = WHEEL_NONE;
+    unsigned long long c, t;
+    uint64_t rot;
+    int lvl, shift, s;
+
+    for (lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        if (wheel_map[lvl] == 0)
+            continue;
+        
+        shift = WHEEL_BITS * lvl;
+        c = (wheel_now + (1ULL << shift) - 1) >> shift;
+        s = c & (WHEEL_SIZE-1);
+        rot = (wheel_map[lvl] >> s) | (wheel_map[lvl] << ((WHEEL_SIZE - s) & (WHEEL_SIZE-1)));
+        t = (c + lowest_bit(rot)) << shift;
+
+        if (t < tnext)
+            tnext = t;
+    }
+
+    return tnext;
+}
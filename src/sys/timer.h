@@ -15,7 +15,9 @@
 
 struct alarm {
     struct condition cond;
-    struct alarm * next;
+    struct alarm * next; // in timer wheel slot
+    struct alarm * prev;
+    int slot; // timer wheel slot, or -1 if not pending
     unsigned long long twake;
 };
 
@@ -40,6 +42,12 @@ extern void alarm_sleep(struct alarm * al, unsigned long long tcnt);
 
 extern void alarm_reset(struct alarm * al);
 
+// Cancels a pending alarm. A thread sleeping on it returns from alarm_sleep
+// right away. Does nothing if the alarm is not pending. May be called from an
+// ISR.
+
+extern void alarm_cancel(struct alarm * al);
+
 extern void alarm_sleep_sec(struct alarm * al, unsigned int sec);
 extern void alarm_sleep_ms(struct alarm * al, unsigned long ms);
 extern void alarm_sleep_us(struct alarm * al, unsigned long us);
@@ -48,6 +56,11 @@ extern void sleep_sec(unsigned int sec);
 extern void sleep_ms(unsigned long ms);
 extern void sleep_us(unsigned long us);
 
+// Requests a timer interrupt at _twhen_ (UINT64_MAX for none) so the running
+// thread can be preempted at the end of its quantum. Called by the scheduler.
+
+extern void timer_preempt_at(unsigned long long twhen);
+
 extern void handle_timer_interrupt(void); // called from trap.s
 
 #endif // _TIMER_H_
\ No newline at end of file
@@ -145,11 +145,20 @@ smode_trap_entry_from_umode:
         rdinstret t6
         sd      t6, SINSTRET(sp)
 
-        
+        # Take the kernel lock (thread.c) before running any kernel code. We
+        # hold it until we return to U mode.
+
+        call    kernel_lock
 
         # Set up ra to return from exception and interrupt handlers to next instruction
         call    smode_trap_entry_from_umode_cont
 
+        # Handlers may have enabled interrupts. Disable them before dropping the
+        # kernel lock so nothing runs in S mode on this hart without it.
+
+        csrci   sstatus, 2 # SIE
+        call    kernel_unlock
+
 
         ld      a0, A0(sp)
         ld      a1, A1(sp)
@@ -353,6 +362,16 @@ smode_trap_entry_from_smode_cont:
 # a1 is pointer to thread stack anchor - sizeof(trap frame)
 trap_frame_jump:
 
+        # We are leaving the kernel, so drop the kernel lock (thread.c) with
+        # interrupts disabled. The s1 and s2 registers are restored below.
+
+        csrci   sstatus, 2 # SIE
+        mv      s1, a0
+        mv      s2, a1
+        call    kernel_unlock
+        mv      a0, s1
+        mv      a1, s2
+
         # Start by restoring some GPRs now (_early_) and some after disabling
         # interrupts (_late_). See discussion in smode_trap_entry_from_umode.
         # The _late_ registers are _gp_, _tp_, _sp_, as well as _a0_ (points to
@@ -24,16 +24,24 @@
 #include "console.h"
 
 #include "error.h"
+#include "string.h"
 
 #include <stdint.h>
 
 // COMPILE-TIME CONSTANT DEFINITIONS
 //
 
+// Default size of each ring of a port. A port's rings can be resized with
+// IOCTL_SETBUF while they are empty, to any power of two in
+// [UART_RBUFSZ_MIN, UART_RBUFSZ_MAX].
+
 #ifndef UART_RBUFSZ
 #define UART_RBUFSZ 64
 #endif
 
+#define UART_RBUFSZ_MIN 16
+#define UART_RBUFSZ_MAX 4096
+
 #ifndef UART_INTR_PRIO
 #define UART_INTR_PRIO 1
 #endif
@@ -79,7 +87,8 @@ struct uart_regs {
 struct ringbuf {
     unsigned int hpos; // head of queue (from where elements are removed)
     unsigned int tpos; // tail of queue (where elements are inserted)
-    char data[UART_RBUFSZ];
+    unsigned int size; // power of two
+    char * data;
 };
 
 struct uart_device {
@@ -90,14 +99,21 @@ struct uart_device {
     struct io io;
 
     unsigned long rxovrcnt; // number of times OE was set
+    char nonblock; // IOCTL_SETNONBLOCK: return -EAGAIN instead of waiting
 
     struct ringbuf rxbuf;
     struct ringbuf txbuf;
     struct lock uart_lock;
-};
+    struct condition rxbuf_not_empty; // broadcast once per ISR batch
+    struct condition txbuf_not_full;
+
+    // The ISR moves bytes and leaves waking threads to deferred work. The
+    // wake flags say which side the ISR moved bytes on since the work ran.
 
-struct condition rxbuf_not_empty; // setup new conditions in place of spinning
-struct condition txbuf_not_full;
+    struct intr_work wake_work;
+    char wake_rx;
+    char wake_tx;
+};
 
 // INTERNAL FUNCTION DEFINITIONS
 //
@@ -106,14 +122,22 @@ static int uart_open(struct io ** ioptr, void * aux);
 static void uart_close(struct io * io);
 static long uart_read(struct io * io, void * buf, long bufsz);
 static long uart_write(struct io * io, const void * buf, long len);
+static int uart_poll(struct io * io, int events);
+static int uart_cntl(struct io * io, int cmd, void * arg);
 
 static void uart_isr(int srcno, void * driver_private);
+static void uart_wake(void * aux);
+
+static int uart_setbufsz(struct uart_device * uart, unsigned int size);
 
 static void rbuf_init(struct ringbuf * rbuf);
 static int rbuf_empty(const struct ringbuf * rbuf);
 static int rbuf_full(const struct ringbuf * rbuf);
 static void rbuf_putc(struct ringbuf * rbuf, char c);
 static char rbuf_getc(struct ringbuf * rbuf);
+static unsigned int rbuf_get(struct ringbuf * rbuf, char * buf, unsigned int n);
+static unsigned int rbuf_put (
+    struct ringbuf * rbuf, const char * buf, unsigned int n);
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
@@ -122,7 +146,9 @@ void uart_attach(void * mmio_base, int irqno) {
     static const struct iointf uart_iointf = {
         .close = &uart_close,
         .read = &uart_read,
-        .write = &uart_write
+        .write = &uart_write,
+        .poll = &uart_poll,
+        .cntl = &uart_cntl
     };
 
     struct uart_device * uart;
@@ -153,8 +179,14 @@ void uart_attach(void * mmio_base, int irqno) {
     } else
         uart->instno = register_device(UART_NAME, NULL, NULL);
 
-    condition_init(&rxbuf_not_empty, "rxbuf"); // intialize the conditions
-    condition_init(&txbuf_not_full, "txbuf");
+    uart->rxbuf.size = UART_RBUFSZ;
+    uart->txbuf.size = UART_RBUFSZ;
+    uart->rxbuf.data = kmalloc(UART_RBUFSZ);
+    uart->txbuf.data = kmalloc(UART_RBUFSZ);
+
+    condition_init(&uart->rxbuf_not_empty, "rxbuf"); // intialize the conditions
+    condition_init(&uart->txbuf_not_full, "txbuf");
+    init_intr_work(&uart->wake_work, irqno, uart_wake, uart);
 
     lock_init(&uart->uart_lock);
 }
@@ -183,6 +215,7 @@ int uart_open(struct io ** ioptr, void * aux) {
     
     rbuf_init(&uart->rxbuf);
     rbuf_init(&uart->txbuf);
+    uart->nonblock = 0;
 
     // Read receive buffer register to flush any stale data in hardware buffer
 
@@ -240,22 +273,19 @@ void uart_close(struct io * io) {
 //   void * buf - Buffer to store the received data.
 //   long bufsz - Maximum number of bytes to read.
 // Outputs: 
-//   long - Number of bytes actually read, or 0 if no data is available, or -1 on error.
+//   long - Number of bytes actually read, or -EAGAIN in non-blocking mode if
+//   nothing has been received.
 // Description: 
-//   Reads available bytes from the UART receive buffer into the provided buffer.
-//   The function waits if no data is available until at least one byte is received.
+//   Waits until at least one byte is received, then copies as much of the
+//   receive buffer as fits into the provided buffer in one go.
 // Side Effects: 
 //   Modifies the UART receive buffer and may block execution while waiting for data.
 
 
 long uart_read(struct io * io, void * buf, long bufsz) {
-    int pie;
-
     struct uart_device * const uart = (void*)io - offsetof(struct uart_device, io);
-
-    char c;
-
-    int loop_counter = 0;
+    unsigned int cnt;
+    int pie;
 
     if(io == NULL || buf == NULL || bufsz < 0){
         panic("improper arguments for uart_read");
@@ -265,46 +295,28 @@ long uart_read(struct io * io, void * buf, long bufsz) {
     }
 
     lock_acquire(&uart->uart_lock);
-    
-    pie = disable_interrupts(); // make sure to always disable interrupts before condition wait
-    if(rbuf_empty(&uart->rxbuf)){
-        condition_wait(&rxbuf_not_empty); // instead of spin waiting we define a new condition to wait on
-    }
-    restore_interrupts(pie);
-    // long prev_state = disable_interrupts();
-
-    // uart->regs->ier &= ~IER_DRIE;
 
-
-    int available = (int)(uart->rxbuf.tpos - uart->rxbuf.hpos); // how many bytes are available to read 
+    // The ISR fills the ring, so it stays out while we check and copy
     
-    if (available < bufsz) {
-        loop_counter = available; // making sure it does not exceed buffer size
-    } else {
-        loop_counter = bufsz;
-    }
-    
-
-    if (loop_counter > UART_RBUFSZ) {
-        loop_counter = UART_RBUFSZ; // making sure it does not exceed uart read buffer
-    }
-
-    for(int i = 0; i < loop_counter; i++){
-        c = rbuf_getc(&uart->rxbuf); // loop through recieve buffer to collect all the characters and copy it into the given void buffer
-        ((char*)buf)[i] = c;
+    pie = disable_interrupts();
+    while(rbuf_empty(&uart->rxbuf)){
+        if(uart->nonblock){
+            restore_interrupts(pie);
+            lock_release(&uart->uart_lock);
+            return -EAGAIN; // nothing received and we may not wait for it
+        }
+        condition_wait(&uart->rxbuf_not_empty);
     }
 
-    
-    // restore_interrupts(prev_state);
+    cnt = rbuf_get(&uart->rxbuf, buf,
+        (bufsz < uart->rxbuf.size) ? bufsz : uart->rxbuf.size);
 
-    uart->regs->ier |= IER_DRIE; // restore the interrupts
+    uart->regs->ier |= IER_DRIE; // there is room again if the ISR stopped
+    restore_interrupts(pie);
 
     lock_release(&uart->uart_lock);
 
-    return loop_counter; // how many bytes were read
-    
-    // FIXME your code goes here
-
+    return cnt; // how many bytes were read
 }
 
 // long uart_write(struct io * io, const void * buf, long len)
@@ -313,18 +325,19 @@ long uart_read(struct io * io, void * buf, long bufsz) {
 //   const void * buf - Buffer containing the data to be written.
 //   long len - Number of bytes to write.
 // Outputs: 
-//   long - Number of bytes actually written, or -1 on error.
+//   long - Number of bytes actually written, or -EAGAIN in non-blocking mode
+//   if the transmit buffer is full.
 // Description: 
-//   Writes data to the UART transmit buffer and enables the transmit interrupt.
-//   The function waits if the transmit buffer is full until space becomes available.
+//   Copies data into the UART transmit buffer as many bytes at a time as fit
+//   and enables the transmit interrupt. Waits for room while the transmit
+//   buffer is full.
 // Side Effects: 
 //   Modifies the UART transmit buffer and enables the transmit interrupt.
 
 long uart_write(struct io * io, const void * buf, long len) {
-    int pie;
     struct uart_device * const uart = (void*)io - offsetof(struct uart_device, io);
-
-    char c;
+    long done = 0;
+    int pie;
     
     if(io == NULL || buf == NULL || len < 0){
         panic("improper arguments for uart_read");
@@ -335,38 +348,29 @@ long uart_write(struct io * io, const void * buf, long len) {
 
     lock_acquire(&uart->uart_lock);
 
- 
-    for(int i = 0; i < len; i++){
+    pie = disable_interrupts();
 
-        pie = disable_interrupts();
-        if(rbuf_full(&uart->txbuf)){
-            condition_wait(&txbuf_not_full); // wait until txbuf not being full is met (this will be tracked in isr)
+    while(done < len){
+        while(rbuf_full(&uart->txbuf)){
+            if(uart->nonblock){
+                restore_interrupts(pie);
+                lock_release(&uart->uart_lock);
+                return (done > 0) ? done : -EAGAIN; // only what fit in the transmit buffer
+            }
+            condition_wait(&uart->txbuf_not_full); // the ISR broadcasts once it has sent some
         }
-        restore_interrupts(pie);
-
-        // long prev_state = disable_interrupts();
-
-        // uart->regs->ier &= ~IER_THREIE;
-
-        c = ((char*)buf)[i]; // get character from the void buffer
-
-        rbuf_putc(&uart->txbuf, c); // put this character into the transmit buffer
-
-        // restore_interrupts(prev_state);
-
-
-        uart->regs->ier |= IER_THREIE; // enable interrupts since isr will not take care of it
 
+        done += rbuf_put(&uart->txbuf, (const char*)buf + done,
+            (len - done < uart->txbuf.size) ? len - done : uart->txbuf.size);
 
+        uart->regs->ier |= IER_THREIE; // the ISR disables it when the buffer drains
     }
 
-    lock_release(&uart->uart_lock);
+    restore_interrupts(pie);
 
+    lock_release(&uart->uart_lock);
 
     return len; // return how many bytes were written
-
-    // FIXME your code goes here
-
 }
 
 // void uart_isr(int srcno, void * aux)
@@ -377,64 +381,160 @@ long uart_write(struct io * io, const void * buf, long len) {
 //   None
 // Description: 
 //   UART interrupt handler that processes both receive and transmit events.
-//   If data is received, it is stored in the receive buffer. If the transmit buffer 
-//   is not empty, it sends the next byte.
+//   Received bytes are stored in the receive buffer and bytes from the
+//   transmit buffer are sent while the transmitter has room. Waiting readers
+//   and writers of this port are woken once per interrupt, not per byte.
 // Side Effects: 
 //   Modifies the UART receive and transmit buffers. May disable interrupts if buffers are full.
 
 void uart_isr(int srcno, void * aux) {
     struct uart_device * const uart = aux;
-
     uint8_t lsr = uart->regs->lsr;
+    int nrx = 0;
+    int ntx = 0;
 
-    char read_data;
-    char write_data;
-    int prev_state = -2; // make sure it is an invalid entry to begin with (any negative number)
-
-    if(lsr & LSR_DR){ // ensure data ready
-        while(lsr & LSR_DR){
-            read_data = uart->regs->rbr; // get read data
+    while(lsr & LSR_DR){ // ensure data ready
+        if (lsr & LSR_OE) {
+            uart->rxovrcnt++;  // Track how many times OE happens
+        }
 
-            if (lsr & LSR_OE) {
-                uart->rxovrcnt++;  // Track how many times OE happens
-            }
+        if(rbuf_full(&uart->rxbuf)){
+            uart->regs->ier &= ~IER_DRIE; // leave the rest in the device until read
+            break;
+        }
 
-            if(!rbuf_full(&uart->rxbuf)){
-                rbuf_putc(&uart->rxbuf, read_data);
-                condition_broadcast(&rxbuf_not_empty); // since we know after putc that rbuf cannot be empty we broadcast
-            }
-            else if(rbuf_full(&uart->rxbuf)){
-                uart->regs->ier &= ~IER_DRIE;
-            }
+        rbuf_putc(&uart->rxbuf, uart->regs->rbr);
+        nrx++;
 
-            lsr = uart->regs->lsr; // read again for more potential ready bytes
-        }
+        lsr = uart->regs->lsr; // read again for more potential ready bytes
     }
-    if((lsr & LSR_THRE) && !rbuf_empty(&uart->txbuf)){
-        while((lsr & LSR_THRE) && !rbuf_empty(&uart->txbuf)){
-            write_data = rbuf_getc(&uart->txbuf);
-            condition_broadcast(&txbuf_not_full); // since we know txbuf cannot be full after getting a char we can broadcast
-            uart->regs->thr = write_data;
 
-            lsr = uart->regs->lsr; // force another read in case there are more
-        }
+    while((lsr & LSR_THRE) && !rbuf_empty(&uart->txbuf)){
+        uart->regs->thr = rbuf_getc(&uart->txbuf);
+        ntx++;
+
+        lsr = uart->regs->lsr; // force another read in case there are more
     }
+
     if(rbuf_empty(&uart->txbuf) && (lsr & LSR_THRE)){
         uart->regs->ier &= ~IER_THREIE; // if transmit buffer is empty, disable interrupt
     }
 
-    // if (rbuf_empty(&uart->txbuf)) {
-    //     uart->regs->ier &= ~IER_THREIE;  // Disable TX interrupt if no data left
-    // }
-    // if (rbuf_full(&uart->rxbuf)) {
-    //     uart->regs->ier &= ~IER_DRIE;  // Disable RX interrupt if buffer is full
-    // }
+    uart->wake_rx |= (nrx != 0);
+    uart->wake_tx |= (ntx != 0);
+
+    if(nrx != 0 || ntx != 0)
+        queue_intr_work(&uart->wake_work);
+}
+
+// Deferred part of uart_isr(): wakes readers and writers the ISR made room
+// for, then pollers, which recheck whether they can read or write now.
+
+void uart_wake(void * aux) {
+    struct uart_device * const uart = aux;
+    int wake_rx, wake_tx;
+    int pie;
+
+    pie = disable_interrupts();
+    wake_rx = uart->wake_rx;
+    wake_tx = uart->wake_tx;
+    uart->wake_rx = 0;
+    uart->wake_tx = 0;
+    restore_interrupts(pie);
+
+    if (wake_rx)
+        condition_broadcast(&uart->rxbuf_not_empty);
+    if (wake_tx)
+        condition_broadcast(&uart->txbuf_not_full);
+
+    iopoll_notify();
+}
+
+// Ready to read when the receive buffer has data, to write when the
+// transmit buffer has room. The ISR notifies pollers of both.
+
+int uart_poll(struct io * io, int events) {
+    struct uart_device * const uart =
+        (void*)io - offsetof(struct uart_device, io);
+    int ready = 0;
+
+    if (!rbuf_empty(&uart->rxbuf))
+        ready |= POLLIN;
+    if (!rbuf_full(&uart->txbuf))
+        ready |= POLLOUT;
+    return ready;
+}
+
+int uart_cntl(struct io * io, int cmd, void * arg) {
+    struct uart_device * const uart =
+        (void*)io - offsetof(struct uart_device, io);
+
+    switch (cmd) {
+    case IOCTL_GETBLKSZ:
+        return 1;
+    case IOCTL_SETNONBLOCK:
+        uart->nonblock = (*(const int *)arg != 0);
+        return 0;
+    case IOCTL_ISATTY:
+        return 1;
+    case IOCTL_SETBUF:
+        return uart_setbufsz(uart, *(const unsigned int *)arg);
+    default:
+        return -ENOTSUP;
+    }
+}
+
+// Resizes both rings of /uart/ to /size/ bytes, or UART_RBUFSZ if /size/
+// is 0. Fails with -EBUSY while either ring holds data.
+
+int uart_setbufsz(struct uart_device * uart, unsigned int size) {
+    char * rxdata, * txdata;
+    int pie;
+
+    if (size == 0)
+        size = UART_RBUFSZ;
+
+    if (size < UART_RBUFSZ_MIN || UART_RBUFSZ_MAX < size ||
+        (size & (size - 1)) != 0)
+        return -EINVAL;
+
+    rxdata = kmalloc(size);
+    txdata = kmalloc(size);
+
+    if (rxdata == NULL || txdata == NULL) {
+        kfree(rxdata);
+        kfree(txdata);
+        return -ENOMEM;
+    }
+
+    lock_acquire(&uart->uart_lock);
+    pie = disable_interrupts();
 
-    if(prev_state != -2){
-        restore_interrupts(prev_state); // if the prev_state was changed then we need to restore interrupts
+    if (!rbuf_empty(&uart->rxbuf) || !rbuf_empty(&uart->txbuf)) {
+        restore_interrupts(pie);
+        lock_release(&uart->uart_lock);
+        kfree(rxdata);
+        kfree(txdata);
+        return -EBUSY;
     }
+
+    kfree(uart->rxbuf.data);
+    kfree(uart->txbuf.data);
+    uart->rxbuf.data = rxdata;
+    uart->txbuf.data = txdata;
+    uart->rxbuf.size = size;
+    uart->txbuf.size = size;
+    rbuf_init(&uart->rxbuf);
+    rbuf_init(&uart->txbuf);
+
+    restore_interrupts(pie);
+    lock_release(&uart->uart_lock);
+    return 0;
 }
 
+// Ring positions run freely; the size is a power of two, so they wrap
+// consistently and tpos - hpos is always the number of bytes held.
+
 void rbuf_init(struct ringbuf * rbuf) {
     rbuf->hpos = 0;
     rbuf->tpos = 0;
@@ -445,29 +545,73 @@ int rbuf_empty(const struct ringbuf * rbuf) {
 }
 
 int rbuf_full(const struct ringbuf * rbuf) {
-    return ((uint16_t)(rbuf->tpos - rbuf->hpos) == UART_RBUFSZ);
+    return (rbuf->tpos - rbuf->hpos == rbuf->size);
 }
 
 void rbuf_putc(struct ringbuf * rbuf, char c) {
-    uint_fast16_t tpos;
+    unsigned int tpos;
 
     tpos = rbuf->tpos;
-    rbuf->data[tpos % UART_RBUFSZ] = c;
+    rbuf->data[tpos & (rbuf->size - 1)] = c;
     asm volatile ("" ::: "memory");
     rbuf->tpos = tpos + 1;
 }
 
 char rbuf_getc(struct ringbuf * rbuf) {
-    uint_fast16_t hpos;
+    unsigned int hpos;
     char c;
 
     hpos = rbuf->hpos;
-    c = rbuf->data[hpos % UART_RBUFSZ];
+    c = rbuf->data[hpos & (rbuf->size - 1)];
     asm volatile ("" ::: "memory");
     rbuf->hpos = hpos + 1;
     return c;
 }
 
+// Copies up to /n/ bytes out of the ring, in at most two spans, and returns
+// the number copied.
+
+unsigned int rbuf_get(struct ringbuf * rbuf, char * buf, unsigned int n) {
+    const unsigned int hidx = rbuf->hpos & (rbuf->size - 1);
+    unsigned int span;
+
+    if (rbuf->tpos - rbuf->hpos < n)
+        n = rbuf->tpos - rbuf->hpos;
+
+    span = rbuf->size - hidx;
+    if (n < span)
+        span = n;
+
+    memcpy(buf, rbuf->data + hidx, span);
+    memcpy(buf + span, rbuf->data, n - span);
+    asm volatile ("" ::: "memory");
+    rbuf->hpos += n;
+    return n;
+}
+
+// Copies up to /n/ bytes into the ring, in at most two spans, and returns the
+// number copied.
+
+unsigned int rbuf_put (
+    struct ringbuf * rbuf, const char * buf, unsigned int n)
+{
+    const unsigned int tidx = rbuf->tpos & (rbuf->size - 1);
+    unsigned int span;
+
+    if (rbuf->size - (rbuf->tpos - rbuf->hpos) < n)
+        n = rbuf->size - (rbuf->tpos - rbuf->hpos);
+
+    span = rbuf->size - tidx;
+    if (n < span)
+        span = n;
+
+    memcpy(rbuf->data + tidx, buf, span);
+    memcpy(rbuf->data, buf + span, n - span);
+    asm volatile ("" ::: "memory");
+    rbuf->tpos += n;
+    return n;
+}
+
 // The functions below provide polled uart input and output for the console.
 
 #define UART0 (*(volatile struct uart_regs*)UART0_MMIO_BASE)
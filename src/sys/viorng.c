@@ -17,12 +17,13 @@
 #include "intr.h"
 #include "console.h"
 #include "thread.h"
+#include "entropy.h"
 
 // INTERNAL CONSTANT DEFINITIONS
 //
 
 #ifndef VIORNG_BUFSZ
-#define VIORNG_BUFSZ 256
+#define VIORNG_BUFSZ 512 // bytes per refill of the entropy pool
 #endif
 
 #ifndef VIORNG_NAME
@@ -62,14 +63,15 @@ struct viorng_device {
         struct virtq_desc desc[1];
     } vq;
 
-    // bufcnt is the number of bytes left in buffer. The usable bytes are
-    // between buf+0 and buf+bufcnt. (We read from the end of the buffer.)
+    // The device fills buf for the entropy pool. The buffer is posted
+    // whenever the pool asks for more (see viorng_refill()).
 
-    unsigned int bufcnt;
     char buf[VIORNG_BUFSZ];
-};
 
-struct condition descriptor_filled;
+    struct intr_work fill_work; // hands a filled buf to the pool
+
+    char nonblock; // IOCTL_SETNONBLOCK: return -EAGAIN instead of waiting
+};
 
 // INTERNAL FUNCTION DECLARATIONS
 //
@@ -77,7 +79,11 @@ struct condition descriptor_filled;
 static int viorng_open(struct io ** ioptr, void * aux);
 static void viorng_close(struct io * io);
 static long viorng_read(struct io * io, void * buf, long bufsz);
+static int viorng_poll(struct io * io, int events);
+static int viorng_cntl(struct io * io, int cmd, void * arg);
 static void viorng_isr(int irqno, void * aux);
+static void viorng_refill(void * aux);
+static void viorng_filled(void * aux);
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -103,7 +109,9 @@ void viorng_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     //set up io interface like how we did with uart
     static const struct iointf viorng_iointf = {
         .close = &viorng_close,
-        .read = &viorng_read
+        .read = &viorng_read,
+        .poll = &viorng_poll,
+        .cntl = &viorng_cntl
     };
 
     virtio_featset_t enabled_features, wanted_features, needed_features;
@@ -151,18 +159,24 @@ void viorng_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     attachment->vq.last_used_idx = 0;
 
     ioinit0(&attachment->io, &viorng_iointf);
+    init_intr_work(&attachment->fill_work, irqno, viorng_filled, attachment);
 
 
     // attachment->vq.desc[0].next = VIRTQ_DESC_F_NEXT; prolly not necessary type shi
 
     virtio_attach_virtq(regs, 0, 1, (uint64_t)(uintptr_t)&attachment->vq.desc, (uint64_t)(uintptr_t)&attachment->vq.used, (uint64_t)(uintptr_t)&attachment->vq.avail);
-
-    condition_init(&descriptor_filled, "bytesfilled");
+    virtio_enable_virtq(regs, 0);
 
     // fence o,oi
     regs->status |= VIRTIO_STAT_DRIVER_OK;    
     //           fence o,oi
     __sync_synchronize();
+
+    // The device feeds the entropy pool from now on, whether or not anyone
+    // has it open. Registering posts the first buffer.
+
+    enable_intr_source(irqno, VIORNG_INTR_PRIO, viorng_isr, attachment);
+    entropy_register_source(viorng_refill, attachment);
 }
 
 // int viorng_open(struct io ** ioptr, void * aux)
@@ -172,10 +186,10 @@ void viorng_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 // Outputs: 
 //   int - Returns 0 on success, or calls panic() on invalid arguments.
 // Description: 
-//   Opens the VirtIO RNG device, initializes its queue, enables interrupts, 
-//   and makes the device ready for random number generation requests.
+//   Opens the VirtIO RNG device. The queue and interrupts were set up at
+//   attach time, since the device keeps the entropy pool filled.
 // Side Effects: 
-//   Modifies the VirtIO queue and enables device interrupts.
+//   Clears the non-blocking flag.
 
 int viorng_open(struct io ** ioptr, void * aux) {
 
@@ -187,18 +201,7 @@ int viorng_open(struct io ** ioptr, void * aux) {
     }
     struct viorng_device * const device = aux;
 
-    virtio_enable_virtq(device->regs, 0);
-
-    //update avail.idx and put descriptor in there
-
-    device->vq.avail.ring[0] = 0;
-
-    device->vq.avail.idx = 1;
-
-    virtio_notify_avail(device->regs, 0);
-
-    enable_intr_source(device->irqno, VIORNG_INTR_PRIO, viorng_isr, device);
-
+    device->nonblock = 0;
 
     *ioptr = &device->io; // pass a reference for the io
 
@@ -213,45 +216,32 @@ int viorng_open(struct io ** ioptr, void * aux) {
 // Outputs: 
 //   None
 // Description: 
-//   Closes the VirtIO RNG device by disabling interrupts and resetting the VirtIO queue.
+//   Closes the VirtIO RNG device. The device stays active, feeding the
+//   entropy pool for the kernel and the next open.
 // Side Effects: 
-//   Clears the VirtIO queue, disables interrupts, and marks the device as inactive.
+//   None
 
 void viorng_close(struct io * io) {
     if(io == NULL){
         panic("improper io argument in viorng_close");
     }
-
-    struct viorng_device * const device = (void*)io - offsetof(struct viorng_device, io);
-
-    virtio_reset_virtq(device->regs, 0); // needs to be done such that the next time we open we do not have old stuff
-
-    device->regs->status = 0;
-
-    disable_intr_source(device->irqno);
-
-    device->vq.avail.idx = 0;
-    device->vq.used.idx  = 0;
-    device->vq.last_used_idx = 0;
-
 }
 
 // long viorng_read(struct io * io, void * buf, long bufsz)
 // Inputs: 
 //   struct io * io - Pointer to the VirtIO RNG device interface.
-//   void * buf - Buffer to store the random data retrieved from the device.
-//   long bufsz - Maximum number of bytes to read.
+//   void * buf - Buffer to store the random data.
+//   long bufsz - Number of bytes to read.
 // Outputs: 
-//   long - Number of bytes actually read, or calls panic() on invalid arguments.
+//   long - bufsz, or -EAGAIN in non-blocking mode before the pool is seeded.
 // Description: 
-//   Reads random data from the VirtIO RNG device into the provided buffer. 
-//   If no data is available, the function waits until data is ready.
+//   Fills the buffer from the kernel random number generator, which the
+//   device keeps rekeyed. Reads do not wait on the device, except for the
+//   very first chunk after boot.
 // Side Effects: 
-//   Modifies the VirtIO queue and buffers. May block execution until data is available.
-
+//   May ask the device for another chunk of entropy.
 
 long viorng_read(struct io * io, void * buf, long bufsz) {
-    int pie;
     if(io == NULL || buf == NULL || bufsz < 0){
         panic("improper arguments in viorng_read");
     }
@@ -261,40 +251,28 @@ long viorng_read(struct io * io, void * buf, long bufsz) {
 
     struct viorng_device * const device = (void*)io - offsetof(struct viorng_device, io);
 
+    return entropy_read(buf, bufsz, device->nonblock);
+}
 
-    uint32_t queue_size = 1; // i think its 1? ask in oh to make sure
-
-    pie = disable_interrupts();
-    if(device->vq.used.idx == device->vq.last_used_idx){
-        condition_wait(&descriptor_filled); // we need to wait until used is one further along than last_used
-    }
-    restore_interrupts(pie);
-    
-    uint32_t id_used = device->vq.used.ring[device->vq.last_used_idx % queue_size].id; // not actually used
-    (void)id_used;
-    uint32_t length = device->vq.used.ring[device->vq.last_used_idx % queue_size].len; // to know how big of a chunk we have
+// A read does not block once the entropy pool has been seeded.
 
-    device->vq.last_used_idx++;
+int viorng_poll(struct io * io, int events) {
+    return entropy_ready() ? POLLIN : 0;
+}
 
-    long copy_number;
+int viorng_cntl(struct io * io, int cmd, void * arg) {
+    struct viorng_device * const device =
+        (void*)io - offsetof(struct viorng_device, io);
 
-    if(length > bufsz){
-        copy_number = bufsz;
-    }
-    else{
-        copy_number = length;
+    switch (cmd) {
+    case IOCTL_GETBLKSZ:
+        return 1;
+    case IOCTL_SETNONBLOCK:
+        device->nonblock = (*(const int *)arg != 0);
+        return 0;
+    default:
+        return -ENOTSUP;
     }
-
-    memcpy(buf, device->buf, copy_number); // easy way to copy into buffer instead of using a for loop
-
-    device->bufcnt = 0;
-
-    device->vq.avail.ring[device->vq.avail.idx % queue_size] = 0;
-    device->vq.avail.idx++;
-    virtio_notify_avail(device->regs, 0);  // notify device we posted again
-
-
-    return copy_number;
 }
 
 // void viorng_isr(int irqno, void * aux)
@@ -304,22 +282,58 @@ long viorng_read(struct io * io, void * buf, long bufsz) {
 // Outputs: 
 //   None
 // Description: 
-//   Interrupt handler for the VirtIO RNG device that processes the interrupt, acknowledges it, 
-//   and wakes up any waiting threads that requested random data.
+//   Interrupt handler for the VirtIO RNG device. Acknowledges the interrupt
+//   and leaves the filled buffer to deferred work (see viorng_filled()).
 // Side Effects: 
-//   Modifies the VirtIO queue and may enable waiting threads to resume execution.
+//   Queues the device's work item.
 
 void viorng_isr(int irqno, void * aux) {
-    //FIXME your code here
+    struct viorng_device * const device = aux;
+    uint32_t int_status;
+
+    int_status = device->regs->interrupt_status; // find out the interrupt enabled bits
+    device->regs->interrupt_ack |= int_status; // write them to the ack to say we are handling it
+
+    if (device->vq.used.idx != device->vq.last_used_idx)
+        queue_intr_work(&device->fill_work);
+}
 
+// Hands the buffer the device filled to the entropy pool, which may post it
+// again right away (see viorng_refill()).
+
+void viorng_filled(void * aux) {
     struct viorng_device * const device = aux;
+    uint32_t length;
+    int was_ready;
 
-    uint32_t int_status = device->regs->interrupt_status; // find out the interrupt enabled bits
+    if (device->vq.used.idx == device->vq.last_used_idx)
+        return;
 
-    device->regs->interrupt_ack |= int_status; // write them to the ack to say we are handling it
-    
-    condition_broadcast(&descriptor_filled); // since we are processing an interrupt that means we are ready to process more
+    length = device->vq.used.ring[0].len;
+    if (VIORNG_BUFSZ < length)
+        length = VIORNG_BUFSZ;
+    device->vq.last_used_idx++;
+
+    was_ready = entropy_ready();
+    entropy_add(device->buf, length);
 
-    device->bufcnt = 256;
+    if (!was_ready && entropy_ready())
+        iopoll_notify();
+}
+
+// Posts the buffer for the device to fill. Called by the entropy pool, with
+// interrupts disabled, when it wants more.
+
+void viorng_refill(void * aux) {
+    struct viorng_device * const device = aux;
+    uint16_t old_idx;
+
+    old_idx = device->vq.avail.idx;
+    device->vq.avail.ring[0] = 0; // the queue has one entry
+    __sync_synchronize(); // fence w,w
+    device->vq.avail.idx = old_idx + 1;
 
-}   
\ No newline at end of file
+    // notify device we posted again (unless it said not to)
+    virtio_kick(device->regs, 0, 0, &device->vq.used, 1,
+        old_idx, old_idx + 1);
+}
@@ -0,0 +1,382 @@
+// bench.c - Kernel microbenchmarks
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// Usage: bench [name ...]
+//
+// Runs the named benchmarks, or all of them, and prints one line per result:
+//
+//     <benchmark> <value> <unit>
+//
+// Latencies are in nanoseconds per operation and bandwidths in KB/s, both
+// computed from rdtime, so results from two kernels can be compared with a
+// line diff. Lines starting with # are comments. The ktfs benchmarks create
+// and delete a scratch file, so the file system must be writable.
+
+#include "io.h"
+#include "error.h"
+#include "heap.h"
+#include "string.h"
+#include "syscall.h"
+
+#define TIMER_FREQ 10000000UL // must match the kernel's conf.h
+#define PAGE_SIZE 4096
+
+#define NULL_ITERS      10000
+#define PIPE_BYTES      (1024 * 1024)
+#define FILE_BYTES      (256 * 1024)
+#define FILE_RANDOPS    256
+#define PROC_ITERS      20
+#define CSW_ITERS       1000
+#define FAULT_PAGES     64
+
+#define SCRATCH_NAME    "bench.tmp"
+#define SELF_NAME       "bench"
+#define CHILD_ARG       "-child" // exec and spawn: exit right away
+
+struct benchmark {
+    const char * name;
+    void (*fn)(void);
+};
+
+static void bench_null(void);
+static void bench_pipe(void);
+static void bench_file(void);
+static void bench_fork(void);
+static void bench_exec(void);
+static void bench_spawn(void);
+static void bench_csw(void);
+static void bench_fault(void);
+
+static const struct benchmark benchmarks[] = {
+    { "null", bench_null },
+    { "pipe", bench_pipe },
+    { "file", bench_file },
+    { "fork", bench_fork },
+    { "exec", bench_exec },
+    { "spawn", bench_spawn },
+    { "csw", bench_csw },
+    { "fault", bench_fault }
+};
+
+#define NBENCH (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static char iobuf[PAGE_SIZE];
+
+static inline unsigned long long rdtime(void) {
+    unsigned long long time;
+    asm volatile ("rdtime %0" : "=r"(time));
+    return time;
+}
+
+// Prints the time per operation of /n/ operations that took /ticks/.
+
+static void report_latency (
+    const char * name, unsigned long long ticks, unsigned long n)
+{
+    printf("%s %llu ns\n", name,
+        ticks * (1000000000UL / TIMER_FREQ) / n);
+}
+
+// Prints the bandwidth of moving /bytes/ bytes in /ticks/.
+
+static void report_bandwidth (
+    const char * name, unsigned long long ticks, unsigned long long bytes)
+{
+    if (ticks == 0)
+        ticks = 1;
+    printf("%s %llu KB/s\n", name, bytes * TIMER_FREQ / 1024 / ticks);
+}
+
+static void report_error(const char * name, int err) {
+    printf("# %s: error %d\n", name, err);
+}
+
+void main(int argc, char ** argv) {
+    int i, j;
+
+    if (0 < argc && strcmp(argv[0], CHILD_ARG) == 0)
+        return;
+
+    printf("# bench timer_hz %lu\n", TIMER_FREQ);
+
+    for (i = 0; i < NBENCH; i++) {
+        for (j = 0; j < argc; j++) {
+            if (strcmp(argv[j], benchmarks[i].name) == 0)
+                break;
+        }
+
+        if (argc == 0 || j < argc)
+            benchmarks[i].fn();
+    }
+}
+
+// Trap into the kernel and straight back: an ioctl on an fd that cannot be
+// open is rejected before any I/O object is touched.
+
+void bench_null(void) {
+    unsigned long long t0;
+    int i;
+
+    t0 = rdtime();
+    for (i = 0; i < NULL_ITERS; i++)
+        _ioctl(-1, IOCTL_GETBLKSZ, NULL);
+    report_latency("null_syscall", rdtime() - t0, NULL_ITERS);
+}
+
+// A child writes PIPE_BYTES into a pipe a page at a time while we read.
+
+void bench_pipe(void) {
+    unsigned long long t0;
+    unsigned long total = 0;
+    int wfd, rfd;
+    long n;
+    int tid;
+
+    if ((n = _pipe(&wfd, &rfd)) < 0) {
+        report_error("pipe", n);
+        return;
+    }
+
+    t0 = rdtime();
+    tid = _fork();
+
+    if (tid == 0) {
+        _close(rfd);
+        while (total < PIPE_BYTES) {
+            n = _write(wfd, iobuf, sizeof(iobuf));
+            if (n <= 0)
+                break;
+            total += n;
+        }
+        _exit();
+    }
+
+    _close(wfd);
+
+    if (tid < 0) {
+        _close(rfd);
+        report_error("pipe", tid);
+        return;
+    }
+
+    while ((n = _read(rfd, iobuf, sizeof(iobuf))) > 0)
+        total += n;
+
+    _wait(tid);
+    report_bandwidth("pipe_bw", rdtime() - t0, total);
+    _close(rfd);
+}
+
+// Sequential then random reads and writes of a scratch file, a page at a
+// time. The random offsets come from a fixed LCG, so each run touches the
+// same pages.
+
+void bench_file(void) {
+    unsigned long long t0, pos;
+    unsigned long seed = 1;
+    unsigned long total;
+    long n = 0;
+    int fd, i;
+
+    _fsdelete(SCRATCH_NAME);
+
+    if ((n = _fscreate(SCRATCH_NAME)) < 0 ||
+        (n = fd = _fsopen(-1, SCRATCH_NAME)) < 0)
+    {
+        report_error("file", n);
+        return;
+    }
+
+    t0 = rdtime();
+    for (total = 0; total < FILE_BYTES; total += n) {
+        n = _write(fd, iobuf, sizeof(iobuf));
+        if (n <= 0)
+            break;
+    }
+    report_bandwidth("file_seq_write", rdtime() - t0, total);
+
+    pos = 0;
+    _ioctl(fd, IOCTL_SETPOS, &pos);
+
+    t0 = rdtime();
+    for (total = 0; total < FILE_BYTES; total += n) {
+        n = _read(fd, iobuf, sizeof(iobuf));
+        if (n <= 0)
+            break;
+    }
+    report_bandwidth("file_seq_read", rdtime() - t0, total);
+
+    t0 = rdtime();
+    for (total = 0, i = 0; i < FILE_RANDOPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        pos = (seed >> 16) % (FILE_BYTES / PAGE_SIZE) * PAGE_SIZE;
+        n = _pread(fd, iobuf, sizeof(iobuf), pos);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    report_bandwidth("file_rand_read", rdtime() - t0, total);
+
+    t0 = rdtime();
+    for (total = 0, i = 0; i < FILE_RANDOPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        pos = (seed >> 16) % (FILE_BYTES / PAGE_SIZE) * PAGE_SIZE;
+        n = _pwrite(fd, iobuf, sizeof(iobuf), pos);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    report_bandwidth("file_rand_write", rdtime() - t0, total);
+
+    _close(fd);
+    _fsdelete(SCRATCH_NAME);
+}
+
+// Each iteration forks a child that exits at once and waits for it.
+
+void bench_fork(void) {
+    unsigned long long t0;
+    int i, tid;
+
+    t0 = rdtime();
+    for (i = 0; i < PROC_ITERS; i++) {
+        tid = _fork();
+        if (tid == 0)
+            _exit();
+        if (tid < 0) {
+            report_error("fork", tid);
+            return;
+        }
+        _wait(tid);
+    }
+    report_latency("fork_wait", rdtime() - t0, PROC_ITERS);
+}
+
+// As bench_fork(), but the child execs this program, which exits as soon
+// as it sees CHILD_ARG.
+
+void bench_exec(void) {
+    static char * child_argv[] = { CHILD_ARG, NULL };
+    unsigned long long t0;
+    int i, tid;
+    int fd;
+
+    fd = _fsopen(-1, SELF_NAME);
+    if (fd < 0) {
+        report_error("exec", fd);
+        return;
+    }
+
+    t0 = rdtime();
+    for (i = 0; i < PROC_ITERS; i++) {
+        tid = _fork();
+        if (tid == 0) {
+            _exec(fd, 1, child_argv);
+            _exit();
+        }
+        if (tid < 0) {
+            report_error("exec", tid);
+            break;
+        }
+        _wait(tid);
+    }
+
+    if (i == PROC_ITERS)
+        report_latency("fork_exec_wait", rdtime() - t0, PROC_ITERS);
+    _close(fd);
+}
+
+void bench_spawn(void) {
+    static char * child_argv[] = { CHILD_ARG, NULL };
+    unsigned long long t0;
+    int i, tid;
+    int fd;
+
+    fd = _fsopen(-1, SELF_NAME);
+    if (fd < 0) {
+        report_error("spawn", fd);
+        return;
+    }
+
+    t0 = rdtime();
+    for (i = 0; i < PROC_ITERS; i++) {
+        tid = _spawn(fd, 1, child_argv, NULL);
+        if (tid < 0) {
+            report_error("spawn", tid);
+            break;
+        }
+        _wait(tid);
+    }
+
+    if (i == PROC_ITERS)
+        report_latency("spawn_wait", rdtime() - t0, PROC_ITERS);
+    _close(fd);
+}
+
+// A byte bounced between us and a child over two pipes. Each round trip is
+// two switches between the processes.
+
+void bench_csw(void) {
+    unsigned long long t0;
+    int w1, r1, w2, r2;
+    int i, tid;
+    char c = 0;
+
+    if (_pipe(&w1, &r1) < 0)
+        return;
+    if (_pipe(&w2, &r2) < 0) {
+        _close(w1);
+        _close(r1);
+        return;
+    }
+
+    tid = _fork();
+
+    if (tid == 0) {
+        _close(w1);
+        _close(r2);
+        while (_read(r1, &c, 1) == 1)
+            _write(w2, &c, 1);
+        _exit();
+    }
+
+    _close(r1);
+    _close(w2);
+
+    if (tid < 0) {
+        report_error("csw", tid);
+        _close(w1);
+        _close(r2);
+        return;
+    }
+
+    t0 = rdtime();
+    for (i = 0; i < CSW_ITERS; i++) {
+        if (_write(w1, &c, 1) != 1 || _read(r2, &c, 1) != 1)
+            break;
+    }
+    report_latency("csw_round_trip", rdtime() - t0, (i != 0) ? i : 1);
+
+    _close(w1);
+    _wait(tid);
+    _close(r2);
+}
+
+// First stores to fresh heap pages, each of which the kernel fills with a
+// zeroed page on demand.
+
+void bench_fault(void) {
+    unsigned long long t0;
+    volatile char * p;
+    int i;
+
+    p = malloc(FAULT_PAGES * PAGE_SIZE + PAGE_SIZE);
+    p = (volatile char *)(((unsigned long)p + PAGE_SIZE - 1) & -PAGE_SIZE);
+
+    t0 = rdtime();
+    for (i = 0; i < FAULT_PAGES; i++)
+        p[i * PAGE_SIZE] = 1;
+    report_latency("page_fault", rdtime() - t0, FAULT_PAGES);
+}
@@ -0,0 +1,65 @@
+// cstat.c - Print or reset the file system block cache counters
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// Usage: cstat <file> [-r]
+//
+// Any open file on the file system reaches the shared block cache, so the
+// file named only selects the file system. With -r the counters are reset
+// after being printed, starting a new measurement window.
+
+#include "io.h"
+#include "error.h"
+#include "string.h"
+#include "syscall.h"
+
+#define TIMER_FREQ 10000000UL // must match the kernel's conf.h
+
+void main(int argc, char ** argv) {
+    struct cache_stats st;
+    const char * name = NULL;
+    int reset = 0;
+    int fd, result;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0)
+            reset = 1;
+        else
+            name = argv[i];
+    }
+
+    if (name == NULL) {
+        printf("usage: cstat <file> [-r]\n");
+        return;
+    }
+
+    fd = _fsopen(-1, name);
+    if (fd < 0) {
+        printf("cstat: %s: error %d\n", name, fd);
+        return;
+    }
+
+    result = _ioctl(fd, IOCTL_GETCSTATS, &st);
+    if (result < 0) {
+        printf("cstat: IOCTL_GETCSTATS failed (%d)\n", result);
+        _close(fd);
+        return;
+    }
+
+    printf("hits       %llu\n", st.hits);
+    printf("misses     %llu\n", st.misses);
+    printf("evictions  %llu\n", st.evictions);
+    printf("writebacks %llu\n", st.writebacks);
+    printf("flushes    %llu\n", st.flushes);
+    printf("device ms  %llu\n", st.wait_ticks / (TIMER_FREQ / 1000));
+
+    if (st.hits + st.misses != 0)
+        printf("hit rate   %llu%%\n", 100 * st.hits / (st.hits + st.misses));
+    
+    if (reset)
+        _ioctl(fd, IOCTL_RSTCSTATS, NULL);
+
+    _close(fd);
+}
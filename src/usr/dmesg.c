@@ -0,0 +1,43 @@
+// dmesg.c - Print the kernel log
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// Usage: dmesg
+//
+// Prints the most recent kernel output still held in the kernel log buffer,
+// oldest first.
+
+#include "io.h"
+#include "error.h"
+#include "string.h"
+#include "syscall.h"
+
+#define KLOG_SIZE 16384 // must match the kernel's klog.h
+
+static char logbuf[KLOG_SIZE];
+
+void main(int argc, char ** argv) {
+    long len, n, pos;
+    int fd;
+
+    fd = _devopen(-1, "klog", 0);
+    if (fd < 0) {
+        printf("dmesg: cannot open klog device (%d)\n", fd);
+        return;
+    }
+
+    len = _read(fd, logbuf, sizeof(logbuf));
+    _close(fd);
+
+    if (len < 0) {
+        printf("dmesg: read failed (%ld)\n", len);
+        return;
+    }
+
+    for (pos = 0; pos < len; pos += n) {
+        n = _write(1, logbuf + pos, len - pos);
+        if (n <= 0)
+            break;
+    }
+}
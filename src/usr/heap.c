@@ -1,65 +1,145 @@
-// heap.c - Simple, non-freeing user heap memory manager
+// heap.c - User heap memory allocator
 //
-// Copyright (c) 2024-2025 University of Illinois
-// SPDX-License-identifier: NCSA
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
 //
+// The heap is memory obtained from the kernel with _sbrk(). It is divided into
+// blocks, each starting with a header word that holds the block size (a
+// multiple of HEAP_ALIGN) and two flags: BLK_ALLOC if the block is in use and
+// BLK_PREV_ALLOC if the block just before it is. The payload follows the
+// header and is HEAP_ALIGN-aligned. A free block also keeps its size in its
+// last word, so free() can find a free block before the one being freed and
+// merge the two, and two list links in its payload.
+//
+// Free blocks are kept in size classes, one list per power of two. malloc()
+// takes the first block that fits from the smallest class that could hold
+// the request and splits off what it does not need. A zero-size header that
+// is always marked in use ends the heap. When no free block is big enough,
+// the heap is grown by at least HEAP_GROW bytes, moving that end marker.
 
 #include "heap.h"
 #include "string.h"
 #include "syscall.h"
 
 #include <stddef.h>
+#include <stdint.h>
+
+// INTERNAL CONSTANTS
+//
+
+#define HEAP_ALIGN      16
+#define HEAP_GROW       (64 * 1024) // least growth, a multiple of a page
+#define HEAP_NCLASS     20 // class i holds sizes in [2^(i+5), 2^(i+6))
+
+#define BLK_ALLOC       1UL
+#define BLK_PREV_ALLOC  2UL
+#define BLK_FLAGS       (BLK_ALLOC | BLK_PREV_ALLOC)
 
-// INTERNAL GLOBAL VARIABLES
+#define HDR_SIZE        sizeof(size_t)
+#define MIN_BLKSZ       (4 * sizeof(size_t)) // header, two links, footer
+
+// INTERNAL TYPE DEFINITIONS
 //
 
-static void * heap_low; // lowest address of heap memory
-static void * heap_end; // end of heap memory
+struct blk {
+    size_t hdr; // size | BLK_ flags
+    struct blk * next; // free list links, valid only while free
+    struct blk * prev;
+};
 
-// EXPORTED GLOBAL VARIABLES
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static inline size_t blk_size(const struct blk * b);
+static inline struct blk * blk_next(const struct blk * b);
+static inline void blk_set_footer(struct blk * b);
+
+static int size_class(size_t size);
+static void list_insert(struct blk * b);
+static void list_remove(struct blk * b);
+
+static struct blk * heap_grow(size_t need);
+static struct blk * coalesce(struct blk * b);
+static void * take_block(struct blk * b, size_t need);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct blk * free_lists[HEAP_NCLASS];
+static struct blk * heap_end_blk; // zero-size end marker
+
+// EXPORTED GLOBAL VARIABLES
 //
 
 char heap_initialized = 0;
 
-// EXPORTED FUNCTION DEFINITIONS
+// EXPORTED FUNCTION DEFINITIONS
 //
 
-void heap_init(void * start, void * end) {
-    if (start > end){
+void heap_init(void) {
+    char * start;
+
+    start = _sbrk(HEAP_GROW);
+    if ((intptr_t)start < 0) {
         _print("Heap Uninitialized");
         _exit();
     }
 
-    heap_low = start;
-    heap_end = end;
+    // The first header is one word short of an aligned address, so the
+    // payload after it is aligned. The end marker takes the last word.
+
+    start += HEAP_ALIGN - HDR_SIZE;
+    heap_end_blk = (struct blk *)(start + HEAP_GROW - HEAP_ALIGN);
+    heap_end_blk->hdr = BLK_ALLOC;
+
+    ((struct blk *)start)->hdr = (HEAP_GROW - HEAP_ALIGN) | BLK_PREV_ALLOC;
+    blk_set_footer((struct blk *)start);
+    list_insert((struct blk *)start);
+
     heap_initialized = 1;
 }
 
 void * malloc(size_t size) {
-    void * ptr;
+    struct blk * b;
+    size_t need;
+    int c;
 
-    if (size == 0)
+    if (size == 0 || SIZE_MAX / 2 < size)
         return NULL;
 
-    if (size > heap_end - heap_low) {
-        _print("Heap Overflow");
-        _exit();
+    if (!heap_initialized)
+        heap_init();
+
+    need = (size + HDR_SIZE + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+    if (need < MIN_BLKSZ)
+        need = MIN_BLKSZ;
+
+    for (c = size_class(need); c < HEAP_NCLASS; c++) {
+        for (b = free_lists[c]; b != NULL; b = b->next) {
+            if (need <= blk_size(b))
+                return take_block(b, need);
+        }
     }
 
-    ptr = heap_low;
-    heap_low += size;
-    
-    return ptr;
+    b = heap_grow(need);
+    if (b == NULL)
+        return NULL;
+
+    return take_block(b, need);
 }
 
 void * calloc(size_t nelts, size_t eltsz) {
     size_t size;
     void * ptr;
+
+    if (eltsz != 0 && SIZE_MAX / eltsz < nelts)
+        return NULL;
+
     size =  nelts * eltsz;
 
     ptr = malloc(size);
-    
-    // check if malloc allocated any memory
+
+    // check if malloc allocated any memory
     if (!ptr) return NULL;
 
     memset(ptr, 0, size);
@@ -67,6 +147,136 @@ void * calloc(size_t nelts, size_t eltsz) {
 }
 
 void free(void * ptr) {
-    // DO NOTHING
+    struct blk * b;
+
+    if (ptr == NULL)
+        return;
+
+    b = (struct blk *)((char *)ptr - HDR_SIZE);
+    b->hdr &= ~BLK_ALLOC;
+    blk_next(b)->hdr &= ~BLK_PREV_ALLOC;
+    blk_set_footer(b);
+
+    list_insert(coalesce(b));
 }
 
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static inline size_t blk_size(const struct blk * b) {
+    return b->hdr & ~BLK_FLAGS;
+}
+
+static inline struct blk * blk_next(const struct blk * b) {
+    return (struct blk *)((char *)b + blk_size(b));
+}
+
+static inline void blk_set_footer(struct blk * b) {
+    *(size_t *)((char *)blk_next(b) - sizeof(size_t)) = blk_size(b);
+}
+
+int size_class(size_t size) {
+    int c = 0;
+
+    size >>= 6;
+    while (size != 0 && c < HEAP_NCLASS - 1) {
+        size >>= 1;
+        c += 1;
+    }
+
+    return c;
+}
+
+void list_insert(struct blk * b) {
+    const int c = size_class(blk_size(b));
+
+    b->prev = NULL;
+    b->next = free_lists[c];
+    if (b->next != NULL)
+        b->next->prev = b;
+    free_lists[c] = b;
+}
+
+void list_remove(struct blk * b) {
+    if (b->prev != NULL)
+        b->prev->next = b->next;
+    else
+        free_lists[size_class(blk_size(b))] = b->next;
+
+    if (b->next != NULL)
+        b->next->prev = b->prev;
+}
+
+// Grows the heap by enough for a block of /need/ bytes and returns the free
+// block that ends the heap afterwards, or NULL if the kernel refuses. The old
+// end marker becomes the header of the new space.
+
+struct blk * heap_grow(size_t need) {
+    struct blk * b;
+    size_t incr;
+    char * old;
+
+    incr = (need + HEAP_GROW - 1) / HEAP_GROW * HEAP_GROW;
+    old = _sbrk(incr);
+    if ((intptr_t)old < 0)
+        return NULL;
+
+    b = heap_end_blk;
+    b->hdr = incr | (b->hdr & BLK_PREV_ALLOC);
+    blk_set_footer(b);
+
+    heap_end_blk = blk_next(b);
+    heap_end_blk->hdr = BLK_ALLOC;
+
+    b = coalesce(b);
+    list_insert(b);
+    return b;
+}
+
+// Merges free block /b/, which is on no free list, with the free blocks on
+// either side of it, taking them off their lists. Returns the merged block.
+
+struct blk * coalesce(struct blk * b) {
+    struct blk * nb = blk_next(b);
+    struct blk * pb;
+    size_t psize;
+
+    if (!(nb->hdr & BLK_ALLOC)) {
+        list_remove(nb);
+        b->hdr += blk_size(nb);
+    }
+
+    if (!(b->hdr & BLK_PREV_ALLOC)) {
+        psize = *(size_t *)((char *)b - sizeof(size_t));
+        pb = (struct blk *)((char *)b - psize);
+        list_remove(pb);
+        pb->hdr += blk_size(b);
+        b = pb;
+    }
+
+    blk_set_footer(b);
+    return b;
+}
+
+// Marks /need/ bytes at the start of free block /b/ in use, putting the rest
+// back on a free list if it can stand as a block. Returns the payload.
+
+void * take_block(struct blk * b, size_t need) {
+    const size_t size = blk_size(b);
+    struct blk * rest;
+
+    list_remove(b);
+
+    if (MIN_BLKSZ <= size - need) {
+        b->hdr = need | (b->hdr & BLK_PREV_ALLOC) | BLK_ALLOC;
+        rest = blk_next(b);
+        rest->hdr = (size - need) | BLK_PREV_ALLOC;
+        blk_set_footer(rest);
+        list_insert(rest);
+    } else {
+        b->hdr |= BLK_ALLOC;
+        blk_next(b)->hdr |= BLK_PREV_ALLOC;
+    }
+
+    return (char *)b + HDR_SIZE;
+}
@@ -9,7 +9,7 @@
 
 extern char heap_initialized;
 
-extern void heap_init(void * start, void * end);
+extern void heap_init(void);
 extern void * malloc(size_t size);
 extern void * calloc(size_t nelts, size_t eltsz);
 extern void free(void * ptr);
@@ -0,0 +1,106 @@
+// heap_test.c - Test I/O into freshly allocated heap memory
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// Usage: heap_test
+//
+// Writes a scratch file, then reads it back with _pread() and _readv()
+// into buffers just returned by malloc(), whose pages the process has not
+// touched yet. The kernel must fault them in as a store from the process
+// would. Prints "heap_test: ok" or the first check that failed. The file
+// system must be writable.
+
+#include "io.h"
+#include "error.h"
+#include "heap.h"
+#include "string.h"
+#include "syscall.h"
+
+#define SCRATCH_NAME    "heap_test.tmp"
+#define TEST_BYTES      (4 * 4096 + 100) // spans pages at both ends
+
+static char pattern[TEST_BYTES];
+
+static int check(const char * what, const char * buf, long n);
+
+void main(int argc, char ** argv) {
+    unsigned long long pos = 0;
+    struct iovec iov[2];
+    char * buf;
+    long n;
+    int fd, i;
+
+    for (i = 0; i < TEST_BYTES; i++)
+        pattern[i] = (char)(i * 7 + 1);
+
+    _fsdelete(SCRATCH_NAME);
+
+    if ((n = _fscreate(SCRATCH_NAME)) < 0 ||
+        (n = fd = _fsopen(-1, SCRATCH_NAME)) < 0)
+    {
+        printf("heap_test: cannot create %s (%ld)\n", SCRATCH_NAME, n);
+        return;
+    }
+
+    n = _write(fd, pattern, TEST_BYTES);
+    if (n != TEST_BYTES) {
+        printf("heap_test: write returned %ld\n", n);
+        goto done;
+    }
+
+    buf = malloc(TEST_BYTES);
+    if (buf == NULL) {
+        printf("heap_test: malloc failed\n");
+        goto done;
+    }
+
+    n = _pread(fd, buf, TEST_BYTES, 0);
+    if (check("_pread", buf, n) < 0)
+        goto done;
+
+    buf = malloc(TEST_BYTES);
+    if (buf == NULL) {
+        printf("heap_test: malloc failed\n");
+        goto done;
+    }
+
+    _ioctl(fd, IOCTL_SETPOS, &pos);
+
+    iov[0].base = buf;
+    iov[0].len = TEST_BYTES / 2;
+    iov[1].base = buf + TEST_BYTES / 2;
+    iov[1].len = TEST_BYTES - TEST_BYTES / 2;
+
+    n = _readv(fd, iov, 2);
+    if (check("_readv", buf, n) < 0)
+        goto done;
+
+    printf("heap_test: ok\n");
+
+done:
+    _close(fd);
+    _fsdelete(SCRATCH_NAME);
+}
+
+// Returns 0 if /n/, the result of reading the file into /buf/, is the whole
+// file and /buf/ holds the pattern written to it. Otherwise prints what went
+// wrong and returns -1.
+
+int check(const char * what, const char * buf, long n) {
+    int i;
+
+    if (n != TEST_BYTES) {
+        printf("heap_test: %s returned %ld\n", what, n);
+        return -1;
+    }
+
+    for (i = 0; i < TEST_BYTES; i++) {
+        if (buf[i] != pattern[i]) {
+            printf("heap_test: %s: byte %d differs\n", what, i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
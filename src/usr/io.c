@@ -5,6 +5,7 @@
 //
 
 #include "io.h"
+#include "syscall.h"
 
 #include <stddef.h>
 
@@ -29,6 +30,28 @@ static int ioterm_ioctl(struct io * io, int cmd, void * arg);
 
 static void iovprintf_putc(char c, void * aux);
 
+static void iostream_closeio(struct io * io);
+
+static long iostream_read(struct io * io, void * buf, long len);
+
+static long iostream_write(struct io * io, const void * buf, long len);
+
+static int iostream_ioctl(struct io * io, int cmd, void * arg);
+
+static int iostream_drain(struct io_stream * ios);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static const struct iointf iostream_intf = {
+    .close = iostream_closeio,
+    .read = iostream_read,
+    .write = iostream_write,
+    .cntl = iostream_ioctl
+};
+
+static struct io_stream iostreams[IOSTREAM_MAX];
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -172,6 +195,81 @@ struct io * ioterm_init(struct io_term * iot, struct io * rawio) {
     return &iot->io;
 };
 
+struct io * iostream(int fd) {
+    struct io_stream * ios;
+
+    if (fd < 0 || IOSTREAM_MAX <= fd)
+        return NULL;
+
+    ios = &iostreams[fd];
+
+    if (!ios->inuse) {
+        ios->io.intf = &iostream_intf;
+        ios->io.refcnt = 1;
+        ios->fd = fd;
+        ios->len = 0;
+        ios->mode = (_ioctl(fd, IOCTL_ISATTY, NULL) == 1) ?
+            IOSTREAM_LINE : IOSTREAM_FULL;
+        ios->inuse = 1;
+    }
+
+    return &ios->io;
+}
+
+int iostream_setmode(struct io * io, int mode) {
+    struct io_stream * const ios = (void*)io - offsetof(struct io_stream, io);
+    int result;
+
+    if (io->intf != &iostream_intf)
+        return -EINVAL;
+
+    if (mode != IOSTREAM_UNBUF && mode != IOSTREAM_LINE &&
+        mode != IOSTREAM_FULL)
+        return -EINVAL;
+
+    result = iostream_drain(ios);
+    if (result < 0)
+        return result;
+
+    ios->mode = mode;
+    return 0;
+}
+
+int ioflush(struct io * io) {
+    struct io_stream * const ios = (void*)io - offsetof(struct io_stream, io);
+
+    if (io->intf != &iostream_intf)
+        return 0;
+
+    return iostream_drain(ios);
+}
+
+void ioflushall(void) {
+    int fd;
+
+    for (fd = 0; fd < IOSTREAM_MAX; fd++) {
+        if (iostreams[fd].inuse)
+            iostream_drain(&iostreams[fd]);
+    }
+}
+
+void ioflushtty(void) {
+    int fd;
+
+    for (fd = 0; fd < IOSTREAM_MAX; fd++) {
+        if (iostreams[fd].inuse && iostreams[fd].mode == IOSTREAM_LINE)
+            iostream_drain(&iostreams[fd]);
+    }
+}
+
+void iostream_close(int fd) {
+    if (fd < 0 || IOSTREAM_MAX <= fd || !iostreams[fd].inuse)
+        return;
+
+    iostream_drain(&iostreams[fd]);
+    iostreams[fd].inuse = 0;
+}
+
 char * ioterm_getsn(struct io_term * iot, char * buf, size_t n) {
     char * p = buf;
     int result;
@@ -426,3 +524,86 @@ void iovprintf_putc(char c, void * aux) {
             state->err = result;
     }
 }
+
+void iostream_closeio(struct io * io) {
+    struct io_stream * const ios = (void*)io - offsetof(struct io_stream, io);
+
+    iostream_drain(ios);
+    ios->inuse = 0;
+    _close(ios->fd);
+}
+
+long iostream_read(struct io * io, void * buf, long len) {
+    struct io_stream * const ios = (void*)io - offsetof(struct io_stream, io);
+
+    ioflushtty();
+    return _read(ios->fd, buf, len);
+}
+
+long iostream_write(struct io * io, const void * buf, long len) {
+    struct io_stream * const ios = (void*)io - offsetof(struct io_stream, io);
+    const char * p;
+    int result;
+
+    // Make room, or write out what we have if the data would not fit even
+    // into an empty buffer, in which case it goes to the fd as is.
+
+    if (ios->mode == IOSTREAM_UNBUF || IOSTREAM_BUFSZ - ios->len < len) {
+        result = iostream_drain(ios);
+        if (result < 0)
+            return result;
+        if (ios->mode == IOSTREAM_UNBUF || IOSTREAM_BUFSZ <= len)
+            return _write(ios->fd, buf, len);
+    }
+
+    memcpy(ios->buf + ios->len, buf, len);
+    ios->len += len;
+
+    if (ios->len == IOSTREAM_BUFSZ)
+        result = iostream_drain(ios);
+    else if (ios->mode == IOSTREAM_LINE) {
+        result = 0;
+        for (p = buf; p < (const char *)buf + len; p++) {
+            if (*p == '\n') {
+                result = iostream_drain(ios);
+                break;
+            }
+        }
+    } else
+        result = 0;
+
+    return (result < 0) ? result : len;
+}
+
+int iostream_ioctl(struct io * io, int cmd, void * arg) {
+    struct io_stream * const ios = (void*)io - offsetof(struct io_stream, io);
+    int result;
+
+    // The fd's position and size must account for everything written
+
+    result = iostream_drain(ios);
+    if (result < 0)
+        return result;
+
+    return _ioctl(ios->fd, cmd, arg);
+}
+
+// Writes out the contents of the stream's buffer. If the fd fails, what is
+// left is dropped, so that a stream on a broken fd does not fill up.
+
+int iostream_drain(struct io_stream * ios) {
+    size_t pos = 0;
+    long n;
+
+    while (pos < ios->len) {
+        n = _write(ios->fd, ios->buf + pos, ios->len - pos);
+        if (n <= 0) {
+            ios->len = 0;
+            return (n < 0) ? n : -EIO;
+        }
+        pos += n;
+    }
+
+    ios->len = 0;
+    return 0;
+}
@@ -64,12 +64,84 @@ struct io_term {
     int8_t cr_in; // Input CRLF normalization
 };
 
+// Output buffering modes of an I/O stream (see iostream() below)
+
+#define IOSTREAM_UNBUF  0 // every write goes to the fd
+#define IOSTREAM_LINE   1 // written out at each newline and when full
+#define IOSTREAM_FULL   2 // written out when full
+
+#ifndef IOSTREAM_BUFSZ
+#define IOSTREAM_BUFSZ  512
+#endif
+
+#ifndef IOSTREAM_MAX
+#define IOSTREAM_MAX    16 // one per fd, for the lowest fds only
+#endif
+
+struct io_stream {
+    struct io io; // I/O abstraction
+    int fd; // file descriptor written to
+    int8_t mode; // IOSTREAM_UNBUF, IOSTREAM_LINE or IOSTREAM_FULL
+    int8_t inuse; // set up by iostream()
+    size_t len; // bytes waiting in buf
+    char buf[IOSTREAM_BUFSZ];
+};
+
 
 #define IOCTL_GETBLKSZ  0
 #define IOCTL_GETEND    2
 #define IOCTL_SETEND    3
 #define IOCTL_GETPOS    4
 #define IOCTL_SETPOS    5
+#define IOCTL_SETRA     6 // max readahead in blocks, 0 disables
+#define IOCTL_GETCSTATS 7 // file system block cache counters
+#define IOCTL_RSTCSTATS 8 // reset block cache counters
+#define IOCTL_RESERVE   9 // reserve contiguous space for growth (bytes)
+#define IOCTL_SETTRACE  10 // ktrace device: mask of events to record
+#define IOCTL_SETNONBLOCK 11 // pipe, uart, rng: nonzero to get -EAGAIN, not block
+#define IOCTL_SETBUF    12 // files: buffer bytes, 0 to remove; uart: ring bytes
+#define IOCTL_ISATTY    13 // returns 1 for a terminal (uart)
+#define IOCTL_GETID     14 // files: id that changes whenever the contents may change
+#define IOCTL_DISCARD   15 // block devices: drop a struct ioextent range
+#define IOCTL_WRZEROES  16 // block devices: zero a struct ioextent range
+#define IOCTL_FLUSH     17 // block devices: make completed writes durable
+
+// Byte range for IOCTL_DISCARD and IOCTL_WRZEROES
+
+struct ioextent {
+    unsigned long long pos;
+    unsigned long long len;
+};
+
+// Returned by IOCTL_GETCSTATS (same layout as the kernel's)
+
+struct cache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long writebacks;
+    unsigned long long flushes;
+    unsigned long long wait_ticks; // timer ticks spent on device I/O
+};
+
+// Records read from the ktrace device (same layout as the kernel's ktrace.h)
+
+#define KTRACE_SWITCH           1 // from tid, to tid
+#define KTRACE_SYSCALL_ENTER    2 // syscall number, tid
+#define KTRACE_SYSCALL_EXIT     3 // syscall number, return value
+#define KTRACE_INTR             4 // scause, PLIC source
+#define KTRACE_BIO_SUBMIT       5 // sector, request type | len << 8
+#define KTRACE_BIO_DONE         6 // descriptor head, status
+#define KTRACE_CACHE_MISS       7 // block position
+
+struct ktrace_rec {
+    unsigned long long time;
+    unsigned int seq;
+    unsigned short event;
+    unsigned short hart;
+    unsigned long long arg0;
+    unsigned long long arg1;
+};
 
 // refcount functions
 unsigned long iorefcnt(const struct io * io);
@@ -139,6 +211,29 @@ struct io * ioterm_init(struct io_term * iot, struct io * rawio);
 // backspace) and limits the input to /n/ characters.
 char * ioterm_getsn(struct io_term * iot, char * buf, size_t n);
 
+// An I/O stream buffers the output written to a file descriptor, so that
+// printing a line costs one _write instead of one per character. The stream
+// of an fd is set up on first use: line-buffered if the fd is a terminal,
+// fully buffered otherwise (files and pipes). Reads pass straight through.
+//
+// iostream returns the stream of /fd/, or NULL if /fd/ is out of range.
+// iostream_setmode changes the buffering mode of a stream, writing out what
+// it holds first. ioflush writes out what a stream holds; on an object that
+// is not a stream it does nothing. ioflushall flushes every stream and
+// ioflushtty only the line-buffered ones, which is done before reading so
+// that a prompt appears. iostream_close flushes and forgets the stream of
+// /fd/ when the fd is about to be closed.
+//
+// The _exit, _fork, _exec and _close stubs flush first (see syscall.S), so
+// buffered output is neither lost nor written twice.
+
+struct io * iostream(int fd);
+int iostream_setmode(struct io * io, int mode);
+int ioflush(struct io * io);
+void ioflushall(void);
+void ioflushtty(void);
+void iostream_close(int fd);
+
 // definitions for putc and getc
 static inline int ioputc(struct io * io, char c) {
     long wlen;
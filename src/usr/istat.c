@@ -0,0 +1,39 @@
+// istat.c - Print per-source interrupt counts and handler times
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// Usage: istat
+//
+// Prints a line for each interrupt source that has had an ISR: how many
+// interrupts it took, the average and longest time spent in its ISR, and
+// the same for the deferred work its ISR queued. Times are in microseconds.
+
+#include "io.h"
+#include "error.h"
+#include "string.h"
+#include "syscall.h"
+
+#define TIMER_FREQ 10000000UL // must match the kernel's conf.h
+#define TICKS_PER_US (TIMER_FREQ / 1000000)
+
+static unsigned long long avg_us(unsigned long long ticks, unsigned long n) {
+    return (n != 0) ? ticks / TICKS_PER_US / n : 0;
+}
+
+void main(int argc, char ** argv) {
+    struct intrstat st;
+    int srcno, result;
+
+    printf("SRC    COUNT ISR_AVG ISR_MAX    WORK WRK_AVG WRK_MAX\n");
+
+    for (srcno = 0; (result = _intrstat(srcno, &st)) != -EINVAL; srcno++) {
+        if (result < 0)
+            continue;
+
+        printf("%3d %8lu %7llu %7llu %7lu %7llu %7llu\n", srcno, st.count,
+            avg_us(st.isr_ticks, st.count), st.isr_max / TICKS_PER_US,
+            st.nwork, avg_us(st.work_ticks, st.nwork),
+            st.work_max / TICKS_PER_US);
+    }
+}
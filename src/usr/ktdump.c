@@ -0,0 +1,88 @@
+// ktdump.c - Control and decode the kernel trace buffer
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// Usage: ktdump [on [mask] | off]
+//
+// With no arguments, prints the records in the kernel trace buffer, oldest
+// first, with times in microseconds since the first one. "on" starts
+// recording the events in mask (a hex bit mask of event ids, all events if
+// omitted) and "off" stops recording.
+
+#include "io.h"
+#include "error.h"
+#include "string.h"
+#include "syscall.h"
+
+#define TIMER_FREQ 10000000UL // must match the kernel's conf.h
+#define KTRACE_NREC 1024 // must match the kernel's ktrace.c
+
+static const char * const event_names[] = {
+    [KTRACE_SWITCH] = "switch",
+    [KTRACE_SYSCALL_ENTER] = "syscall",
+    [KTRACE_SYSCALL_EXIT] = "sysret",
+    [KTRACE_INTR] = "intr",
+    [KTRACE_BIO_SUBMIT] = "bio_submit",
+    [KTRACE_BIO_DONE] = "bio_done",
+    [KTRACE_CACHE_MISS] = "cache_miss"
+};
+
+static struct ktrace_rec recs[KTRACE_NREC];
+
+void main(int argc, char ** argv) {
+    unsigned long long t0;
+    const char * name;
+    unsigned int mask;
+    long len;
+    int fd, result;
+    int i;
+
+    fd = _devopen(-1, "ktrace", 0);
+    if (fd < 0) {
+        printf("ktdump: cannot open ktrace device (%d)\n", fd);
+        return;
+    }
+
+    // argv[0] is the first argument, as in cstat
+
+    if (0 < argc) {
+        if (strcmp(argv[0], "on") == 0)
+            mask = (1 < argc) ? strtoul(argv[1], NULL, 16) : ~0U;
+        else if (strcmp(argv[0], "off") == 0)
+            mask = 0;
+        else {
+            printf("usage: ktdump [on [mask] | off]\n");
+            _close(fd);
+            return;
+        }
+
+        result = _ioctl(fd, IOCTL_SETTRACE, &mask);
+        if (result < 0)
+            printf("ktdump: IOCTL_SETTRACE failed (%d)\n", result);
+        _close(fd);
+        return;
+    }
+
+    len = _read(fd, recs, sizeof(recs));
+    _close(fd);
+
+    if (len < 0) {
+        printf("ktdump: read failed (%ld)\n", len);
+        return;
+    }
+
+    t0 = (0 < len) ? recs[0].time : 0;
+
+    for (i = 0; i < len / sizeof(struct ktrace_rec); i++) {
+        if (recs[i].event < sizeof(event_names)/sizeof(event_names[0]) &&
+            event_names[recs[i].event] != NULL)
+            name = event_names[recs[i].event];
+        else
+            name = "?";
+        
+        printf("%10llu %u %s %llx %llx\n",
+            (recs[i].time - t0) / (TIMER_FREQ / 1000000),
+            recs[i].hart, name, recs[i].arg0, recs[i].arg1);
+    }
+}
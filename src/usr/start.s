@@ -9,16 +9,11 @@
         .global _start
         .type   _start, @function
 
-        .equ    USER_HEAP_START, 0xE0000000
-        .equ    USER_HEAP_END,   0xF0000000
-        
 _start:
         addi    sp, sp, -16
         sd      a0, 0(sp)
         sd      a1, 8(sp)     
 
-        li      a0, USER_HEAP_START
-        li      a1, USER_HEAP_END
         call    heap_init
 
         ld      a0, 0(sp)
@@ -6,6 +6,7 @@
 
 # include "string.h"
 # include "syscall.h"
+# include "io.h"
 
 #include <stdint.h>
 #include <limits.h>
@@ -15,6 +16,17 @@
 #define UART_DESC 2
 #define NDEV     16
 
+// Memory and string functions access memory of any type through word_t.
+// WORD_HASZERO(w) is nonzero if and only if some byte of w is zero.
+
+typedef uint64_t __attribute__ ((__may_alias__)) word_t;
+
+#define WORD_SIZE sizeof(word_t)
+#define WORD_MASK (WORD_SIZE - 1)
+#define WORD_ONES 0x0101010101010101UL // byte repeated by multiplying
+#define WORD_HIGHS (WORD_ONES << 7)
+#define WORD_HASZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
 // INTERNAL STRUCTURE DEFINITIONS
 // 
 
@@ -40,6 +52,8 @@ static void vprintf_putc(char c, void * __attribute__ ((unused)) aux);
 
 static void dvprintf_putc(char c, void * aux);
 
+static void dwrite(int fd, const char * buf, size_t len);
+
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
@@ -62,15 +76,14 @@ void dputc(int fd, char c) {
 
     switch (c) {
     case '\r':
-        _write(fd, &c, 1);
-        _write(fd, "\n",1);
+        dwrite(fd, "\r\n", 2);
         break;
     case '\n':
         if (pcprev[fd] != '\r')
-            _write(fd, "\r",1);
+            dwrite(fd, "\r",1);
         // nobreak
     default:
-        _write(fd, &c, 1);
+        dwrite(fd, &c, 1);
         break;
     }
 
@@ -80,7 +93,9 @@ void dputc(int fd, char c) {
 char dgetc(int fd) {
     static char gcprev[NDEV] = {'\0'};
     char c;
-    // Convert \r followed by any number of \n to just \n 
+    // Convert \r followed by any number of \n to just \n 
+
+    ioflushtty(); // show any prompt first
 
     do {
         _read(fd,&c,1);
@@ -187,6 +202,27 @@ int strcmp(const char * s1, const char * s2) {
             return 1;
     }
 
+    // When both strings are aligned alike, skip whole words that match and
+    // hold no '\0'. Aligned words never cross a page, so reading past the
+    // end of a string within its last word is safe.
+
+    if ((((uintptr_t)s1 ^ (uintptr_t)s2) & WORD_MASK) == 0) {
+        while (((uintptr_t)s1 & WORD_MASK) != 0) {
+            if (*s1 != *s2 || *s1 == '\0')
+                goto bytes;
+            s1 += 1;
+            s2 += 1;
+        }
+
+        while (*(const word_t *)s1 == *(const word_t *)s2 &&
+            !WORD_HASZERO(*(const word_t *)s1))
+        {
+            s1 += WORD_SIZE;
+            s2 += WORD_SIZE;
+        }
+    }
+
+bytes:
     // Find first non-matching character (or '\0')
 
     while (*s1 == *s2 && *s1 != '\0') {
@@ -221,6 +257,15 @@ size_t strlen(const char * s) {
     if (s == NULL)
         return 0;
 
+    while (((uintptr_t)p & WORD_MASK) != 0) {
+        if (*p == '\0')
+            return (p - s);
+        p += 1;
+    }
+
+    while (!WORD_HASZERO(*(const word_t *)p))
+        p += WORD_SIZE;
+
     while (*p != '\0')
         p += 1;
     
@@ -244,6 +289,29 @@ char * strncpy(char *dst, const char *src, size_t n) {
 }
 
 char * strchr(const char * s, int c) {
+    word_t pat, w;
+
+    // Skip words that hold neither '\0' nor c. A c that is not a char
+    // value is never found, so the byte loop handles it.
+
+    if (c != '\0' && c == (char)c) {
+        pat = WORD_ONES * (unsigned char)c;
+
+        while (((uintptr_t)s & WORD_MASK) != 0) {
+            if (*s == '\0' || *s == c)
+                goto bytes;
+            s += 1;
+        }
+
+        for (;;) {
+            w = *(const word_t *)s;
+            if (WORD_HASZERO(w) || WORD_HASZERO(w ^ pat))
+                break;
+            s += WORD_SIZE;
+        }
+    }
+
+bytes:
     while (*s != '\0') {
         if (*s == c)
             return (char*)s;
@@ -265,25 +333,106 @@ char * strrchr(const char * s, int c) {
     return p;
 }
 
+// The memory functions move eight bytes at a time once the destination is
+// aligned, four words per iteration. memcpy() handles a source that is not
+// aligned the same way as the destination by shifting together two aligned
+// source words per destination word, so it never makes a misaligned access.
+// An aligned word never crosses a page, so reading all of the last source
+// word is safe even when only part of it is copied.
+
 void * memset(void * s, int c, size_t n) {
-  char * p = s;
+    unsigned char * p = s;
+    word_t * w;
+    word_t v;
 
-  while (n != 0) {
-    *p++ = c;
-    n -= 1;
-  }
+    while (n != 0 && ((uintptr_t)p & WORD_MASK) != 0) {
+        *p++ = c;
+        n -= 1;
+    }
+
+    v = WORD_ONES * (unsigned char)c;
+    w = (word_t *)p;
+
+    while (4 * WORD_SIZE <= n) {
+        w[0] = v;
+        w[1] = v;
+        w[2] = v;
+        w[3] = v;
+        w += 4;
+        n -= 4 * WORD_SIZE;
+    }
 
-  return s;
+    while (WORD_SIZE <= n) {
+        *w++ = v;
+        n -= WORD_SIZE;
+    }
+
+    p = (unsigned char *)w;
+
+    while (n != 0) {
+        *p++ = c;
+        n -= 1;
+    }
+
+    return s;
 }
 
 void * memcpy(void * restrict dst, const void * restrict src, size_t n) {
-    const char * q = src;
-    char * p = dst;
-    
+    const unsigned char * q = src;
+    unsigned char * p = dst;
+    const word_t * u;
+    word_t * w;
+    word_t lo, hi;
+    unsigned int rsh, lsh;
+
+    while (n != 0 && ((uintptr_t)p & WORD_MASK) != 0) {
+        *p++ = *q++;
+        n -= 1;
+    }
+
+    w = (word_t *)p;
+
+    if (((uintptr_t)q & WORD_MASK) == 0) {
+        u = (const word_t *)q;
+
+        while (4 * WORD_SIZE <= n) {
+            w[0] = u[0];
+            w[1] = u[1];
+            w[2] = u[2];
+            w[3] = u[3];
+            w += 4;
+            u += 4;
+            n -= 4 * WORD_SIZE;
+        }
+
+        while (WORD_SIZE <= n) {
+            *w++ = *u++;
+            n -= WORD_SIZE;
+        }
+
+        q = (const unsigned char *)u;
+    } else if (WORD_SIZE <= n) {
+        // Little-endian: the low bytes of each destination word are the
+        // high bytes of one aligned source word.
+
+        rsh = 8 * ((uintptr_t)q & WORD_MASK);
+        lsh = 8 * WORD_SIZE - rsh;
+        u = (const word_t *)((uintptr_t)q & ~(uintptr_t)WORD_MASK);
+        lo = *u++;
+
+        while (WORD_SIZE <= n) {
+            hi = *u++;
+            *w++ = (lo >> rsh) | (hi << lsh);
+            lo = hi;
+            q += WORD_SIZE;
+            n -= WORD_SIZE;
+        }
+    }
+
+    p = (unsigned char *)w;
+
     while (n != 0) {
-        *p = *q;
-        p += 1;
-        q += 1;
+        *p++ = *q++;
         n -= 1;
     }
 
@@ -294,6 +443,27 @@ int memcmp(const void * p1, const void * p2, size_t n) {
     const uint8_t * u = p1;
     const uint8_t * v = p2;
 
+    // Skip equal words when both are aligned alike, leaving the first
+    // differing word to the byte loop.
+
+    if ((((uintptr_t)u ^ (uintptr_t)v) & WORD_MASK) == 0) {
+        while (n != 0 && ((uintptr_t)u & WORD_MASK) != 0) {
+            if (*u != *v)
+                return (*u - *v);
+            u += 1;
+            v += 1;
+            n -= 1;
+        }
+
+        while (WORD_SIZE <= n &&
+            *(const word_t *)u == *(const word_t *)v)
+        {
+            u += WORD_SIZE;
+            v += WORD_SIZE;
+            n -= WORD_SIZE;
+        }
+    }
+
     while (n != 0) {
         if (*u != *v)
             return (*u - *v);
@@ -601,4 +771,16 @@ void vprintf_putc(char c, void * __attribute__ ((unused)) aux) {
 
 void dvprintf_putc(char c, void *  aux) {
     dputc(*((int*)aux), c);
+}
+
+// Writes through the fd's output stream (see io.h), which saves a _write per
+// character.
+
+void dwrite(int fd, const char * buf, size_t len) {
+    struct io * const io = iostream(fd);
+
+    if (io != NULL)
+        iowrite(io, buf, len);
+    else
+        _write(fd, buf, len);
 }
\ No newline at end of file
@@ -9,19 +9,141 @@
 
 #include <stddef.h>
 
+#define MMAP_WRITE (1 << 0) // _mmap(): writes are written back to the file
+
+// One buffer of _readv() and _writev(), which take at most IOV_MAX
+
+#define IOV_MAX 16
+
+struct iovec {
+    void * base;
+    size_t len;
+};
+
+// One entry of _poll()'s array. POLLHUP and POLLNVAL are reported in
+// revents without being asked for.
+
+#define POLLIN   (1 << 0)
+#define POLLOUT  (1 << 1)
+#define POLLHUP  (1 << 2)
+#define POLLNVAL (1 << 3)
+
+struct pollfd {
+    int fd;
+    int events;
+    int revents;
+};
+
+// The ring page returned by _ioring_setup(). Queue operations at sq[sq_tail
+// % nsqe] and advance sq_tail, then call _ioring_enter(). Completions appear
+// at cq[cq_head % ncqe] up to cq_tail; advance cq_head to consume them.
+
+#define IORING_OP_NOP    0
+#define IORING_OP_READ   1 // like _read()
+#define IORING_OP_WRITE  2 // like _write()
+#define IORING_OP_PREAD  3 // like _pread()
+#define IORING_OP_PWRITE 4 // like _pwrite()
+#define IORING_OP_CLOSE  5 // like _close()
+
+#define IORING_NSQE 32
+#define IORING_NCQE 64
+
+struct ioring_sqe {
+    unsigned int op;
+    int fd;
+    void * buf;
+    unsigned long long len;
+    unsigned long long pos;
+    unsigned long long user_data;   // copied to the completion
+};
+
+struct ioring_cqe {
+    unsigned long long user_data;
+    long long result;               // as the matching syscall would return
+};
+
+struct ioring_page {
+    volatile unsigned int sq_head, sq_tail;
+    volatile unsigned int cq_head, cq_tail;
+    unsigned int nsqe, ncqe;
+    unsigned int reserved[10];
+    struct ioring_sqe sq[IORING_NSQE];
+    struct ioring_cqe cq[IORING_NCQE];
+};
+
+// Filled in by _memstat(); sizes are in pages unless noted
+
+struct memstat {
+    unsigned long total_pages;  // pages managed by the page allocator
+    unsigned long free_pages;   // pages free in the page allocator
+    unsigned long zeroed_pages; // pages in the pre-zeroed pool
+    unsigned long free_blocks;  // free blocks; higher is more fragmented
+    unsigned long largest_free; // pages in the largest free block
+    unsigned long heap_bytes;   // kernel heap bytes allocated
+    unsigned long heap_pages;   // pages held by the kernel heap
+    
+    unsigned long user_pages;   // resident user pages of the process
+    unsigned long ptab_pages;   // page table pages of the process
+};
+
+// Filled in by _thrstat(); times are in timer ticks
+
+#define THRSTAT_NBKT 16
+
+struct thrstat {
+    char name[16];
+    int state;                      // 0 uninit, 1 waiting, 2 running, 3 ready, 4 exited
+    int prio;
+    unsigned long long run_ticks;   // time spent running
+    unsigned long long wait_ticks;  // time spent ready but not running
+    unsigned long nvcsw;            // switches away because it blocked or exited
+    unsigned long nivcsw;           // switches away while still runnable
+    unsigned long lat_hist[THRSTAT_NBKT]; // ready-to-run waits, log2 microseconds
+};
+
+// Filled in by _intrstat(); times are in timer ticks
+
+struct intrstat {
+    unsigned long count;            // interrupts handled
+    unsigned long long isr_ticks;   // time spent in the ISR
+    unsigned long long isr_max;     // longest ISR run
+    unsigned long nwork;            // deferred work items run
+    unsigned long long work_ticks;  // time spent in deferred work
+    unsigned long long work_max;    // longest work item run
+};
 
 extern void __attribute__ ((noreturn)) _exit(void);
 extern int _exec(int fd, int argc, char ** argv);
 extern int _fork(void);
+extern int _spawn(int fd, int argc, char ** argv, const int * fd_map);
 extern int _wait(int tid);
 extern void _print(const char * msg);
 extern int _usleep(unsigned long us);
 extern int _devopen(int fd, const char * name, int instno);
 extern int _fsopen(int fd, const char * name);
+extern int _fscreate(const char * name);
+extern int _fsdelete(const char * name);
 extern int _close(int fd);
 extern long _read(int fd, void * buf, size_t bufsz);
 extern long _write(int fd, const void * buf, size_t len);
+extern long _readv(int fd, const struct iovec * iov, int iovcnt);
+extern long _writev(int fd, const struct iovec * iov, int iovcnt);
+extern long _pread(int fd, void * buf, size_t len, unsigned long long pos);
+extern long _pwrite (
+    int fd, const void * buf, size_t len, unsigned long long pos);
+extern long _sendfile (
+    int out_fd, int in_fd, unsigned long long pos, size_t len);
+extern int _poll(struct pollfd * fds, int nfds, long timeout_us);
+extern struct ioring_page * _ioring_setup(void);
+extern int _ioring_enter(unsigned int min_complete);
+extern void * _sbrk(long incr); // old end of heap, or negative error
 extern int _ioctl(int fd, const int cmd, void * arg);
 extern int _pipe(int * wfdptr, int * rfdptr);
 extern int _iodup(int oldfd, int newfd);
+extern void * _mmap(int fd, size_t len, int flags);
+extern int _munmap(void * addr);
+extern int _memstat(int tid, struct memstat * buf);
+extern int _setprio(int prio);
+extern int _thrstat(int tid, struct thrstat * buf);
+extern int _intrstat(int srcno, struct intrstat * buf);
 #endif // _SYSCALL_H_
\ No newline at end of file
@@ -0,0 +1,52 @@
+// time.c - Reading the time without a syscall
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#include "time.h"
+#include "error.h"
+
+#define NSEC_PER_SEC 1000000000UL
+
+static inline uint64_t rdtime(void) {
+    uint64_t time;
+    asm volatile ("rdtime %0" : "=r"(time));
+    return time;
+}
+
+// The time page is only read, never written, so a torn read is detected by
+// seq and retried: the kernel makes seq odd before it changes the page and
+// even again after.
+
+int clock_gettime(int clk, struct timespec * ts) {
+    const struct time_page * const tp = (const struct time_page *)TIME_PAGE_VMA;
+    uint64_t freq, boot_ns, ticks, ns;
+    uint32_t seq;
+
+    if (clk != CLOCK_REALTIME && clk != CLOCK_MONOTONIC)
+        return -EINVAL;
+
+    do {
+        seq = tp->seq;
+        __sync_synchronize();
+        freq = tp->timer_freq;
+        boot_ns = tp->boot_ns;
+        ticks = rdtime();
+        __sync_synchronize();
+    } while ((seq & 1) != 0 || seq != tp->seq);
+
+    if (freq == 0)
+        return -ENOTSUP;
+
+    ts->tv_sec = ticks / freq;
+    ts->tv_nsec = ticks % freq * NSEC_PER_SEC / freq;
+
+    if (clk == CLOCK_REALTIME) {
+        ns = boot_ns % NSEC_PER_SEC + ts->tv_nsec;
+        ts->tv_sec += boot_ns / NSEC_PER_SEC + ns / NSEC_PER_SEC;
+        ts->tv_nsec = ns % NSEC_PER_SEC;
+    }
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+// time.h - Reading the time without a syscall
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _TIME_H_
+#define _TIME_H_
+
+#include <stdint.h>
+
+// The kernel maps a read-only time page into every process at TIME_PAGE_VMA.
+// The layout must match struct time_page in the kernel's rtc.h.
+
+#define TIME_PAGE_VMA 0x0FF001000UL // the kernel's UMEM_TIME_PAGE_VMA
+
+struct time_page {
+    volatile uint32_t seq; // odd while the kernel updates the page
+    uint32_t reserved;
+    uint64_t timer_freq; // rdtime ticks per second
+    uint64_t boot_ns; // wall-clock time at rdtime() == 0, ns since the epoch
+};
+
+#define CLOCK_REALTIME  0 // wall-clock time since the epoch
+#define CLOCK_MONOTONIC 1 // time since boot
+
+struct timespec {
+    long tv_sec;
+    long tv_nsec;
+};
+
+// Fills in /ts/ with the time on clock /clk/. Returns 0, or -EINVAL for an
+// unknown clock or -ENOTSUP if the kernel has not filled in the time page.
+
+extern int clock_gettime(int clk, struct timespec * ts);
+
+#endif // _TIME_H_
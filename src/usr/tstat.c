@@ -0,0 +1,61 @@
+// tstat.c - Print per-thread CPU time and scheduling latency
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// Usage: tstat [tid]
+//
+// Without an argument, prints a line for each thread: its state, priority,
+// time spent running and waiting to run, and how often it switched away
+// voluntarily (blocked or exited) and involuntarily (yielded or preempted).
+// With a thread id, also prints that thread's histogram of the time between
+// becoming ready and running.
+
+#include "io.h"
+#include "error.h"
+#include "string.h"
+#include "syscall.h"
+
+#define TIMER_FREQ 10000000UL // must match the kernel's conf.h
+
+static const char state_chars[] = "?WRrX";
+
+static void print_thread(int tid, const struct thrstat * st) {
+    printf("%3d %c %d %8llu %8llu %6lu %6lu %s\n", tid,
+        (0 <= st->state && st->state < 5) ? state_chars[st->state] : '?',
+        st->prio, st->run_ticks / (TIMER_FREQ / 1000),
+        st->wait_ticks / (TIMER_FREQ / 1000), st->nvcsw, st->nivcsw,
+        st->name);
+}
+
+void main(int argc, char ** argv) {
+    struct thrstat st;
+    int tid, result;
+    int i;
+
+    printf("TID S P   RUN_MS  WAIT_MS   VCSW  IVCSW NAME\n");
+
+    if (0 < argc) {
+        tid = strtoul(argv[0], NULL, 10);
+        result = _thrstat(tid, &st);
+        if (result < 0) {
+            printf("tstat: thread %d: error %d\n", tid, result);
+            return;
+        }
+
+        print_thread(tid, &st);
+        printf("\nready-to-run latency\n");
+
+        for (i = 0; i < THRSTAT_NBKT; i++) {
+            if (st.lat_hist[i] != 0)
+                printf("  >= %6lu us: %lu\n", 1UL << i, st.lat_hist[i]);
+        }
+
+        return;
+    }
+
+    for (tid = 0; (result = _thrstat(tid, &st)) != -EINVAL; tid++) {
+        if (result == 0)
+            print_thread(tid, &st);
+    }
+}